@@ -0,0 +1,82 @@
+#ifndef CBUDGET_H
+#define CBUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+/** @brief Result of an evaluation with a budget.
+ */
+enum class CEvalStatus {
+    // the values are computed
+    READY,
+    // the budget ran out, the formulas computed so far stay cached
+    NOT_READY
+};
+
+/** @brief Deadline and cancellation token of an evaluation.
+ *
+ * The budget is checked between two formulas, a formula that has started is
+ * always finished. A deadline lets at least one formula be evaluated per
+ * call, so repeating a call on the same version always gets further, while a
+ * cancelled budget stops before the first one. Copies share the token, so
+ * another thread can cancel an evaluation through its own copy. A default
+ * budget is unlimited.
+ */
+class CBudget {
+public:
+    using CClock = std::chrono::steady_clock;
+
+    /**  @brief creates an unlimited budget
+     */
+    CBudget() = default;
+
+    /**
+     * @brief budget ending at a point in time
+     *
+     * @param deadline [in] end of the budget
+     * @return CBudget the budget.
+     */
+    static CBudget until(CClock::time_point deadline) {
+        CBudget result;
+        result.deadline = deadline;
+        return result;
+    }
+
+    /**
+     * @brief budget ending after a duration from now
+     *
+     * @param timeout [in] length of the budget
+     * @return CBudget the budget.
+     */
+    static CBudget within(CClock::duration timeout) {
+        return until(CClock::now() + timeout);
+    }
+
+    /**
+     * @brief stops the evaluations using this budget or a copy of it
+     */
+    void cancel() const {
+        token->store(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief tells whether the budget was cancelled
+     */
+    bool cancelled() const {
+        return token->load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief tells whether the deadline has passed
+     */
+    bool expired() const {
+        return deadline != CClock::time_point::max() && CClock::now() >= deadline;
+    }
+
+private:
+    CClock::time_point deadline = CClock::time_point::max();
+    std::shared_ptr<std::atomic<bool>> token = std::make_shared<std::atomic<bool>>(false);
+};
+
+#endif // CBUDGET_H
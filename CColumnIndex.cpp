@@ -0,0 +1,217 @@
+#include "CColumnIndex.h"
+#include "CMemoryUsage.h"
+#include <cmath>
+#include <atomic>
+#include <iterator>
+#include <algorithm>
+
+std::optional<CColumnIndex::CKey> CColumnIndex::key(const CTerm &value) {
+    if (std::holds_alternative<double>(value)) {
+        // NaN is equal to nothing and cannot be ordered
+        if (std::isnan(std::get<double>(value))) {
+            return std::nullopt;
+        }
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<CRope>(value)) {
+        return std::get<CRope>(value).str();
+    }
+    return std::nullopt;
+}
+
+void CColumnIndex::update(size_t row, const CValue &previous, const CValue &literal, bool formula) {
+    std::lock_guard lock(mutex);
+    CLiterals &stored = writable();
+    if (std::optional<CKey> old = key(CRope::term(previous))) {
+        erase(stored.values, *old, row);
+    }
+    forget(row);
+    stored.formulas.erase(row);
+    if (formula) {
+        stored.formulas.insert(row);
+    } else if (std::optional<CKey> value = key(CRope::term(literal))) {
+        insert(stored.values, *value, row);
+    }
+}
+
+void CColumnIndex::invalidate(size_t row) {
+    std::lock_guard lock(mutex);
+    forget(row);
+}
+
+void CColumnIndex::invalidateAll() {
+    std::lock_guard lock(mutex);
+    values = CEntries();
+    computed.clear();
+}
+
+void CColumnIndex::clear() {
+    std::lock_guard lock(mutex);
+    literals = std::make_shared<CLiterals>();
+    values = CEntries();
+    computed.clear();
+}
+
+void CColumnIndex::inherit(const CColumnIndex &base) {
+    CEntries found;
+    std::map<size_t, std::optional<CKey>> rows;
+    {
+        std::lock_guard lock(base.mutex);
+        found = base.values;
+        rows = base.computed;
+    }
+    std::lock_guard lock(mutex);
+    values = std::move(found);
+    computed = std::move(rows);
+}
+
+bool CColumnIndex::hasComputed() const {
+    std::lock_guard lock(mutex);
+    return !computed.empty();
+}
+
+std::vector<size_t> CColumnIndex::stale(size_t top, size_t bottom) const {
+    std::lock_guard lock(mutex);
+    std::vector<size_t> result;
+    const std::set<size_t> &formulas = literals->formulas;
+    for (auto it = formulas.lower_bound(top); it != formulas.end() && *it <= bottom; ++it) {
+        if (!computed.contains(*it)) {
+            result.push_back(*it);
+        }
+    }
+    return result;
+}
+
+void CColumnIndex::fill(size_t row, const CTerm &value) const {
+    std::lock_guard lock(mutex);
+    if (!literals->formulas.contains(row) || computed.contains(row)) {
+        return;
+    }
+    std::optional<CKey> indexed = key(value);
+    if (indexed) {
+        insert(values, *indexed, row);
+    }
+    computed.emplace(row, std::move(indexed));
+}
+
+size_t CColumnIndex::find(const CKey &value, size_t top, size_t bottom) const {
+    std::lock_guard lock(mutex);
+    return std::min(first(literals->values, value, top, bottom), first(values, value, top, bottom));
+}
+
+size_t CColumnIndex::floor(const CKey &value, size_t top, size_t bottom) const {
+    std::lock_guard lock(mutex);
+    const std::set<std::pair<CKey, size_t>> *sets[] = {&literals->values.sorted, &values.sorted};
+    CKey bound = value;
+    bool inclusive = true;
+    while (true) {
+        // the largest value of the literals and the formulas up to the bound
+        const CKey *candidate = nullptr;
+        for (const auto *sorted: sets) {
+            auto it = inclusive ? sorted->upper_bound({bound, SIZE_MAX}) : sorted->lower_bound({bound, 0});
+            if (it != sorted->begin() && (!candidate || *candidate < std::prev(it)->first)) {
+                candidate = &std::prev(it)->first;
+            }
+        }
+        if (!candidate || candidate->index() != value.index()) {
+            return NOT_FOUND;
+        }
+        size_t row = std::min(first(literals->values, *candidate, top, bottom), first(values, *candidate, top, bottom));
+        if (row != NOT_FOUND) {
+            return row;
+        }
+        // no row of this value is searched, try the next smaller one
+        bound = *candidate;
+        inclusive = false;
+    }
+}
+
+size_t CColumnIndex::memoryUsage() const {
+    std::lock_guard lock(mutex);
+    auto text = [](const CKey &value) {
+        return std::holds_alternative<std::string>(value) ? CMemoryUsage::text(std::get<std::string>(value)) : 0;
+    };
+    auto entries = [&text](const CEntries &stored) {
+        size_t result = CMemoryUsage::hash(stored.hashed.size(), stored.hashed.bucket_count(),
+                                           sizeof(decltype(stored.hashed)::value_type))
+                        + CMemoryUsage::tree(stored.sorted.size(), sizeof(decltype(stored.sorted)::value_type));
+        for (const auto &[value, rows]: stored.hashed) {
+            result += text(value) + rows.capacity() * sizeof(size_t);
+        }
+        for (const auto &[value, row]: stored.sorted) {
+            result += text(value);
+        }
+        return result;
+    };
+    // shared literals are counted by every index holding them
+    size_t result = entries(literals->values) + entries(values)
+                    + CMemoryUsage::tree(literals->formulas.size(), sizeof(size_t))
+                    + CMemoryUsage::tree(computed.size(), sizeof(decltype(computed)::value_type));
+    for (const auto &[row, value]: computed) {
+        result += value ? text(*value) : 0;
+    }
+    return result;
+}
+
+CColumnIndex::CLiterals &CColumnIndex::writable() {
+    if (literals.use_count() != 1) {
+        literals = std::make_shared<CLiterals>(*literals);
+    } else {
+        // the last other holder may have released it in another thread
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *literals;
+}
+
+void CColumnIndex::insert(CEntries &entries, const CKey &value, size_t row) const {
+    if (kind == CIndexKind::SORTED) {
+        entries.sorted.emplace(value, row);
+        return;
+    }
+    std::vector<size_t> &rows = entries.hashed[value];
+    // rows mostly come in ascending order
+    rows.insert(std::upper_bound(rows.begin(), rows.end(), row), row);
+}
+
+void CColumnIndex::erase(CEntries &entries, const CKey &value, size_t row) const {
+    if (kind == CIndexKind::SORTED) {
+        entries.sorted.erase({value, row});
+        return;
+    }
+    auto it = entries.hashed.find(value);
+    if (it == entries.hashed.end()) {
+        return;
+    }
+    auto position = std::lower_bound(it->second.begin(), it->second.end(), row);
+    if (position != it->second.end() && *position == row) {
+        it->second.erase(position);
+    }
+    if (it->second.empty()) {
+        entries.hashed.erase(it);
+    }
+}
+
+size_t CColumnIndex::first(const CEntries &entries, const CKey &value, size_t top, size_t bottom) const {
+    if (kind == CIndexKind::HASH) {
+        auto it = entries.hashed.find(value);
+        if (it == entries.hashed.end()) {
+            return NOT_FOUND;
+        }
+        auto row = std::lower_bound(it->second.begin(), it->second.end(), top);
+        return row != it->second.end() && *row <= bottom ? *row : NOT_FOUND;
+    }
+    auto it = entries.sorted.lower_bound({value, top});
+    return it != entries.sorted.end() && it->first == value && it->second <= bottom ? it->second : NOT_FOUND;
+}
+
+bool CColumnIndex::forget(size_t row) {
+    auto it = computed.find(row);
+    if (it == computed.end()) {
+        return false;
+    }
+    if (it->second) {
+        erase(values, *it->second, row);
+    }
+    computed.erase(it);
+    return true;
+}
@@ -0,0 +1,211 @@
+#ifndef CCOLUMNINDEX_H
+#define CCOLUMNINDEX_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <variant>
+#include <optional>
+#include <utility>
+#include <cstdint>
+#include <unordered_map>
+#include "CRope.h"
+
+/** @brief Kind of the index of a column, see CSpreadsheet::setColumnIndex().
+ */
+enum class CIndexKind {
+    NONE,
+    // finds equal values in O(1)
+    HASH,
+    // finds equal values and the largest value not above a given one in O(log n)
+    SORTED
+};
+
+/** @brief Index of the values of one column for lookup functions.
+ *
+ * Literals are indexed when they are stored. Formulas are indexed by their
+ * computed values: a formula starts stale, a lookup evaluates the stale
+ * formulas of its range and adds their values, and a write makes the formulas
+ * depending on it stale again, as it drops their cached values. A copy shares
+ * the literals and the rows of formulas with the original until either of them
+ * stores a cell of the column, its formulas are stale. Readers of the same
+ * version fill it concurrently under one mutex, the formulas are evaluated
+ * outside of it.
+ *
+ * Numbers are ordered before texts and never equal to them, like CTerm.
+ */
+class CColumnIndex {
+public:
+    using CKey = std::variant<double, std::string>;
+
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+    /**  @brief creates an empty index
+     * @param kind [in] HASH or SORTED
+     */
+    explicit CColumnIndex(CIndexKind kind) : kind(kind), literals(std::make_shared<CLiterals>()) {}
+
+    /**  @brief copies the index, values of formulas are not copied, the literals are shared
+     * @param other [in] other index
+     */
+    CColumnIndex(const CColumnIndex &other) : kind(other.kind), literals(other.literals) {}
+
+    CColumnIndex &operator=(const CColumnIndex &) = delete;
+
+    /**
+     * @brief key of a value
+     *
+     * @param value [in] computed value
+     * @return std::optional<CKey> the key, nullopt for an undefined value.
+     */
+    static std::optional<CKey> key(const CTerm &value);
+
+    CIndexKind getKind() const {
+        return kind;
+    }
+
+    /**
+     * @brief updates a stored cell
+     *
+     * @param row [in] row of the cell
+     * @param previous [in] literal the cell held, monostate if none
+     * @param literal [in] literal the cell holds now, monostate if none
+     * @param formula [in] the cell holds a formula now
+     */
+    void update(size_t row, const CValue &previous, const CValue &literal, bool formula);
+
+    /**
+     * @brief makes a formula stale, its value may have changed
+     *
+     * @param row [in] row of the formula
+     */
+    void invalidate(size_t row);
+
+    /**
+     * @brief makes all formulas stale
+     */
+    void invalidateAll();
+
+    /**
+     * @brief drops everything
+     */
+    void clear();
+
+    /**
+     * @brief takes over the values of formulas the index of another version has found
+     *
+     * @param base [in] index of the same column and kind this one was copied from
+     */
+    void inherit(const CColumnIndex &base);
+
+    /**
+     * @brief tells whether some formula is indexed by its value
+     */
+    bool hasComputed() const;
+
+    /**
+     * @brief rows of stale formulas
+     *
+     * @param top [in] first row
+     * @param bottom [in] last row
+     * @return std::vector<size_t> stale rows between top and bottom.
+     */
+    std::vector<size_t> stale(size_t top, size_t bottom) const;
+
+    /**
+     * @brief indexes the value of a stale formula
+     *
+     * @param row [in] row of the formula, nothing happens if it is not stale
+     * @param value [in] its computed value
+     */
+    void fill(size_t row, const CTerm &value) const;
+
+    /**
+     * @brief finds the first row holding a value
+     *
+     * @param value [in] value to be found
+     * @param top [in] first row searched
+     * @param bottom [in] last row searched
+     * @return size_t the row, NOT_FOUND if there is none.
+     */
+    size_t find(const CKey &value, size_t top, size_t bottom) const;
+
+    /**
+     * @brief finds the first row holding the largest value not above a given one, the index is SORTED
+     *
+     * Only numbers are compared with a number and texts with a text. It takes
+     * O(log n) when the rows hold no values of the same kind outside of the
+     * searched rows, every such distinct value costs another O(log n).
+     *
+     * @param value [in] upper bound
+     * @param top [in] first row searched
+     * @param bottom [in] last row searched
+     * @return size_t the row, NOT_FOUND if there is none.
+     */
+    size_t floor(const CKey &value, size_t top, size_t bottom) const;
+
+    /**
+     * @brief estimates the memory of the index
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+private:
+    /** @brief Values with the rows holding them.
+     */
+    struct CEntries {
+        // HASH: rows holding every value, in ascending order
+        std::unordered_map<CKey, std::vector<size_t>> hashed;
+        // SORTED: values with their rows
+        std::set<std::pair<CKey, size_t>> sorted;
+    };
+
+    /** @brief Literals of the column and the rows of its formulas.
+     */
+    struct CLiterals {
+        CEntries values;
+        std::set<size_t> formulas;
+    };
+
+    CIndexKind kind;
+    mutable std::mutex mutex;
+    // shared with the copies of the index until a cell of the column is stored
+    std::shared_ptr<CLiterals> literals;
+    // values of the formulas indexed so far, formulas not among them are stale
+    mutable CEntries values;
+    // formulas indexed by their values, nullopt for an undefined one
+    mutable std::map<size_t, std::optional<CKey>> computed;
+
+    /**
+     * @brief literals to be written, copied first if a copy of the index still holds them
+     */
+    CLiterals &writable();
+
+    /**
+     * @brief adds a row holding a value, the caller holds mutex
+     */
+    void insert(CEntries &entries, const CKey &value, size_t row) const;
+
+    /**
+     * @brief removes a row holding a value, the caller holds mutex
+     */
+    void erase(CEntries &entries, const CKey &value, size_t row) const;
+
+    /**
+     * @brief finds the first row holding a value among given entries, the caller holds mutex
+     */
+    size_t first(const CEntries &entries, const CKey &value, size_t top, size_t bottom) const;
+
+    /**
+     * @brief removes a formula from the index, the caller holds mutex
+     *
+     * @return bool True if it was indexed by its value.
+     */
+    bool forget(size_t row);
+};
+
+#endif // CCOLUMNINDEX_H
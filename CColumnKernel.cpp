@@ -0,0 +1,206 @@
+#include "CColumnKernel.h"
+#include "CSnapshot.h"
+#include <set>
+#include <cmath>
+
+const std::vector<CKernelOp> *CColumnKernel::programAt(const CSnapshot &sheet, const std::pair<size_t, size_t> &key) {
+    auto it = sheet.getCells().find(key);
+    if (it == sheet.getCells().end()) {
+        return nullptr;
+    }
+    // only numeric formulas compile, they are recognized when they are built
+    auto numeric = dynamic_cast<const NumericNode *>(it->second.second.get());
+    return numeric ? &numeric->getProgram() : nullptr;
+}
+
+std::vector<CKernelOp> CColumnKernel::relative(const std::vector<CKernelOp> &program,
+                                               const std::pair<size_t, size_t> &key) {
+    std::vector<CKernelOp> result = program;
+    for (auto &op: result) {
+        if (op.type == CKernelOp::Type::REFERENCE) {
+            op.row -= op.absRow ? 0 : static_cast<long long>(key.first);
+            op.column -= op.absColumn ? 0 : static_cast<long long>(key.second);
+        }
+    }
+    return result;
+}
+
+bool CColumnKernel::matches(const CSnapshot &sheet, const std::pair<size_t, size_t> &key,
+                            const std::vector<CKernelOp> &program) {
+    const std::vector<CKernelOp> *other = programAt(sheet, key);
+    if (!other || other->size() != program.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < program.size(); ++i) {
+        CKernelOp op = (*other)[i];
+        if (op.type == CKernelOp::Type::REFERENCE) {
+            op.row -= op.absRow ? 0 : static_cast<long long>(key.first);
+            op.column -= op.absColumn ? 0 : static_cast<long long>(key.second);
+        }
+        if (!(op == program[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CColumnKernel::evaluate(const CSnapshot &sheet, const std::pair<size_t, size_t> &key, CTerm &result) {
+    // blocks being evaluated by this thread, a block must not wait for itself
+    static thread_local std::set<std::pair<size_t, size_t>> active;
+
+    const std::vector<CKernelOp> *compiled = programAt(sheet, key);
+    if (!compiled) {
+        return false;
+    }
+    std::vector<CKernelOp> program = relative(*compiled, key);
+    for (const auto &op: program) {
+        // the column feeds itself, rows would have to be evaluated one by one anyway, also through $B1 in B2
+        bool ownColumn = op.absColumn ? op.column == static_cast<long long>(key.second) : op.column == 0;
+        if (op.type == CKernelOp::Type::REFERENCE && ownColumn
+            && !op.absRow && op.row != 0 && std::llabs(op.row) < static_cast<long long>(BLOCK)) {
+            return false;
+        }
+    }
+    size_t blockStart = key.first - key.first % BLOCK;
+    std::pair<size_t, size_t> block{key.second, blockStart};
+    if (active.contains(block)) {
+        return false;
+    }
+    size_t first = key.first;
+    while (first > blockStart && matches(sheet, {first - 1, key.second}, program)) {
+        --first;
+    }
+    size_t last = key.first;
+    while (last + 1 < blockStart + BLOCK && matches(sheet, {last + 1, key.second}, program)) {
+        ++last;
+    }
+    size_t count = last - first + 1;
+    if (count < MIN_RUN) {
+        return false;
+    }
+
+    active.insert(block);
+    size_t cyclesBefore = CSnapshot::cycleCount();
+    std::vector<double> values;
+    std::vector<uint8_t> scalar;
+    run(sheet, program, {first, key.second}, count, values, scalar);
+    std::vector<CTerm> results(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (scalar[i]) {
+            results[i] = sheet.getCells().at({first + i, key.second}).second->value(sheet);
+        } else {
+            results[i] = values[i];
+        }
+    }
+    active.erase(block);
+    if (CSnapshot::cycleCount() != cyclesBefore) {
+        // values depending on a cycle are not cached, readers must notice the cycle
+        return false;
+    }
+    sheet.cache.store({first, key.second}, results);
+    result = results[key.first - first];
+    return true;
+}
+
+void CColumnKernel::run(const CSnapshot &sheet, const std::vector<CKernelOp> &program,
+                        const std::pair<size_t, size_t> &first, size_t count,
+                        std::vector<double> &values, std::vector<uint8_t> &scalar) {
+    scalar.assign(count, 0);
+    std::vector<std::vector<double>> stack;
+    for (size_t n = 0; n < program.size(); ++n) {
+        const CKernelOp &op = program[n];
+        if (op.type == CKernelOp::Type::SHARED) {
+            // the same value for every row
+            CTerm value = op.node->value(sheet);
+            bool number = std::holds_alternative<double>(value);
+            stack.emplace_back(count, number ? std::get<double>(value) : 0.0);
+            if (!number) {
+                scalar.assign(count, 1);
+            }
+            n += op.length;
+            continue;
+        }
+        if (op.type == CKernelOp::Type::CONSTANT) {
+            stack.emplace_back(count, op.constant);
+            continue;
+        }
+        if (op.type == CKernelOp::Type::REFERENCE) {
+            std::vector<double> &column = stack.emplace_back(count, 0.0);
+            for (size_t i = 0; i < count; ++i) {
+                long long row = op.absRow ? op.row : static_cast<long long>(first.first + i) + op.row;
+                long long col = op.absColumn ? op.column : static_cast<long long>(first.second) + op.column;
+                if (row < 0 || col < 1) {
+                    scalar[i] = 1;
+                    continue;
+                }
+                std::pair<size_t, size_t> target{static_cast<size_t>(row), static_cast<size_t>(col)};
+                CTerm value;
+                auto it = sheet.getCells().find(target);
+                if (it != sheet.getCells().end() && std::holds_alternative<double>(it->second.first)) {
+                    column[i] = std::get<double>(it->second.first);
+                    continue;
+                }
+                if (!sheet.cache.find(target, value)) {
+                    value = sheet.getValueAt(target);
+                }
+                if (std::holds_alternative<double>(value)) {
+                    column[i] = std::get<double>(value);
+                } else {
+                    scalar[i] = 1;
+                }
+            }
+            continue;
+        }
+        double *a;
+        const double *b = nullptr;
+        if (op.op == Operator::NEGATE) {
+            a = stack.back().data();
+        } else {
+            b = stack.back().data();
+            a = stack[stack.size() - 2].data();
+        }
+        switch (op.op) {
+            case Operator::ADD:
+                for (size_t i = 0; i < count; ++i) a[i] += b[i];
+                break;
+            case Operator::SUBTRACT:
+                for (size_t i = 0; i < count; ++i) a[i] -= b[i];
+                break;
+            case Operator::MULTIPLY:
+                for (size_t i = 0; i < count; ++i) a[i] *= b[i];
+                break;
+            case Operator::DIVIDE:
+                for (size_t i = 0; i < count; ++i) scalar[i] |= b[i] == 0;
+                for (size_t i = 0; i < count; ++i) a[i] /= b[i];
+                break;
+            case Operator::POWER:
+                for (size_t i = 0; i < count; ++i) a[i] = std::pow(a[i], b[i]);
+                break;
+            case Operator::NEGATE:
+                for (size_t i = 0; i < count; ++i) a[i] = -a[i];
+                break;
+            case Operator::EQUAL:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] == b[i] ? 1.0 : 0.0;
+                break;
+            case Operator::NOT_EQUAL:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] != b[i] ? 1.0 : 0.0;
+                break;
+            case Operator::LESS_THAN:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] < b[i] ? 1.0 : 0.0;
+                break;
+            case Operator::LESS_THAN_OR_EQUAL:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] <= b[i] ? 1.0 : 0.0;
+                break;
+            case Operator::GREATER_THAN:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] > b[i] ? 1.0 : 0.0;
+                break;
+            case Operator::GREATER_THAN_OR_EQUAL:
+                for (size_t i = 0; i < count; ++i) a[i] = a[i] >= b[i] ? 1.0 : 0.0;
+                break;
+        }
+        if (op.op != Operator::NEGATE) {
+            stack.pop_back();
+        }
+    }
+    values = std::move(stack.back());
+}
@@ -0,0 +1,115 @@
+#ifndef CCOLUMNKERNEL_H
+#define CCOLUMNKERNEL_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <variant>
+#include "Node.h"
+
+using CValue = std::variant<std::monostate, double, std::string>;
+
+class CSnapshot;
+
+/** @brief One instruction of a compiled numeric formula, in postfix order.
+ *
+ * References keep relative coordinates as offsets from the formula cell and
+ * absolute ones as they are, so all cells of a column filled by copyRect
+ * compile into equal programs. A sub-expression reading absolute cells only
+ * is preceded by a SHARED instruction naming its node, so once other formulas
+ * use the node too its value is taken from the cache of the version instead of
+ * running the following length instructions.
+ */
+struct CKernelOp {
+    enum class Type {
+        CONSTANT,
+        REFERENCE,
+        OPERATOR,
+        SHARED
+    };
+
+    Type type;
+    Operator op = Operator::ADD;
+    double constant = 0;
+    bool absRow = false;
+    bool absColumn = false;
+    long long row = 0;
+    long long column = 0;
+    const Node *node = nullptr;
+    size_t length = 0;
+
+    bool operator==(const CKernelOp &other) const = default;
+};
+
+/** @brief Evaluates runs of cells that share one relative formula as a column.
+ *
+ * The run around the requested cell is cut into aligned blocks. Inputs of a
+ * block are gathered into contiguous arrays of doubles and every instruction
+ * runs as one straight loop over the block, which the compiler vectorizes
+ * (CMakeLists.txt builds this file with -O3 in every build type). Rows with a
+ * non-numeric input or a division by zero are evaluated by the usual node
+ * evaluation. A shared sub-expression is evaluated once per block. Results of
+ * the whole block go into the value cache. A run reading its own column a few
+ * rows away, relatively or through $, is left to the usual evaluation.
+ */
+class CColumnKernel {
+public:
+    static constexpr size_t BLOCK = 1024;
+    static constexpr size_t MIN_RUN = 8;
+
+    /**
+     * @brief evaluates the block of the run containing given cell
+     *
+     * @param sheet [in] version to evaluate against
+     * @param key [in] position of the requested formula cell
+     * @param result [out] value of the requested cell
+     * @return bool True if the block was evaluated, false if the cell needs the usual evaluation.
+     */
+    static bool evaluate(const CSnapshot &sheet, const std::pair<size_t, size_t> &key, CTerm &result);
+
+private:
+    /**
+     * @brief finds the compiled program of a cell
+     *
+     * @param sheet [in] version to evaluate against
+     * @param key [in] position of the cell
+     * @return const std::vector<CKernelOp> * program compiled at row 0 and column 0, nullptr if the cell holds no numeric formula.
+     */
+    static const std::vector<CKernelOp> *programAt(const CSnapshot &sheet, const std::pair<size_t, size_t> &key);
+
+    /**
+     * @brief converts a program compiled at row 0 and column 0 into offsets from given cell
+     *
+     * @param program [in] program of the cell
+     * @param key [in] position of the cell
+     * @return std::vector<CKernelOp> relative program, equal for all cells filled by copyRect.
+     */
+    static std::vector<CKernelOp> relative(const std::vector<CKernelOp> &program, const std::pair<size_t, size_t> &key);
+
+    /**
+     * @brief tells whether a cell computes the same relative program
+     *
+     * @param sheet [in] version to evaluate against
+     * @param key [in] position of the cell
+     * @param program [in] relative program
+     * @return bool True if the cell belongs to the run.
+     */
+    static bool matches(const CSnapshot &sheet, const std::pair<size_t, size_t> &key,
+                        const std::vector<CKernelOp> &program);
+
+    /**
+     * @brief runs a program over rows of one column
+     *
+     * @param sheet [in] version to evaluate against
+     * @param program [in] program shared by the rows
+     * @param first [in] position of the first row
+     * @param count [in] number of rows
+     * @param values [out] computed values
+     * @param scalar [out] rows that have to be evaluated by nodes
+     */
+    static void run(const CSnapshot &sheet, const std::vector<CKernelOp> &program,
+                    const std::pair<size_t, size_t> &first, size_t count,
+                    std::vector<double> &values, std::vector<uint8_t> &scalar);
+};
+
+#endif // CCOLUMNKERNEL_H
@@ -0,0 +1,104 @@
+#include "CCompressor.h"
+#include <vector>
+#include <cstring>
+
+void CCompressor::putVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool CCompressor::getVarint(std::string_view data, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        auto byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string CCompressor::compress(std::string_view data) {
+    std::string out;
+    out.reserve(data.size() / 2 + 16);
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, UINT32_MAX);
+    auto hash = [&data](size_t pos) {
+        uint32_t word;
+        std::memcpy(&word, data.data() + pos, sizeof(word));
+        return (word * 2654435761u) >> (32 - HASH_BITS);
+    };
+    size_t literalStart = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= data.size()) {
+        uint32_t &slot = table[hash(pos)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(pos);
+        if (candidate == UINT32_MAX || std::memcmp(data.data() + candidate, data.data() + pos, MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+        size_t len = MIN_MATCH;
+        while (pos + len < data.size() && data[candidate + len] == data[pos + len]) {
+            ++len;
+        }
+        putVarint(out, pos - literalStart);
+        out.append(data.substr(literalStart, pos - literalStart));
+        putVarint(out, len);
+        putVarint(out, pos - candidate);
+        size_t end = pos + len;
+        // remember a few positions inside the match so following data can refer to it
+        for (size_t i = pos + 1; i + MIN_MATCH <= data.size() && i < end; i += 2) {
+            table[hash(i)] = static_cast<uint32_t>(i);
+        }
+        pos = end;
+        literalStart = end;
+    }
+    putVarint(out, data.size() - literalStart);
+    out.append(data.substr(literalStart));
+    putVarint(out, 0);
+    return out;
+}
+
+bool CCompressor::decompress(std::string_view data, std::string &out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos < data.size()) {
+        uint64_t literals, len, distance;
+        if (!getVarint(data, pos, literals) || literals > data.size() - pos) {
+            return false;
+        }
+        out.append(data.substr(pos, literals));
+        pos += literals;
+        if (!getVarint(data, pos, len)) {
+            return false;
+        }
+        if (len == 0) {
+            return pos == data.size();
+        }
+        if (!getVarint(data, pos, distance) || distance == 0 || distance > out.size()) {
+            return false;
+        }
+        size_t from = out.size() - distance;
+        if (distance >= len) {
+            out.append(out, from, len);
+        } else {
+            // the match overlaps the bytes it produces
+            for (uint64_t i = 0; i < len; ++i) {
+                out += out[from + i];
+            }
+        }
+    }
+    return false;
+}
+
+uint64_t CCompressor::checksum(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c: data) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
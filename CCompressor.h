@@ -0,0 +1,65 @@
+#ifndef CCOMPRESSOR_H
+#define CCOMPRESSOR_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+/** @brief Small LZ77 codec used by the compact save format.
+ *
+ * The output is a sequence of blocks: varint literal length, the literals,
+ * varint match length and varint match distance. Matches are found through a
+ * hash of the next four bytes, which is enough for the repetitive structure of
+ * serialized sheets and keeps both directions fast.
+ */
+class CCompressor {
+public:
+    /**
+     * @brief compresses data
+     *
+     * @param data [in] data to be compressed
+     * @return std::string compressed data.
+     */
+    static std::string compress(std::string_view data);
+
+    /**
+     * @brief decompresses data
+     *
+     * @param data [in] data made by compress
+     * @param out [out] decompressed data
+     * @return bool True if data is valid, false otherwise.
+     */
+    static bool decompress(std::string_view data, std::string &out);
+
+    /**
+     * @brief appends an unsigned varint
+     *
+     * @param out [in,out] buffer to append to
+     * @param value [in] value to be written
+     */
+    static void putVarint(std::string &out, uint64_t value);
+
+    /**
+     * @brief reads an unsigned varint
+     *
+     * @param data [in] buffer to read from
+     * @param pos [in,out] read position
+     * @param value [out] value read
+     * @return bool True if a whole varint was read.
+     */
+    static bool getVarint(std::string_view data, size_t &pos, uint64_t &value);
+
+    /**
+     * @brief computes a 64-bit FNV-1a checksum
+     *
+     * @param data [in] data to be checked
+     * @return uint64_t checksum.
+     */
+    static uint64_t checksum(std::string_view data);
+
+private:
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t HASH_BITS = 16;
+};
+
+#endif // CCOMPRESSOR_H
@@ -0,0 +1,494 @@
+#include "CDependencyGraph.h"
+#include "CMemoryUsage.h"
+#include "CRelocation.h"
+#include "CFormulaText.h"
+#include <algorithm>
+#include <unordered_set>
+
+void CDependencyGraph::set(const CKey &key, CPrecedents precedents, bool detect) {
+    std::vector<CKey> old;
+    if (auto it = component.find(key); it != component.end()) {
+        old = members.at(it->second);
+        dissolve(it->second);
+    }
+    if (auto node = nodes.find(key); node == nodes.end()) {
+        formulas[{key.second, key.first}] = true;
+    } else {
+        unlink(key, node->second);
+    }
+    link(key, precedents);
+    nodes[key] = std::move(precedents);
+    if (!detect) {
+        return;
+    }
+    if (!old.empty()) {
+        // the rest of the old cycle may fall apart without the old edges
+        std::unordered_set<CKey, CKeyHash> inside(old.begin(), old.end());
+        findComponents(old, [&inside](const CKey &cell) { return inside.contains(cell); });
+    }
+    if (!candidate(key, nodes.at(key))) {
+        return;
+    }
+    // the formula is in a cycle only if something it reads depends on it
+    std::unordered_set<CKey, CKeyHash> dependents;
+    std::vector<CKey> todo{key};
+    while (!todo.empty()) {
+        CKey cell = todo.back();
+        todo.pop_back();
+        forEachDependent(cell, [&](const CKey &dependent) {
+            if (dependents.insert(dependent).second) {
+                todo.push_back(dependent);
+            }
+        });
+    }
+    if (!dependents.contains(key)) {
+        return;
+    }
+    std::vector<CKey> cycle;
+    std::unordered_set<CKey, CKeyHash> seen{key};
+    todo.push_back(key);
+    while (!todo.empty()) {
+        CKey cell = todo.back();
+        todo.pop_back();
+        cycle.push_back(cell);
+        forEachPrecedent(nodes.at(cell), [&](const CKey &precedent) {
+            if (dependents.contains(precedent) && seen.insert(precedent).second) {
+                todo.push_back(precedent);
+            }
+        });
+    }
+    for (const auto &cell: cycle) {
+        if (auto it = component.find(cell); it != component.end()) {
+            dissolve(it->second);
+        }
+    }
+    record(std::move(cycle));
+}
+
+void CDependencyGraph::erase(const CKey &key) {
+    auto node = nodes.find(key);
+    if (node == nodes.end()) {
+        return;
+    }
+    std::vector<CKey> old;
+    if (auto it = component.find(key); it != component.end()) {
+        old = members.at(it->second);
+        dissolve(it->second);
+    }
+    unlink(key, node->second);
+    nodes.erase(key);
+    formulas.erase({key.second, key.first});
+    old.erase(std::remove(old.begin(), old.end(), key), old.end());
+    if (!old.empty()) {
+        std::unordered_set<CKey, CKeyHash> inside(old.begin(), old.end());
+        findComponents(old, [&inside](const CKey &cell) { return inside.contains(cell); });
+    }
+}
+
+void CDependencyGraph::relocate(const CRelocation &relocation, bool precedents,
+                                const std::function<void(const CKey &, const CKey &, bool)> &moved) {
+    // a reference to a deleted cell becomes #REF!, as Node::relocate makes it
+    auto moveCell = [&relocation](CKey &cell) {
+        if (cell.second != CFormulaText::INVALID_COLUMN && !relocation.move(cell.first, cell.second)) {
+            cell = {1, CFormulaText::INVALID_COLUMN};
+        }
+    };
+    auto moveRect = [&relocation](CRect &rect) {
+        if (rect.left == CFormulaText::INVALID_COLUMN) {
+            return;
+        }
+        if (!(relocation.columns ? relocation.span(rect.left, rect.right) : relocation.span(rect.top, rect.bottom))) {
+            rect = {1, CFormulaText::INVALID_COLUMN, 1, CFormulaText::INVALID_COLUMN};
+        }
+    };
+
+    // all kept formulas move alike, so they stay in order
+    CSharedMap<CKey, CPrecedents> movedNodes;
+    nodes.drain([&](std::pair<CKey, CPrecedents> &&node) {
+        CKey from = node.first;
+        if (!relocation.move(node.first.first, node.first.second)) {
+            return;
+        }
+        if (precedents) {
+            // coordinates along the relocation, unsigned differences compare as well as signed ones
+            auto along = [&relocation](const CKey &cell) { return relocation.columns ? cell.second : cell.first; };
+            size_t shift = along(node.first) - along(from);
+            bool changed = false;
+            bool crossed = shift && (relocation.columns ? node.second.fixedColumns : node.second.fixedRows);
+            for (auto &cell: node.second.cells) {
+                CKey old = cell;
+                moveCell(cell);
+                changed = changed || cell != old;
+                if (old.second != CFormulaText::INVALID_COLUMN
+                    && (cell.second == CFormulaText::INVALID_COLUMN || along(cell) - along(old) != shift)) {
+                    crossed = true;
+                }
+            }
+            for (auto &rect: node.second.ranges) {
+                CRect old = rect;
+                moveRect(rect);
+                size_t low = relocation.columns ? rect.left - old.left : rect.top - old.top;
+                size_t high = relocation.columns ? rect.right - old.right : rect.bottom - old.bottom;
+                changed = changed || low || high || rect.left != old.left;
+                if (old.left != CFormulaText::INVALID_COLUMN
+                    && (rect.left == CFormulaText::INVALID_COLUMN || low != shift || high != shift)) {
+                    crossed = true;
+                }
+            }
+            if (moved && (changed || crossed)) {
+                moved(from, node.first, crossed);
+            }
+        }
+        movedNodes.append(node.first, std::move(node.second));
+    });
+    nodes.swap(movedNodes);
+
+    CSharedMap<CKey, bool> movedFormulas;
+    formulas.drain([&relocation, &movedFormulas](std::pair<CKey, bool> &&formula) {
+        auto [column, row] = formula.first;
+        if (relocation.move(row, column)) {
+            movedFormulas.append({column, row}, true);
+        }
+    });
+    formulas.swap(movedFormulas);
+
+    CSharedMap<CKey, std::set<CKey>> movedReferrers;
+    // cells read as #REF! are merged at the end, they are out of order
+    std::set<CKey> invalid;
+    referrers.drain([&](std::pair<CKey, std::set<CKey>> &&cell) {
+        std::set<CKey> &owners = cell.second;
+        std::set<CKey> movedOwners;
+        while (!owners.empty()) {
+            auto owner = owners.extract(owners.begin());
+            if (relocation.move(owner.value().first, owner.value().second)) {
+                movedOwners.insert(movedOwners.end(), std::move(owner));
+            }
+        }
+        if (movedOwners.empty()) {
+            return;
+        }
+        if (precedents) {
+            moveCell(cell.first);
+        }
+        if (cell.first.second == CFormulaText::INVALID_COLUMN) {
+            invalid.merge(movedOwners);
+        } else {
+            movedReferrers.append(cell.first, std::move(movedOwners));
+        }
+    });
+    if (!invalid.empty()) {
+        movedReferrers[{1, CFormulaText::INVALID_COLUMN}] = std::move(invalid);
+    }
+    referrers.swap(movedReferrers);
+
+    rangeColumns.clear();
+    wideRanges.clear();
+    for (const auto &[key, node]: nodes) {
+        if (!node.ranges.empty()) {
+            link(key, {{}, node.ranges, {}});
+        }
+    }
+    component.clear();
+    members.clear();
+}
+
+void CDependencyGraph::detectCycles() {
+    component.clear();
+    members.clear();
+    std::unordered_set<CKey, CKeyHash> candidates;
+    for (const auto &node: nodes) {
+        if (candidate(node.first, node.second)) {
+            candidates.insert(node.first);
+        }
+    }
+    std::vector<CKey> roots(candidates.begin(), candidates.end());
+    findComponents(roots, [&candidates](const CKey &cell) { return candidates.contains(cell); });
+}
+
+void CDependencyGraph::forEachFormula(const CRect &rect, const std::function<void(const CKey &)> &fn) const {
+    scanFormulas(rect, [&fn](const CKey &key) {
+        fn(key);
+        return true;
+    });
+}
+
+void CDependencyGraph::forEachDependent(const CKey &key, const std::function<void(const CKey &)> &fn) const {
+    if (auto it = referrers.find(key); it != referrers.end()) {
+        for (const auto &referrer: it->second) {
+            fn(referrer);
+        }
+    }
+    for (auto it = rangeColumns.lower_bound({key.second, 0, CKey()});
+         it != rangeColumns.end() && std::get<0>(it->first) == key.second && std::get<1>(it->first) <= key.first; ++it) {
+        if (it->second >= key.first) {
+            fn(std::get<2>(it->first));
+        }
+    }
+    // only the band holding the cell is searched on each pair of levels, pairs without ranges are skipped
+    size_t columnLevel = 0;
+    size_t rowLevel = 0;
+    while (columnLevel < LEVELS && !wideRanges.empty()) {
+        size_t column = key.second >> bandShift(columnLevel);
+        size_t row = key.first >> bandShift(rowLevel);
+        auto it = wideRanges.lower_bound({columnLevel, rowLevel, column, row, CKey()});
+        for (; it != wideRanges.end() && std::get<0>(it->first) == columnLevel && std::get<1>(it->first) == rowLevel
+               && std::get<2>(it->first) == column && std::get<3>(it->first) == row; ++it) {
+            for (const auto &rect: it->second) {
+                if (rect.top <= key.first && key.first <= rect.bottom
+                    && rect.left <= key.second && key.second <= rect.right) {
+                    fn(std::get<4>(it->first));
+                }
+            }
+        }
+        if (it == wideRanges.end()) {
+            break;
+        }
+        if (std::get<0>(it->first) == columnLevel && std::get<1>(it->first) == rowLevel) {
+            if (++rowLevel == LEVELS) {
+                rowLevel = 0;
+                ++columnLevel;
+            }
+        } else {
+            columnLevel = std::get<0>(it->first);
+            rowLevel = std::get<1>(it->first);
+        }
+    }
+}
+
+std::vector<CDependencyGraph::CKey> CDependencyGraph::evaluationOrder(const std::vector<CKey> &roots,
+                                                                      const std::function<bool(const CKey &)> &done) const {
+    std::vector<CKey> order;
+    std::unordered_set<CKey, CKeyHash> visited;
+    // iterative post-order, a long chain of formulas must not exhaust the stack
+    std::vector<std::pair<CKey, bool>> todo;
+    for (const auto &root: roots) {
+        todo.emplace_back(root, false);
+        while (!todo.empty()) {
+            auto [cell, expanded] = todo.back();
+            todo.pop_back();
+            if (expanded) {
+                order.push_back(cell);
+                continue;
+            }
+            if (cyclic(cell) || !nodes.contains(cell) || !visited.insert(cell).second || (done && done(cell))) {
+                continue;
+            }
+            todo.emplace_back(cell, true);
+            forEachPrecedent(nodes.at(cell), [&](const CKey &precedent) {
+                if (!visited.contains(precedent)) {
+                    todo.emplace_back(precedent, false);
+                }
+            });
+        }
+    }
+    return order;
+}
+
+size_t CDependencyGraph::memoryUsage() const {
+    size_t result = nodes.memoryUsage();
+    for (const auto &[key, precedents]: nodes) {
+        result += precedents.cells.capacity() * sizeof(CKey) + precedents.ranges.capacity() * sizeof(CRect);
+    }
+    result += formulas.memoryUsage() + referrers.memoryUsage();
+    for (const auto &[key, cells]: referrers) {
+        result += CMemoryUsage::tree(cells.size(), sizeof(CKey));
+    }
+    result += rangeColumns.memoryUsage();
+    result += wideRanges.memoryUsage() + component.memoryUsage() + members.memoryUsage();
+    for (const auto &[band, rects]: wideRanges) {
+        result += rects.capacity() * sizeof(CRect);
+    }
+    for (const auto &[id, cells]: members) {
+        result += cells.capacity() * sizeof(CKey);
+    }
+    return result;
+}
+
+void CDependencyGraph::link(const CKey &key, const CPrecedents &precedents) {
+    for (const auto &cell: precedents.cells) {
+        referrers[cell].insert(key);
+    }
+    for (const auto &rect: precedents.ranges) {
+        if (rect.right - rect.left >= WIDE) {
+            forEachBand(rect, key, [this, &rect](const CBand &band) {
+                wideRanges[band].push_back(rect);
+            });
+            continue;
+        }
+        // counted from the left, the right column may be the last one
+        for (size_t column = rect.left; column - rect.left <= rect.right - rect.left; ++column) {
+            // a formula reading two ranges from the same top reads down to the lower bottom
+            size_t &bottom = rangeColumns[{column, rect.top, key}];
+            bottom = std::max(bottom, rect.bottom);
+        }
+    }
+}
+
+void CDependencyGraph::unlink(const CKey &key, const CPrecedents &precedents) {
+    for (const auto &cell: precedents.cells) {
+        if (!referrers.contains(cell)) {
+            continue;
+        }
+        std::set<CKey> &owners = referrers[cell];
+        owners.erase(key);
+        if (owners.empty()) {
+            referrers.erase(cell);
+        }
+    }
+    for (const auto &rect: precedents.ranges) {
+        if (rect.right - rect.left >= WIDE) {
+            forEachBand(rect, key, [this](const CBand &band) {
+                wideRanges.erase(band);
+            });
+            continue;
+        }
+        for (size_t column = rect.left; column - rect.left <= rect.right - rect.left; ++column) {
+            rangeColumns.erase({column, rect.top, key});
+        }
+    }
+}
+
+size_t CDependencyGraph::bandLevel(size_t first, size_t last) {
+    size_t level = 0;
+    while ((last >> bandShift(level)) - (first >> bandShift(level)) >= (size_t(1) << LEVEL_BITS)) {
+        ++level;
+    }
+    return level;
+}
+
+void CDependencyGraph::forEachBand(const CRect &rect, const CKey &owner, const std::function<void(const CBand &)> &fn) {
+    size_t columnLevel = bandLevel(rect.left, rect.right);
+    size_t rowLevel = bandLevel(rect.top, rect.bottom);
+    size_t columnShift = bandShift(columnLevel);
+    size_t rowShift = bandShift(rowLevel);
+    for (size_t column = rect.left >> columnShift; column <= rect.right >> columnShift; ++column) {
+        for (size_t row = rect.top >> rowShift; row <= rect.bottom >> rowShift; ++row) {
+            fn({columnLevel, rowLevel, column, row, owner});
+        }
+    }
+}
+
+void CDependencyGraph::forEachPrecedent(const CPrecedents &precedents,
+                                        const std::function<void(const CKey &)> &fn) const {
+    for (const auto &cell: precedents.cells) {
+        if (nodes.contains(cell)) {
+            fn(cell);
+        }
+    }
+    for (const auto &rect: precedents.ranges) {
+        forEachFormula(rect, fn);
+    }
+}
+
+bool CDependencyGraph::scanFormulas(const CRect &rect, const std::function<bool(const CKey &)> &fn) const {
+    auto it = formulas.lower_bound({rect.left, rect.top});
+    while (it != formulas.end() && it->first.first <= rect.right) {
+        auto [column, row] = it->first;
+        if (row < rect.top) {
+            it = formulas.lower_bound({column, rect.top});
+        } else if (row > rect.bottom) {
+            // skips the rest of the column
+            it = formulas.lower_bound({column + 1, rect.top});
+        } else {
+            if (!fn({row, column})) {
+                return false;
+            }
+            ++it;
+        }
+    }
+    return true;
+}
+
+bool CDependencyGraph::candidate(const CKey &key, const CPrecedents &precedents) const {
+    bool reads = std::any_of(precedents.cells.begin(), precedents.cells.end(),
+                             [this](const CKey &cell) { return nodes.contains(cell); });
+    for (auto rect = precedents.ranges.begin(); !reads && rect != precedents.ranges.end(); ++rect) {
+        reads = !scanFormulas(*rect, [](const CKey &) { return false; });
+    }
+    if (!reads) {
+        return false;
+    }
+    bool read = false;
+    forEachDependent(key, [&read](const CKey &) { read = true; });
+    return read;
+}
+
+void CDependencyGraph::dissolve(size_t id) {
+    for (const auto &cell: members.at(id)) {
+        component.erase(cell);
+    }
+    members.erase(id);
+}
+
+void CDependencyGraph::record(std::vector<CKey> cells) {
+    size_t id = nextComponent++;
+    for (const auto &cell: cells) {
+        component[cell] = id;
+    }
+    members[id] = std::move(cells);
+}
+
+void CDependencyGraph::findComponents(const std::vector<CKey> &roots,
+                                      const std::function<bool(const CKey &)> &inside) {
+    struct CFrame {
+        CKey node;
+        std::vector<CKey> next;
+        size_t i = 0;
+    };
+    std::unordered_map<CKey, size_t, CKeyHash> index;
+    std::unordered_map<CKey, size_t, CKeyHash> low;
+    std::unordered_set<CKey, CKeyHash> onStack;
+    std::vector<CKey> stack;
+    std::vector<CFrame> frames;
+    size_t counter = 0;
+    auto open = [&](const CKey &node) {
+        index[node] = low[node] = counter++;
+        stack.push_back(node);
+        onStack.insert(node);
+        CFrame frame{node, {}, 0};
+        forEachPrecedent(nodes.at(node), [&](const CKey &precedent) {
+            if (inside(precedent)) {
+                frame.next.push_back(precedent);
+            }
+        });
+        frames.push_back(std::move(frame));
+    };
+    for (const auto &root: roots) {
+        if (index.contains(root) || !nodes.contains(root)) {
+            continue;
+        }
+        open(root);
+        while (!frames.empty()) {
+            CFrame &frame = frames.back();
+            if (frame.i < frame.next.size()) {
+                CKey next = frame.next[frame.i++];
+                if (!index.contains(next)) {
+                    open(next);
+                } else if (onStack.contains(next)) {
+                    low[frame.node] = std::min(low[frame.node], index[next]);
+                }
+                continue;
+            }
+            CKey node = frame.node;
+            bool selfLoop = std::find(frame.next.begin(), frame.next.end(), node) != frame.next.end();
+            frames.pop_back();
+            if (!frames.empty()) {
+                low[frames.back().node] = std::min(low[frames.back().node], low[node]);
+            }
+            if (low[node] != index[node]) {
+                continue;
+            }
+            std::vector<CKey> cells;
+            CKey cell;
+            do {
+                cell = stack.back();
+                stack.pop_back();
+                onStack.erase(cell);
+                cells.push_back(cell);
+            } while (cell != node);
+            if (cells.size() > 1 || selfLoop) {
+                record(std::move(cells));
+            }
+        }
+    }
+}
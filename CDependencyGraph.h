@@ -0,0 +1,227 @@
+#ifndef CDEPENDENCYGRAPH_H
+#define CDEPENDENCYGRAPH_H
+
+#include <set>
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include "CValueCache.h"
+#include "CRangeIndex.h"
+#include "CSharedMap.h"
+
+class CSpreadsheet;
+struct CRelocation;
+
+/** @brief Cells and ranges a formula reads.
+ */
+struct CPrecedents {
+    std::vector<std::pair<size_t, size_t>> cells;
+    std::vector<CRect> ranges;
+    // cells and ranges of other sheets of the workbook, a cell as a rectangle of one cell
+    std::vector<std::pair<const CSpreadsheet *, CRect>> external;
+    // a reference keeps its row (column) when the cell of the formula moves, it is written with $ or reads another sheet
+    bool fixedRows = false;
+    bool fixedColumns = false;
+};
+
+/** @brief Dependency graph of the formula cells of one version.
+ *
+ * Cycles are found when formulas are stored, not while they are evaluated.
+ * Every strongly connected component with more than one cell, or a cell that
+ * reads itself, is recorded and its cells evaluate to undefined. Storing a
+ * formula only searches the cells that depend on it, so formulas nobody reads
+ * yet (e.g. filled by copyRect) are added in constant time. The formulas and
+ * their edges are kept in CSharedMaps, so a copy shares them with the original
+ * until either of them changes. So are the recorded cycles.
+ */
+class CDependencyGraph {
+public:
+    using CKey = std::pair<size_t, size_t>;
+
+    /**
+     * @brief stores the precedents of a formula cell
+     *
+     * @param key [in] position of the formula
+     * @param precedents [in] cells and ranges the formula reads
+     * @param detect [in] update the cycles right away, false when detectCycles follows
+     */
+    void set(const CKey &key, CPrecedents precedents, bool detect = true);
+
+    /**
+     * @brief removes a cell that no longer holds a formula
+     *
+     * @param key [in] position of the cell
+     */
+    void erase(const CKey &key);
+
+    /**
+     * @brief moves the formulas as inserted or deleted rows or columns move the cells
+     *
+     * The precedents change as Node::relocate changes the expressions, formulas
+     * in deleted cells are dropped. The moved formulas and the cells they read
+     * are re-keyed without copying them, only the ranges are linked again. The
+     * cycles are dropped, detectCycles finds them again.
+     *
+     * The formulas whose expressions or relative forms change are reported
+     * with their old and new positions. The relative form (CFormulaText::toRelative)
+     * changes when a reference crosses the inserted or deleted rows, i.e. it
+     * does not move by as much as the formula, or when the formula moves and
+     * has a reference that stays, see CPrecedents::fixedRows.
+     *
+     * @param relocation [in] inserted or deleted rows or columns
+     * @param precedents [in] move the precedents too, false when they are cells of another sheet
+     * @param moved [in] called with the old and new position of every such formula and whether its relative form changes
+     */
+    void relocate(const CRelocation &relocation, bool precedents = true,
+                  const std::function<void(const CKey &, const CKey &, bool)> &moved = nullptr);
+
+    /**
+     * @brief finds all cycles from scratch
+     */
+    void detectCycles();
+
+    /**
+     * @brief tells whether a cell is a part of a cycle
+     *
+     * @param key [in] position of the cell
+     * @return bool True if the cell is in a cycle.
+     */
+    bool cyclic(const CKey &key) const {
+        return !component.empty() && component.contains(key);
+    }
+
+    /**
+     * @brief calls a function for every formula cell inside a rectangle
+     *
+     * @param rect [in] rectangle to be searched
+     * @param fn [in] function called with the position of a formula
+     */
+    void forEachFormula(const CRect &rect, const std::function<void(const CKey &)> &fn) const;
+
+    /**
+     * @brief calls a function for every formula reading given cell directly
+     *
+     * @param key [in] position of the read cell
+     * @param fn [in] function called with the position of a formula
+     */
+    void forEachDependent(const CKey &key, const std::function<void(const CKey &)> &fn) const;
+
+    /**
+     * @brief orders given formulas and all formulas they read
+     *
+     * @param roots [in] formulas to be evaluated, other cells are skipped
+     * @param done [in] tells whether a formula is computed already, it is then skipped with what it reads
+     * @return std::vector<CKey> formulas, each after all formulas it reads, cycles are left out.
+     */
+    std::vector<CKey> evaluationOrder(const std::vector<CKey> &roots,
+                                      const std::function<bool(const CKey &)> &done = nullptr) const;
+
+    /**
+     * @brief tells whether the graph has no formulas
+     */
+    bool isEmpty() const {
+        return nodes.empty();
+    }
+
+    /**
+     * @brief estimates the memory of the graph
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+private:
+    static constexpr size_t WIDE = 64;
+    // bands of level n are 2^(BAND_BITS + LEVEL_BITS * n) columns or rows wide, a wide range is kept on the
+    // first column and row levels on which it reaches fewer than 2^LEVEL_BITS bands
+    static constexpr size_t BAND_BITS = 6;
+    static constexpr size_t LEVEL_BITS = 3;
+    static constexpr size_t LEVELS = 20;
+
+    // (column level, row level, column band, row band, owner)
+    using CBand = std::tuple<size_t, size_t, size_t, size_t, CKey>;
+
+    CSharedMap<CKey, CPrecedents> nodes;
+    // (column, row) of formula cells, the cells of a column follow one another
+    CSharedMap<CKey, bool> formulas;
+    CSharedMap<CKey, std::set<CKey>> referrers;
+    // (column, top row, owner) -> bottom row, ranges narrower than WIDE columns
+    CSharedMap<std::tuple<size_t, size_t, CKey>, size_t> rangeColumns;
+    // band -> ranges at least WIDE columns wide, a range is kept in every band it reaches
+    CSharedMap<CBand, std::vector<CRect>> wideRanges;
+    CSharedMap<CKey, size_t> component;
+    CSharedMap<size_t, std::vector<CKey>> members;
+    size_t nextComponent = 0;
+
+    /**
+     * @brief adds the edges of a formula
+     */
+    void link(const CKey &key, const CPrecedents &precedents);
+
+    /**
+     * @brief removes the edges of a formula
+     */
+    void unlink(const CKey &key, const CPrecedents &precedents);
+
+    /**
+     * @brief bit shift of the bands of a level
+     */
+    static size_t bandShift(size_t level) {
+        return BAND_BITS + LEVEL_BITS * level;
+    }
+
+    /**
+     * @brief the first level on which the columns or rows from first to last reach fewer than 2^LEVEL_BITS bands
+     */
+    static size_t bandLevel(size_t first, size_t last);
+
+    /**
+     * @brief calls a function for every band of a wide range
+     *
+     * @param rect [in] range at least WIDE columns wide
+     * @param owner [in] formula reading the range
+     * @param fn [in] function called with the band
+     */
+    static void forEachBand(const CRect &rect, const CKey &owner, const std::function<void(const CBand &)> &fn);
+
+    /**
+     * @brief calls a function for the formula cells inside a rectangle, column by column
+     *
+     * @param rect [in] rectangle to be searched
+     * @param fn [in] function called with the position of a formula, returns false to stop
+     * @return bool False if the function stopped the search.
+     */
+    bool scanFormulas(const CRect &rect, const std::function<bool(const CKey &)> &fn) const;
+
+    /**
+     * @brief calls a function for every formula cell among given precedents
+     */
+    void forEachPrecedent(const CPrecedents &precedents, const std::function<void(const CKey &)> &fn) const;
+
+    /**
+     * @brief tells whether a formula may be in a cycle, i.e. it both reads and is read by a formula
+     */
+    bool candidate(const CKey &key, const CPrecedents &precedents) const;
+
+    /**
+     * @brief forgets a component, its cells are no longer cyclic
+     */
+    void dissolve(size_t id);
+
+    /**
+     * @brief records a component as a cycle
+     */
+    void record(std::vector<CKey> cells);
+
+    /**
+     * @brief finds strongly connected components among given formulas (Tarjan)
+     *
+     * @param roots [in] formulas to be searched
+     * @param inside [in] restricts the search to a part of the graph
+     */
+    void findComponents(const std::vector<CKey> &roots, const std::function<bool(const CKey &)> &inside);
+};
+
+#endif // CDEPENDENCYGRAPH_H
@@ -0,0 +1,443 @@
+#include "CFormulaParser.h"
+#include "CFormulaText.h"
+#include <charconv>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+    // ASCII only, the classification of <cctype> goes through the locale
+    bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    bool isAlpha(char c) {
+        return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::parse(std::string_view formula, TBuilder &builder) {
+    if (formula.empty() || formula[0] != '=') {
+        builder.valString(formula);
+        return;
+    }
+    CBasicFormulaParser parser(formula, builder);
+    // only a formula with a ! may name a sheet
+    parser.named = formula.find('!') != std::string_view::npos;
+    parser.pos = 1;
+    parser.next();
+    bool range = parser.equality();
+    if (parser.token != Token::END) {
+        parser.fail("Unexpected extra token(s)");
+    }
+    if (range) {
+        parser.fail("Range is invalid expression result");
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::next() {
+    while (pos < text.length() && isSpace(text[pos])) {
+        ++pos;
+    }
+    if (pos == text.length()) {
+        token = Token::END;
+        return;
+    }
+    char c = text[pos];
+    sheet.clear();
+    if (named) {
+        size_t end = CFormulaText::sheetEnd(text, pos, sheet);
+        if (end != pos) {
+            // a reference to another sheet follows
+            pos = end;
+            readName();
+            return;
+        }
+    }
+    if (isDigit(c)) {
+        readNumber();
+        return;
+    }
+    if (c == '$' || c == '#' || isAlpha(c)) {
+        readName();
+        return;
+    }
+    ++pos;
+    switch (c) {
+        case '"':
+            readString();
+            return;
+        case '+':
+            token = Token::ADD;
+            return;
+        case '-':
+            token = Token::SUBTRACT;
+            return;
+        case '*':
+            token = Token::MULTIPLY;
+            return;
+        case '/':
+            token = Token::DIVIDE;
+            return;
+        case '^':
+            token = Token::POWER;
+            return;
+        case '(':
+            token = Token::OPEN;
+            return;
+        case ')':
+            token = Token::CLOSE;
+            return;
+        case ',':
+            token = Token::COMMA;
+            return;
+        case '=':
+            token = Token::EQUAL;
+            return;
+        case '<':
+            if (pos < text.length() && text[pos] == '>') {
+                ++pos;
+                token = Token::NOT_EQUAL;
+            } else if (pos < text.length() && text[pos] == '=') {
+                ++pos;
+                token = Token::LESS_EQUAL;
+            } else {
+                token = Token::LESS;
+            }
+            return;
+        case '>':
+            if (pos < text.length() && text[pos] == '=') {
+                ++pos;
+                token = Token::GREATER_EQUAL;
+            } else {
+                token = Token::GREATER;
+            }
+            return;
+        default:
+            --pos;
+            fail("Unknown char sequence");
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::readNumber() {
+    size_t start = pos;
+    while (pos < text.length() && isDigit(text[pos])) {
+        ++pos;
+    }
+    if (pos < text.length() && text[pos] == '.') {
+        ++pos;
+        while (pos < text.length() && isDigit(text[pos])) {
+            ++pos;
+        }
+    }
+    if (pos < text.length() && (text[pos] == 'e' || text[pos] == 'E')) {
+        ++pos;
+        if (pos < text.length() && (text[pos] == '+' || text[pos] == '-')) {
+            ++pos;
+        }
+        if (pos == text.length() || !isDigit(text[pos])) {
+            fail("Invalid number");
+        }
+        while (pos < text.length() && isDigit(text[pos])) {
+            ++pos;
+        }
+    }
+    token = Token::NUMBER;
+    auto [end, error] = std::from_chars(text.data() + start, text.data() + pos, number);
+    if (error == std::errc::result_out_of_range) {
+        // infinity or zero, as strtod rounds it
+        number = std::strtod(std::string(text.substr(start, pos - start)).c_str(), nullptr);
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::readString() {
+    size_t start = pos;
+    bool escaped = false;
+    while (true) {
+        size_t quote = text.find('"', pos);
+        if (quote == std::string_view::npos) {
+            pos = text.length();
+            fail("Missing string terminator");
+        }
+        pos = quote + 1;
+        if (pos == text.length() || text[pos] != '"') {
+            break;
+        }
+        // a doubled quote stands for one
+        escaped = true;
+        ++pos;
+    }
+    token = Token::STRING;
+    lexeme = text.substr(start, pos - 1 - start);
+    if (escaped) {
+        buffer.clear();
+        for (size_t i = 0; i < lexeme.length(); ++i) {
+            buffer += lexeme[i];
+            if (lexeme[i] == '"') {
+                ++i;
+            }
+        }
+        lexeme = buffer;
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::readName() {
+    size_t start = pos;
+    size_t end = pos;
+    while (end < text.length() && isAlpha(text[end])) {
+        ++end;
+    }
+    if (end > start && (end == text.length() || (text[end] != '$' && !isDigit(text[end])))) {
+        // letters only, the name of a function
+        lexeme = text.substr(start, end - start);
+        pos = end;
+        while (pos < text.length() && isSpace(text[pos])) {
+            ++pos;
+        }
+        if (pos == text.length()) {
+            fail("Invalid cell/range");
+        }
+        if (text[pos] != '(') {
+            fail("Missing ( in function call");
+        }
+        token = Token::FUNCTION;
+        return;
+    }
+    readCell();
+    token = Token::CELL;
+    if (pos < text.length() && text[pos] == ':') {
+        ++pos;
+        if (pos == text.length() || (text[pos] != '$' && text[pos] != '#' && !isAlpha(text[pos]))) {
+            fail("Invalid cell/range");
+        }
+        readCell();
+        if (pos < text.length() && text[pos] == ':') {
+            fail("Invalid range");
+        }
+        token = Token::RANGE;
+    }
+    lexeme = text.substr(start, pos - start);
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::readCell() {
+    if (text.substr(pos, CFormulaText::INVALID_REF.length()) == CFormulaText::INVALID_REF) {
+        pos += CFormulaText::INVALID_REF.length();
+        return;
+    }
+    if (text[pos] == '$') {
+        ++pos;
+    }
+    size_t letters = pos;
+    while (pos < text.length() && isAlpha(text[pos])) {
+        ++pos;
+    }
+    if (pos == letters) {
+        fail("Missing column id");
+    }
+    if (pos < text.length() && text[pos] == '$') {
+        ++pos;
+    }
+    size_t digits = pos;
+    while (pos < text.length() && isDigit(text[pos])) {
+        ++pos;
+    }
+    if (pos == digits) {
+        fail("Missing cell row");
+    }
+    if (pos < text.length() && (isAlpha(text[pos]) || text[pos] == '$')) {
+        fail("Invalid cell/range");
+    }
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::equality() {
+    bool range = comparison();
+    while (token == Token::EQUAL || token == Token::NOT_EQUAL) {
+        Token op = token;
+        value(range);
+        next();
+        value(comparison());
+        range = false;
+        if (op == Token::EQUAL) {
+            builder.opEq();
+        } else {
+            builder.opNe();
+        }
+    }
+    return range;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::comparison() {
+    bool range = sum();
+    while (token >= Token::LESS && token <= Token::GREATER_EQUAL) {
+        Token op = token;
+        value(range);
+        next();
+        value(sum());
+        range = false;
+        switch (op) {
+            case Token::LESS:
+                builder.opLt();
+                break;
+            case Token::LESS_EQUAL:
+                builder.opLe();
+                break;
+            case Token::GREATER:
+                builder.opGt();
+                break;
+            default:
+                builder.opGe();
+        }
+    }
+    return range;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::sum() {
+    bool range = term();
+    while (token == Token::ADD || token == Token::SUBTRACT) {
+        Token op = token;
+        value(range);
+        next();
+        value(term());
+        range = false;
+        if (op == Token::ADD) {
+            builder.opAdd();
+        } else {
+            builder.opSub();
+        }
+    }
+    return range;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::term() {
+    bool range = negation();
+    while (token == Token::MULTIPLY || token == Token::DIVIDE) {
+        Token op = token;
+        value(range);
+        next();
+        value(negation());
+        range = false;
+        if (op == Token::MULTIPLY) {
+            builder.opMul();
+        } else {
+            builder.opDiv();
+        }
+    }
+    return range;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::negation() {
+    if (token != Token::SUBTRACT) {
+        return power();
+    }
+    next();
+    value(negation());
+    builder.opNeg();
+    return false;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::power() {
+    bool range = operand();
+    while (token == Token::POWER) {
+        value(range);
+        next();
+        value(operand());
+        range = false;
+        builder.opPow();
+    }
+    return range;
+}
+
+template <class TBuilder>
+bool CBasicFormulaParser<TBuilder>::operand() {
+    bool range = false;
+    switch (token) {
+        case Token::NUMBER:
+            builder.valNumber(number);
+            break;
+        case Token::STRING:
+            builder.valString(lexeme);
+            break;
+        case Token::CELL:
+            builder.valReference(sheet, lexeme);
+            break;
+        case Token::RANGE:
+            builder.valRange(sheet, lexeme);
+            range = true;
+            break;
+        case Token::FUNCTION:
+            call();
+            return false;
+        case Token::OPEN:
+            next();
+            range = equality();
+            if (token != Token::CLOSE) {
+                fail("Missing )");
+            }
+            break;
+        default:
+            fail("Unexpected token");
+    }
+    next();
+    return range;
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::call() {
+    const CFunctionRegistry::CFunction *function = CFunctionRegistry::find(lexeme);
+    if (!function) {
+        fail("Unknown function");
+    }
+    next();
+    next();
+    size_t count = 0;
+    if (token != Token::CLOSE) {
+        while (true) {
+            if (equality() != function->takesRange(count)) {
+                fail("Wrong kind of function argument");
+            }
+            ++count;
+            if (token != Token::COMMA) {
+                break;
+            }
+            next();
+        }
+        if (token != Token::CLOSE) {
+            fail("Missing )");
+        }
+    }
+    if (!function->takesCount(count)) {
+        fail("Wrong number of function arguments");
+    }
+    builder.funcCall(function->name, static_cast<int>(count));
+    next();
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::value(bool range) const {
+    if (range) {
+        fail("Range is not a valid operand of an operator");
+    }
+}
+
+template <class TBuilder>
+void CBasicFormulaParser<TBuilder>::fail(const char *message) const {
+    throw std::invalid_argument(std::string(message) + " at " + std::to_string(pos) + " in " + std::string(text));
+}
+
+template class CBasicFormulaParser<ExpressionBuilder>;
+template class CBasicFormulaParser<CNullBuilder>;
@@ -0,0 +1,213 @@
+#ifndef CFORMULAPARSER_H
+#define CFORMULAPARSER_H
+
+#include <string>
+#include <string_view>
+#include "ExpressionBuilder.h"
+#include "CFunctionRegistry.h"
+
+/** @brief Builder ignoring the expression, measures the parser alone.
+ */
+struct CNullBuilder {
+    void opAdd() {}
+
+    void opSub() {}
+
+    void opMul() {}
+
+    void opDiv() {}
+
+    void opPow() {}
+
+    void opNeg() {}
+
+    void opEq() {}
+
+    void opNe() {}
+
+    void opLt() {}
+
+    void opLe() {}
+
+    void opGt() {}
+
+    void opGe() {}
+
+    void valNumber(double) {}
+
+    void valString(std::string_view) {}
+
+    void valReference(std::string_view, std::string_view) {}
+
+    void valRange(std::string_view, std::string_view) {}
+
+    void funcCall(std::string_view, int) {}
+};
+
+/** @brief Parses the text of a formula straight into a builder.
+ *
+ * It accepts the language of parseExpression and calls the builder in the
+ * same order, so both build the same nodes. Unlike parseExpression it rounds
+ * every number correctly, does not wrap huge exponents and rejects a formula
+ * ending in a lone < or >. A cell or range may name a sheet of the workbook
+ * (Data!A1, 'My data'!A1:B2), the builder gets the name apart from the
+ * reference, and #REF! stands for a cell. Tokens are views into the text,
+ * only a string literal with doubled quotes is copied, into one buffer reused
+ * by the whole formula. The builder is called directly, not through CExprBuilder. It is
+ * instantiated for ExpressionBuilder (CFormulaParser) and for CNullBuilder,
+ * which the benchmark uses to time parsing without building nodes.
+ *
+ * = and <> bind weakest, then <, <=, > and >=, + and -, * and /, unary minus
+ * and ^ (left associative, so -2^2 is -(2^2) and 2^3^2 is (2^3)^2). A range
+ * may only be an argument of a function, CFunctionRegistry lists the
+ * parameters of every function.
+ */
+template <class TBuilder>
+class CBasicFormulaParser {
+public:
+    /**
+     * @brief builds the expression of a formula
+     *
+     * @param formula [in] formula text, a text not starting with = is a string
+     * @param builder [in, out] builder receiving the expression
+     * @throws std::invalid_argument when the formula is not valid.
+     */
+    static void parse(std::string_view formula, TBuilder &builder);
+
+private:
+    enum class Token {
+        END,
+        NUMBER,
+        STRING,
+        CELL,
+        RANGE,
+        FUNCTION,
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        POWER,
+        EQUAL,
+        NOT_EQUAL,
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL,
+        OPEN,
+        CLOSE,
+        COMMA
+    };
+
+    std::string_view text;
+    TBuilder &builder;
+    // position after the current token
+    size_t pos = 0;
+    Token token = Token::END;
+    // text of a cell, range or function name, contents of a string literal
+    std::string_view lexeme;
+    double number = 0;
+    // unescaped string literals
+    std::string buffer;
+    // the formula may name sheets
+    bool named = false;
+    // sheet named in front of the current cell or range, empty for the sheet of the formula
+    std::string sheet;
+
+    CBasicFormulaParser(std::string_view text, TBuilder &builder) : text(text), builder(builder) {}
+
+    /**
+     * @brief reads the next token into token, lexeme and number
+     */
+    void next();
+
+    /**
+     * @brief reads a number starting at pos
+     */
+    void readNumber();
+
+    /**
+     * @brief reads a string literal, pos is after its opening quote
+     */
+    void readString();
+
+    /**
+     * @brief reads a cell, range or function name starting at pos, after the name of a sheet
+     */
+    void readName();
+
+    /**
+     * @brief reads one cell of a reference or range starting at pos
+     */
+    void readCell();
+
+    /**
+     * @brief parses = and <>
+     *
+     * @return bool True if the result is a range.
+     */
+    bool equality();
+
+    /**
+     * @brief parses <, <=, > and >=
+     *
+     * @return bool True if the result is a range.
+     */
+    bool comparison();
+
+    /**
+     * @brief parses additions and subtractions
+     *
+     * @return bool True if the result is a range.
+     */
+    bool sum();
+
+    /**
+     * @brief parses multiplications and divisions
+     *
+     * @return bool True if the result is a range.
+     */
+    bool term();
+
+    /**
+     * @brief parses unary minus
+     *
+     * @return bool True if the result is a range.
+     */
+    bool negation();
+
+    /**
+     * @brief parses powers
+     *
+     * @return bool True if the result is a range.
+     */
+    bool power();
+
+    /**
+     * @brief parses a number, string, cell, range, function call or parenthesis
+     *
+     * @return bool True if the result is a range.
+     */
+    bool operand();
+
+    /**
+     * @brief parses the arguments of a function and calls it
+     */
+    void call();
+
+    /**
+     * @brief rejects a range used as an operand of an operator
+     */
+    void value(bool range) const;
+
+    /**
+     * @brief throws std::invalid_argument describing an error at pos
+     */
+    [[noreturn]] void fail(const char *message) const;
+};
+
+extern template class CBasicFormulaParser<ExpressionBuilder>;
+extern template class CBasicFormulaParser<CNullBuilder>;
+
+using CFormulaParser = CBasicFormulaParser<ExpressionBuilder>;
+
+#endif // CFORMULAPARSER_H
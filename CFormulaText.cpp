@@ -0,0 +1,394 @@
+#include "CFormulaText.h"
+#include "CRelocation.h"
+#include <cctype>
+#include <charconv>
+
+size_t CFormulaText::literalEnd(std::string_view str, size_t i) {
+    // quotes inside a literal are doubled
+    size_t end = i + 1;
+    while (end < str.length()) {
+        if (str[end] == '"') {
+            if (end + 1 < str.length() && str[end + 1] == '"') {
+                end += 2;
+                continue;
+            }
+            return end + 1;
+        }
+        ++end;
+    }
+    return end;
+}
+
+size_t CFormulaText::quotedEnd(std::string_view str, size_t i) {
+    // quotes inside a quoted name are doubled
+    size_t end = i + 1;
+    while (end < str.length()) {
+        if (str[end] == '\'') {
+            if (end + 1 < str.length() && str[end + 1] == '\'') {
+                end += 2;
+                continue;
+            }
+            return end + 1;
+        }
+        ++end;
+    }
+    return end;
+}
+
+size_t CFormulaText::scanRef(std::string_view str, size_t i, CRef &ref) {
+    if (str.substr(i, INVALID_REF.length()) == INVALID_REF) {
+        ref = CRef{true, INVALID_COLUMN, true, 1};
+        return i + INVALID_REF.length();
+    }
+    size_t end = i;
+    ref = CRef{false, 0, false, 0};
+    if (end < str.length() && str[end] == '$') {
+        ref.absColumn = true;
+        ++end;
+    }
+    size_t letters = end;
+    while (end < str.length() && std::isalpha(static_cast<unsigned char>(str[end]))) {
+        ref.column = ref.column * 26 + (std::tolower(str[end]) - 'a' + 1);
+        ++end;
+    }
+    if (end == letters) {
+        return i;
+    }
+    if (end < str.length() && str[end] == '$') {
+        ref.absRow = true;
+        ++end;
+    }
+    size_t digits = end;
+    while (end < str.length() && std::isdigit(static_cast<unsigned char>(str[end]))) {
+        ref.row = ref.row * 10 + (str[end] - '0');
+        ++end;
+    }
+    return end == digits ? i : end;
+}
+
+bool CFormulaText::parseRef(std::string_view str, CRef &ref) {
+    return !str.empty() && scanRef(str, 0, ref) == str.length();
+}
+
+size_t CFormulaText::sheetEnd(std::string_view str, size_t i, std::string &sheet) {
+    size_t end = i;
+    sheet.clear();
+    if (end < str.length() && str[end] == '\'') {
+        // quotes inside a quoted name are doubled
+        for (++end; end < str.length(); ++end) {
+            if (str[end] == '\'') {
+                if (end + 1 < str.length() && str[end + 1] == '\'') {
+                    sheet += str[++end];
+                    continue;
+                }
+                break;
+            }
+            sheet += str[end];
+        }
+        if (end >= str.length() || sheet.empty()) {
+            return i;
+        }
+        ++end;
+    } else {
+        while (end < str.length() && (std::isalnum(static_cast<unsigned char>(str[end])) || str[end] == '_'
+                                      || str[end] == '.')) {
+            ++end;
+        }
+    }
+    CRef ref{};
+    if (end == i || end >= str.length() || str[end] != '!' || scanRef(str, end + 1, ref) == end + 1) {
+        sheet.clear();
+        return i;
+    }
+    if (str[i] != '\'') {
+        sheet = str.substr(i, end - i);
+    }
+    return end + 1;
+}
+
+std::string CFormulaText::rewrite(std::string_view str,
+                                  const std::function<std::string(const CRef &, const std::string &)> &replace,
+                                  bool keepSheets) {
+    return rewriteRanges(str, [&replace](const CRef &from, const CRef *to, const std::string &sheet) {
+        return to ? replace(from, sheet) + ':' + replace(*to, sheet) : replace(from, sheet);
+    }, keepSheets);
+}
+
+std::string CFormulaText::rewriteRanges(std::string_view str,
+                                        const std::function<std::string(const CRef &, const CRef *,
+                                                                        const std::string &)> &replace,
+                                        bool keepSheets) {
+    std::string res;
+    res.reserve(str.length() + 8);
+    // sheet named in front of the reference being read
+    std::string sheet;
+    std::string name;
+    size_t i = 0;
+    while (i < str.length()) {
+        char c = str[i];
+        if (c != '"' && c != '$') {
+            size_t end = sheetEnd(str, i, name);
+            if (end != i) {
+                if (keepSheets) {
+                    res.append(str.substr(i, end - i));
+                }
+                sheet.swap(name);
+                i = end;
+                continue;
+            }
+        }
+        if (c == '"') {
+            size_t end = literalEnd(str, i);
+            res.append(str.substr(i, end - i));
+            i = end;
+            sheet.clear();
+        } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            size_t end = i;
+            while (end < str.length() && (std::isdigit(static_cast<unsigned char>(str[end])) || str[end] == '.')) {
+                ++end;
+            }
+            if (end < str.length() && (str[end] == 'e' || str[end] == 'E')) {
+                size_t exp = end + 1;
+                if (exp < str.length() && (str[exp] == '+' || str[exp] == '-')) {
+                    ++exp;
+                }
+                if (exp < str.length() && std::isdigit(static_cast<unsigned char>(str[exp]))) {
+                    end = exp;
+                    while (end < str.length() && std::isdigit(static_cast<unsigned char>(str[end]))) {
+                        ++end;
+                    }
+                }
+            }
+            res.append(str.substr(i, end - i));
+            i = end;
+            sheet.clear();
+        } else if (c == '$' || c == '#' || std::isalpha(static_cast<unsigned char>(c))) {
+            CRef ref{};
+            size_t end = scanRef(str, i, ref);
+            if (end == i) {
+                // a function name or some other identifier
+                do {
+                    res += str[i++];
+                } while (i < str.length() && std::isalpha(static_cast<unsigned char>(str[i])));
+                sheet.clear();
+                continue;
+            }
+            CRef to{};
+            size_t last = end < str.length() && str[end] == ':' ? scanRef(str, end + 1, to) : end;
+            if (last > end + 1) {
+                res += replace(ref, &to, sheet);
+                i = last;
+            } else {
+                res += replace(ref, nullptr, sheet);
+                i = end;
+            }
+            sheet.clear();
+        } else {
+            res += c;
+            ++i;
+            sheet.clear();
+        }
+    }
+    return res;
+}
+
+std::string CFormulaText::shift(std::string_view str, long long w, long long h) {
+    return rewriteRanges(str, [w, h](const CRef &from, const CRef *to, const std::string &) {
+        bool valid = true;
+        auto move = [w, h, &valid](const CRef &ref) {
+            CRef shifted = ref;
+            if (ref.column == INVALID_COLUMN) {
+                return shifted;
+            }
+            if (!ref.absColumn) {
+                valid = offset(ref.column, w, 1, shifted.column) && valid;
+            }
+            if (!ref.absRow) {
+                valid = offset(ref.row, h, 0, shifted.row) && valid;
+            }
+            return shifted;
+        };
+        CRef first = move(from);
+        if (!to) {
+            return valid ? refText(first) : std::string(INVALID_REF);
+        }
+        CRef second = move(*to);
+        return valid ? refText(first) + ':' + refText(second)
+                     : std::string(INVALID_REF) + ':' + std::string(INVALID_REF);
+    });
+}
+
+std::string CFormulaText::toRelative(std::string_view str, size_t row, size_t column) {
+    return rewrite(str, [row, column](const CRef &ref, const std::string &) {
+        std::string res = "{";
+        res += ref.absColumn ? "$" + std::to_string(ref.column)
+                             : std::to_string(static_cast<long long>(ref.column) - static_cast<long long>(column));
+        res += ',';
+        res += ref.absRow ? "$" + std::to_string(ref.row)
+                          : std::to_string(static_cast<long long>(ref.row) - static_cast<long long>(row));
+        res += '}';
+        return res;
+    });
+}
+
+std::string CFormulaText::relocate(std::string_view str, const CRelocation &relocation, std::string_view sheet) {
+    return rewriteRanges(str, [&relocation, sheet](const CRef &from, const CRef *to, const std::string &name) {
+        if (name != sheet || from.column == INVALID_COLUMN) {
+            return to ? refText(from) + ':' + refText(*to) : refText(from);
+        }
+        CRef first = from;
+        size_t &coordinate = relocation.columns ? first.column : first.row;
+        if (!to) {
+            return relocation.move(coordinate) ? refText(first) : std::string(INVALID_REF);
+        }
+        CRef second = *to;
+        size_t &other = relocation.columns ? second.column : second.row;
+        // the corners may be written in any order
+        bool ordered = coordinate <= other;
+        if (!relocation.span(ordered ? coordinate : other, ordered ? other : coordinate)) {
+            return std::string(INVALID_REF) + ':' + std::string(INVALID_REF);
+        }
+        return refText(first) + ':' + refText(second);
+    });
+}
+
+bool CFormulaText::relocateRelative(std::string_view str, size_t row, size_t column, const CRelocation &relocation,
+                                    std::string &moved) {
+    size_t movedRow = row;
+    size_t movedColumn = column;
+    relocation.move(movedRow, movedColumn);
+    size_t base = relocation.columns ? column : row;
+    size_t movedBase = relocation.columns ? movedColumn : movedRow;
+    // column of #REF! in relative form, it never moves
+    const std::string invalid = "$" + std::to_string(INVALID_COLUMN);
+    bool changed = false;
+    size_t i = 0;
+    while (i < str.length() && !changed) {
+        if (str[i] == '"') {
+            i = literalEnd(str, i);
+            continue;
+        }
+        if (str[i] == '\'') {
+            i = quotedEnd(str, i);
+            continue;
+        }
+        size_t comma = str.find(',', i);
+        size_t close = str.find('}', i);
+        if (str[i] != '{' || comma == std::string_view::npos || close == std::string_view::npos || comma > close) {
+            ++i;
+            continue;
+        }
+        // only the coordinate along the relocation may change
+        std::string_view part = relocation.columns ? str.substr(i + 1, comma - i - 1)
+                                                   : str.substr(comma + 1, close - comma - 1);
+        bool abs = !part.empty() && part[0] == '$';
+        long long value = 0;
+        std::from_chars(part.data() + abs, part.data() + part.length(), value);
+        if (i > 0 && str[i - 1] == '!') {
+            // a cell of another sheet stays, only the offset from the moved cell changes
+            changed = !abs && movedBase != base;
+        } else if (str.substr(i + 1, comma - i - 1) != invalid) {
+            size_t coordinate = abs ? static_cast<size_t>(value) : base + static_cast<size_t>(value);
+            size_t target = abs ? coordinate : movedBase + static_cast<size_t>(value);
+            changed = !relocation.move(coordinate) || coordinate != target;
+        }
+        i = close + 1;
+    }
+    if (changed) {
+        moved = toRelative(relocate(fromRelative(str, row, column), relocation), movedRow, movedColumn);
+    }
+    return changed;
+}
+
+std::string CFormulaText::fromRelative(std::string_view str, size_t row, size_t column) {
+    std::string res;
+    res.reserve(str.length());
+    size_t i = 0;
+    while (i < str.length()) {
+        if (str[i] == '"' || str[i] == '\'') {
+            size_t end = str[i] == '"' ? literalEnd(str, i) : quotedEnd(str, i);
+            res.append(str.substr(i, end - i));
+            i = end;
+        } else if (str[i] == '{') {
+            CRef ref{};
+            size_t end = scanRelative(str, i, row, column, ref);
+            if (end == i) {
+                res.append(str.substr(i));
+                break;
+            }
+            CRef to{};
+            size_t last = end < str.length() && str[end] == ':' ? scanRelative(str, end + 1, row, column, to) : end;
+            if (last > end + 1) {
+                // a range reaching off the sheet is lost as a whole, as a deleted one
+                bool valid = ref.column != INVALID_COLUMN && to.column != INVALID_COLUMN;
+                res += valid ? refText(ref) + ':' + refText(to)
+                             : std::string(INVALID_REF) + ':' + std::string(INVALID_REF);
+                i = last;
+            } else {
+                res += refText(ref);
+                i = end;
+            }
+        } else {
+            res += str[i++];
+        }
+    }
+    return res;
+}
+
+bool CFormulaText::offset(size_t coordinate, long long offset, size_t lowest, size_t &result) {
+    long long moved = static_cast<long long>(coordinate) + offset;
+    if (moved < static_cast<long long>(lowest)) {
+        return false;
+    }
+    result = static_cast<size_t>(moved);
+    return true;
+}
+
+size_t CFormulaText::scanRelative(std::string_view str, size_t i, size_t row, size_t column, CRef &ref) {
+    size_t comma = str.find(',', i);
+    size_t close = str.find('}', i);
+    if (i >= str.length() || str[i] != '{' || comma == std::string_view::npos || close == std::string_view::npos
+        || comma > close) {
+        return i;
+    }
+    auto component = [](std::string_view part, size_t base, size_t lowest, bool &abs, size_t &result) {
+        abs = !part.empty() && part[0] == '$';
+        long long value = std::stoll(std::string(abs ? part.substr(1) : part));
+        if (abs) {
+            result = static_cast<size_t>(value);
+            return true;
+        }
+        return offset(base, value, lowest, result);
+    };
+    bool valid = component(str.substr(i + 1, comma - i - 1), column, 1, ref.absColumn, ref.column);
+    valid = component(str.substr(comma + 1, close - comma - 1), row, 0, ref.absRow, ref.row) && valid;
+    if (!valid) {
+        ref = CRef{true, INVALID_COLUMN, true, 1};
+    }
+    return close + 1;
+}
+
+std::string CFormulaText::columnName(size_t number) {
+    std::string result;
+    while (number > 0) {
+        result.insert(result.begin(), static_cast<char>('A' + (number - 1) % 26));
+        number = (number - 1) / 26;
+    }
+    return result;
+}
+
+std::string CFormulaText::refText(const CRef &ref) {
+    if (ref.column == INVALID_COLUMN) {
+        return std::string(INVALID_REF);
+    }
+    std::string res;
+    if (ref.absColumn) {
+        res += '$';
+    }
+    res += columnName(ref.column);
+    if (ref.absRow) {
+        res += '$';
+    }
+    res += std::to_string(ref.row);
+    return res;
+}
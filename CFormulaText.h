@@ -0,0 +1,214 @@
+#ifndef CFORMULATEXT_H
+#define CFORMULATEXT_H
+
+#include <string>
+#include <string_view>
+#include <functional>
+
+struct CRelocation;
+
+/** @brief Rewrites cell references inside the text of a formula.
+ *
+ * String literals, numbers and function names are copied unchanged, only
+ * references (A1, $A1, A$1, $A$1, also inside ranges) are passed to a callback.
+ * A reference may name a sheet of the workbook (Data!A1, 'My data'!A1:B2),
+ * the name is kept as it is. #REF! is a reference to a deleted cell, it is
+ * read as an absolute reference to INVALID_COLUMN.
+ */
+class CFormulaText {
+public:
+    // column of #REF!, no sheet reaches it
+    static constexpr size_t INVALID_COLUMN = 2481152873203736576; // 26^13
+    static constexpr std::string_view INVALID_REF = "#REF!";
+
+    /** @brief One reference found in a formula.
+     */
+    struct CRef {
+        bool absColumn;
+        size_t column;
+        bool absRow;
+        size_t row;
+    };
+
+    /**
+     * @brief shifts relative references as copyRect does
+     *
+     * A reference shifted left of column A or above row 1 becomes #REF!, a
+     * range with such a corner as a whole.
+     *
+     * @param str [in] formula text
+     * @param w [in] column offset
+     * @param h [in] row offset
+     * @return std::string shifted formula.
+     */
+    static std::string shift(std::string_view str, long long w, long long h);
+
+    /**
+     * @brief converts a formula into a position independent form
+     *
+     * Relative references are stored as offsets from the cell, so formulas
+     * copied by copyRect have the same relative form.
+     *
+     * @param str [in] formula text
+     * @param row [in] row of the cell holding the formula
+     * @param column [in] column of the cell holding the formula
+     * @return std::string relative form.
+     */
+    static std::string toRelative(std::string_view str, size_t row, size_t column);
+
+    /**
+     * @brief converts a relative form back into a formula for given cell
+     *
+     * Offsets reaching left of column A or above row 1 become #REF! as in shift.
+     *
+     * @param str [in] relative form made by toRelative
+     * @param row [in] row of the cell holding the formula
+     * @param column [in] column of the cell holding the formula
+     * @return std::string formula text.
+     */
+    static std::string fromRelative(std::string_view str, size_t row, size_t column);
+
+    /**
+     * @brief moves references as inserted or deleted rows or columns move the cells
+     *
+     * Only references naming the given sheet are moved, with an empty name
+     * those without a sheet name.
+     *
+     * @param str [in] formula text
+     * @param relocation [in] inserted or deleted rows or columns
+     * @param sheet [in] name of the relocated sheet, empty for the sheet of the formula
+     * @return std::string formula reading the moved cells.
+     */
+    static std::string relocate(std::string_view str, const CRelocation &relocation, std::string_view sheet = {});
+
+    /**
+     * @brief moves a formula in relative form together with its cell
+     *
+     * The references are moved as relocate moves them. The relative form of
+     * most moved formulas stays the same, it is checked without rewriting
+     * the formula.
+     *
+     * @param str [in] relative form made by toRelative
+     * @param row [in] row of the cell holding the formula, it is not deleted
+     * @param column [in] column of the cell holding the formula
+     * @param relocation [in] inserted or deleted rows or columns
+     * @param moved [out] relative form in the moved cell, set only when it differs
+     * @return bool True if the relative form changes.
+     */
+    static bool relocateRelative(std::string_view str, size_t row, size_t column, const CRelocation &relocation,
+                                 std::string &moved);
+
+    /**
+     * @brief reads a sheet name followed by ! and a reference
+     *
+     * @param str [in] formula text
+     * @param i [in] start of the name, possibly quoted by '
+     * @param sheet [out] the name without quotes
+     * @return size_t position just after the !, i if there is no such name.
+     */
+    static size_t sheetEnd(std::string_view str, size_t i, std::string &sheet);
+
+    /**
+     * @brief parses a single reference such as $B7
+     *
+     * @param str [in] reference text
+     * @param ref [out] parsed reference
+     * @return bool True if the whole text is a reference, false otherwise.
+     */
+    static bool parseRef(std::string_view str, CRef &ref);
+
+    /**
+     * @brief converts number into a column name
+     *
+     * @param number [in] column number, 1 is A
+     * @return std::string column name.
+     */
+    static std::string columnName(size_t number);
+
+    /**
+     * @brief writes a reference
+     *
+     * @param ref [in] reference to be written
+     * @return std::string reference text, e.g. $B7, #REF! for INVALID_COLUMN.
+     */
+    static std::string refText(const CRef &ref);
+
+private:
+    /**
+     * @brief reads a reference starting at given position
+     *
+     * @param str [in] formula text
+     * @param i [in] start of the reference
+     * @param ref [out] parsed reference
+     * @return size_t end of the reference, i if there is none.
+     */
+    static size_t scanRef(std::string_view str, size_t i, CRef &ref);
+
+    /**
+     * @brief finds the end of a sheet name quoted by '
+     *
+     * @param str [in] formula text
+     * @param i [in] position of the opening quote
+     * @return size_t position just after the closing quote.
+     */
+    static size_t quotedEnd(std::string_view str, size_t i);
+
+    /**
+     * @brief adds an offset to a row or column
+     *
+     * @param coordinate [in] row or column
+     * @param offset [in] signed offset
+     * @param lowest [in] first valid coordinate, 1 for columns, 0 for rows
+     * @param result [out] the moved row or column
+     * @return bool False if it falls left of column A or above row 0.
+     */
+    static bool offset(size_t coordinate, long long offset, size_t lowest, size_t &result);
+
+    /**
+     * @brief reads one reference {column,row} of a relative form
+     *
+     * @param str [in] relative form
+     * @param i [in] position of the {
+     * @param row [in] row of the cell holding the formula
+     * @param column [in] column of the cell holding the formula
+     * @param ref [out] the reference, #REF! if it falls off the sheet
+     * @return size_t position just after the }, i if there is no such reference.
+     */
+    static size_t scanRelative(std::string_view str, size_t i, size_t row, size_t column, CRef &ref);
+
+    /**
+     * @brief finds the end of a string literal
+     *
+     * @param str [in] formula text
+     * @param i [in] position of the opening quote
+     * @return size_t position just after the closing quote.
+     */
+    static size_t literalEnd(std::string_view str, size_t i);
+
+    /**
+     * @brief copies a formula, every reference is replaced by what the callback returns
+     *
+     * @param str [in] formula text
+     * @param replace [in] callback producing the text of a reference, it gets the sheet name or an empty one
+     * @param keepSheets [in] copy sheet names in front of references, false to leave them out
+     * @return std::string rewritten formula.
+     */
+    static std::string rewrite(std::string_view str,
+                               const std::function<std::string(const CRef &, const std::string &)> &replace,
+                               bool keepSheets = true);
+
+    /**
+     * @brief copies a formula, every reference or range is replaced by what the callback returns
+     *
+     * @param str [in] formula text
+     * @param replace [in] callback producing the text of a reference, or of a range when the second corner is given
+     * @param keepSheets [in] copy sheet names in front of references, false to leave them out
+     * @return std::string rewritten formula.
+     */
+    static std::string rewriteRanges(std::string_view str,
+                                     const std::function<std::string(const CRef &, const CRef *,
+                                                                     const std::string &)> &replace,
+                                     bool keepSheets = true);
+};
+
+#endif // CFORMULATEXT_H
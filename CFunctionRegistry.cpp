@@ -0,0 +1,181 @@
+#include "CFunctionRegistry.h"
+#include "CSnapshot.h"
+#include "Node.h"
+#include <array>
+
+namespace {
+    using CArgs = std::vector<std::shared_ptr<Node>>;
+
+    /**
+     * @brief aggregates the range of the first argument
+     *
+     * @return bool False if a cell of a cycle was read, undefined cells are skipped but a cycle must not be.
+     */
+    bool aggregate(const CSnapshot &sheet, const CArgs &args, CAggregate &total) {
+        size_t cycles = CSnapshot::cycleCount();
+        total = static_cast<const RangeNode &>(*args[0]).aggregate(sheet);
+        return CSnapshot::cycleCount() == cycles;
+    }
+
+    CTerm sum(const CSnapshot &sheet, const CArgs &args) {
+        CAggregate total;
+        if (!aggregate(sheet, args, total) || !total.numbers) {
+            return CTerm();
+        }
+        return total.sum;
+    }
+
+    CTerm min(const CSnapshot &sheet, const CArgs &args) {
+        CAggregate total;
+        if (!aggregate(sheet, args, total) || !total.numbers) {
+            return CTerm();
+        }
+        return total.min;
+    }
+
+    CTerm max(const CSnapshot &sheet, const CArgs &args) {
+        CAggregate total;
+        if (!aggregate(sheet, args, total) || !total.numbers) {
+            return CTerm();
+        }
+        return total.max;
+    }
+
+    CTerm count(const CSnapshot &sheet, const CArgs &args) {
+        CAggregate total;
+        if (!aggregate(sheet, args, total)) {
+            return CTerm();
+        }
+        return static_cast<double>(total.values);
+    }
+
+    CTerm countval(const CSnapshot &sheet, const CArgs &args) {
+        CTerm value = args[0]->value(sheet);
+        if (value.index() == 0) {
+            return CTerm();
+        }
+        size_t cycles = CSnapshot::cycleCount();
+        size_t matches = 0;
+        static_cast<const RangeNode &>(*args[1]).forEachValue(sheet, [&value, &matches](const CTerm &cell) {
+            if (cell == value) {
+                ++matches;
+            }
+        });
+        if (CSnapshot::cycleCount() != cycles) {
+            return CTerm();
+        }
+        return static_cast<double>(matches);
+    }
+
+    /**
+     * @brief finds the first argument in the range of the second one
+     *
+     * @param floor [in] find the largest value not above it instead of an equal one
+     * @param offset [out] offset of the found cell in the range
+     * @return bool False if there is no such cell or a cell of a cycle was read.
+     */
+    bool find(const CSnapshot &sheet, const CArgs &args, bool floor, size_t &offset) {
+        CTerm value = args[0]->value(sheet);
+        if (value.index() == 0) {
+            return false;
+        }
+        size_t cycles = CSnapshot::cycleCount();
+        offset = static_cast<const RangeNode &>(*args[1]).match(sheet, value, floor);
+        return CSnapshot::cycleCount() == cycles && offset != CColumnIndex::NOT_FOUND;
+    }
+
+    CTerm match(const CSnapshot &sheet, const CArgs &args) {
+        size_t offset;
+        if (!find(sheet, args, false, offset)) {
+            return CTerm();
+        }
+        return static_cast<double>(offset + 1);
+    }
+
+    CTerm exactLookup(const CSnapshot &sheet, const CArgs &args) {
+        size_t offset;
+        if (!find(sheet, args, false, offset)) {
+            return CTerm();
+        }
+        return static_cast<const RangeNode &>(*args[2]).valueAt(sheet, offset);
+    }
+
+    CTerm lookup(const CSnapshot &sheet, const CArgs &args) {
+        size_t offset;
+        if (!find(sheet, args, true, offset)) {
+            return CTerm();
+        }
+        return static_cast<const RangeNode &>(*args[2]).valueAt(sheet, offset);
+    }
+
+    /**
+     * @brief reads a condition, a number is true unless it is zero
+     *
+     * @return bool False if the value is not a number.
+     */
+    bool condition(const CSnapshot &sheet, const Node &arg, bool &result) {
+        CTerm value = arg.value(sheet);
+        if (!std::holds_alternative<double>(value)) {
+            return false;
+        }
+        result = std::get<double>(value) != 0;
+        return true;
+    }
+
+    CTerm branch(const CSnapshot &sheet, const CArgs &args) {
+        bool taken;
+        if (!condition(sheet, *args[0], taken)) {
+            return CTerm();
+        }
+        return args[taken ? 1 : 2]->value(sheet);
+    }
+
+    CTerm all(const CSnapshot &sheet, const CArgs &args) {
+        for (const auto &arg: args) {
+            bool result;
+            if (!condition(sheet, *arg, result)) {
+                return CTerm();
+            }
+            if (!result) {
+                return 0.0;
+            }
+        }
+        return 1.0;
+    }
+
+    CTerm any(const CSnapshot &sheet, const CArgs &args) {
+        for (const auto &arg: args) {
+            bool result;
+            if (!condition(sheet, *arg, result)) {
+                return CTerm();
+            }
+            if (result) {
+                return 1.0;
+            }
+        }
+        return 0.0;
+    }
+
+    constexpr std::array FUNCTIONS = {
+            CFunctionRegistry::CFunction{"sum", "r", false, sum},
+            CFunctionRegistry::CFunction{"min", "r", false, min},
+            CFunctionRegistry::CFunction{"max", "r", false, max},
+            CFunctionRegistry::CFunction{"count", "r", false, count},
+            CFunctionRegistry::CFunction{"countval", "vr", false, countval},
+            CFunctionRegistry::CFunction{"match", "vr", false, match},
+            CFunctionRegistry::CFunction{"xlookup", "vrr", false, exactLookup},
+            CFunctionRegistry::CFunction{"lookup", "vrr", false, lookup},
+            CFunctionRegistry::CFunction{"if", "vvv", false, branch},
+            CFunctionRegistry::CFunction{"and", "v", true, all},
+            CFunctionRegistry::CFunction{"or", "v", true, any},
+    };
+}
+
+const CFunctionRegistry::CFunction *CFunctionRegistry::find(std::string_view name) {
+    for (const auto &function: FUNCTIONS) {
+        if (function.name == name) {
+            return &function;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,61 @@
+#ifndef CFUNCTIONREGISTRY_H
+#define CFUNCTIONREGISTRY_H
+
+#include <memory>
+#include <algorithm>
+#include <string_view>
+#include <vector>
+#include "CRope.h"
+
+class Node;
+class CSnapshot;
+
+/** @brief Functions a formula may call, resolved by name when the formula is built.
+ *
+ * A function gets its arguments unevaluated and evaluates only those it
+ * needs: if evaluates the condition and the branch it takes, and and or stop
+ * at the first argument deciding the result. The others evaluate all of them.
+ * A function is added by a row of the table in CFunctionRegistry.cpp.
+ */
+class CFunctionRegistry {
+public:
+    using CEvaluate = CTerm (*)(const CSnapshot &sheet, const std::vector<std::shared_ptr<Node>> &args);
+
+    /** @brief One function of the table.
+     */
+    struct CFunction {
+        // lowercase name
+        std::string_view name;
+        // kinds of the parameters, v for a value and r for a range
+        std::string_view params;
+        // the last parameter may repeat
+        bool variadic;
+        CEvaluate evaluate;
+
+        /**
+         * @brief tells whether an argument may be a range
+         *
+         * @param i [in] index of the argument
+         */
+        bool takesRange(size_t i) const {
+            return params[std::min(i, params.length() - 1)] == 'r';
+        }
+
+        /**
+         * @brief tells whether the function takes given number of arguments
+         */
+        bool takesCount(size_t count) const {
+            return variadic ? count >= params.length() : count == params.length();
+        }
+    };
+
+    /**
+     * @brief finds a function
+     *
+     * @param name [in] name of the function, lowercase
+     * @return const CFunction * the function, nullptr if there is none.
+     */
+    static const CFunction *find(std::string_view name);
+};
+
+#endif // CFUNCTIONREGISTRY_H
@@ -0,0 +1,63 @@
+#include "CHistory.h"
+#include "CMemoryUsage.h"
+#include <unordered_set>
+
+void CHistory::record(CStep step) {
+    for (const auto &dropped: redoSteps) {
+        used -= dropped.bytes;
+    }
+    redoSteps.clear();
+    store(false, std::move(step));
+}
+
+bool CHistory::take(bool redo, CStep &step) {
+    std::deque<CStep> &steps = redo ? redoSteps : undoSteps;
+    if (steps.empty()) {
+        return false;
+    }
+    step = std::move(steps.back());
+    steps.pop_back();
+    used -= step.bytes;
+    return true;
+}
+
+void CHistory::store(bool redo, CStep step) {
+    step.bytes = estimate(step);
+    used += step.bytes;
+    (redo ? redoSteps : undoSteps).push_back(std::move(step));
+    trim();
+}
+
+void CHistory::clear() {
+    undoSteps.clear();
+    redoSteps.clear();
+    used = 0;
+}
+
+void CHistory::setLimit(size_t bytes) {
+    limit = bytes;
+    trim();
+}
+
+size_t CHistory::estimate(const CStep &step) {
+    size_t result = sizeof(CStep) + step.cells.capacity() * sizeof(std::pair<CKey, CCell>);
+    std::unordered_set<const Node *> seen;
+    for (const auto &[key, cell]: step.cells) {
+        if (std::holds_alternative<std::string>(cell.first)) {
+            result += CMemoryUsage::text(std::get<std::string>(cell.first));
+        }
+        if (cell.second) {
+            result += cell.second->memoryUsage(seen);
+        }
+    }
+    return result;
+}
+
+void CHistory::trim() {
+    while (used > limit) {
+        // older undo steps go first, then the steps to redo furthest away
+        std::deque<CStep> &steps = undoSteps.empty() ? redoSteps : undoSteps;
+        used -= steps.front().bytes;
+        steps.pop_front();
+    }
+}
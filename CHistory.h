@@ -0,0 +1,119 @@
+#ifndef CHISTORY_H
+#define CHISTORY_H
+
+#include <deque>
+#include <vector>
+#include <utility>
+#include "CSnapshot.h"
+
+/** @brief Undo and redo steps of a sheet, see CSpreadsheet::undo().
+ *
+ * A step holds only the cells an edit touched, with the contents they had
+ * before it. Undoing a step stores the current contents of the same cells as
+ * the step to redo and the other way around, so both stacks hold deltas only.
+ * The estimated memory of all steps is kept under a limit, the oldest steps
+ * are dropped first. A step over the limit on its own cannot be kept, the
+ * steps before it are dropped with it as they could not be undone anyway.
+ * The limit is DEFAULT_LIMIT (64 MiB), a limit of 0 records nothing.
+ */
+class CHistory {
+public:
+    using CKey = std::pair<size_t, size_t>;
+
+    static constexpr size_t DEFAULT_LIMIT = size_t(64) << 20;
+
+    /** @brief Cells of one edit with the contents to be restored.
+     */
+    struct CStep {
+        // an empty cell is held as a cell without a value
+        std::vector<std::pair<CKey, CCell>> cells;
+        // the edit replaced the whole sheet, the step is restored like load
+        bool replace = false;
+        // estimated bytes, set by CHistory
+        size_t bytes = 0;
+    };
+
+    /**
+     * @brief records a new edit, the steps to redo are dropped
+     *
+     * @param step [in] cells touched by the edit with their previous contents
+     */
+    void record(CStep step);
+
+    /**
+     * @brief takes the last step to undo or redo
+     *
+     * @param redo [in] true for the step to redo, false for the step to undo
+     * @param step [out] the step
+     * @return bool False if there is no such step.
+     */
+    bool take(bool redo, CStep &step);
+
+    /**
+     * @brief stores the inverse of a step taken by take
+     *
+     * @param redo [in] true to store the step to redo, false to store the step to undo
+     * @param step [in] cells of the taken step with their current contents
+     */
+    void store(bool redo, CStep step);
+
+    /**
+     * @brief drops all steps
+     */
+    void clear();
+
+    /**
+     * @brief sets the memory limit and drops the oldest steps over it
+     *
+     * @param bytes [in] limit of the estimated memory of all steps
+     */
+    void setLimit(size_t bytes);
+
+    /**
+     * @brief tells whether edits are recorded, the limit is not 0
+     */
+    bool enabled() const {
+        return limit != 0;
+    }
+
+    /**
+     * @brief number of steps that can be undone or redone
+     *
+     * @param redo [in] true for the steps to redo, false for the steps to undo
+     */
+    size_t steps(bool redo) const {
+        return redo ? redoSteps.size() : undoSteps.size();
+    }
+
+    /**
+     * @brief estimated memory of all steps
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const {
+        return used;
+    }
+
+private:
+    // the last step is on the back
+    std::deque<CStep> undoSteps;
+    std::deque<CStep> redoSteps;
+    size_t limit = DEFAULT_LIMIT;
+    size_t used = 0;
+
+    /**
+     * @brief estimates the memory of a step
+     *
+     * An overwritten formula is usually owned by the step alone, so its
+     * expression nodes are counted, each once per step. Nodes still shared
+     * with the sheet or CNodePool are counted too, the estimate errs upwards.
+     */
+    static size_t estimate(const CStep &step);
+
+    /**
+     * @brief drops the oldest steps until the memory is under the limit
+     */
+    void trim();
+};
+
+#endif // CHISTORY_H
@@ -0,0 +1,156 @@
+#include "CJournal.h"
+#include <filesystem>
+#include <iomanip>
+#include <limits>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    /**
+     * @brief writes a file or the entries of a directory through to the disk
+     *
+     * @param path [in] a file already flushed by its stream, or a directory
+     * @return bool True if the kernel reports them stored.
+     */
+    bool sync(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+}
+
+CJournal::CJournal(std::string snapshotPath, std::string journalPath, size_t compactEvery)
+        : snapshotPath(std::move(snapshotPath)), journalPath(std::move(journalPath)),
+          compactEvery(std::max<size_t>(compactEvery, 1)) {}
+
+bool CJournal::appendSet(size_t row, size_t column, const std::string &contents) {
+    journal << ++sequence << ' ' << OP_SET << ' ' << row << ' ' << column << ' ';
+    journal << contents.length() << ' ' << contents << '\n';
+    return finishRecord();
+}
+
+bool CJournal::appendClear(size_t row, size_t column) {
+    journal << ++sequence << ' ' << OP_CLEAR << ' ' << row << ' ' << column << '\n';
+    return finishRecord();
+}
+
+bool CJournal::appendCopy(size_t row, size_t column, size_t srcRow, size_t srcColumn, int w, int h) {
+    journal << ++sequence << ' ' << OP_COPY << ' ' << row << ' ' << column << ' ';
+    journal << srcRow << ' ' << srcColumn << ' ' << w << ' ' << h << '\n';
+    return finishRecord();
+}
+
+bool CJournal::appendRelocate(const CRelocation &relocation) {
+    journal << ++sequence << ' ' << OP_RELOCATE << ' ' << relocation.columns << ' ' << relocation.insert << ' ';
+    journal << relocation.first << ' ' << relocation.count << '\n';
+    return finishRecord();
+}
+
+bool CJournal::finishRecord() {
+    ++records;
+    journal.flush();
+    // a flushed record survives a crash of the process, only fsync makes it survive a crash of the machine
+    return journal.good() && sync(journalPath);
+}
+
+bool CJournal::needsCompaction() const {
+    return records >= compactEvery;
+}
+
+bool CJournal::compact(const std::function<bool(std::ostream &)> &saveSheet) {
+    std::string tmpPath = snapshotPath + ".tmp";
+    {
+        std::ofstream os(tmpPath, std::ios::trunc);
+        os << std::setprecision(std::numeric_limits<double>::max_digits10);
+        os << sequence << '\n';
+        if (!saveSheet(os)) {
+            return false;
+        }
+        os.flush();
+        if (!os.good()) {
+            return false;
+        }
+    }
+    // the snapshot is on the disk before its name is, and the new name before the journal is truncated
+    if (!sync(tmpPath)) {
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, snapshotPath, error);
+    if (error) {
+        return false;
+    }
+    std::filesystem::path directory = std::filesystem::path(snapshotPath).parent_path();
+    if (!sync(directory.empty() ? std::string(".") : directory.string())) {
+        return false;
+    }
+    journal.close();
+    journal.open(journalPath, std::ios::trunc);
+    records = 0;
+    return journal.good();
+}
+
+bool CJournal::recover(const std::function<bool(std::istream &)> &loadSheet,
+                       const std::function<void(const CRecord &)> &apply) {
+    std::ifstream snapshot(snapshotPath);
+    size_t snapshotSequence;
+    if (!(snapshot >> snapshotSequence)) {
+        return false;
+    }
+    snapshot >> std::ws;
+    if (!loadSheet(snapshot)) {
+        return false;
+    }
+    sequence = snapshotSequence;
+    records = 0;
+    std::ifstream is(journalPath);
+    CRecord record;
+    // a damaged tail is a record that was never acknowledged, replay stops there
+    while (readRecord(is, record)) {
+        if (record.sequence <= snapshotSequence) {
+            continue;
+        }
+        apply(record);
+        sequence = record.sequence;
+        ++records;
+    }
+    return true;
+}
+
+bool CJournal::readRecord(std::istream &is, CRecord &record) {
+    if (!(is >> record.sequence >> record.operation)) {
+        return false;
+    }
+    if (record.operation == OP_RELOCATE) {
+        CRelocation &relocation = record.relocation;
+        if (!(is >> relocation.columns >> relocation.insert >> relocation.first >> relocation.count)) {
+            return false;
+        }
+        return is.get() == '\n';
+    }
+    if (!(is >> record.row >> record.column)) {
+        return false;
+    }
+    if (record.operation == OP_SET) {
+        size_t len;
+        if (!(is >> len) || is.get() != ' ') {
+            return false;
+        }
+        record.contents.assign(len, '\0');
+        if (!is.read(record.contents.data(), static_cast<std::streamsize>(len))) {
+            return false;
+        }
+    } else if (record.operation == OP_COPY) {
+        if (!(is >> record.srcRow >> record.srcColumn >> record.w >> record.h)) {
+            return false;
+        }
+    } else if (record.operation != OP_CLEAR) {
+        return false;
+    }
+    return is.get() == '\n';
+}
@@ -0,0 +1,134 @@
+#ifndef CJOURNAL_H
+#define CJOURNAL_H
+
+#include <string>
+#include <fstream>
+#include <functional>
+#include "CRelocation.h"
+
+/** @brief Append-only journal of sheet modifications.
+ *
+ * Every setCell/copyRect and every insertion or deletion of rows or columns is appended as one record, flushed and
+ * synced to the disk (fsync), undo and redo append a record per restored cell, so a durable save costs I/O proportional
+ * to the edit. Once the journal grows over the compaction threshold, the whole sheet is written into a temporary file,
+ * synced, renamed over the snapshot file with its directory synced after it, and the journal starts over. Records carry a sequence number and the snapshot
+ * stores the last sequence number it contains, so a crash between writing the
+ * snapshot and truncating the journal does not replay anything twice.
+ */
+class CJournal {
+public:
+    /** @brief One journal record.
+     */
+    struct CRecord {
+        size_t sequence = 0;
+        char operation = 0;
+        size_t row = 0;
+        size_t column = 0;
+        std::string contents;
+        size_t srcRow = 0;
+        size_t srcColumn = 0;
+        int w = 0;
+        int h = 0;
+        CRelocation relocation;
+    };
+
+    static constexpr char OP_SET = 'S';
+    static constexpr char OP_COPY = 'C';
+    static constexpr char OP_RELOCATE = 'R';
+    static constexpr char OP_CLEAR = 'E';
+
+    /**  @brief creates a new journal, files are opened later
+     * @param snapshotPath [in] file holding the last compacted sheet
+     * @param journalPath [in] file holding records made after the snapshot
+     * @param compactEvery [in] number of records that triggers compaction
+     */
+    CJournal(std::string snapshotPath, std::string journalPath, size_t compactEvery);
+
+    /**
+     * @brief appends a setCell record
+     *
+     * @param row [in] row of the cell
+     * @param column [in] column of the cell
+     * @param contents [in] contents as given to setCell
+     * @return bool True if the record was written, false otherwise.
+     */
+    bool appendSet(size_t row, size_t column, const std::string &contents);
+
+    /**
+     * @brief appends a record emptying a cell, undo writes it for a cell that was empty
+     *
+     * @param row [in] row of the cell
+     * @param column [in] column of the cell
+     * @return bool True if the record was written, false otherwise.
+     */
+    bool appendClear(size_t row, size_t column);
+
+    /**
+     * @brief appends a copyRect record
+     *
+     * @return bool True if the record was written, false otherwise.
+     */
+    bool appendCopy(size_t row, size_t column, size_t srcRow, size_t srcColumn, int w, int h);
+
+    /**
+     * @brief appends a record of inserted or deleted rows or columns
+     *
+     * @param relocation [in] inserted or deleted rows or columns
+     * @return bool True if the record was written, false otherwise.
+     */
+    bool appendRelocate(const CRelocation &relocation);
+
+    /**
+     * @brief tells whether the journal grew over the compaction threshold
+     *
+     * @return bool True if compact should be called.
+     */
+    bool needsCompaction() const;
+
+    /**
+     * @brief writes a full snapshot and starts an empty journal
+     *
+     * @param saveSheet [in] writes the sheet in the save format into a stream
+     * @return bool True if compaction is successful, false otherwise.
+     */
+    bool compact(const std::function<bool(std::ostream &)> &saveSheet);
+
+    /**
+     * @brief replays the snapshot and the journal
+     *
+     * The journal may end with a torn record, so the caller compacts afterwards
+     * before appending anything new.
+     *
+     * @param loadSheet [in] loads the sheet from a stream in the save format, the stream may be empty
+     * @param apply [in] applies one record on top of the loaded sheet
+     * @return bool True if the snapshot could be loaded, false otherwise.
+     */
+    bool recover(const std::function<bool(std::istream &)> &loadSheet,
+                 const std::function<void(const CRecord &)> &apply);
+
+private:
+    std::string snapshotPath;
+    std::string journalPath;
+    size_t compactEvery;
+    size_t sequence = 0;
+    size_t records = 0;
+    std::ofstream journal;
+
+    /**
+     * @brief reads one record, fails on a torn or damaged record
+     *
+     * @param is [in] stream to read from
+     * @param record [out] parsed record
+     * @return bool True if a whole record was read.
+     */
+    static bool readRecord(std::istream &is, CRecord &record);
+
+    /**
+     * @brief finishes a record that is already in the stream
+     *
+     * @return bool True if the record was flushed and synced to the disk.
+     */
+    bool finishRecord();
+};
+
+#endif // CJOURNAL_H
@@ -0,0 +1,63 @@
+#ifndef CMEMORYUSAGE_H
+#define CMEMORYUSAGE_H
+
+#include <string>
+#include <cstddef>
+
+/** @brief Estimated memory of a sheet version in bytes, see CSpreadsheet::memoryUsage().
+ *
+ * The sizes of the containers are estimated from their element counts and the
+ * usual node layouts of the standard library, heap blocks are not rounded.
+ */
+struct CMemoryUsage {
+    // nodes of the cell map, including the CValue and the pointer to the expression
+    size_t cells = 0;
+    // heap buffers of texts and formula sources, short strings are kept inline
+    size_t strings = 0;
+    // expression nodes, a node shared by several formulas is counted once
+    size_t formulas = 0;
+    // value caches, the range index and the dependency graph
+    size_t caches = 0;
+
+    /**
+     * @brief sum of all parts
+     *
+     * @return size_t bytes in total.
+     */
+    size_t total() const { return cells + strings + formulas + caches; }
+
+    /**
+     * @brief bytes of the nodes of a std::map or std::set
+     *
+     * @param count [in] number of elements
+     * @param value [in] size of one element
+     * @return size_t estimated bytes.
+     */
+    static size_t tree(size_t count, size_t value) { return count * (4 * sizeof(void *) + value); }
+
+    /**
+     * @brief bytes of the nodes and buckets of an unordered container
+     *
+     * @param count [in] number of elements
+     * @param buckets [in] number of buckets
+     * @param value [in] size of one element
+     * @return size_t estimated bytes.
+     */
+    static size_t hash(size_t count, size_t buckets, size_t value) {
+        return count * (2 * sizeof(void *) + value) + buckets * sizeof(void *);
+    }
+
+    /**
+     * @brief bytes of the heap buffer of a string
+     *
+     * @param text [in] the string
+     * @return size_t 0 for a string kept inline, its capacity otherwise.
+     */
+    static size_t text(const std::string &text) {
+        auto data = reinterpret_cast<const char *>(text.data());
+        auto self = reinterpret_cast<const char *>(&text);
+        return data >= self && data < self + sizeof(std::string) ? 0 : text.capacity() + 1;
+    }
+};
+
+#endif // CMEMORYUSAGE_H
@@ -0,0 +1,105 @@
+#include "CNodeCache.h"
+#include <cstddef>
+#include "CMemoryUsage.h"
+
+CNodeCache &CNodeCache::operator=(const CNodeCache &other) {
+    if (this != &other) {
+        clear();
+    }
+    return *this;
+}
+
+bool CNodeCache::find(const Node *node, CTerm &value) const {
+    if (empty.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    const CShard &part = shard(node);
+    std::lock_guard lock(part.mutex);
+    auto it = part.entries.find(node);
+    if (it == part.entries.end()) {
+        return false;
+    }
+    value = it->second.value;
+    return true;
+}
+
+void CNodeCache::store(std::shared_ptr<const Node> node, const CTerm &value) {
+    CPrecedents precedents;
+    node->precedents(precedents);
+    CShard &part = shard(node.get());
+    std::lock_guard lock(part.mutex);
+    const Node *key = node.get();
+    part.entries.insert_or_assign(key, CEntry{std::move(node), value, std::move(precedents)});
+    empty.store(false, std::memory_order_relaxed);
+}
+
+void CNodeCache::invalidate(const std::function<bool(const CPrecedents &)> &stale) {
+    if (empty.load(std::memory_order_relaxed)) {
+        return;
+    }
+    bool left = false;
+    for (auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        // an entry holding the only reference belongs to a formula that was overwritten
+        std::erase_if(part.entries, [&stale](const auto &entry) {
+            return entry.second.node.use_count() == 1 || stale(entry.second.precedents);
+        });
+        left = left || !part.entries.empty();
+    }
+    empty.store(!left, std::memory_order_relaxed);
+}
+
+void CNodeCache::clear() {
+    if (empty.exchange(true)) {
+        return;
+    }
+    for (auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        part.entries.clear();
+    }
+}
+
+void CNodeCache::inherit(const CNodeCache &base) {
+    clear();
+    bool copied = false;
+    for (size_t i = 0; i < SHARDS; ++i) {
+        std::unordered_map<const Node *, CEntry> entries;
+        {
+            std::lock_guard lock(base.shards[i].mutex);
+            entries = base.shards[i].entries;
+        }
+        std::lock_guard lock(shards[i].mutex);
+        shards[i].entries = std::move(entries);
+        copied = copied || !shards[i].entries.empty();
+    }
+    empty.store(!copied, std::memory_order_relaxed);
+}
+
+bool CNodeCache::isEmpty() const {
+    return empty.load(std::memory_order_relaxed);
+}
+
+size_t CNodeCache::memoryUsage() const {
+    size_t result = 0;
+    for (const auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        result += CMemoryUsage::hash(part.entries.size(), part.entries.bucket_count(),
+                                     sizeof(std::pair<const Node *const, CEntry>));
+        for (const auto &[node, entry]: part.entries) {
+            result += entry.precedents.cells.capacity() * sizeof(std::pair<size_t, size_t>)
+                      + entry.precedents.ranges.capacity() * sizeof(CRect);
+            if (std::holds_alternative<CRope>(entry.value)) {
+                result += std::get<CRope>(entry.value).memoryUsage();
+            }
+        }
+    }
+    return result;
+}
+
+CNodeCache::CShard &CNodeCache::shard(const Node *node) {
+    return shards[std::hash<const Node *>{}(node) / alignof(std::max_align_t) % SHARDS];
+}
+
+const CNodeCache::CShard &CNodeCache::shard(const Node *node) const {
+    return shards[std::hash<const Node *>{}(node) / alignof(std::max_align_t) % SHARDS];
+}
@@ -0,0 +1,103 @@
+#ifndef CNODECACHE_H
+#define CNODECACHE_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include "Node.h"
+
+/** @brief Computed values of shared sub-expressions of one version.
+ *
+ * A node reused by several formulas (see CNodePool) is evaluated once per
+ * version and its value kept here together with the cells it reads. When a
+ * version is modified in place, only the values reading a changed cell are
+ * dropped. An entry holds its node, so the address used as the key is not
+ * reused while the entry exists. A copy starts empty like CValueCache.
+ */
+class CNodeCache {
+public:
+    CNodeCache() = default;
+
+    CNodeCache(const CNodeCache &) {}
+
+    CNodeCache &operator=(const CNodeCache &other);
+
+    /**
+     * @brief looks a value up
+     *
+     * @param node [in] shared node
+     * @param value [out] cached value
+     * @return bool True if the value is cached.
+     */
+    bool find(const Node *node, CTerm &value) const;
+
+    /**
+     * @brief stores a value
+     *
+     * @param node [in] shared node
+     * @param value [in] computed value
+     */
+    void store(std::shared_ptr<const Node> node, const CTerm &value);
+
+    /**
+     * @brief drops the values whose precedents are stale and the values of nodes no formula uses any more
+     *
+     * @param stale [in] tells whether a value reading given precedents must be dropped
+     */
+    void invalidate(const std::function<bool(const CPrecedents &)> &stale);
+
+    /**
+     * @brief forgets all values
+     */
+    void clear();
+
+    /**
+     * @brief replaces the values by those of another version, the entries share their nodes
+     *
+     * @param base [in] cache of the version this one was copied from
+     */
+    void inherit(const CNodeCache &base);
+
+    /**
+     * @brief tells whether nothing is cached
+     *
+     * @return bool True if the cache is empty.
+     */
+    bool isEmpty() const;
+
+    /**
+     * @brief estimates the memory of the cached values
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct CEntry {
+        std::shared_ptr<const Node> node;
+        CTerm value;
+        CPrecedents precedents;
+    };
+
+    struct CShard {
+        mutable std::mutex mutex;
+        std::unordered_map<const Node *, CEntry> entries;
+    };
+
+    std::array<CShard, SHARDS> shards;
+    std::atomic<bool> empty = true;
+
+    /**
+     * @brief selects the shard of a node
+     */
+    CShard &shard(const Node *node);
+
+    const CShard &shard(const Node *node) const;
+};
+
+#endif // CNODECACHE_H
@@ -0,0 +1,51 @@
+#include "CNodePool.h"
+
+CNodePool &CNodePool::instance() {
+    static CNodePool pool;
+    return pool;
+}
+
+std::shared_ptr<Node> CNodePool::intern(const std::string &key, const std::function<std::shared_ptr<Node>()> &make,
+                                        bool share) {
+    CShard &part = shard(key);
+    std::lock_guard lock(part.mutex);
+    auto [it, fresh] = part.nodes.try_emplace(key);
+    if (!fresh) {
+        if (std::shared_ptr<Node> node = it->second.lock()) {
+            if (share) {
+                node->share();
+            }
+            return node;
+        }
+    }
+    std::shared_ptr<Node> node = make();
+    it->second = node;
+    if (part.nodes.size() >= part.sweepAt) {
+        // released nodes leave their entries behind, drop them once the shard doubles
+        std::erase_if(part.nodes, [](const auto &entry) { return entry.second.expired(); });
+        part.sweepAt = std::max(MIN_SWEEP, part.nodes.size() * 2);
+    }
+    return node;
+}
+
+void CNodePool::sweep() {
+    for (auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        std::erase_if(part.nodes, [](const auto &entry) { return entry.second.expired(); });
+        part.nodes.rehash(0);
+        part.sweepAt = std::max(MIN_SWEEP, part.nodes.size() * 2);
+    }
+}
+
+size_t CNodePool::size() const {
+    size_t result = 0;
+    for (const auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        result += part.nodes.size();
+    }
+    return result;
+}
+
+CNodePool::CShard &CNodePool::shard(const std::string &key) {
+    return shards[std::hash<std::string>{}(key) % SHARDS];
+}
@@ -0,0 +1,74 @@
+#ifndef CNODEPOOL_H
+#define CNODEPOOL_H
+
+#include <array>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include "Node.h"
+
+/** @brief Table of all expression nodes that are alive, used for hash-consing.
+ *
+ * ExpressionBuilder asks the pool for every node it creates. A node is
+ * described by its kind, its own data and the addresses of its children,
+ * which are pooled already, so structurally identical sub-expressions of any
+ * formulas become one node and the formulas share it as a DAG. Nodes are
+ * immutable and compute the same value wherever they are used, references
+ * point to absolute cells. The pool only observes the nodes, they are
+ * released together with the last formula using them. The descriptions are
+ * split by their hash into independently locked shards, so builders on
+ * several threads rarely wait for each other.
+ */
+class CNodePool {
+public:
+    /**
+     * @brief returns the pool shared by all sheets
+     *
+     * @return CNodePool & the pool.
+     */
+    static CNodePool &instance();
+
+    /**
+     * @brief returns the living node with given description or makes a new one
+     *
+     * @param key [in] description of the node
+     * @param make [in] creates the node when there is none
+     * @param share [in] mark a reused node as shared, so its value is cached per version
+     * @return std::shared_ptr<Node> the pooled node.
+     */
+    std::shared_ptr<Node> intern(const std::string &key, const std::function<std::shared_ptr<Node>()> &make,
+                                 bool share);
+
+    /**
+     * @brief drops the entries of released nodes from all shards
+     */
+    void sweep();
+
+    /**
+     * @brief number of described nodes, including released ones not swept yet
+     *
+     * @return size_t number of entries.
+     */
+    size_t size() const;
+
+private:
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t MIN_SWEEP = 1024;
+
+    struct CShard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, std::weak_ptr<Node>> nodes;
+        size_t sweepAt = MIN_SWEEP;
+    };
+
+    std::array<CShard, SHARDS> shards;
+
+    /**
+     * @brief selects the shard of a description
+     */
+    CShard &shard(const std::string &key);
+};
+
+#endif // CNODEPOOL_H
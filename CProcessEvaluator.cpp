@@ -0,0 +1,441 @@
+#include "CProcessEvaluator.h"
+#include <set>
+#include <deque>
+#include <cerrno>
+#include <climits>
+#include <thread>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+void CProcessEvaluator::evaluate(const CSnapshot &version, size_t processes, size_t regionRows,
+                                 std::chrono::milliseconds stall) {
+    CProcessEvaluator evaluator(version);
+    evaluator.partition(std::max<size_t>(regionRows, 1));
+    size_t regions = evaluator.begin.size() - 1;
+    if (processes < 2 || regions < 2) {
+        version.recalculate(evaluator.cells);
+        return;
+    }
+    evaluator.merge(evaluator.schedule(std::min(processes, regions), stall));
+    if (evaluator.slots) {
+        munmap(evaluator.slots, evaluator.mapped);
+    }
+}
+
+void CProcessEvaluator::partition(size_t regionRows) {
+    // (band of rows, column) -> formulas in row order
+    std::map<CKey, std::vector<CKey>> bands;
+    for (const auto &[key, cell]: version.sheet) {
+        if (cell.second && !version.graph.cyclic(key)) {
+            bands[{key.first / regionRows, key.second}].push_back(key);
+        }
+    }
+    // formula -> its band, later its region and its index in the region
+    std::unordered_map<CKey, std::pair<size_t, size_t>, CKeyHash> place;
+    size_t band = 0;
+    for (const auto &[id, keys]: bands) {
+        for (const auto &key: keys) {
+            place.emplace(key, std::make_pair(band, 0));
+        }
+        ++band;
+    }
+    // formula and a formula reading it
+    std::vector<std::pair<CKey, CKey>> links;
+    std::vector<std::vector<size_t>> edges(bands.size());
+    band = 0;
+    for (const auto &[id, keys]: bands) {
+        std::set<size_t> read;
+        for (const auto &key: keys) {
+            version.graph.forEachDependent(key, [&](const CKey &dependent) {
+                auto it = place.find(dependent);
+                if (it == place.end()) {
+                    return;
+                }
+                links.emplace_back(key, dependent);
+                if (it->second.first != band) {
+                    read.insert(it->second.first);
+                }
+            });
+        }
+        edges[band++].assign(read.begin(), read.end());
+    }
+
+    // bands reading each other become one region, so the regions form a DAG
+    std::vector<size_t> regionOf = components(edges);
+    size_t regions = regionOf.empty() ? 0 : *std::max_element(regionOf.begin(), regionOf.end()) + 1;
+    std::vector<std::vector<CKey>> members(regions);
+    band = 0;
+    for (const auto &[id, keys]: bands) {
+        size_t region = regionOf[band++];
+        for (const auto &key: keys) {
+            place[key] = {region, members[region].size()};
+            members[region].push_back(key);
+        }
+    }
+
+    std::vector<std::set<size_t>> reads(regions);
+    // the cells of a region are ordered by the formulas of the region they read
+    std::vector<std::vector<size_t>> waiting(regions);
+    std::vector<std::vector<std::vector<size_t>>> next(regions);
+    for (size_t r = 0; r < regions; ++r) {
+        waiting[r].assign(members[r].size(), 0);
+        next[r].resize(members[r].size());
+    }
+    for (const auto &[key, dependent]: links) {
+        auto [region, i] = place[key];
+        auto [other, j] = place[dependent];
+        if (region != other) {
+            reads[region].insert(other);
+        } else {
+            next[region][i].push_back(j);
+            ++waiting[region][j];
+        }
+    }
+    begin.push_back(0);
+    for (size_t r = 0; r < regions; ++r) {
+        std::deque<size_t> ready;
+        for (size_t i = 0; i < members[r].size(); ++i) {
+            if (!waiting[r][i]) {
+                ready.push_back(i);
+            }
+        }
+        while (!ready.empty()) {
+            size_t i = ready.front();
+            ready.pop_front();
+            cells.push_back(members[r][i]);
+            for (size_t j: next[r][i]) {
+                if (!--waiting[r][j]) {
+                    ready.push_back(j);
+                }
+            }
+        }
+        begin.push_back(cells.size());
+    }
+    precedents.resize(regions);
+    dependents.resize(regions);
+    for (size_t r = 0; r < regions; ++r) {
+        dependents[r].assign(reads[r].begin(), reads[r].end());
+        for (size_t other: reads[r]) {
+            precedents[other].push_back(r);
+        }
+    }
+}
+
+std::vector<size_t> CProcessEvaluator::components(const std::vector<std::vector<size_t>> &edges) {
+    size_t count = edges.size();
+    std::vector<size_t> index(count, SIZE_MAX);
+    std::vector<size_t> low(count, 0);
+    std::vector<size_t> component(count, SIZE_MAX);
+    std::vector<bool> onStack(count, false);
+    std::vector<size_t> stack;
+    // vertex and its next edge, the recursion of Tarjan's algorithm
+    std::vector<std::pair<size_t, size_t>> calls;
+    size_t visited = 0;
+    size_t found = 0;
+    for (size_t root = 0; root < count; ++root) {
+        if (index[root] != SIZE_MAX) {
+            continue;
+        }
+        calls.emplace_back(root, 0);
+        while (!calls.empty()) {
+            size_t vertex = calls.back().first;
+            if (index[vertex] == SIZE_MAX) {
+                index[vertex] = low[vertex] = visited++;
+                stack.push_back(vertex);
+                onStack[vertex] = true;
+            }
+            size_t &next = calls.back().second;
+            if (next < edges[vertex].size()) {
+                size_t target = edges[vertex][next++];
+                if (index[target] == SIZE_MAX) {
+                    calls.emplace_back(target, 0);
+                } else if (onStack[target]) {
+                    low[vertex] = std::min(low[vertex], index[target]);
+                }
+                continue;
+            }
+            if (low[vertex] == index[vertex]) {
+                size_t member;
+                do {
+                    member = stack.back();
+                    stack.pop_back();
+                    onStack[member] = false;
+                    component[member] = found;
+                } while (member != vertex);
+                ++found;
+            }
+            calls.pop_back();
+            if (!calls.empty()) {
+                size_t caller = calls.back().first;
+                low[caller] = std::min(low[caller], low[vertex]);
+            }
+        }
+    }
+    return component;
+}
+
+std::vector<bool> CProcessEvaluator::schedule(size_t processes, std::chrono::milliseconds stall) {
+    size_t regions = begin.size() - 1;
+    std::vector<bool> done(regions, false);
+    mapped = cells.size() * sizeof(CSlot) + processes * ARENA;
+    void *shared = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shared == MAP_FAILED) {
+        return done;
+    }
+    slots = static_cast<CSlot *>(shared);
+    texts = static_cast<char *>(shared) + cells.size() * sizeof(CSlot);
+
+    std::vector<int> channels;
+    std::vector<pid_t> workers;
+    for (size_t i = 0; i < processes; ++i) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pair[0]);
+            for (int channel: channels) {
+                close(channel);
+            }
+            work(pair[1], i);
+            _exit(0);
+        }
+        close(pair[1]);
+        if (pid < 0) {
+            close(pair[0]);
+            break;
+        }
+        channels.push_back(pair[0]);
+        workers.push_back(pid);
+    }
+
+    std::vector<size_t> waiting(regions);
+    std::deque<size_t> ready;
+    for (size_t r = 0; r < regions; ++r) {
+        waiting[r] = precedents[r].size();
+        if (!waiting[r]) {
+            ready.push_back(r);
+        }
+    }
+    std::vector<size_t> idle(channels.size());
+    std::iota(idle.begin(), idle.end(), 0);
+    std::vector<uint64_t> busy(channels.size(), STOP);
+    // a worker that has not passed its region back by its deadline is killed
+    std::vector<CClock::time_point> deadlines(channels.size());
+    auto retire = [&](size_t worker) {
+        terminate(workers[worker]);
+        close(channels[worker]);
+        channels[worker] = -1;
+        busy[worker] = STOP;
+    };
+    size_t running = 0;
+    while (true) {
+        while (!ready.empty() && !idle.empty()) {
+            size_t worker = idle.back();
+            idle.pop_back();
+            // a worker that cannot be reached is not used again
+            if (send(channels[worker], ready.front())) {
+                busy[worker] = ready.front();
+                deadlines[worker] = CClock::now() + stall;
+                ready.pop_front();
+                ++running;
+            }
+        }
+        if (!running) {
+            break;
+        }
+        std::vector<pollfd> polled;
+        std::vector<size_t> polledWorkers;
+        CClock::time_point first = CClock::time_point::max();
+        for (size_t worker = 0; worker < channels.size(); ++worker) {
+            if (busy[worker] != STOP) {
+                polled.push_back({channels[worker], POLLIN, 0});
+                polledWorkers.push_back(worker);
+                first = std::min(first, deadlines[worker]);
+            }
+        }
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(first - CClock::now());
+        int waited = poll(polled.data(), polled.size(),
+                          static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(timeout.count(), 0, INT_MAX)));
+        if (waited < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        CClock::time_point now = CClock::now();
+        for (size_t i = 0; i < polled.size(); ++i) {
+            size_t worker = polledWorkers[i];
+            if (!polled[i].revents) {
+                if (deadlines[worker] <= now) {
+                    // a stuck worker, e.g. on a lock another thread held during the fork
+                    retire(worker);
+                    --running;
+                }
+                continue;
+            }
+            uint64_t region;
+            bool received = receive(channels[worker], region) && region == busy[worker];
+            busy[worker] = STOP;
+            --running;
+            if (!received) {
+                // the region of a worker that died is left to the parent, and so are its dependents
+                continue;
+            }
+            done[region] = true;
+            idle.push_back(worker);
+            for (size_t dependent: dependents[region]) {
+                if (!--waiting[dependent]) {
+                    ready.push_back(dependent);
+                }
+            }
+        }
+    }
+    for (int channel: channels) {
+        if (channel >= 0) {
+            send(channel, STOP);
+            close(channel);
+        }
+    }
+    // idle workers exit on STOP, the ones that do not are killed as well
+    CClock::time_point deadline = CClock::now() + stall;
+    for (pid_t pid: workers) {
+        if (!reap(pid, deadline)) {
+            terminate(pid);
+        }
+    }
+    return done;
+}
+
+void CProcessEvaluator::work(int channel, size_t worker) {
+    size_t regions = begin.size() - 1;
+    std::vector<bool> imported(regions, false);
+    char *arena = texts + worker * ARENA;
+    size_t used = 0;
+    uint64_t region;
+    while (receive(channel, region) && region < regions) {
+        // boundary values, computed by other workers or by this one
+        for (size_t precedent: precedents[region]) {
+            if (imported[precedent]) {
+                continue;
+            }
+            imported[precedent] = true;
+            for (size_t i = begin[precedent]; i < begin[precedent + 1]; ++i) {
+                CTerm value;
+                if (load(slots[i], value)) {
+                    version.cache.store(cells[i], value);
+                }
+            }
+        }
+        for (size_t i = begin[region]; i < begin[region + 1]; ++i) {
+            CSlot &slot = slots[i];
+            size_t before = CSnapshot::cycleCount();
+            CTerm value = version.getValueAt(cells[i]);
+            if (CSnapshot::cycleCount() != before) {
+                continue;
+            }
+            version.cache.store(cells[i], value);
+            if (std::holds_alternative<double>(value)) {
+                slot.number = std::get<double>(value);
+                slot.type = CSlot::Type::NUMBER;
+            } else if (std::holds_alternative<CRope>(value)) {
+                std::string text = std::get<CRope>(value).str();
+                if (text.length() > ARENA - used) {
+                    continue;
+                }
+                std::memcpy(arena + used, text.data(), text.length());
+                slot.offset = worker * ARENA + used;
+                slot.length = text.length();
+                used += text.length();
+                slot.type = CSlot::Type::TEXT;
+            } else {
+                slot.type = CSlot::Type::UNDEFINED;
+            }
+        }
+        imported[region] = true;
+        if (!send(channel, region)) {
+            break;
+        }
+    }
+    close(channel);
+}
+
+void CProcessEvaluator::merge(const std::vector<bool> &done) {
+    std::vector<CKey> rest;
+    for (size_t r = 0; r + 1 < begin.size(); ++r) {
+        for (size_t i = begin[r]; i < begin[r + 1]; ++i) {
+            CTerm value;
+            if (done[r] && load(slots[i], value)) {
+                version.cache.store(cells[i], value);
+            } else {
+                rest.push_back(cells[i]);
+            }
+        }
+    }
+    version.recalculate(rest);
+}
+
+bool CProcessEvaluator::load(const CSlot &slot, CTerm &value) const {
+    switch (slot.type) {
+        case CSlot::Type::UNDEFINED:
+            value = CTerm();
+            return true;
+        case CSlot::Type::NUMBER:
+            value = slot.number;
+            return true;
+        case CSlot::Type::TEXT:
+            value = CRope(std::string(texts + slot.offset, slot.length));
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool CProcessEvaluator::reap(pid_t pid, CClock::time_point deadline) {
+    while (true) {
+        pid_t reaped = waitpid(pid, nullptr, WNOHANG);
+        if (reaped == pid || (reaped < 0 && errno != EINTR)) {
+            return true;
+        }
+        if (reaped == 0) {
+            if (CClock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void CProcessEvaluator::terminate(pid_t pid) {
+    kill(pid, SIGKILL);
+    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+}
+
+bool CProcessEvaluator::send(int channel, uint64_t region) {
+    return ::send(channel, &region, sizeof(region), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(region));
+}
+
+bool CProcessEvaluator::receive(int channel, uint64_t &region) {
+    char *data = reinterpret_cast<char *>(&region);
+    size_t received = 0;
+    while (received < sizeof(region)) {
+        ssize_t n = recv(channel, data + received, sizeof(region) - received, 0);
+        if (n > 0) {
+            received += static_cast<size_t>(n);
+        } else if (n == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,165 @@
+#ifndef CPROCESSEVALUATOR_H
+#define CPROCESSEVALUATOR_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+#include "CSnapshot.h"
+
+/** @brief Evaluates the formulas of one version in local worker processes.
+ *
+ * Formula cells are partitioned into bands of regionRows rows of one column,
+ * bands reading each other are joined into one region, so the regions form a
+ * DAG, and the dependency graph orders the cells of every region. Workers are
+ * forked, so they read the pinned version copy-on-write without copying it
+ * anywhere. The parent hands a region out once all regions it reads are done,
+ * over a socket pair per worker. The worker first loads the values of those
+ * regions (the boundary values) from an anonymous shared mmap into its own
+ * value cache, then evaluates its region and writes the values into the mmap.
+ * The parent stores all of them into the value cache of the version. Regions
+ * of a worker that died and values a worker could not pass back are
+ * evaluated by the parent.
+ *
+ * No other thread may evaluate or write while the workers are being forked,
+ * a lock it held would stay locked in the workers. A worker that does not
+ * pass its region back within the stall timeout is killed and its region is
+ * evaluated by the parent, so a worker stuck on such a lock costs time, not
+ * a hang.
+ */
+class CProcessEvaluator {
+public:
+    using CKey = std::pair<size_t, size_t>;
+    using CClock = std::chrono::steady_clock;
+
+    static constexpr size_t REGION_ROWS = 1024;
+    static constexpr std::chrono::milliseconds STALL{30000};
+    // bytes of texts a worker may pass back, reserved but only used pages take memory
+    static constexpr size_t ARENA = size_t(64) << 20;
+
+    /**
+     * @brief evaluates all formulas of a version into its value cache
+     *
+     * @param version [in] pinned version
+     * @param processes [in] number of worker processes, the version is evaluated in this process when below 2
+     * @param regionRows [in] rows of one region
+     * @param stall [in] time a worker may take for one region before it is killed
+     */
+    static void evaluate(const CSnapshot &version, size_t processes, size_t regionRows = REGION_ROWS,
+                         std::chrono::milliseconds stall = STALL);
+
+private:
+    /** @brief Value of one formula passed back by a worker.
+     */
+    struct CSlot {
+        enum class Type : uint8_t {
+            MISSING,
+            UNDEFINED,
+            NUMBER,
+            TEXT
+        };
+        Type type;
+        double number;
+        // text in the arena of the worker
+        size_t offset;
+        size_t length;
+    };
+
+    static constexpr uint64_t STOP = UINT64_MAX;
+
+    const CSnapshot &version;
+    // formulas of all regions, the cells of a region in evaluation order
+    std::vector<CKey> cells;
+    // region r holds cells[begin[r]] up to cells[begin[r + 1]]
+    std::vector<size_t> begin;
+    std::vector<std::vector<size_t>> precedents;
+    std::vector<std::vector<size_t>> dependents;
+    // shared with the workers, slots of the cells followed by an arena per worker
+    CSlot *slots = nullptr;
+    char *texts = nullptr;
+    size_t mapped = 0;
+
+    CProcessEvaluator(const CSnapshot &version) : version(version) {}
+
+    /**
+     * @brief splits the formulas into regions and orders them
+     *
+     * @param regionRows [in] rows of one region
+     */
+    void partition(size_t regionRows);
+
+    /**
+     * @brief finds strongly connected components of a graph (Tarjan)
+     *
+     * @param edges [in] targets of the edges of every vertex
+     * @return std::vector<size_t> component of every vertex.
+     */
+    static std::vector<size_t> components(const std::vector<std::vector<size_t>> &edges);
+
+    /**
+     * @brief runs the workers, hands the regions out and collects them
+     *
+     * @param processes [in] number of worker processes
+     * @param stall [in] time a worker may take for one region before it is killed
+     * @return std::vector<bool> regions evaluated by the workers.
+     */
+    std::vector<bool> schedule(size_t processes, std::chrono::milliseconds stall);
+
+    /**
+     * @brief evaluates the regions sent over a channel, runs in a worker
+     *
+     * @param channel [in] socket to the parent
+     * @param worker [in] index of the worker, selects its arena
+     */
+    void work(int channel, size_t worker);
+
+    /**
+     * @brief stores the values of the regions evaluated by the workers and evaluates the rest
+     *
+     * @param done [in] regions evaluated by the workers
+     */
+    void merge(const std::vector<bool> &done);
+
+    /**
+     * @brief reads a value passed back by a worker
+     *
+     * @param slot [in] slot of the value
+     * @param value [out] the value
+     * @return bool False if the worker did not pass it back.
+     */
+    bool load(const CSlot &slot, CTerm &value) const;
+
+    /**
+     * @brief waits for a worker to exit
+     *
+     * @param pid [in] the worker
+     * @param deadline [in] end of the wait
+     * @return bool False if the worker still runs at the deadline.
+     */
+    static bool reap(pid_t pid, CClock::time_point deadline);
+
+    /**
+     * @brief kills a worker and waits for it
+     *
+     * @param pid [in] the worker
+     */
+    static void terminate(pid_t pid);
+
+    /**
+     * @brief sends a region index
+     *
+     * @return bool False if the channel was closed.
+     */
+    static bool send(int channel, uint64_t region);
+
+    /**
+     * @brief receives a region index
+     *
+     * @return bool False if the channel was closed.
+     */
+    static bool receive(int channel, uint64_t &region);
+};
+
+#endif // CPROCESSEVALUATOR_H
@@ -0,0 +1,444 @@
+#include "CRangeIndex.h"
+#include "CMemoryUsage.h"
+#include <bit>
+#include <set>
+#include <algorithm>
+
+namespace {
+    /**
+     * @brief mask of the slots from to to of a bucket
+     */
+    uint64_t slots(size_t from, size_t to) {
+        return (to - from + 1 == 64) ? ~uint64_t(0) : ((uint64_t(1) << (to - from + 1)) - 1) << from;
+    }
+}
+
+void CRangeIndex::CTotals::add(const CTotals &other) {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    numbers += other.numbers;
+    values += other.values;
+    cells += other.cells;
+}
+
+void CRangeIndex::update(const std::pair<size_t, size_t> &key, const CValue &value, bool formula) {
+    size_t kind = formula ? 0 : value.index();
+    write(literals, key, kind, kind == 1 ? std::get<double>(value) : 0, formula);
+    invalidate(key);
+}
+
+void CRangeIndex::invalidate(const std::pair<size_t, size_t> &key) {
+    std::lock_guard lock(mutex);
+    auto it = computed.buckets.find({key.second, key.first / BUCKET});
+    if (it != computed.buckets.end() && (it->second.cells & (uint64_t(1) << (key.first % BUCKET)))) {
+        write(computed, key, 0, 0, false);
+    }
+}
+
+void CRangeIndex::invalidateAll() {
+    std::lock_guard lock(mutex);
+    computed = CLayer();
+}
+
+void CRangeIndex::inherit(const CRangeIndex &base) {
+    CLayer layer;
+    {
+        std::lock_guard lock(base.mutex);
+        layer = base.computed;
+    }
+    std::lock_guard lock(mutex);
+    computed = std::move(layer);
+}
+
+bool CRangeIndex::hasComputed() const {
+    std::lock_guard lock(mutex);
+    return !computed.trees.empty();
+}
+
+std::vector<std::pair<size_t, size_t>> CRangeIndex::stale(const CRect &rect) const {
+    std::vector<std::pair<size_t, size_t>> result;
+    std::lock_guard lock(mutex);
+    split(rect.left, rect.right, literals.levels, [&](size_t level, size_t first, size_t last) {
+        for (auto it = literals.trees.lower_bound({level, first});
+             it != literals.trees.end() && it->first.first == level && it->first.second <= last; ++it) {
+            stale(level, it->first.second, rect.top, rect.bottom, result);
+        }
+    });
+    return result;
+}
+
+void CRangeIndex::stale(size_t level, size_t unit, size_t top, size_t bottom,
+                        std::vector<std::pair<size_t, size_t>> &result) const {
+    auto tree = literals.trees.find({level, unit});
+    if (tree == literals.trees.end()) {
+        return;
+    }
+    CTotals formulas;
+    rows(literals, level, tree->second, unit, top, bottom, formulas);
+    if (!formulas.cells) {
+        return;
+    }
+    CTotals values;
+    auto done = computed.trees.find({level, unit});
+    if (done != computed.trees.end()) {
+        rows(computed, level, done->second, unit, top, bottom, values);
+    }
+    if (formulas.cells == values.cells) {
+        return;
+    }
+    if (level) {
+        for (size_t child = unit << FANOUT_BITS; child < (unit << FANOUT_BITS) + FANOUT; ++child) {
+            stale(level - 1, child, top, bottom, result);
+        }
+        return;
+    }
+    for (auto it = literals.buckets.lower_bound({unit, top / BUCKET});
+         it != literals.buckets.end() && it->first.first == unit && it->first.second <= bottom / BUCKET; ++it) {
+        size_t low = it->first.second * BUCKET;
+        uint64_t mask = it->second.cells & slots(std::max(top, low) - low, std::min(bottom, low + BUCKET - 1) - low);
+        auto filled = computed.buckets.find(it->first);
+        if (filled != computed.buckets.end()) {
+            mask &= ~filled->second.cells;
+        }
+        for (; mask; mask &= mask - 1) {
+            result.emplace_back(low + std::countr_zero(mask), unit);
+        }
+    }
+}
+
+void CRangeIndex::fill(const std::pair<size_t, size_t> &key, const CTerm &value) const {
+    uint64_t bit = uint64_t(1) << (key.first % BUCKET);
+    std::pair<size_t, size_t> position(key.second, key.first / BUCKET);
+    std::lock_guard lock(mutex);
+    auto formula = literals.buckets.find(position);
+    if (formula == literals.buckets.end() || !(formula->second.cells & bit)) {
+        return;
+    }
+    auto filled = computed.buckets.find(position);
+    if (filled != computed.buckets.end() && (filled->second.cells & bit)) {
+        return;
+    }
+    size_t kind = value.index();
+    write(computed, key, kind, kind == 1 ? std::get<double>(value) : 0, true);
+}
+
+CAggregate CRangeIndex::query(const CRect &rect) const {
+    CTotals totals;
+    auto add = [&rect, &totals](const CLayer &layer) {
+        split(rect.left, rect.right, layer.levels, [&](size_t level, size_t first, size_t last) {
+            for (auto it = layer.trees.lower_bound({level, first});
+                 it != layer.trees.end() && it->first.first == level && it->first.second <= last; ++it) {
+                rows(layer, level, it->second, it->first.second, rect.top, rect.bottom, totals);
+            }
+        });
+    };
+    add(literals);
+    {
+        std::lock_guard lock(mutex);
+        add(computed);
+    }
+    CAggregate result;
+    result.sum = totals.sum;
+    result.numbers = totals.numbers;
+    result.values = totals.values;
+    result.min = totals.min;
+    result.max = totals.max;
+    return result;
+}
+
+void CRangeIndex::write(CLayer &layer, const std::pair<size_t, size_t> &key, size_t kind, double number,
+                        bool cell) {
+    size_t bucketRow = key.first / BUCKET;
+    size_t slot = key.first % BUCKET;
+    uint64_t bit = uint64_t(1) << slot;
+    std::pair<size_t, size_t> position(key.second, bucketRow);
+    if (!kind && !cell && !layer.buckets.contains(position)) {
+        return;
+    }
+    grow(layer, levelsFor(key.second));
+    CBucket &bucket = layer.buckets[position];
+    bucket.numeric &= ~bit;
+    bucket.text &= ~bit;
+    bucket.cells &= ~bit;
+    bucket.numbers[slot] = 0;
+    if (kind == 1) {
+        bucket.numeric |= bit;
+        bucket.numbers[slot] = number;
+    } else if (kind == 2) {
+        bucket.text |= bit;
+    }
+    if (cell) {
+        bucket.cells |= bit;
+    }
+    // totals are summed again from the numbers, a running delta would keep its rounding errors
+    CTotals totals;
+    partial(bucket, 0, BUCKET - 1, totals);
+    if (totals.empty()) {
+        layer.buckets.erase(position);
+    }
+    assign(layer, 0, key.second, bucketRow, totals);
+    for (size_t level = 1; level < layer.levels; ++level) {
+        if (!refresh(layer, level, key.second >> (FANOUT_BITS * level), key.first)) {
+            break;
+        }
+    }
+}
+
+void CRangeIndex::grow(CLayer &layer, size_t levels) {
+    while (layer.levels < levels) {
+        size_t level = layer.levels++;
+        // the bands of the new level are summed from the occupied bucket rows of the level below
+        std::set<std::pair<size_t, size_t>> occupied;
+        for (auto it = layer.trees.lower_bound({level - 1, 0});
+             it != layer.trees.end() && it->first.first == level - 1; ++it) {
+            const CTree &tree = it->second;
+            size_t band = it->first.second >> FANOUT_BITS;
+            leaves(tree, tree.root, 0, tree.span, [&occupied, band](size_t bucketRow) {
+                occupied.emplace(band, bucketRow);
+            });
+        }
+        for (const auto &[band, bucketRow]: occupied) {
+            for (size_t slot = 0; slot < BUCKET; ++slot) {
+                refresh(layer, level, band, bucketRow * BUCKET + slot);
+            }
+        }
+    }
+}
+
+size_t CRangeIndex::levelsFor(size_t column) {
+    size_t levels = 1;
+    while ((column >> (FANOUT_BITS * (levels - 1))) >= FANOUT) {
+        ++levels;
+    }
+    return levels;
+}
+
+bool CRangeIndex::refresh(CLayer &layer, size_t level, size_t band, size_t row) {
+    size_t bucketRow = row / BUCKET;
+    CTotals total;
+    for (size_t child = band << FANOUT_BITS; child < (band << FANOUT_BITS) + FANOUT; ++child) {
+        total.add(totalsAt(layer, level - 1, child, row));
+    }
+    std::tuple<size_t, size_t, size_t> position(level, band, bucketRow);
+    if (total.empty() && !layer.bands.contains(position)) {
+        return false;
+    }
+    CBand &rows = layer.bands[position];
+    rows.rows[row % BUCKET] = total;
+    // the bucket total is summed again from the rows like the one of a column
+    CTotals totals;
+    for (const CTotals &entry: rows.rows) {
+        totals.add(entry);
+    }
+    if (totals.empty()) {
+        layer.bands.erase(position);
+    }
+    assign(layer, level, band, bucketRow, totals);
+    return true;
+}
+
+CRangeIndex::CTotals CRangeIndex::totalsAt(const CLayer &layer, size_t level, size_t unit, size_t row) {
+    CTotals result;
+    if (!level) {
+        auto bucket = layer.buckets.find({unit, row / BUCKET});
+        if (bucket != layer.buckets.end()) {
+            partial(bucket->second, row % BUCKET, row % BUCKET, result);
+        }
+    } else {
+        auto band = layer.bands.find({level, unit, row / BUCKET});
+        if (band != layer.bands.end()) {
+            result = band->second.rows[row % BUCKET];
+        }
+    }
+    return result;
+}
+
+void CRangeIndex::rows(const CLayer &layer, size_t level, const CTree &tree, size_t unit, size_t top,
+                       size_t bottom, CTotals &result) {
+    auto edge = [&](size_t bucketRow, size_t from, size_t to) {
+        if (!level) {
+            auto bucket = layer.buckets.find({unit, bucketRow});
+            if (bucket != layer.buckets.end()) {
+                partial(bucket->second, from, to, result);
+            }
+            return;
+        }
+        auto band = layer.bands.find({level, unit, bucketRow});
+        if (band != layer.bands.end()) {
+            for (size_t slot = from; slot <= to; ++slot) {
+                result.add(band->second.rows[slot]);
+            }
+        }
+    };
+    size_t firstBucket = top / BUCKET;
+    size_t lastBucket = bottom / BUCKET;
+    if (firstBucket == lastBucket) {
+        edge(firstBucket, top % BUCKET, bottom % BUCKET);
+        return;
+    }
+    edge(firstBucket, top % BUCKET, BUCKET - 1);
+    edge(lastBucket, 0, bottom % BUCKET);
+    if (firstBucket + 1 < lastBucket) {
+        collect(tree, tree.root, 0, tree.span, firstBucket + 1, lastBucket - 1, result);
+    }
+}
+
+void CRangeIndex::split(size_t left, size_t right, size_t levels,
+                        const std::function<void(size_t, size_t, size_t)> &fn) {
+    for (size_t level = 0;; ++level) {
+        if (level + 1 >= levels) {
+            fn(level, left, right);
+            return;
+        }
+        // columns or bands before the first and after the last group of FANOUT covered whole
+        if (left % FANOUT) {
+            size_t last = std::min(right, left | (FANOUT - 1));
+            fn(level, left, last);
+            if (last == right) {
+                return;
+            }
+            left = last + 1;
+        }
+        if (right % FANOUT != FANOUT - 1) {
+            size_t first = std::max(left, right & ~(FANOUT - 1));
+            fn(level, first, right);
+            if (first == left) {
+                return;
+            }
+            right = first - 1;
+        }
+        left >>= FANOUT_BITS;
+        right >>= FANOUT_BITS;
+    }
+}
+
+void CRangeIndex::partial(const CBucket &bucket, size_t from, size_t to, CTotals &result) {
+    uint64_t mask = slots(from, to);
+    uint64_t numeric = bucket.numeric & mask;
+    result.numbers += std::popcount(numeric);
+    result.values += std::popcount(numeric | (bucket.text & mask));
+    result.cells += std::popcount(bucket.cells & mask);
+    for (; numeric; numeric &= numeric - 1) {
+        double number = bucket.numbers[std::countr_zero(numeric)];
+        result.sum += number;
+        result.min = std::min(result.min, number);
+        result.max = std::max(result.max, number);
+    }
+}
+
+void CRangeIndex::assign(CLayer &layer, size_t level, size_t unit, size_t bucketRow, const CTotals &totals) {
+    std::pair<size_t, size_t> position(level, unit);
+    if (totals.empty() && !layer.trees.contains(position)) {
+        return;
+    }
+    CTree &tree = layer.trees[position];
+    if (!tree.size) {
+        tree.push(CNode());
+    }
+    // a new root covers twice as many bucket rows, the old one is its lower half
+    while (bucketRow >= tree.span) {
+        CNode top = tree.node(tree.root);
+        top.children[0] = tree.root;
+        top.children[1] = NONE;
+        tree.root = tree.push(top);
+        tree.span *= 2;
+    }
+    // nodes from the root down to the leaf, the span is at most 2^64
+    std::array<uint32_t, 65> path;
+    size_t depth = 0;
+    uint32_t node = tree.root;
+    size_t low = 0;
+    size_t span = tree.span;
+    while (true) {
+        path[depth++] = node;
+        if (span == 1) {
+            break;
+        }
+        span /= 2;
+        size_t half = bucketRow >= low + span;
+        low += half * span;
+        uint32_t child = tree.node(node).children[half];
+        if (child == NONE) {
+            child = tree.push(CNode());
+            tree.writable(node).children[half] = child;
+        }
+        node = child;
+    }
+    tree.writable(node).totals = totals;
+    // every ancestor is the sum of its children, so no error of an old value stays behind
+    for (size_t i = depth - 1; i-- > 0;) {
+        CNode sums = tree.node(path[i]);
+        sums.totals = CTotals();
+        for (uint32_t child: sums.children) {
+            if (child != NONE) {
+                sums.totals.add(tree.node(child).totals);
+            }
+        }
+        tree.writable(path[i]) = sums;
+    }
+    if (tree.node(tree.root).totals.empty()) {
+        layer.trees.erase(position);
+    }
+}
+
+CRangeIndex::CNode &CRangeIndex::CTree::writable(uint32_t id) {
+    std::shared_ptr<std::array<CNode, PAGE>> &page = pages[id / PAGE];
+    if (page.use_count() != 1) {
+        page = std::make_shared<std::array<CNode, PAGE>>(*page);
+    } else {
+        // the last other holder may have released it in another thread
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return (*page)[id % PAGE];
+}
+
+uint32_t CRangeIndex::CTree::push(const CNode &node) {
+    if (size % PAGE == 0) {
+        pages.push_back(std::make_shared<std::array<CNode, PAGE>>());
+    }
+    uint32_t id = size++;
+    writable(id) = node;
+    return id;
+}
+
+void CRangeIndex::collect(const CTree &tree, uint32_t node, size_t low, size_t span, size_t first, size_t last,
+                          CTotals &result) {
+    if (node == NONE || last < low || first >= low + span) {
+        return;
+    }
+    const CNode &entry = tree.node(node);
+    if (first <= low && low + span - 1 <= last) {
+        result.add(entry.totals);
+        return;
+    }
+    span /= 2;
+    collect(tree, entry.children[0], low, span, first, last, result);
+    collect(tree, entry.children[1], low + span, span, first, last, result);
+}
+
+void CRangeIndex::leaves(const CTree &tree, uint32_t node, size_t low, size_t span,
+                         const std::function<void(size_t)> &fn) {
+    if (node == NONE || tree.node(node).totals.empty()) {
+        return;
+    }
+    if (span == 1) {
+        fn(low);
+        return;
+    }
+    span /= 2;
+    leaves(tree, tree.node(node).children[0], low, span, fn);
+    leaves(tree, tree.node(node).children[1], low + span, span, fn);
+}
+
+size_t CRangeIndex::memoryUsage() const {
+    auto usage = [](const CLayer &layer) {
+        size_t trees = layer.trees.memoryUsage();
+        for (const auto &[position, tree]: layer.trees) {
+            trees += tree.pages.capacity() * sizeof(void *) * 2 + tree.pages.size() * sizeof(std::array<CNode, PAGE>);
+        }
+        return layer.buckets.memoryUsage() + layer.bands.memoryUsage() + trees;
+    };
+    std::lock_guard lock(mutex);
+    return usage(literals) + usage(computed);
+}
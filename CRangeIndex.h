@@ -0,0 +1,320 @@
+#ifndef CRANGEINDEX_H
+#define CRANGEINDEX_H
+
+#include <array>
+#include <memory>
+#include <limits>
+#include <cstdint>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <functional>
+#include <utility>
+#include "CValueCache.h"
+#include "CSharedMap.h"
+
+/** @brief Rectangle of cells, both corners included.
+ */
+struct CRect {
+    size_t top;
+    size_t left;
+    size_t bottom;
+    size_t right;
+
+    size_t area() const {
+        return (bottom - top + 1) * (right - left + 1);
+    }
+};
+
+/** @brief Aggregates over the values of a rectangle.
+ */
+struct CAggregate {
+    double sum = 0;
+    size_t numbers = 0;
+    size_t values = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+};
+
+/** @brief Updatable index of sums and counts over the values of cells.
+ *
+ * Cells are grouped into buckets of BUCKET consecutive rows of one column.
+ * A bucket keeps its numbers and bit masks of numeric and text cells. Columns
+ * are grouped into bands of FANOUT^n columns on level n, level 0 being single
+ * columns, and a band keeps the totals of each of its rows in buckets of
+ * BUCKET rows too, summed from the FANOUT bands or columns of the level below.
+ * Every column and band keeps a sparse segment tree over its bucket rows with
+ * the bucket totals. The trees only have the nodes on the paths to occupied
+ * buckets, so the index takes memory proportional to the values, however far
+ * apart they are. Levels are added while the columns reach more than FANOUT
+ * bands of the top level.
+ *
+ * The columns of a rectangle are split into at most 2 * (FANOUT - 1) columns
+ * or bands per level, and every one of them is answered by its tree for the
+ * bucket rows it covers whole and by at most two partial buckets, so a query
+ * takes O(levels * log rows) tree nodes however many columns it covers. An
+ * update touches one bucket and one band row, bucket and tree path per level.
+ * Totals are summed again from the numbers of the bucket, from the rows of the
+ * band and from the children of a node, never adjusted by a delta, so an
+ * overwritten huge value leaves no rounding error behind. Minimums and
+ * maximums are kept the same way.
+ *
+ * Literals are indexed when they are stored. Formulas are indexed by their
+ * computed values, kept apart like in CColumnIndex: a formula starts stale,
+ * the caller evaluates the stale formulas of a rectangle and fills in their
+ * values, and a write makes the formulas depending on it stale again. The
+ * trees count the formulas and the computed values, so the stale formulas
+ * are found without visiting the buckets whose summaries are current. A copy
+ * shares the literals with the original, the values of formulas are not
+ * copied. Readers of the same version fill it concurrently under one mutex,
+ * the formulas are evaluated outside of it.
+ */
+class CRangeIndex {
+public:
+    static constexpr size_t BUCKET = 64;
+    static constexpr size_t PAGE = 64;
+    static constexpr size_t FANOUT_BITS = 3;
+    static constexpr size_t FANOUT = size_t(1) << FANOUT_BITS;
+
+    /**  @brief creates an empty index
+     */
+    CRangeIndex() = default;
+
+    /**  @brief copies the index, values of formulas are not copied, the literals are shared
+     * @param other [in] other index
+     */
+    CRangeIndex(const CRangeIndex &other) : literals(other.literals) {}
+
+    CRangeIndex &operator=(const CRangeIndex &) = delete;
+
+    /**
+     * @brief updates a cell
+     *
+     * @param key [in] position of the cell
+     * @param value [in] literal value of the cell, monostate when it holds no literal
+     * @param formula [in] the cell holds a formula, it is stale until its value is filled in
+     */
+    void update(const std::pair<size_t, size_t> &key, const CValue &value, bool formula);
+
+    /**
+     * @brief makes a formula stale, its value may have changed
+     *
+     * @param key [in] position of the formula
+     */
+    void invalidate(const std::pair<size_t, size_t> &key);
+
+    /**
+     * @brief makes all formulas stale
+     */
+    void invalidateAll();
+
+    /**
+     * @brief takes over the values of formulas indexed by another version
+     *
+     * The layer is shared with the other index until either of them writes
+     * into it, like the literals of a copy.
+     *
+     * @param base [in] index this one was copied from
+     */
+    void inherit(const CRangeIndex &base);
+
+    /**
+     * @brief tells whether some formula is indexed by its value
+     */
+    bool hasComputed() const;
+
+    /**
+     * @brief positions of stale formulas
+     *
+     * Columns and bands whose formulas all have their values are skipped
+     * without visiting their buckets.
+     *
+     * @param rect [in] rectangle searched
+     * @return std::vector<std::pair<size_t, size_t>> stale formulas inside the rectangle.
+     */
+    std::vector<std::pair<size_t, size_t>> stale(const CRect &rect) const;
+
+    /**
+     * @brief indexes the value of a stale formula
+     *
+     * @param key [in] position of the formula, nothing happens if it is not stale
+     * @param value [in] its computed value
+     */
+    void fill(const std::pair<size_t, size_t> &key, const CTerm &value) const;
+
+    /**
+     * @brief aggregates the values of a rectangle, stale formulas are left out
+     *
+     * @param rect [in] rectangle to be aggregated
+     * @return CAggregate sum, minimum, maximum and count of numbers and count of all values.
+     */
+    CAggregate query(const CRect &rect) const;
+
+    /**
+     * @brief estimates the memory of the buckets, the bands and the trees
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+private:
+    /** @brief Totals of some cells.
+     */
+    struct CTotals {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        uint32_t numbers = 0;
+        uint32_t values = 0;
+        // formulas among the literals, formulas with a value among the computed values
+        uint32_t cells = 0;
+
+        void add(const CTotals &other);
+
+        bool empty() const {
+            return !values && !cells;
+        }
+    };
+
+    struct CBucket {
+        std::array<double, BUCKET> numbers{};
+        uint64_t numeric = 0;
+        uint64_t text = 0;
+        uint64_t cells = 0;
+    };
+
+    /** @brief Totals of every row of a band in one bucket row.
+     */
+    struct CBand {
+        std::array<CTotals, BUCKET> rows;
+    };
+
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    /** @brief Totals of the bucket rows below a node of a tree.
+     */
+    struct CNode {
+        CTotals totals;
+        // lower and upper half, NONE when it holds no bucket
+        uint32_t children[2] = {NONE, NONE};
+    };
+
+    /** @brief Segment tree over the bucket rows of one column or band.
+     */
+    struct CTree {
+        // bucket rows covered by the root, a power of two
+        size_t span = 1;
+        uint32_t root = 0;
+        uint32_t size = 0;
+        // nodes by their number, shared with the copies of the tree until written
+        std::vector<std::shared_ptr<std::array<CNode, PAGE>>> pages;
+
+        const CNode &node(uint32_t id) const {
+            return (*pages[id / PAGE])[id % PAGE];
+        }
+
+        /**
+         * @brief a node to be written, its page is copied first if it is shared
+         */
+        CNode &writable(uint32_t id);
+
+        /**
+         * @brief adds a node
+         *
+         * @return uint32_t its number.
+         */
+        uint32_t push(const CNode &node);
+    };
+
+    /** @brief Buckets, bands and trees of one kind of values.
+     */
+    struct CLayer {
+        // keyed by column and bucket row, so buckets of a column are adjacent, a copied chunk has a few of them
+        CSharedMap<std::pair<size_t, size_t>, CBucket, 8> buckets;
+        // (level, band, bucket row) -> rows of the band, level 1 and above
+        CSharedMap<std::tuple<size_t, size_t, size_t>, CBand, 2> bands;
+        // (level, column or band) -> tree, for the columns and bands holding a value or a formula
+        CSharedMap<std::pair<size_t, size_t>, CTree> trees;
+        size_t levels = 1;
+    };
+
+    CLayer literals;
+    mutable std::mutex mutex;
+    // values of the formulas indexed so far, formulas not among them are stale
+    mutable CLayer computed;
+
+    /**
+     * @brief stores a cell into a layer and updates the bands and trees above it
+     *
+     * @param kind [in] index of the value in CValue or CTerm, 0 if it has none
+     * @param number [in] the number when kind is 1
+     * @param cell [in] the cell is counted in CTotals::cells
+     */
+    static void write(CLayer &layer, const std::pair<size_t, size_t> &key, size_t kind, double number, bool cell);
+
+    /**
+     * @brief adds levels to a layer until it has given number of them
+     */
+    static void grow(CLayer &layer, size_t levels);
+
+    /**
+     * @brief number of levels a layer needs to hold a column
+     */
+    static size_t levelsFor(size_t column);
+
+    /**
+     * @brief recomputes a row of a band and its bucket total from the level below
+     *
+     * @return bool False if the band holds nothing in that row and did not before.
+     */
+    static bool refresh(CLayer &layer, size_t level, size_t band, size_t row);
+
+    /**
+     * @brief totals of one row of a column or band
+     */
+    static CTotals totalsAt(const CLayer &layer, size_t level, size_t unit, size_t row);
+
+    /**
+     * @brief sets the totals of a bucket in the tree of a column or band and recomputes its ancestors
+     */
+    static void assign(CLayer &layer, size_t level, size_t unit, size_t bucketRow, const CTotals &totals);
+
+    /**
+     * @brief adds the totals of rows [top, bottom] of a column or band
+     */
+    static void rows(const CLayer &layer, size_t level, const CTree &tree, size_t unit, size_t top, size_t bottom,
+                     CTotals &result);
+
+    /**
+     * @brief adds the totals of bucket rows [first, last] of a tree
+     */
+    static void collect(const CTree &tree, uint32_t node, size_t low, size_t span, size_t first, size_t last,
+                        CTotals &result);
+
+    /**
+     * @brief calls a function for the bucket rows of the leaves of a tree
+     */
+    static void leaves(const CTree &tree, uint32_t node, size_t low, size_t span,
+                       const std::function<void(size_t)> &fn);
+
+    /**
+     * @brief aggregates rows [from, to] of one bucket
+     */
+    static void partial(const CBucket &bucket, size_t from, size_t to, CTotals &result);
+
+    /**
+     * @brief splits columns [left, right] into columns and bands covered whole
+     *
+     * @param fn [in] called with a level and the first and last column or band of it
+     */
+    static void split(size_t left, size_t right, size_t levels,
+                      const std::function<void(size_t, size_t, size_t)> &fn);
+
+    /**
+     * @brief adds the stale formulas of rows [top, bottom] of a column or band, the caller holds mutex
+     */
+    void stale(size_t level, size_t unit, size_t top, size_t bottom,
+               std::vector<std::pair<size_t, size_t>> &result) const;
+};
+
+#endif // CRANGEINDEX_H
@@ -0,0 +1,125 @@
+#include "CRecalcWorker.h"
+
+CRecalcWorker::CRecalcWorker(std::function<std::shared_ptr<const CSnapshot>()> pin,
+                             const std::atomic<size_t> &writers)
+        : pin(std::move(pin)), writers(writers), future(promise.get_future().share()) {
+    thread = std::thread(&CRecalcWorker::run, this);
+}
+
+CRecalcWorker::~CRecalcWorker() {
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    thread.join();
+    // nobody may wait forever for cells that will not be recalculated
+    promise.set_value();
+}
+
+std::shared_future<void> CRecalcWorker::enqueue(const std::vector<CKey> &cells) {
+    {
+        std::lock_guard lock(mutex);
+        changed.insert(changed.end(), cells.begin(), cells.end());
+    }
+    wake.notify_one();
+    return pending();
+}
+
+void CRecalcWorker::discard() {
+    {
+        std::lock_guard lock(mutex);
+        ++generation;
+        if (!changed.empty()) {
+            changed.clear();
+            // nobody may wait forever for the dropped cells
+            promise.set_value();
+            promise = std::promise<void>();
+            future = promise.get_future().share();
+        }
+        if (!busy) {
+            idle.notify_all();
+        }
+    }
+    wake.notify_all();
+}
+
+std::shared_future<void> CRecalcWorker::pending() {
+    std::lock_guard lock(mutex);
+    if (!changed.empty()) {
+        return future;
+    }
+    if (busy) {
+        return running;
+    }
+    std::promise<void> done;
+    done.set_value();
+    return done.get_future().share();
+}
+
+void CRecalcWorker::waitIdle() {
+    std::unique_lock lock(mutex);
+    idle.wait(lock, [this]() { return changed.empty() && !busy; });
+}
+
+void CRecalcWorker::run() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return stop || !changed.empty(); });
+        if (stop) {
+            return;
+        }
+        std::vector<CKey> roots = std::move(changed);
+        changed.clear();
+        std::promise<void> done = std::move(promise);
+        running = future;
+        promise = std::promise<void>();
+        future = promise.get_future().share();
+        busy = true;
+        size_t started = generation;
+        lock.unlock();
+
+        // a failure of resources ends the job and reaches the waiting callers, the rest of it is not recalculated
+        std::exception_ptr failure;
+        try {
+            std::vector<CKey> dirty = pin()->dependents(roots);
+            for (size_t first = 0; first < dirty.size(); first += BATCH) {
+                lock.lock();
+                // a pinned version would make the write copy it, the write wakes us by enqueue or discard once it is done
+                wake.wait(lock, [this]() { return stop || !writers.load(); });
+                bool dropped = generation != started;
+                lock.unlock();
+                if (stop || dropped) {
+                    break;
+                }
+                std::shared_ptr<const CSnapshot> version = pin();
+                std::vector<CKey> batch(dirty.begin() + first, dirty.begin() + std::min(first + BATCH, dirty.size()));
+                try {
+                    version->recalculate(batch);
+                } catch (const CEvalError &) {
+                    // the formulas before the failing one are cached, the others are retried one by one
+                    for (const auto &key: batch) {
+                        try {
+                            version->recalculate({key});
+                        } catch (const CEvalError &) {
+                            // the failing cell stays uncached, getValue evaluates it again and reports it
+                        }
+                    }
+                }
+            }
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        if (failure) {
+            done.set_exception(failure);
+        } else {
+            done.set_value();
+        }
+
+        lock.lock();
+        busy = false;
+        if (changed.empty()) {
+            idle.notify_all();
+        }
+    }
+}
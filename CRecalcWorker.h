@@ -0,0 +1,103 @@
+#ifndef CRECALCWORKER_H
+#define CRECALCWORKER_H
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <condition_variable>
+#include "CSnapshot.h"
+
+/** @brief Background thread recalculating formulas after edits.
+ *
+ * Modified cells are queued by CSpreadsheet. The worker finds all formulas
+ * depending on them and evaluates them in dependency order into the value
+ * cache of the current version, BATCH formulas per pinned version. A reader
+ * never waits for it: getValue of a cell not recalculated yet evaluates just
+ * that cell and what it reads. The worker does not pin a version while a
+ * write is in progress, so writes can usually modify it in place. A formula
+ * failing with CEvalError is left uncached and the rest of its batch is still
+ * recalculated, any other exception ends the job and is stored in its future.
+ */
+class CRecalcWorker {
+public:
+    using CKey = std::pair<size_t, size_t>;
+
+    static constexpr size_t BATCH = 64;
+
+    /**
+     * @brief starts the worker
+     *
+     * @param pin [in] returns the current version
+     * @param writers [in] number of writes in progress, every write calls enqueue or discard once it is done
+     */
+    CRecalcWorker(std::function<std::shared_ptr<const CSnapshot>()> pin, const std::atomic<size_t> &writers);
+
+    CRecalcWorker(const CRecalcWorker &) = delete;
+
+    CRecalcWorker &operator=(const CRecalcWorker &) = delete;
+
+    /**
+     * @brief stops the worker, queued cells are not recalculated
+     */
+    ~CRecalcWorker();
+
+    /**
+     * @brief queues modified cells
+     *
+     * @param cells [in] modified cells
+     * @return std::shared_future<void> completes once the cells and their dependents are recalculated, holds
+     * the exception that ended the job otherwise.
+     */
+    std::shared_future<void> enqueue(const std::vector<CKey> &cells);
+
+    /**
+     * @brief drops the queued cells and the rest of the job in progress
+     *
+     * Called by a write that moved cells, once it is done, instead of enqueue.
+     * The positions queued before it no longer name the same cells, and the
+     * write left no value of them cached anyway.
+     */
+    void discard();
+
+    /**
+     * @brief future of everything queued so far
+     *
+     * @return std::shared_future<void> completes once all queued cells are recalculated.
+     */
+    std::shared_future<void> pending();
+
+    /**
+     * @brief waits until nothing is queued or being recalculated
+     */
+    void waitIdle();
+
+private:
+    std::function<std::shared_ptr<const CSnapshot>()> pin;
+    const std::atomic<size_t> &writers;
+    std::mutex mutex;
+    // signalled by enqueue and discard, after a write, and by the destructor
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<CKey> changed;
+    bool busy = false;
+    // incremented by discard, the job in progress stops once it changes
+    size_t generation = 0;
+    std::atomic<bool> stop = false;
+    // completed by the job taking the cells queued now
+    std::promise<void> promise;
+    std::shared_future<void> future;
+    // completed by the job in progress
+    std::shared_future<void> running;
+    std::thread thread;
+
+    /**
+     * @brief body of the thread
+     */
+    void run();
+};
+
+#endif // CRECALCWORKER_H
@@ -0,0 +1,83 @@
+#ifndef CRELOCATION_H
+#define CRELOCATION_H
+
+#include <cstddef>
+
+class CSpreadsheet;
+
+/** @brief Rows or columns inserted into or deleted from a sheet.
+ *
+ * Cells from the first affected row (column) on move by count, references to
+ * them move with them, absolute or not. A reference to a deleted cell becomes
+ * #REF! and reads an undefined value. A range loses its deleted rows (columns)
+ * and becomes #REF!:#REF! when all of them are deleted. References from other
+ * sheets of a workbook are moved by a relocation naming the moved sheet.
+ */
+struct CRelocation {
+    // columns are inserted or deleted, rows otherwise
+    bool columns = false;
+    bool insert = true;
+    size_t first = 0;
+    size_t count = 0;
+    // sheet whose cells move when formulas of other sheets are relocated, nullptr for the sheet of the formulas
+    const CSpreadsheet *source = nullptr;
+
+    /**
+     * @brief moves a row or column
+     *
+     * @param coordinate [in, out] row or column, moved on return
+     * @return bool False if it was deleted.
+     */
+    bool move(size_t &coordinate) const {
+        if (coordinate < first) {
+            return true;
+        }
+        if (insert) {
+            coordinate += count;
+            return true;
+        }
+        if (coordinate - first < count) {
+            return false;
+        }
+        coordinate -= count;
+        return true;
+    }
+
+    /**
+     * @brief moves the rows or columns spanned by a range
+     *
+     * @param low [in, out] first row or column
+     * @param high [in, out] last row or column, not below low
+     * @return bool False if all of them were deleted.
+     */
+    bool span(size_t &low, size_t &high) const {
+        if (!insert) {
+            bool lowDeleted = low >= first && low - first < count;
+            bool highDeleted = high >= first && high - first < count;
+            if (lowDeleted && highDeleted) {
+                return false;
+            }
+            if (lowDeleted) {
+                low = first + count;
+            } else if (highDeleted) {
+                high = first - 1;
+            }
+        }
+        move(low);
+        move(high);
+        return true;
+    }
+
+    /**
+     * @brief moves a cell
+     *
+     * @param row [in, out] row of the cell
+     * @param column [in, out] column of the cell
+     * @return bool False if the cell was deleted.
+     */
+    bool move(size_t &row, size_t &column) const {
+        return move(columns ? column : row);
+    }
+};
+
+#endif // CRELOCATION_H
@@ -0,0 +1,104 @@
+#include "CRope.h"
+#include "CMemoryUsage.h"
+
+CRope::CSegment::~CSegment() {
+    // a long chain is released in a loop, not by recursion
+    std::vector<std::shared_ptr<const CSegment>> pending;
+    pending.push_back(std::move(left));
+    pending.push_back(std::move(right));
+    while (!pending.empty()) {
+        std::shared_ptr<const CSegment> segment = std::move(pending.back());
+        pending.pop_back();
+        if (segment && segment.use_count() == 1) {
+            // the last owner, nobody else can reach the segment any more
+            auto &owned = const_cast<CSegment &>(*segment);
+            pending.push_back(std::move(owned.left));
+            pending.push_back(std::move(owned.right));
+        }
+    }
+}
+
+CRope::CRope(std::string text) {
+    if (!text.empty()) {
+        auto segment = std::make_shared<CSegment>();
+        segment->length = text.length();
+        segment->text = std::move(text);
+        root = std::move(segment);
+    }
+}
+
+CRope CRope::concat(const CRope &left, const CRope &right) {
+    if (!left.root) {
+        return right;
+    }
+    if (!right.root) {
+        return left;
+    }
+    if (left.length() + right.length() <= FLAT) {
+        return CRope(left.str() + right.str());
+    }
+    auto segment = std::make_shared<CSegment>();
+    segment->left = left.root;
+    segment->right = right.root;
+    segment->length = left.length() + right.length();
+    CRope result;
+    result.root = std::move(segment);
+    return result;
+}
+
+std::string CRope::str() const {
+    std::string result;
+    result.reserve(length());
+    std::vector<const CSegment *> pending;
+    if (root) {
+        pending.push_back(root.get());
+    }
+    while (!pending.empty()) {
+        const CSegment *segment = pending.back();
+        pending.pop_back();
+        if (!segment->left) {
+            result += segment->text;
+            continue;
+        }
+        pending.push_back(segment->right.get());
+        pending.push_back(segment->left.get());
+    }
+    return result;
+}
+
+bool CRope::operator==(const CRope &other) const {
+    return root == other.root || (length() == other.length() && str() == other.str());
+}
+
+std::strong_ordering CRope::operator<=>(const CRope &other) const {
+    if (root == other.root) {
+        return std::strong_ordering::equal;
+    }
+    return str() <=> other.str();
+}
+
+size_t CRope::memoryUsage() const {
+    return root ? sizeof(CSegment) + 2 * sizeof(void *) + CMemoryUsage::text(root->text) : 0;
+}
+
+CValue CRope::flatten(const CTerm &term) {
+    switch (term.index()) {
+        case 1:
+            return std::get<double>(term);
+        case 2:
+            return std::get<CRope>(term).str();
+        default:
+            return CValue();
+    }
+}
+
+CTerm CRope::term(const CValue &value) {
+    switch (value.index()) {
+        case 1:
+            return std::get<double>(value);
+        case 2:
+            return CRope(std::get<std::string>(value));
+        default:
+            return CTerm();
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef CROPE_H
+#define CROPE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <variant>
+#include <compare>
+
+class CRope;
+
+using CValue = std::variant<std::monostate, double, std::string>;
+// a value while it is computed, texts are ropes
+using CTerm = std::variant<std::monostate, double, CRope>;
+
+/** @brief Immutable text made of shared segments.
+ *
+ * Concatenation makes a new segment pointing to both parts, so a chain of
+ * formulas each appending to the text of the previous one shares all the
+ * text and copies no bytes. Short results are copied into one segment. The
+ * text is flattened into a std::string only when a value leaves the engine
+ * (getValue, getValues, subscriptions) or is compared.
+ */
+class CRope {
+public:
+    // results up to this length are copied into one segment
+    static constexpr size_t FLAT = 64;
+
+    /**
+     * @brief creates an empty text
+     */
+    CRope() = default;
+
+    /**
+     * @brief creates a text of one segment
+     *
+     * @param text [in] contents
+     */
+    explicit CRope(std::string text);
+
+    /**
+     * @brief joins two texts
+     *
+     * @param left [in] first part
+     * @param right [in] second part
+     * @return CRope left followed by right, sharing their segments.
+     */
+    static CRope concat(const CRope &left, const CRope &right);
+
+    /**
+     * @brief Getter for the length in bytes.
+     */
+    size_t length() const { return root ? root->length : 0; }
+
+    /**
+     * @brief builds the flat text
+     *
+     * @return std::string contents of all segments.
+     */
+    std::string str() const;
+
+    bool operator==(const CRope &other) const;
+
+    std::strong_ordering operator<=>(const CRope &other) const;
+
+    /**
+     * @brief estimates the memory of the top segment, the segments below belong to the texts it was joined from
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+    /**
+     * @brief converts a computed value into a value leaving the engine
+     *
+     * @param term [in] computed value
+     * @return CValue the value with a flat text.
+     */
+    static CValue flatten(const CTerm &term);
+
+    /**
+     * @brief converts a stored value into a computed value
+     *
+     * @param value [in] stored value
+     * @return CTerm the value with the text as one segment.
+     */
+    static CTerm term(const CValue &value);
+
+private:
+    struct CSegment {
+        // text of a leaf, empty in a joined segment
+        std::string text;
+        std::shared_ptr<const CSegment> left;
+        std::shared_ptr<const CSegment> right;
+        size_t length = 0;
+
+        ~CSegment();
+    };
+
+    std::shared_ptr<const CSegment> root;
+};
+
+#endif // CROPE_H
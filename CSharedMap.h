@@ -0,0 +1,347 @@
+#ifndef CSHAREDMAP_H
+#define CSHAREDMAP_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+/** @brief Ordered map whose copies share their entries.
+ *
+ * The entries are kept sorted in chunks of at most 2 * CHUNK entries. A copy
+ * copies only the pointers to the chunks, a write copies the one chunk it
+ * changes when another map still holds it. A version copied for a few changes
+ * costs a few chunks instead of the whole map, and the older versions keep
+ * reading their own entries. Maps of large values use smaller chunks. Copies
+ * may be read and written by different threads, a single map is not
+ * synchronized. Writes invalidate iterators.
+ */
+template <class TKey, class TValue, size_t TChunk = 128>
+class CSharedMap {
+public:
+    using key_type = TKey;
+    using mapped_type = TValue;
+    using value_type = std::pair<TKey, TValue>;
+    static constexpr size_t CHUNK = TChunk;
+
+    /** @brief Iterator over the entries in the order of their keys.
+     */
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = CSharedMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+
+        const_iterator() = default;
+
+        reference operator*() const {
+            return (*map->chunks[chunk])[pos];
+        }
+
+        pointer operator->() const {
+            return &**this;
+        }
+
+        const_iterator &operator++() {
+            if (++pos == map->chunks[chunk]->size()) {
+                ++chunk;
+                pos = 0;
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator result = *this;
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return chunk == other.chunk && pos == other.pos;
+        }
+
+    private:
+        friend class CSharedMap;
+
+        const CSharedMap *map = nullptr;
+        size_t chunk = 0;
+        size_t pos = 0;
+
+        const_iterator(const CSharedMap *map, size_t chunk, size_t pos) : map(map), chunk(chunk), pos(pos) {}
+    };
+
+    using iterator = const_iterator;
+
+    const_iterator begin() const {
+        return {this, 0, 0};
+    }
+
+    const_iterator end() const {
+        return {this, chunks.size(), 0};
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    /**
+     * @brief finds an entry
+     *
+     * @param key [in] key of the entry
+     * @return const_iterator the entry, end() if there is none.
+     */
+    const_iterator find(const TKey &key) const {
+        if (chunks.empty()) {
+            return end();
+        }
+        size_t chunk = locate(key);
+        const std::vector<value_type> &entries = *chunks[chunk];
+        size_t pos = position(entries, key);
+        return pos < entries.size() && !(key < entries[pos].first) ? const_iterator(this, chunk, pos) : end();
+    }
+
+    /**
+     * @brief finds the first entry not below a key
+     *
+     * @param key [in] the key
+     * @return const_iterator the entry, end() if there is none.
+     */
+    const_iterator lower_bound(const TKey &key) const {
+        if (chunks.empty()) {
+            return end();
+        }
+        size_t chunk = locate(key);
+        size_t pos = position(*chunks[chunk], key);
+        // the next chunk starts above the key
+        return pos < chunks[chunk]->size() ? const_iterator(this, chunk, pos) : const_iterator(this, chunk + 1, 0);
+    }
+
+    bool contains(const TKey &key) const {
+        return find(key) != end();
+    }
+
+    /**
+     * @brief value of an entry that must exist
+     *
+     * @param key [in] key of the entry
+     * @return const TValue & the value.
+     */
+    const TValue &at(const TKey &key) const {
+        const_iterator it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("CSharedMap::at");
+        }
+        return it->second;
+    }
+
+    /**
+     * @brief value of an entry to be written, a default one is inserted if there is none
+     *
+     * @param key [in] key of the entry
+     * @return TValue & the value, valid until the next write.
+     */
+    TValue &operator[](const TKey &key) {
+        if (chunks.empty()) {
+            chunks.push_back(std::make_shared<std::vector<value_type>>());
+            firsts.push_back(key);
+        }
+        size_t chunk = locate(key);
+        std::vector<value_type> &entries = writable(chunk);
+        size_t pos = position(entries, key);
+        if (pos < entries.size() && !(key < entries[pos].first)) {
+            return entries[pos].second;
+        }
+        entries.emplace(entries.begin() + static_cast<std::ptrdiff_t>(pos), key, TValue());
+        ++count;
+        if (pos == 0) {
+            firsts[chunk] = key;
+        }
+        if (entries.size() <= 2 * CHUNK) {
+            return entries[pos].second;
+        }
+        // a full chunk is split in halves
+        auto upper = std::make_shared<std::vector<value_type>>(std::make_move_iterator(entries.begin() + CHUNK),
+                                                               std::make_move_iterator(entries.end()));
+        entries.resize(CHUNK);
+        firsts.insert(firsts.begin() + static_cast<std::ptrdiff_t>(chunk + 1), upper->front().first);
+        chunks.insert(chunks.begin() + static_cast<std::ptrdiff_t>(chunk + 1), std::move(upper));
+        return pos < CHUNK ? entries[pos].second : (*chunks[chunk + 1])[pos - CHUNK].second;
+    }
+
+    /**
+     * @brief removes an entry
+     *
+     * @param key [in] key of the entry
+     * @return size_t number of removed entries, 0 or 1.
+     */
+    size_t erase(const TKey &key) {
+        if (chunks.empty()) {
+            return 0;
+        }
+        size_t chunk = locate(key);
+        size_t pos = position(*chunks[chunk], key);
+        if (pos == chunks[chunk]->size() || key < (*chunks[chunk])[pos].first) {
+            return 0;
+        }
+        std::vector<value_type> &entries = writable(chunk);
+        entries.erase(entries.begin() + static_cast<std::ptrdiff_t>(pos));
+        --count;
+        if (entries.empty()) {
+            chunks.erase(chunks.begin() + static_cast<std::ptrdiff_t>(chunk));
+            firsts.erase(firsts.begin() + static_cast<std::ptrdiff_t>(chunk));
+        } else if (pos == 0) {
+            firsts[chunk] = entries.front().first;
+        }
+        return 1;
+    }
+
+    /**
+     * @brief adds an entry whose key is above all stored keys
+     *
+     * Chunks filled this way are left half empty, so later inserts rarely split them.
+     *
+     * @param key [in] key of the entry
+     * @param value [in] value of the entry
+     */
+    void append(const TKey &key, TValue value) {
+        if (chunks.empty() || chunks.back()->size() >= CHUNK) {
+            chunks.push_back(std::make_shared<std::vector<value_type>>());
+            chunks.back()->reserve(CHUNK);
+            firsts.push_back(key);
+        }
+        writable(chunks.size() - 1).emplace_back(key, std::move(value));
+        ++count;
+    }
+
+    /**
+     * @brief removes all entries and passes them in order to a callback
+     *
+     * The entries of chunks no other map holds are moved, the others are copied.
+     *
+     * @param visit [in] callback getting each entry as value_type &&
+     */
+    template <class TVisit>
+    void drain(TVisit &&visit) {
+        for (auto &chunk: chunks) {
+            if (chunk.use_count() == 1) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                for (auto &entry: *chunk) {
+                    visit(std::move(entry));
+                }
+            } else {
+                for (const auto &entry: *chunk) {
+                    visit(value_type(entry));
+                }
+            }
+            chunk.reset();
+        }
+        clear();
+    }
+
+    /**
+     * @brief removes the entries from a key on and passes them in order to a callback
+     *
+     * The entries below the key stay in their chunks, only the chunk holding
+     * the key is split.
+     *
+     * @param key [in] first key to be removed
+     * @param visit [in] callback getting each entry as value_type &&
+     */
+    template <class TVisit>
+    void drainFrom(const TKey &key, TVisit &&visit) {
+        if (chunks.empty()) {
+            return;
+        }
+        size_t chunk = locate(key);
+        size_t pos = position(*chunks[chunk], key);
+        size_t kept = chunk;
+        if (pos > 0) {
+            std::vector<value_type> &entries = writable(chunk);
+            for (size_t i = pos; i < entries.size(); ++i) {
+                visit(std::move(entries[i]));
+            }
+            count -= entries.size() - pos;
+            entries.erase(entries.begin() + static_cast<std::ptrdiff_t>(pos), entries.end());
+            kept = chunk + 1;
+        }
+        CSharedMap upper;
+        upper.chunks.assign(std::make_move_iterator(chunks.begin() + static_cast<std::ptrdiff_t>(kept)),
+                            std::make_move_iterator(chunks.end()));
+        chunks.resize(kept);
+        firsts.resize(kept);
+        for (const auto &entries: upper.chunks) {
+            count -= entries->size();
+        }
+        upper.drain(visit);
+    }
+
+    void clear() {
+        chunks.clear();
+        firsts.clear();
+        count = 0;
+    }
+
+    void swap(CSharedMap &other) noexcept {
+        chunks.swap(other.chunks);
+        firsts.swap(other.firsts);
+        std::swap(count, other.count);
+    }
+
+    /**
+     * @brief estimates the memory of the entries and the chunks, without what the values point to
+     *
+     * @return size_t bytes, shared chunks are counted by every map holding them.
+     */
+    size_t memoryUsage() const {
+        size_t result = (chunks.capacity() + firsts.capacity()) * sizeof(void *) * 2;
+        for (const auto &chunk: chunks) {
+            result += sizeof(*chunk) + 2 * sizeof(void *) + chunk->capacity() * sizeof(value_type);
+        }
+        return result;
+    }
+
+private:
+    std::vector<std::shared_ptr<std::vector<value_type>>> chunks;
+    // the first key of each chunk, searched without touching the chunks
+    std::vector<TKey> firsts;
+    size_t count = 0;
+
+    /**
+     * @brief the chunk an entry belongs to, the last one starting at or below the key
+     */
+    size_t locate(const TKey &key) const {
+        size_t chunk = static_cast<size_t>(std::upper_bound(firsts.begin(), firsts.end(), key) - firsts.begin());
+        return chunk ? chunk - 1 : 0;
+    }
+
+    static size_t position(const std::vector<value_type> &entries, const TKey &key) {
+        auto it = std::lower_bound(entries.begin(), entries.end(), key, [](const value_type &entry, const TKey &k) {
+            return entry.first < k;
+        });
+        return static_cast<size_t>(it - entries.begin());
+    }
+
+    /**
+     * @brief a chunk this map alone holds, copied first if it is shared
+     */
+    std::vector<value_type> &writable(size_t chunk) {
+        if (chunks[chunk].use_count() != 1) {
+            chunks[chunk] = std::make_shared<std::vector<value_type>>(*chunks[chunk]);
+        } else {
+            // the last other holder may have released it in another thread
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *chunks[chunk];
+    }
+};
+
+#endif // CSHAREDMAP_H
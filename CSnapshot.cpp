@@ -0,0 +1,558 @@
+#include "CSnapshot.h"
+#include "CColumnKernel.h"
+#include "CFormulaText.h"
+#include "CRelocation.h"
+#include <tuple>
+#include <unordered_set>
+
+thread_local size_t CSnapshot::cycles = 0;
+thread_local size_t CSnapshot::evaluations = 0;
+
+CValue CSnapshot::getValue(CPos pos) const {
+    return CRope::flatten(getValueAt({pos.getRow(), pos.getColumn()}));
+}
+
+std::vector<std::vector<CValue>> CSnapshot::getValues(const CRect &rect) const {
+    std::vector<std::vector<CValue>> result;
+    getValues(rect, result, CBudget());
+    return result;
+}
+
+CEvalStatus CSnapshot::getValue(CPos pos, CValue &value, const CBudget &budget) const {
+    std::pair<size_t, size_t> key{pos.getRow(), pos.getColumn()};
+    if (!recalculate({key}, budget)) {
+        return CEvalStatus::NOT_READY;
+    }
+    value = CRope::flatten(getValueAt(key));
+    return CEvalStatus::READY;
+}
+
+CEvalStatus CSnapshot::getValues(const CRect &rect, std::vector<std::vector<CValue>> &values,
+                                 const CBudget &budget) const {
+    std::vector<std::pair<size_t, size_t>> roots;
+    graph.forEachFormula(rect, [&roots](const std::pair<size_t, size_t> &key) {
+        roots.push_back(key);
+    });
+    if (!recalculate(roots, budget)) {
+        return CEvalStatus::NOT_READY;
+    }
+    std::vector<std::vector<CValue>> result(rect.bottom - rect.top + 1);
+    for (size_t row = rect.top; row <= rect.bottom; ++row) {
+        std::vector<CValue> &values = result[row - rect.top];
+        values.reserve(rect.right - rect.left + 1);
+        for (size_t column = rect.left; column <= rect.right; ++column) {
+            values.push_back(CRope::flatten(getValueAt({row, column})));
+        }
+    }
+    values = std::move(result);
+    return CEvalStatus::READY;
+}
+
+bool CSnapshot::recalculate(const std::vector<std::pair<size_t, size_t>> &roots, const CBudget &budget) const {
+    auto cached = [this](const std::pair<size_t, size_t> &key) {
+        CTerm value;
+        return cache.find(key, value);
+    };
+    // a deadline lets at least one value be cached, so a repeated call gets further
+    bool progress = false;
+    for (const auto &key: graph.evaluationOrder(roots, cached)) {
+        CTerm value;
+        // a run of copied formulas may have been cached meanwhile by CColumnKernel
+        if (graph.cyclic(key) || cache.find(key, value)) {
+            continue;
+        }
+        if (budget.cancelled() || (progress && budget.expired())) {
+            return false;
+        }
+        size_t before = cycles;
+        value = getValueAt(key);
+        if (cycles == before) {
+            cache.store(key, value);
+            progress = true;
+        }
+    }
+    return true;
+}
+
+std::vector<std::pair<size_t, size_t>> CSnapshot::dependents(const std::vector<std::pair<size_t, size_t>> &changed,
+                                                             size_t limit) const {
+    std::unordered_set<std::pair<size_t, size_t>, CKeyHash> affected(changed.begin(), changed.end());
+    std::vector<std::pair<size_t, size_t>> result(affected.begin(), affected.end());
+    // result doubles as the queue, cells before next have been expanded
+    for (size_t next = 0; next < result.size() && result.size() <= limit; ++next) {
+        std::pair<size_t, size_t> key = result[next];
+        graph.forEachDependent(key, [&](const std::pair<size_t, size_t> &dependent) {
+            if (affected.insert(dependent).second) {
+                result.push_back(dependent);
+            }
+        });
+    }
+    return result;
+}
+
+CTerm CSnapshot::getValueAt(const std::pair<size_t, size_t> &key) const {
+    auto it = sheet.find(key);
+    if (it != sheet.end()) {
+        switch (it->second.first.index()) {
+            case 1:
+                return std::get<double>(it->second.first);
+            case 2: {
+                const std::string &value = std::get<std::string>(it->second.first);
+                if (!value.empty() && value[0] == '=' && it->second.second) {
+                    if (graph.cyclic(key)) {
+                        noteCycle();
+                        return CTerm();
+                    }
+                    CTerm result;
+                    if (cache.find(key, result)) {
+                        return result;
+                    }
+                    CTracer::CScope scope(tracer.get(), key);
+                    if (CColumnKernel::evaluate(*this, key, result)) {
+                        return result;
+                    }
+                    return it->second.second->value(*this);
+                } else if (value.empty()) {
+                    return CTerm();
+                } else {
+                    return CRope(value);
+                }
+            }
+            default:
+                return CTerm();
+        }
+    } else {
+        return CTerm();
+    }
+}
+
+bool CSnapshot::getNumberAt(const std::pair<size_t, size_t> &key, double &number, CTerm &value) const {
+    auto it = sheet.find(key);
+    if (it == sheet.end()) {
+        value = CTerm();
+        return false;
+    }
+    if (std::holds_alternative<double>(it->second.first)) {
+        number = std::get<double>(it->second.first);
+        return true;
+    }
+    value = getValueAt(key);
+    if (!std::holds_alternative<double>(value)) {
+        return false;
+    }
+    number = std::get<double>(value);
+    return true;
+}
+
+CTerm CSnapshot::getSharedValue(const Node &node) const {
+    CTerm value;
+    if (shared.find(&node, value)) {
+        return value;
+    }
+    size_t before = cycles;
+    ++evaluations;
+    value = node.evaluate(*this);
+    if (cycles == before) {
+        shared.store(node.shared_from_this(), value);
+    }
+    return value;
+}
+
+CAggregate CSnapshot::aggregate(const CRect &rect) const {
+    CAggregate result;
+    auto add = [&result](const auto &value) {
+        if (std::holds_alternative<double>(value)) {
+            result.sum += std::get<double>(value);
+            result.min = std::min(result.min, std::get<double>(value));
+            result.max = std::max(result.max, std::get<double>(value));
+            ++result.numbers;
+        }
+        if (value.index() != 0) {
+            ++result.values;
+        }
+    };
+    if (index && rect.area() >= INDEX_AREA) {
+        // formulas whose values the summaries lack are evaluated in dependency order and filled in, the others
+        // are not evaluated again, a value depending on a cycle is never filled in and is added by itself
+        std::vector<std::pair<size_t, size_t>> stale = index->stale(rect);
+        recalculate(stale);
+        std::vector<CTerm> cyclic;
+        for (const auto &key: stale) {
+            size_t before = cycles;
+            CTerm value = getValueAt(key);
+            if (cycles == before) {
+                index->fill(key, value);
+            } else {
+                cyclic.push_back(std::move(value));
+            }
+        }
+        result = index->query(rect);
+        for (const CTerm &value: cyclic) {
+            add(value);
+        }
+        return result;
+    }
+    auto it = sheet.lower_bound({rect.top, rect.left});
+    while (it != sheet.end() && it->first.first <= rect.bottom) {
+        if (it->first.second < rect.left) {
+            it = sheet.lower_bound({it->first.first, rect.left});
+        } else if (it->first.second > rect.right) {
+            it = sheet.lower_bound({it->first.first + 1, rect.left});
+        } else {
+            add(literal(it->second));
+            ++it;
+        }
+    }
+    graph.forEachFormula(rect, [this, &add](const std::pair<size_t, size_t> &key) {
+        add(getValueAt(key));
+    });
+    return result;
+}
+
+void CSnapshot::forEachValue(const CRect &rect, const std::function<void(const CTerm &)> &visit) const {
+    auto it = sheet.lower_bound({rect.top, rect.left});
+    while (it != sheet.end() && it->first.first <= rect.bottom) {
+        if (it->first.second < rect.left) {
+            it = sheet.lower_bound({it->first.first, rect.left});
+        } else if (it->first.second > rect.right) {
+            it = sheet.lower_bound({it->first.first + 1, rect.left});
+        } else {
+            if (!it->second.second) {
+                CTerm value = CRope::term(literal(it->second));
+                if (value.index() != 0) {
+                    visit(value);
+                }
+            }
+            ++it;
+        }
+    }
+    graph.forEachFormula(rect, [this, &visit](const std::pair<size_t, size_t> &key) {
+        CTerm value = getValueAt(key);
+        if (value.index() != 0) {
+            visit(value);
+        }
+    });
+}
+
+size_t CSnapshot::match(const CRect &rect, const CTerm &value, bool floor) const {
+    std::optional<CColumnIndex::CKey> wanted = CColumnIndex::key(value);
+    if (!wanted || (rect.top != rect.bottom && rect.left != rect.right)) {
+        return CColumnIndex::NOT_FOUND;
+    }
+    auto lookup = lookups.find(rect.left);
+    if (rect.left == rect.right && lookup != lookups.end()
+        && (!floor || lookup->second.getKind() == CIndexKind::SORTED)) {
+        const CColumnIndex &index = lookup->second;
+        for (size_t row: index.stale(rect.top, rect.bottom)) {
+            size_t before = cycles;
+            CTerm computed = getValueAt({row, rect.left});
+            if (cycles == before) {
+                index.fill(row, computed);
+            }
+        }
+        size_t row = floor ? index.floor(*wanted, rect.top, rect.bottom) : index.find(*wanted, rect.top, rect.bottom);
+        return row == CColumnIndex::NOT_FOUND ? row : row - rect.top;
+    }
+    size_t result = CColumnIndex::NOT_FOUND;
+    std::optional<CColumnIndex::CKey> best;
+    auto it = sheet.lower_bound({rect.top, rect.left});
+    while (it != sheet.end() && it->first.first <= rect.bottom) {
+        if (it->first.second < rect.left) {
+            it = sheet.lower_bound({it->first.first, rect.left});
+        } else if (it->first.second > rect.right) {
+            it = sheet.lower_bound({it->first.first + 1, rect.left});
+        } else {
+            std::optional<CColumnIndex::CKey> cell = CColumnIndex::key(
+                    it->second.second ? getValueAt(it->first) : CRope::term(literal(it->second)));
+            // one of the differences is zero, the range is one row or column
+            size_t offset = it->first.first - rect.top + it->first.second - rect.left;
+            if (cell && !floor && *cell == *wanted) {
+                return offset;
+            }
+            if (cell && floor && cell->index() == wanted->index() && *cell <= *wanted && (!best || *best < *cell)) {
+                best = std::move(cell);
+                result = offset;
+            }
+            ++it;
+        }
+    }
+    return result;
+}
+
+void CSnapshot::noteCycle() {
+    ++cycles;
+}
+
+size_t CSnapshot::cycleCount() {
+    return cycles;
+}
+
+size_t CSnapshot::sharedEvaluations() {
+    return evaluations;
+}
+
+size_t CSnapshot::getEpoch() const {
+    return epoch;
+}
+
+CMemoryUsage CSnapshot::memoryUsage() const {
+    CMemoryUsage usage;
+    usage.cells = sheet.memoryUsage();
+    std::unordered_set<const Node *> seen;
+    for (const auto &[key, cell]: sheet) {
+        if (std::holds_alternative<std::string>(cell.first)) {
+            usage.strings += CMemoryUsage::text(std::get<std::string>(cell.first));
+        }
+        if (cell.second) {
+            usage.formulas += cell.second->memoryUsage(seen);
+        }
+    }
+    usage.caches = cache.memoryUsage() + shared.memoryUsage() + graph.memoryUsage()
+                   + (index ? index->memoryUsage() : 0);
+    for (const auto &[column, lookup]: lookups) {
+        usage.caches += lookup.memoryUsage();
+    }
+    for (const auto &[source, linked]: links) {
+        usage.caches += linked.memoryUsage();
+    }
+    return usage;
+}
+
+const CCellMap &CSnapshot::getCells() const {
+    return sheet;
+}
+
+const std::map<const CSpreadsheet *, CDependencyGraph> &CSnapshot::getLinks() const {
+    return links;
+}
+
+const std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> &CSnapshot::getSources() const {
+    return sources;
+}
+
+void CSnapshot::pin(std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> versions) {
+    for (auto it = versions.begin(); it != versions.end();) {
+        it = links.contains(it->first) ? std::next(it) : versions.erase(it);
+    }
+    sources = std::move(versions);
+}
+
+void CSnapshot::store(const std::pair<size_t, size_t> &key, CCell cell) {
+    if (cell.second) {
+        CPrecedents precedents;
+        cell.second->precedents(precedents);
+        link(key, std::move(precedents.external));
+        graph.set(key, std::move(precedents));
+    } else {
+        link(key, {});
+        graph.erase(key);
+    }
+    if (index) {
+        index->update(key, literal(cell), cell.second != nullptr);
+    }
+    auto lookup = lookups.find(key.second);
+    if (lookup != lookups.end()) {
+        auto it = sheet.find(key);
+        lookup->second.update(key.first, it != sheet.end() ? literal(it->second) : CValue(), literal(cell),
+                              cell.second != nullptr);
+    }
+    sheet[key] = std::move(cell);
+}
+
+void CSnapshot::link(const std::pair<size_t, size_t> &key,
+                     std::vector<std::pair<const CSpreadsheet *, CRect>> external) {
+    for (auto it = links.begin(); it != links.end();) {
+        it->second.erase(key);
+        it = it->second.isEmpty() ? links.erase(it) : std::next(it);
+    }
+    std::map<const CSpreadsheet *, CPrecedents> bySheet;
+    for (const auto &[source, rect]: external) {
+        CPrecedents &precedents = bySheet[source];
+        if (rect.area() == 1) {
+            precedents.cells.emplace_back(rect.top, rect.left);
+        } else {
+            precedents.ranges.push_back(rect);
+        }
+    }
+    for (auto &[source, precedents]: bySheet) {
+        links[source].set(key, std::move(precedents), false);
+    }
+}
+
+bool CSnapshot::hasComputed() const {
+    bool computed = std::any_of(lookups.begin(), lookups.end(), [](const auto &lookup) {
+        return lookup.second.hasComputed();
+    });
+    return !cache.isEmpty() || !shared.isEmpty() || computed || (index && index->hasComputed());
+}
+
+void CSnapshot::invalidate(const std::vector<std::pair<size_t, size_t>> &changed) {
+    if (!hasComputed()) {
+        return;
+    }
+    std::vector<std::pair<size_t, size_t>> cells = dependents(changed, INVALIDATE_LIMIT);
+    if (cells.size() > INVALIDATE_LIMIT) {
+        cache.clear();
+        shared.clear();
+        for (auto &[column, lookup]: lookups) {
+            lookup.invalidateAll();
+        }
+        if (index) {
+            index->invalidateAll();
+        }
+        return;
+    }
+    drop(cells);
+}
+
+void CSnapshot::inherit(const CSnapshot &base, const std::vector<std::pair<size_t, size_t>> &changed) {
+    if (!base.hasComputed()) {
+        return;
+    }
+    std::vector<std::pair<size_t, size_t>> cells = dependents(changed, INVALIDATE_LIMIT);
+    if (cells.size() > INVALIDATE_LIMIT) {
+        return;
+    }
+    cache.inherit(base.cache);
+    shared.inherit(base.shared);
+    for (auto &[column, lookup]: lookups) {
+        auto it = base.lookups.find(column);
+        if (it != base.lookups.end() && it->second.getKind() == lookup.getKind()) {
+            lookup.inherit(it->second);
+        }
+    }
+    if (index && base.index) {
+        index->inherit(*base.index);
+    }
+    drop(cells);
+}
+
+void CSnapshot::drop(const std::vector<std::pair<size_t, size_t>> &cells) {
+    std::unordered_set<std::pair<size_t, size_t>, CKeyHash> affected(cells.begin(), cells.end());
+    for (const auto &key: cells) {
+        cache.erase(key);
+        auto lookup = lookups.find(key.second);
+        if (lookup != lookups.end()) {
+            lookup->second.invalidate(key.first);
+        }
+        if (index) {
+            index->invalidate(key);
+        }
+    }
+    shared.invalidate([&affected](const CPrecedents &precedents) {
+        for (const auto &cell: precedents.cells) {
+            if (affected.contains(cell)) {
+                return true;
+            }
+        }
+        for (const auto &rect: precedents.ranges) {
+            for (const auto &key: affected) {
+                if (rect.top <= key.first && key.first <= rect.bottom
+                    && rect.left <= key.second && key.second <= rect.right) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    });
+}
+
+void CSnapshot::reindex() {
+    graph = CDependencyGraph();
+    links.clear();
+    for (const auto &[key, cell]: sheet) {
+        if (cell.second) {
+            CPrecedents precedents;
+            cell.second->precedents(precedents);
+            if (!precedents.external.empty()) {
+                link(key, std::move(precedents.external));
+            }
+            graph.set(key, std::move(precedents), false);
+        }
+    }
+    graph.detectCycles();
+    indexValues();
+}
+
+void CSnapshot::indexValues() {
+    index.reset();
+    if (indexing) {
+        index.emplace();
+    }
+    for (auto &[column, lookup]: lookups) {
+        lookup.clear();
+    }
+    if (!index && lookups.empty()) {
+        return;
+    }
+    for (const auto &[key, cell]: sheet) {
+        auto lookup = lookups.find(key.second);
+        if (lookup != lookups.end()) {
+            lookup->second.update(key.first, CValue(), literal(cell), cell.second != nullptr);
+        }
+        if (index) {
+            index->update(key, literal(cell), cell.second != nullptr);
+        }
+    }
+}
+
+void CSnapshot::relocate(const CRelocation &relocation) {
+    // the graph finds the formulas whose references move, the others keep their expressions and relative forms
+    std::vector<std::tuple<std::pair<size_t, size_t>, std::pair<size_t, size_t>, bool>> moved;
+    graph.relocate(relocation, true, [&moved](const auto &from, const auto &to, bool crossed) {
+        moved.emplace_back(from, to, crossed);
+    });
+    graph.detectCycles();
+    // cells above the first moved row keep their keys, the others all move alike, so they stay in order
+    CCellMap cells;
+    sheet.drainFrom({relocation.columns ? 0 : relocation.first, 0}, [&cells](CCellMap::value_type &&entry) {
+        cells.append(entry.first, std::move(entry.second));
+    });
+    cells.drain([this, &relocation](CCellMap::value_type &&entry) {
+        if (relocation.move(entry.first.first, entry.first.second)) {
+            sheet.append(entry.first, std::move(entry.second));
+        }
+    });
+    for (const auto &[from, to, crossed]: moved) {
+        CCell &cell = sheet[to];
+        if (std::shared_ptr<Node> ast = cell.second->relocate(relocation)) {
+            cell.second = std::move(ast);
+        }
+        std::string text;
+        if (crossed && CFormulaText::relocateRelative(std::get<std::string>(cell.first), from.first, from.second,
+                                                      relocation, text)) {
+            cell.first = std::move(text);
+        }
+    }
+    std::map<size_t, CColumnIndex> kept;
+    for (const auto &[column, lookup]: lookups) {
+        size_t target = column;
+        if (!relocation.columns || relocation.move(target)) {
+            kept.try_emplace(target, lookup.getKind());
+        }
+    }
+    lookups = std::move(kept);
+    cache.clear();
+    shared.clear();
+    for (auto it = links.begin(); it != links.end();) {
+        it->second.relocate(relocation, false);
+        it = it->second.isEmpty() ? links.erase(it) : std::next(it);
+    }
+    indexValues();
+}
+
+void CSnapshot::indexColumn(size_t column) {
+    CColumnIndex &lookup = lookups.at(column);
+    for (const auto &[key, cell]: sheet) {
+        if (key.second == column) {
+            lookup.update(key.first, CValue(), literal(cell), cell.second != nullptr);
+        }
+    }
+}
+
+CValue CSnapshot::literal(const CCell &cell) {
+    if (cell.second || (std::holds_alternative<std::string>(cell.first) && std::get<std::string>(cell.first).empty())) {
+        return CValue();
+    }
+    return cell.first;
+}
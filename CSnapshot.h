@@ -0,0 +1,382 @@
+#ifndef CSNAPSHOT_H
+#define CSNAPSHOT_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <memory>
+#include <variant>
+#include <optional>
+#include <stdexcept>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include "CPos.h"
+#include "Node.h"
+#include "CValueCache.h"
+#include "CNodeCache.h"
+#include "CRangeIndex.h"
+#include "CColumnIndex.h"
+#include "CTracer.h"
+#include "CBudget.h"
+#include "CDependencyGraph.h"
+#include "CMemoryUsage.h"
+#include "CSharedMap.h"
+
+using CValue = std::variant<std::monostate, double, std::string>;
+using CCell = std::pair<CValue, std::shared_ptr<Node>>;
+using CCellMap = CSharedMap<std::pair<size_t, size_t>, CCell>;
+
+/** @brief Error an evaluation throws for a cell it cannot evaluate.
+ *
+ * Errors of formulas evaluate to undefined, an evaluation throws a
+ * std::logic_error only for cells the version does not hold as it expects
+ * (e.g. std::out_of_range of CSharedMap::at). Anything else, such as
+ * std::bad_alloc, is a failure of resources that callers must not swallow.
+ */
+using CEvalError = std::logic_error;
+
+/** @brief One published version of the sheet contents.
+ *
+ * A snapshot is never modified while somebody else holds it, so a reader
+ * that pinned one through CSpreadsheet::snapshot() evaluates against it
+ * without any locking. It is released together with its last holder. A copy
+ * shares the cells, the dependency graph with its cycles and the range index
+ * with the original (CSharedMap), and the literals of the column indexes, so
+ * a write published while a reader holds the old version copies only the
+ * chunks it changes. A write into an indexed column copies the literals of
+ * that column once per pinned version. Such write also copies the values
+ * computed so far, except those the write makes stale.
+ */
+class CSnapshot {
+public:
+    /**  @brief creates an empty snapshot
+     */
+    CSnapshot() = default;
+
+    /**
+     * @brief returns a value on given position
+     *
+     * @param pos [in] position in the sheet.
+     * @return CValue, Value of a given position.
+     */
+    CValue getValue(CPos pos) const;
+
+    /**
+     * @brief returns values of a rectangle
+     *
+     * Formulas of the rectangle and everything they read are put into
+     * dependency order first, every one of them is evaluated once and its
+     * value cached before the formulas reading it are evaluated.
+     *
+     * @param rect [in] rectangle to be read
+     * @return std::vector<std::vector<CValue>> rows of values.
+     */
+    std::vector<std::vector<CValue>> getValues(const CRect &rect) const;
+
+    /**
+     * @brief returns a value on given position unless the budget runs out first
+     *
+     * The formulas the cell reads are evaluated in dependency order like by
+     * getValues. Those computed before the budget ran out stay cached, so the
+     * next call on this version continues where this one stopped.
+     *
+     * @param pos [in] position in the sheet.
+     * @param value [out] value of the position, untouched when not ready
+     * @param budget [in] deadline and cancellation token
+     * @return CEvalStatus READY if the value is computed, NOT_READY if the budget ran out.
+     */
+    CEvalStatus getValue(CPos pos, CValue &value, const CBudget &budget) const;
+
+    /**
+     * @brief returns values of a rectangle unless the budget runs out first
+     *
+     * @param rect [in] rectangle to be read
+     * @param values [out] rows of values, untouched when not ready
+     * @param budget [in] deadline and cancellation token
+     * @return CEvalStatus READY if the values are computed, NOT_READY if the budget ran out.
+     */
+    CEvalStatus getValues(const CRect &rect, std::vector<std::vector<CValue>> &values, const CBudget &budget) const;
+
+    /**
+     * @brief evaluates formulas in dependency order and caches their values
+     *
+     * Formulas found in the value cache are skipped together with what they read.
+     *
+     * @param roots [in] cells to be evaluated together with all formulas they read
+     * @param budget [in] checked before every formula, see CBudget
+     * @return bool True if all of them are computed, false if the budget ran out.
+     */
+    bool recalculate(const std::vector<std::pair<size_t, size_t>> &roots, const CBudget &budget = CBudget()) const;
+
+    /**
+     * @brief finds the cells whose values depend on modified cells
+     *
+     * @param changed [in] modified cells
+     * @param limit [in] stop searching once more cells are found
+     * @return std::vector<std::pair<size_t, size_t>> modified cells and all formulas depending on them.
+     */
+    std::vector<std::pair<size_t, size_t>> dependents(const std::vector<std::pair<size_t, size_t>> &changed,
+                                                      size_t limit = SIZE_MAX) const;
+
+    /**
+     * @brief returns a value on given position
+     *
+     * Formula cells are answered from the value cache or by CColumnKernel when
+     * they belong to a run of copied formulas, otherwise their nodes are evaluated.
+     * Cells of a cycle are undefined without being evaluated.
+     *
+     * @param key [in] row and column in the sheet.
+     * @return CTerm, Value of a given position, a text as a rope.
+     */
+    CTerm getValueAt(const std::pair<size_t, size_t> &key) const;
+
+    /**
+     * @brief returns a number on given position
+     *
+     * @param key [in] row and column in the sheet.
+     * @param number [out] the number
+     * @param value [out] value of the cell when it is not a number, a formula is not evaluated again
+     * @return bool True if the cell holds or computes a number, false otherwise.
+     */
+    bool getNumberAt(const std::pair<size_t, size_t> &key, double &number, CTerm &value) const;
+
+    /**
+     * @brief returns the value of a node shared by several formulas
+     *
+     * The node is evaluated once per version, its value is kept until a cell
+     * it depends on is modified.
+     *
+     * @param node [in] shared node
+     * @return CTerm value of the node.
+     */
+    CTerm getSharedValue(const Node &node) const;
+
+    /**
+     * @brief aggregates the values of a rectangle
+     *
+     * Large rectangles are answered by CRangeIndex when it is enabled. Only
+     * the formulas whose values the index lacks are evaluated and filled in,
+     * the index keeps them until a write makes them stale, other rectangles
+     * evaluate all of their formulas.
+     *
+     * @param rect [in] rectangle to be aggregated
+     * @return CAggregate sum, minimum, maximum and count of numbers and count of defined values.
+     */
+    CAggregate aggregate(const CRect &rect) const;
+
+    /**
+     * @brief visits the values of a rectangle, empty cells are skipped
+     *
+     * @param rect [in] the rectangle
+     * @param visit [in] called for every value, literals first, then the evaluated formulas
+     */
+    void forEachValue(const CRect &rect, const std::function<void(const CTerm &)> &visit) const;
+
+    /**
+     * @brief finds a value in a range of one row or one column
+     *
+     * A column with a CColumnIndex is searched in the index, after the stale
+     * formulas of the range are evaluated, other ranges are scanned.
+     *
+     * @param rect [in] range searched
+     * @param value [in] value to be found
+     * @param floor [in] find the largest value not above value instead of an equal one
+     * @return size_t offset of the first such cell in the range, CColumnIndex::NOT_FOUND if there is none or the range is not one row or column.
+     */
+    size_t match(const CRect &rect, const CTerm &value, bool floor) const;
+
+    /**
+     * @brief records that an evaluation of this thread read a cell of a cycle
+     */
+    static void noteCycle();
+
+    /**
+     * @brief number of cycles met by evaluations of this thread so far
+     *
+     * A value computed while this number changed depends on a cycle. It is not
+     * cached, so every function reading it notices the cycle again.
+     *
+     * @return size_t number of cycles.
+     */
+    static size_t cycleCount();
+
+    /**
+     * @brief number of shared nodes evaluated by this thread so far, cached values are not counted
+     *
+     * @return size_t number of evaluations.
+     */
+    static size_t sharedEvaluations();
+
+    /**
+     * @brief Getter for the epoch, it grows with every published modification.
+     *
+     * @return size_t epoch of this version.
+     */
+    size_t getEpoch() const;
+
+    /**
+     * @brief estimates the memory of this version
+     *
+     * Expression nodes shared with other versions or sheets are counted here too.
+     *
+     * @return CMemoryUsage bytes of cells, strings, expressions and caches.
+     */
+    CMemoryUsage memoryUsage() const;
+
+    /**
+     * @brief Getter for the stored cells.
+     *
+     * A formula is stored in the relative form of CFormulaText::toRelative,
+     * CFormulaText::fromRelative turns it back into the text of its cell.
+     *
+     * @return const CCellMap & cells of this version.
+     */
+    const CCellMap &getCells() const;
+
+    /**
+     * @brief Getter for the references to other sheets of the workbook.
+     *
+     * @return const std::map<const CSpreadsheet *, CDependencyGraph> & for every other sheet
+     * the formulas of this version reading it, with precedents in that sheet.
+     */
+    const std::map<const CSpreadsheet *, CDependencyGraph> &getLinks() const;
+
+    /**
+     * @brief Getter for the versions of other sheets this version was published against.
+     *
+     * Formulas reading another sheet evaluate its pinned version, so a reader
+     * of this version sees the other sheets as they were when it was published.
+     * A sheet reading this one back, directly or through the versions it
+     * pinned, is not pinned and its formulas read its current version.
+     *
+     * @return const std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> & pinned version of every such sheet.
+     */
+    const std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> &getSources() const;
+
+private:
+    friend class CSpreadsheet;
+    friend class CColumnKernel;
+    friend class CProcessEvaluator;
+    friend class CTracer;
+
+    static constexpr size_t INDEX_AREA = 256;
+    static constexpr size_t INVALIDATE_LIMIT = 4096;
+
+    CCellMap sheet;
+    CDependencyGraph graph;
+    // its cycles are not searched, positions of a formula and of what it reads are in different sheets
+    std::map<const CSpreadsheet *, CDependencyGraph> links;
+    // versions of the sheets in links, taken when this version was published
+    std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> sources;
+    std::optional<CRangeIndex> index{std::in_place};
+    bool indexing = true;
+    // indexes of the values of columns for lookups
+    std::map<size_t, CColumnIndex> lookups;
+    // records evaluations while tracing is enabled, shared by the versions published meanwhile
+    std::shared_ptr<CTracer> tracer;
+    size_t epoch = 0;
+    mutable CValueCache cache;
+    mutable CNodeCache shared;
+    static thread_local size_t cycles;
+    static thread_local size_t evaluations;
+
+    /**
+     * @brief stores a cell and updates the range index and the index of its column
+     *
+     * @param key [in] row and column in the sheet.
+     * @param cell [in] new contents of the cell.
+     */
+    void store(const std::pair<size_t, size_t> &key, CCell cell);
+
+    /**
+     * @brief records the cells of other sheets a formula reads
+     *
+     * @param key [in] row and column of the formula
+     * @param external [in] precedents in other sheets, empty when the cell reads none
+     */
+    void link(const std::pair<size_t, size_t> &key, std::vector<std::pair<const CSpreadsheet *, CRect>> external);
+
+    /**
+     * @brief pins the versions of the other sheets this version reads
+     *
+     * @param versions [in] current versions of the other sheets, those this version does not read are left out
+     */
+    void pin(std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> versions);
+
+    /**
+     * @brief drops cached values depending on modified cells
+     *
+     * Modified cells and all formulas depending on them are found in the
+     * dependency graph, values of other cells and shared nodes stay cached.
+     * When too many formulas depend on the modified cells, everything is dropped.
+     *
+     * @param changed [in] modified cells
+     */
+    void invalidate(const std::vector<std::pair<size_t, size_t>> &changed);
+
+    /**
+     * @brief takes over the computed values of the version this one was copied from
+     *
+     * The values of the caches and of the indexes are copied and those
+     * depending on the modified cells dropped as invalidate drops them. When
+     * too many formulas depend on them, nothing is copied.
+     *
+     * @param base [in] version this one was copied from, the modified cells are stored here already
+     * @param changed [in] modified cells
+     */
+    void inherit(const CSnapshot &base, const std::vector<std::pair<size_t, size_t>> &changed);
+
+    /**
+     * @brief drops the cached values of given cells and of the shared nodes reading them
+     *
+     * @param cells [in] modified cells and the formulas depending on them
+     */
+    void drop(const std::vector<std::pair<size_t, size_t>> &cells);
+
+    /**
+     * @brief tells whether the caches or the indexes hold a computed value
+     */
+    bool hasComputed() const;
+
+    /**
+     * @brief rebuilds the dependency graph, the range index and the column indexes from the stored cells
+     */
+    void reindex();
+
+    /**
+     * @brief rebuilds the range index and the column indexes from the stored cells
+     */
+    void indexValues();
+
+    /**
+     * @brief moves the cells as inserted or deleted rows or columns move them
+     *
+     * Cells above the first moved row keep their places, the others and the
+     * dependency graph are re-keyed without copying them. Only the formulas
+     * the graph reports get new expressions, and only those whose references
+     * cross the inserted or deleted rows get a new relative form, the text of
+     * the others is not read. The indexes of columns move with their columns
+     * and are rebuilt, the cached values are dropped.
+     *
+     * @param relocation [in] inserted or deleted rows or columns
+     */
+    void relocate(const CRelocation &relocation);
+
+    /**
+     * @brief builds the index of a column from the stored cells
+     *
+     * @param column [in] column with an empty index in lookups
+     */
+    void indexColumn(size_t column);
+
+    /**
+     * @brief literal value of a cell
+     *
+     * @param cell [in] stored cell
+     * @return CValue value of a number or a text, undefined for a formula or an empty text.
+     */
+    static CValue literal(const CCell &cell);
+};
+
+#endif // CSNAPSHOT_H
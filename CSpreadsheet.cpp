@@ -1,99 +1,475 @@
 #include "CSpreadsheet.h"
 #include "ExpressionBuilder.h"
+#include "CFormulaParser.h"
+#include "CFormulaText.h"
+#include "CCompressor.h"
+#include "CNodePool.h"
+#include "CWorkbook.h"
+#include "CProcessEvaluator.h"
 
-CSpreadsheet::CSpreadsheet() {
+CSpreadsheet::CSpreadsheet() : current(std::make_shared<CSnapshot>()), published(current) {
 }
 
-CSpreadsheet::CSpreadsheet(const CSpreadsheet &other) : sheet(other.sheet) {}
+CSpreadsheet::CSpreadsheet(const CSpreadsheet &other) : current(other.published.load()), published(current) {
+}
 
 CSpreadsheet &CSpreadsheet::operator=(const CSpreadsheet &other) {
     if (this != &other) {
-        sheet = other.sheet;
+        std::shared_ptr<CSnapshot> next = other.published.load();
+        {
+            std::lock_guard lock(writeMutex);
+            publish(std::move(next));
+            compactJournal(true);
+            history.clear();
+            replaced = true;
+        }
+        propagate();
     }
     return *this;
 }
 
-bool CSpreadsheet::setCell(CPos pos,
-                           std::string contents) {
+std::shared_ptr<const CSnapshot> CSpreadsheet::snapshot() const {
+    while (true) {
+        pinning.fetch_add(1);
+        if (!inPlace.load()) {
+            std::shared_ptr<const CSnapshot> version = published.load();
+            pinning.fetch_sub(1);
+            return version;
+        }
+        pinning.fetch_sub(1);
+        inPlace.wait(true);
+    }
+}
 
-    if (!contents.empty() && contents[0] == '=') {
-        if (!(CValue(contents).index() == 0)) {
-            ExpressionBuilder builder;
-            try {
-                parseExpression(contents, builder);
+bool CSpreadsheet::beginInPlace() {
+    // a reader checks inPlace after announcing itself in pinning, so either it waits or we see it
+    inPlace.store(true);
+    // the version is held by current and published alone
+    if (pinning.load() == 0 && current.use_count() == 2) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+    endInPlace();
+    return false;
+}
+
+void CSpreadsheet::endInPlace() {
+    inPlace.store(false);
+    inPlace.notify_all();
+}
+
+void CSpreadsheet::commit(std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes,
+                          const std::vector<std::pair<size_t, size_t>> &touched) {
+    std::vector<std::pair<size_t, size_t>> changed;
+    changed.reserve(changes.size() + touched.size());
+    for (const auto &change: changes) {
+        changed.push_back(change.first);
+    }
+    if (workbook) {
+        exported.insert(exported.end(), changed.begin(), changed.end());
+    }
+    changed.insert(changed.end(), touched.begin(), touched.end());
+    // a watched cell failing to evaluate is reported as undefined, the write is stored and delivered anyway, a
+    // failure of resources propagates, before the write is published when the old values are read
+    auto evaluate = [](const CSnapshot &version, const std::pair<size_t, size_t> &key) {
+        try {
+            return version.getValueAt(key);
+        } catch (const CEvalError &) {
+            return CTerm();
+        }
+    };
+    // old values of the watched cells that may change, compared after the write
+    std::vector<std::pair<std::pair<size_t, size_t>, CTerm>> watched;
+    if (!subscriptions.empty()) {
+        for (const auto &key: current->dependents(changed)) {
+            for (const auto &[id, subscription]: subscriptions) {
+                const CRect &rect = subscription.first;
+                if (rect.top <= key.first && key.first <= rect.bottom
+                    && rect.left <= key.second && key.second <= rect.right) {
+                    watched.emplace_back(key, evaluate(*current, key));
+                    break;
+                }
             }
-            catch (const std::exception &e) {
-                return false;
+        }
+    }
+    // the other sheets are pinned before an in-place modification makes their readers wait for this one
+    std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> sources;
+    if (workbook) {
+        std::set<const CSpreadsheet *> reads;
+        for (const auto &[source, links]: current->links) {
+            reads.insert(source);
+        }
+        for (const auto &change: changes) {
+            if (change.second.second) {
+                CPrecedents precedents;
+                change.second.second->precedents(precedents);
+                for (const auto &[source, rect]: precedents.external) {
+                    reads.insert(source);
+                }
             }
-            sheet[{pos.getRow(), pos.getColumn()}] = std::make_pair(contents, builder.getAST());
-            return true;
-        } else {
+        }
+        sources = pins(reads);
+    }
+    ++writers;
+    if (beginInPlace()) {
+        for (auto &change: changes) {
+            current->store(change.first, std::move(change.second));
+        }
+        current->pin(std::move(sources));
+        current->invalidate(changed);
+        ++current->epoch;
+        endInPlace();
+    } else {
+        auto next = std::make_shared<CSnapshot>(*current);
+        for (auto &change: changes) {
+            next->store(change.first, std::move(change.second));
+        }
+        next->pin(std::move(sources));
+        next->inherit(*current, changed);
+        next->epoch = current->epoch + 1;
+        publish(std::move(next));
+    }
+    --writers;
+    if (recalcWorker) {
+        recalcWorker->enqueue(changed);
+    }
+    if (watched.empty()) {
+        return;
+    }
+    std::sort(watched.begin(), watched.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (const auto &[id, subscription]: subscriptions) {
+        const CRect &rect = subscription.first;
+        std::vector<CChange> batch;
+        for (const auto &[key, value]: watched) {
+            if (rect.top <= key.first && key.first <= rect.bottom
+                && rect.left <= key.second && key.second <= rect.right) {
+                CTerm now = evaluate(*current, key);
+                if (now != value) {
+                    batch.push_back({key.first, key.second, CRope::flatten(now)});
+                }
+            }
+        }
+        if (!batch.empty()) {
+            notifications.emplace_back(subscription.second, std::move(batch));
+        }
+    }
+}
+
+void CSpreadsheet::deliver() {
+    {
+        std::lock_guard lock(writeMutex);
+        // one thread delivers at a time, so batches arrive in the order of the writes, the
+        // batches of writes made meanwhile, also by its own callbacks, are left to that thread
+        if (delivering) {
+            return;
+        }
+        delivering = true;
+    }
+    try {
+        while (true) {
+            std::vector<std::pair<CChangeCallback, std::vector<CChange>>> pending;
+            {
+                std::lock_guard lock(writeMutex);
+                if (notifications.empty()) {
+                    delivering = false;
+                    return;
+                }
+                pending.swap(notifications);
+            }
+            for (const auto &[callback, changes]: pending) {
+                callback(changes);
+            }
+        }
+    } catch (...) {
+        std::lock_guard lock(writeMutex);
+        delivering = false;
+        throw;
+    }
+}
+
+void CSpreadsheet::refresh(const std::vector<std::pair<size_t, size_t>> &cells) {
+    {
+        std::lock_guard lock(writeMutex);
+        commit({}, cells);
+    }
+    deliver();
+}
+
+void CSpreadsheet::propagate() {
+    if (!workbook) {
+        return;
+    }
+    std::vector<std::pair<size_t, size_t>> cells;
+    bool all;
+    {
+        std::lock_guard lock(writeMutex);
+        cells.swap(exported);
+        all = replaced;
+        replaced = false;
+    }
+    if (all || !cells.empty()) {
+        workbook->propagate(*this, std::move(cells), all);
+    }
+}
+
+ExpressionBuilder CSpreadsheet::makeBuilder() const {
+    if (!workbook) {
+        return ExpressionBuilder();
+    }
+    return ExpressionBuilder([this](const std::string &name) -> std::shared_ptr<const CSpreadsheet> {
+        return workbook->share(name);
+    });
+}
+
+void CSpreadsheet::publish(std::shared_ptr<CSnapshot> next) {
+    published.store(next);
+    current = std::move(next);
+}
+
+void CSpreadsheet::install(std::shared_ptr<CSnapshot> next) {
+    next->indexing = current->indexing;
+    next->tracer = current->tracer;
+    for (const auto &[column, lookup]: current->lookups) {
+        next->lookups.try_emplace(column, lookup.getKind());
+    }
+    next->reindex();
+    std::set<const CSpreadsheet *> reads;
+    for (const auto &[source, links]: next->links) {
+        reads.insert(source);
+    }
+    next->pin(pins(reads));
+    next->epoch = current->epoch + 1;
+    publish(std::move(next));
+}
+
+std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> CSpreadsheet::pins(
+        const std::set<const CSpreadsheet *> &reads) const {
+    if (!workbook || reads.empty()) {
+        return {};
+    }
+    return workbook->pin(*this, reads);
+}
+
+void CSpreadsheet::setRangeIndex(bool enable) {
+    std::lock_guard lock(writeMutex);
+    std::shared_ptr<const CSnapshot> base = snapshot();
+    if (base->indexing == enable) {
+        return;
+    }
+    auto next = std::make_shared<CSnapshot>(*base);
+    next->indexing = enable;
+    next->reindex();
+    next->epoch = base->epoch + 1;
+    publish(std::move(next));
+}
+
+void CSpreadsheet::setColumnIndex(size_t column, CIndexKind kind) {
+    std::lock_guard lock(writeMutex);
+    std::shared_ptr<const CSnapshot> base = snapshot();
+    auto it = base->lookups.find(column);
+    if ((it == base->lookups.end() ? CIndexKind::NONE : it->second.getKind()) == kind) {
+        return;
+    }
+    auto next = std::make_shared<CSnapshot>(*base);
+    next->lookups.erase(column);
+    if (kind != CIndexKind::NONE) {
+        next->lookups.try_emplace(column, kind);
+        next->indexColumn(column);
+    }
+    next->epoch = base->epoch + 1;
+    publish(std::move(next));
+}
+
+void CSpreadsheet::setTracing(bool enable) {
+    std::lock_guard lock(writeMutex);
+    std::shared_ptr<const CSnapshot> base = snapshot();
+    if (!enable && !base->tracer) {
+        return;
+    }
+    auto next = std::make_shared<CSnapshot>(*base);
+    next->tracer = enable ? std::make_shared<CTracer>() : nullptr;
+    // the copy starts with an empty value cache, every formula is traced when read again
+    next->epoch = base->epoch + 1;
+    if (enable) {
+        std::lock_guard lock(traceMutex);
+        trace = next->tracer;
+    }
+    publish(std::move(next));
+}
+
+CTraceReport CSpreadsheet::traceReport(size_t heaviest) const {
+    std::shared_ptr<const CTracer> last;
+    {
+        std::lock_guard lock(traceMutex);
+        last = trace;
+    }
+    if (!last) {
+        return CTraceReport();
+    }
+    return last->report(*snapshot(), heaviest);
+}
+
+bool CSpreadsheet::saveTrace(std::ostream &os, size_t heaviest) const {
+    return CTracer::saveChromeTrace(traceReport(heaviest), os);
+}
+
+void CSpreadsheet::setAsyncRecalc(bool enable) {
+    std::lock_guard lock(writeMutex);
+    if (!enable) {
+        recalcWorker.reset();
+    } else if (!recalcWorker) {
+        recalcWorker = std::make_unique<CRecalcWorker>([this]() { return snapshot(); }, writers);
+    }
+}
+
+std::shared_future<void> CSpreadsheet::recalculation() {
+    std::lock_guard lock(writeMutex);
+    if (recalcWorker) {
+        return recalcWorker->pending();
+    }
+    std::promise<void> done;
+    done.set_value();
+    return done.get_future().share();
+}
+
+void CSpreadsheet::waitIdle() {
+    std::lock_guard lock(writeMutex);
+    if (recalcWorker) {
+        recalcWorker->waitIdle();
+    }
+}
+
+void CSpreadsheet::recalculateInProcesses(size_t processes) {
+    // no write and no background recalculation may hold a lock while the workers are forked
+    std::lock_guard lock(writeMutex);
+    bool async = recalcWorker != nullptr;
+    recalcWorker.reset();
+    CProcessEvaluator::evaluate(*snapshot(), processes);
+    if (async) {
+        recalcWorker = std::make_unique<CRecalcWorker>([this]() { return snapshot(); }, writers);
+    }
+}
+
+size_t CSpreadsheet::subscribe(CPos topLeft, int w, int h, CChangeCallback callback) {
+    if (w <= 0 || h <= 0) {
+        return 0;
+    }
+    std::lock_guard lock(writeMutex);
+    size_t id = nextSubscription++;
+    CRect rect{topLeft.getRow(), topLeft.getColumn(), topLeft.getRow() + h - 1, topLeft.getColumn() + w - 1};
+    subscriptions.emplace(id, std::make_pair(rect, std::move(callback)));
+    return id;
+}
+
+void CSpreadsheet::unsubscribe(size_t id) {
+    std::lock_guard lock(writeMutex);
+    subscriptions.erase(id);
+}
+
+CMemoryUsage CSpreadsheet::memoryUsage() const {
+    return snapshot()->memoryUsage();
+}
+
+void CSpreadsheet::compact() {
+    std::lock_guard lock(writeMutex);
+    std::shared_ptr<const CSnapshot> base = snapshot();
+    auto next = std::make_shared<CSnapshot>();
+    for (const auto &[key, cell]: base->sheet) {
+        // nodes of neighbouring cells are allocated one after another
+        next->sheet.append(key, cell);
+    }
+    base.reset();
+    CNodePool::instance().sweep();
+    install(std::move(next));
+}
+
+bool CSpreadsheet::parseCell(const std::string &contents, size_t row, size_t column, CCell &cell) const {
+    if (!contents.empty() && contents[0] == '=') {
+        std::shared_ptr<Node> ast = parseFormula(contents);
+        if (!ast) {
             return false;
         }
+        cell = std::make_pair(CFormulaText::toRelative(contents, row, column), std::move(ast));
+        return true;
     } else {
         std::istringstream iss(contents);
         double number;
         if (iss >> number) {
-            sheet[{pos.getRow(), pos.getColumn()}] = std::make_pair(number, nullptr);
-            return true;
+            cell = std::make_pair(number, nullptr);
         } else {
-            sheet[{pos.getRow(), pos.getColumn()}] = std::make_pair(contents, nullptr);
-            return true;
+            cell = std::make_pair(contents, nullptr);
         }
+        return true;
     }
 }
 
-CValue CSpreadsheet::getValue(CPos pos) {
-    auto it = sheet.find({pos.getRow(), pos.getColumn()});
-    if (it != sheet.end()) {
-        switch (it->second.first.index()) {
-            case 1:
-                return CValue(std::get<double>(it->second.first));
-            case 2: {
-                const std::string &value = std::get<std::string>(it->second.first);
-                if (!value.empty() && value[0] == '=' && it->second.second) {
-                    std::set<std::string> positions;
-                    return it->second.second->evaluate(*this, positions);
-                } else if (value.empty()) {
-                    return CValue();
-                } else {
-                    return it->second.first;
-                }
-            }
-            default:
-                return CValue();
-        }
-    } else {
-        return CValue();
+std::shared_ptr<Node> CSpreadsheet::parseFormula(const std::string &formula) const {
+    ExpressionBuilder builder = makeBuilder();
+    try {
+        CFormulaParser::parse(formula, builder);
     }
+    catch (const std::exception &e) {
+        return nullptr;
+    }
+    return builder.getAST();
 }
 
-CValue CSpreadsheet::getValueRec(CPos pos, std::set<std::string> &positions) {
-    auto it = sheet.find({pos.getRow(), pos.getColumn()});
-    if (it != sheet.end()) {
-        switch (it->second.first.index()) {
-            case 1:
-                return CValue(std::get<double>(it->second.first));
-            case 2: {
-                const std::string &value = std::get<std::string>(it->second.first);
-                if (!value.empty() && value[0] == '=' && it->second.second) {
-                    return it->second.second->evaluate(*this, positions);
-                } else if (value.empty()) {
-                    return CValue();
-                } else {
-                    return it->second.first;
-                }
-            }
-            default:
-                return CValue();
+bool CSpreadsheet::setCell(CPos pos,
+                           std::string contents) {
+    CCell cell;
+    if (!parseCell(contents, pos.getRow(), pos.getColumn(), cell)) {
+        return false;
+    }
+    std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes;
+    changes.emplace_back(std::make_pair(pos.getRow(), pos.getColumn()), std::move(cell));
+    {
+        std::lock_guard lock(writeMutex);
+        if (journal && !journal->appendSet(pos.getRow(), pos.getColumn(), contents)) {
+            return false;
         }
-    } else {
-        return CValue();
+        if (history.enabled()) {
+            history.record(prior(changes));
+        }
+        commit(std::move(changes));
+        compactJournal(false);
+    }
+    deliver();
+    propagate();
+    return true;
+}
+
+CValue CSpreadsheet::getValue(CPos pos) const {
+    return snapshot()->getValue(pos);
+}
+
+std::vector<std::vector<CValue>> CSpreadsheet::getValues(CPos topLeft, int w, int h) const {
+    if (w <= 0 || h <= 0) {
+        return {};
+    }
+    return snapshot()->getValues({topLeft.getRow(), topLeft.getColumn(),
+                                  topLeft.getRow() + h - 1, topLeft.getColumn() + w - 1});
+}
+
+CEvalStatus CSpreadsheet::getValue(CPos pos, CValue &value, const CBudget &budget) const {
+    return snapshot()->getValue(pos, value, budget);
+}
+
+CEvalStatus CSpreadsheet::getValues(CPos topLeft, int w, int h, std::vector<std::vector<CValue>> &values,
+                                    const CBudget &budget) const {
+    if (w <= 0 || h <= 0) {
+        values.clear();
+        return CEvalStatus::READY;
     }
+    return snapshot()->getValues({topLeft.getRow(), topLeft.getColumn(),
+                                  topLeft.getRow() + h - 1, topLeft.getColumn() + w - 1}, values, budget);
 }
 
 bool CSpreadsheet::save(std::ostream &os) const {
-    for (const auto &pos: sheet) {
+    return saveVersion(*snapshot(), os);
+}
+
+bool CSpreadsheet::saveVersion(const CSnapshot &version, std::ostream &os) {
+    for (const auto &pos: version.getCells()) {
         switch (pos.second.first.index()) {
             case 1:
                 os << pos.first.first << ' ' << pos.first.second << ' ';
@@ -101,12 +477,17 @@ bool CSpreadsheet::save(std::ostream &os) const {
                 os << 1 << ' ';
                 os << std::get<double>(pos.second.first);
                 break;
-            case 2:
+            case 2: {
+                // a formula is written as it was set, not in its stored relative form
+                const std::string &stored = std::get<std::string>(pos.second.first);
+                std::string text = pos.second.second
+                                   ? CFormulaText::fromRelative(stored, pos.first.first, pos.first.second) : stored;
                 os << pos.first.first << ' ' << pos.first.second << ' ';
                 os << pos.second.first.index() << ' ';
-                os << std::get<std::string>(pos.second.first).length() << ' ';
-                os << std::get<std::string>(pos.second.first);
+                os << text.length() << ' ';
+                os << text;
                 break;
+            }
             default:
                 break;
         }
@@ -116,7 +497,25 @@ bool CSpreadsheet::save(std::ostream &os) const {
 }
 
 bool CSpreadsheet::load(std::istream &is) {
-    std::map<std::pair<size_t, size_t>, std::pair<CValue, std::shared_ptr<Node>>> tmp;
+    auto next = std::make_shared<CSnapshot>();
+    if (!loadVersion(is, *next)) {
+        return false;
+    }
+    replace(std::move(next));
+    propagate();
+    return true;
+}
+
+void CSpreadsheet::replace(std::shared_ptr<CSnapshot> next) {
+    std::lock_guard lock(writeMutex);
+    recordReplace(*next);
+    install(std::move(next));
+    compactJournal(true);
+    replaced = true;
+}
+
+bool CSpreadsheet::loadVersion(std::istream &is, CSnapshot &version) const {
+    CCellMap &tmp = version.sheet;
     while (!is.eof()) {
         size_t row, col;
         if (!(is >> row >> col)) {
@@ -131,7 +530,7 @@ bool CSpreadsheet::load(std::istream &is) {
             return false;
         }
         std::string res;
-        ExpressionBuilder builder;
+        ExpressionBuilder builder = makeBuilder();
         switch (index) {
             case 1:
                 double number;
@@ -141,143 +540,538 @@ bool CSpreadsheet::load(std::istream &is) {
                 tmp[{row, col}] = std::make_pair(CValue(number), nullptr);
                 break;
             case 2:
-                res.reserve(len + 2);
+                res.resize(len);
                 is.ignore(1);
-                is.get(res.data(), len + 1, EOF);
+                if (!is.read(res.data(), static_cast<std::streamsize>(len))) {
+                    return false;
+                }
+                if (res.empty() || res[0] != '=') {
+                    // a text is stored without an expression, as setCell stores it
+                    tmp[{row, col}] = std::make_pair(CValue(std::move(res)), nullptr);
+                    break;
+                }
                 try {
-                    parseExpression(res.data(), builder);
+                    CFormulaParser::parse(res, builder);
                 }
                 catch (const std::exception &e) {
                     return false;
                 }
-                tmp[{row, col}] = std::make_pair(CValue(res.data()), builder.getAST());
+                tmp[{row, col}] = std::make_pair(CValue(CFormulaText::toRelative(res, row, col)),
+                                                 builder.getAST());
                 break;
             default:
                 return false;
         }
         is >> std::ws;
     }
-    sheet.clear();
-    sheet = tmp;
     return !is.fail();
 }
 
-void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
-    std::map<std::pair<size_t, size_t>, std::pair<CValue, std::shared_ptr<Node>>> tmp;
+bool CSpreadsheet::saveCompact(std::ostream &os) const {
+    std::shared_ptr<const CSnapshot> version = snapshot();
+    std::unordered_map<std::string, size_t> dictionary;
+    std::string formulas;
+    std::string cells;
+    size_t count = 0;
+    std::pair<size_t, size_t> prev{0, 0};
+    for (const auto &[key, cell]: version->getCells()) {
+        if (cell.first.index() == 0) {
+            continue;
+        }
+        size_t rowDelta = key.first - prev.first;
+        CCompressor::putVarint(cells, rowDelta);
+        CCompressor::putVarint(cells, rowDelta ? key.second : key.second - prev.second);
+        prev = key;
+        ++count;
+        if (std::holds_alternative<double>(cell.first)) {
+            double number = std::get<double>(cell.first);
+            if (std::trunc(number) == number && std::fabs(number) < 0x1p53 && !(number == 0 && std::signbit(number))) {
+                auto integer = static_cast<int64_t>(number);
+                cells += static_cast<char>(COMPACT_INTEGER);
+                CCompressor::putVarint(cells, (static_cast<uint64_t>(integer) << 1) ^ static_cast<uint64_t>(integer >> 63));
+            } else {
+                uint64_t bits;
+                std::memcpy(&bits, &number, sizeof(bits));
+                cells += static_cast<char>(COMPACT_DOUBLE);
+                for (int i = 0; i < 8; ++i) {
+                    cells += static_cast<char>(bits >> (8 * i));
+                }
+            }
+            continue;
+        }
+        const std::string &text = std::get<std::string>(cell.first);
+        if (!text.empty() && text[0] == '=') {
+            // formulas are stored in relative form already
+            auto [it, inserted] = dictionary.try_emplace(text, dictionary.size());
+            if (inserted) {
+                CCompressor::putVarint(formulas, it->first.length());
+                formulas += it->first;
+            }
+            cells += static_cast<char>(COMPACT_FORMULA);
+            CCompressor::putVarint(cells, it->second);
+        } else {
+            cells += static_cast<char>(COMPACT_TEXT);
+            CCompressor::putVarint(cells, text.length());
+            cells += text;
+        }
+    }
+    std::string payload;
+    payload.reserve(formulas.size() + cells.size() + 20);
+    CCompressor::putVarint(payload, dictionary.size());
+    payload += formulas;
+    CCompressor::putVarint(payload, count);
+    payload += cells;
+    std::string header(COMPACT_MAGIC);
+    CCompressor::putVarint(header, payload.size());
+    CCompressor::putVarint(header, CCompressor::checksum(payload));
+    os << header << CCompressor::compress(payload);
+    return os.good();
+}
+
+bool CSpreadsheet::loadCompact(std::istream &is) {
+    std::string data{std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+    std::string_view magic = COMPACT_MAGIC;
+    if (data.compare(0, magic.size(), magic) != 0) {
+        return false;
+    }
+    size_t pos = magic.size();
+    uint64_t rawSize, checksum;
+    std::string payload;
+    if (!CCompressor::getVarint(data, pos, rawSize) || !CCompressor::getVarint(data, pos, checksum)
+        || !CCompressor::decompress(std::string_view(data).substr(pos), payload)
+        || payload.size() != rawSize || CCompressor::checksum(payload) != checksum) {
+        return false;
+    }
+    pos = 0;
+    uint64_t formulaCount, count, len;
+    if (!CCompressor::getVarint(payload, pos, formulaCount)) {
+        return false;
+    }
+    std::vector<std::string_view> formulas;
+    for (uint64_t i = 0; i < formulaCount; ++i) {
+        if (!CCompressor::getVarint(payload, pos, len) || len > payload.size() - pos) {
+            return false;
+        }
+        formulas.push_back(std::string_view(payload).substr(pos, len));
+        pos += len;
+    }
+    if (!CCompressor::getVarint(payload, pos, count)) {
+        return false;
+    }
+    auto next = std::make_shared<CSnapshot>();
+    std::pair<size_t, size_t> key{0, 0};
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t rowDelta, column, value;
+        if (!CCompressor::getVarint(payload, pos, rowDelta) || !CCompressor::getVarint(payload, pos, column)
+            || pos >= payload.size()) {
+            return false;
+        }
+        key = rowDelta ? std::make_pair(key.first + rowDelta, column) : std::make_pair(key.first, key.second + column);
+        CCell cell;
+        switch (static_cast<uint8_t>(payload[pos++])) {
+            case COMPACT_INTEGER: {
+                if (!CCompressor::getVarint(payload, pos, value)) {
+                    return false;
+                }
+                auto integer = static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+                cell = std::make_pair(CValue(static_cast<double>(integer)), nullptr);
+                break;
+            }
+            case COMPACT_DOUBLE: {
+                if (payload.size() - pos < 8) {
+                    return false;
+                }
+                uint64_t bits = 0;
+                for (int j = 0; j < 8; ++j) {
+                    bits |= static_cast<uint64_t>(static_cast<uint8_t>(payload[pos++])) << (8 * j);
+                }
+                double number;
+                std::memcpy(&number, &bits, sizeof(number));
+                cell = std::make_pair(CValue(number), nullptr);
+                break;
+            }
+            case COMPACT_TEXT:
+                if (!CCompressor::getVarint(payload, pos, len) || len > payload.size() - pos) {
+                    return false;
+                }
+                cell = std::make_pair(CValue(payload.substr(pos, len)), nullptr);
+                pos += len;
+                break;
+            case COMPACT_FORMULA: {
+                if (!CCompressor::getVarint(payload, pos, value) || value >= formulas.size()) {
+                    return false;
+                }
+                std::shared_ptr<Node> ast = parseFormula(CFormulaText::fromRelative(formulas[value], key.first,
+                                                                                   key.second));
+                if (!ast) {
+                    return false;
+                }
+                cell = std::make_pair(CValue(std::string(formulas[value])), std::move(ast));
+                break;
+            }
+            default:
+                return false;
+        }
+        next->sheet.append(key, std::move(cell));
+    }
+    if (pos != payload.size()) {
+        return false;
+    }
+    replace(std::move(next));
+    propagate();
+    return true;
+}
+
+bool CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
+    {
+        std::lock_guard lock(writeMutex);
+        if (journal && !journal->appendCopy(dst.getRow(), dst.getColumn(), src.getRow(), src.getColumn(), w, h)) {
+            return false;
+        }
+        auto changes = copyCells(dst.getRow(), dst.getColumn(), src.getRow(), src.getColumn(), w, h);
+        if (history.enabled()) {
+            history.record(prior(changes));
+        }
+        commit(std::move(changes));
+        compactJournal(false);
+    }
+    deliver();
+    propagate();
+    return true;
+}
+
+std::vector<std::pair<std::pair<size_t, size_t>, CCell>> CSpreadsheet::copyCells(size_t dstRow, size_t dstCol,
+                                                                                   size_t srcRow, size_t srcCol,
+                                                                                   int w, int h) const {
+    const CCellMap &sheet = current->sheet;
+    std::map<std::pair<size_t, size_t>, CCell> tmp;
     for (int i = 0; i < h; ++i) {
         for (int j = 0; j < w; ++j) {
-            ExpressionBuilder builder;
-            auto it = sheet.find({src.getRow() + i, src.getColumn() + j});
+            ExpressionBuilder builder = makeBuilder();
+            auto it = sheet.find({srcRow + i, srcCol + j});
             if (it != sheet.end()) {
                 if (std::holds_alternative<std::string>(it->second.first)) {
                     if (!std::get<std::string>(it->second.first).empty() &&
                         std::get<std::string>(it->second.first)[0] == '=') {
-                        std::string res = processExpression(std::get<std::string>(it->second.first),
-                                                            dst.getColumn() - src.getColumn(),
-                                                            dst.getRow() - src.getRow());
-                        parseExpression(res, builder);
-                        tmp[{dst.getRow() + i, dst.getColumn() + j}] = std::make_pair(res, builder.getAST());
+                        // the relative form of a copied formula stays the same
+                        const std::string &relative = std::get<std::string>(it->second.first);
+                        std::string res = CFormulaText::fromRelative(relative, dstRow + i, dstCol + j);
+                        std::shared_ptr<Node> ast;
+                        try {
+                            CFormulaParser::parse(res, builder);
+                            ast = builder.getAST();
+                        }
+                        catch (const std::invalid_argument &e) {
+                            // another sheet of a workbook this copy of a sheet has left, the copy reads it like
+                            // the original does, through a sheet that is gone
+                            ExpressionBuilder detached([](const std::string &) {
+                                return std::make_shared<const CSpreadsheet>();
+                            });
+                            CFormulaParser::parse(res, detached);
+                            ast = detached.getAST();
+                        }
+                        // a reference copied off the sheet is #REF!, which no longer moves with the cell
+                        bool lost = res.find(CFormulaText::INVALID_REF) != std::string::npos;
+                        tmp[{dstRow + i, dstCol + j}] = std::make_pair(
+                                lost ? CFormulaText::toRelative(res, dstRow + i, dstCol + j) : relative, ast);
                     } else {
-                        tmp[{dst.getRow() + i, dst.getColumn() + j}] = std::make_pair(it->second.first, nullptr);
+                        tmp[{dstRow + i, dstCol + j}] = std::make_pair(it->second.first, nullptr);
                     }
                 } else if (std::holds_alternative<double>(it->second.first)) {
-                    tmp[{dst.getRow() + i, dst.getColumn() + j}] = std::make_pair(it->second.first, nullptr);
+                    tmp[{dstRow + i, dstCol + j}] = std::make_pair(it->second.first, nullptr);
                 } else {
-                    tmp[{dst.getRow() + i, dst.getColumn() + j}] = std::make_pair(CValue(), nullptr);
+                    tmp[{dstRow + i, dstCol + j}] = std::make_pair(CValue(), nullptr);
                 }
             } else {
-                tmp[{dst.getRow() + i, dst.getColumn() + j}] = std::make_pair(CValue(), nullptr);
+                tmp[{dstRow + i, dstCol + j}] = std::make_pair(CValue(), nullptr);
             }
         }
     }
-    for (const auto &pos: tmp) {
-        sheet[pos.first] = pos.second;
+    return {tmp.begin(), tmp.end()};
+}
+
+CHistory::CStep CSpreadsheet::prior(const std::vector<std::pair<std::pair<size_t, size_t>, CCell>> &changes) const {
+    CHistory::CStep step;
+    step.cells.reserve(changes.size());
+    for (const auto &change: changes) {
+        auto it = current->sheet.find(change.first);
+        if (it != current->sheet.end()) {
+            step.cells.emplace_back(change.first, it->second);
+        } else {
+            step.cells.emplace_back(change.first, CCell());
+        }
     }
+    return step;
 }
 
-std::string CSpreadsheet::numberToString(size_t number) const {
-    std::string result;
+void CSpreadsheet::recordReplace(const CSnapshot &next) {
+    if (!history.enabled()) {
+        return;
+    }
+    CHistory::CStep step;
+    step.replace = true;
+    // both maps are ordered, so they are merged in one pass
+    auto it = current->sheet.begin();
+    auto other = next.sheet.begin();
+    while (it != current->sheet.end() || other != next.sheet.end()) {
+        if (other == next.sheet.end() || (it != current->sheet.end() && it->first < other->first)) {
+            step.cells.emplace_back(it->first, it->second);
+            ++it;
+        } else if (it == current->sheet.end() || other->first < it->first) {
+            step.cells.emplace_back(other->first, CCell());
+            ++other;
+        } else {
+            if (it->second.first != other->second.first) {
+                step.cells.emplace_back(it->first, it->second);
+            }
+            ++it;
+            ++other;
+        }
+    }
+    history.record(std::move(step));
+}
+
+bool CSpreadsheet::undo() {
+    return restore(false);
+}
+
+bool CSpreadsheet::redo() {
+    return restore(true);
+}
 
-    while (number > 0) {
-        int remainder = (number - 1) % 26;
-        char digit = 'A' + remainder;
-        result = digit + result;
-        number = (number - 1) / 26;
+void CSpreadsheet::setHistoryLimit(size_t bytes) {
+    std::lock_guard lock(writeMutex);
+    history.setLimit(bytes);
+}
+
+bool CSpreadsheet::restore(bool redo) {
+    {
+        std::lock_guard lock(writeMutex);
+        CHistory::CStep step;
+        if (!history.take(redo, step)) {
+            return false;
+        }
+        CHistory::CStep inverse = prior(step.cells);
+        inverse.replace = step.replace;
+        if (step.replace) {
+            auto next = std::make_shared<CSnapshot>();
+            next->sheet = current->sheet;
+            for (const auto &[key, cell]: step.cells) {
+                if (cell.first.index() == 0) {
+                    next->sheet.erase(key);
+                } else {
+                    next->sheet[key] = cell;
+                }
+            }
+            // the restored sheet is saved before it is installed, so a failure leaves the sheet and the step as they were
+            if (journal && !journal->compact([this, &next](std::ostream &os) { return saveVersion(*next, os); })) {
+                history.store(redo, std::move(step));
+                return false;
+            }
+            install(std::move(next));
+            replaced = true;
+        } else {
+            if (!journalCells(step.cells)) {
+                history.store(redo, std::move(step));
+                return false;
+            }
+            commit(std::move(step.cells));
+            compactJournal(false);
+        }
+        history.store(!redo, std::move(inverse));
     }
+    deliver();
+    propagate();
+    return true;
+}
+
+bool CSpreadsheet::insertRows(size_t row, size_t count) {
+    return relocate({false, true, row, count});
+}
+
+bool CSpreadsheet::deleteRows(size_t row, size_t count) {
+    return relocate({false, false, row, count});
+}
 
-    return result;
+bool CSpreadsheet::insertColumns(size_t column, size_t count) {
+    return relocate({true, true, column, count});
 }
 
-size_t CSpreadsheet::calculateCol(const std::string &str) const {
-    size_t value = 0;
-    for (const char &x: str) {
-        char c = std::tolower(x);
-        value = value * 26 + (c - 'a' + 1);
+bool CSpreadsheet::deleteColumns(size_t column, size_t count) {
+    return relocate({true, false, column, count});
+}
+
+bool CSpreadsheet::relocate(const CRelocation &relocation) {
+    if (!relocation.count) {
+        return true;
+    }
+    {
+        std::lock_guard lock(writeMutex);
+        if (journal && !journal->appendRelocate(relocation)) {
+            return false;
+        }
+        relocateCells(relocation);
+        compactJournal(false);
+    }
+    deliver();
+    if (workbook) {
+        workbook->relocate(*this, relocation);
     }
-    return value;
+    propagate();
+    return true;
 }
 
-std::string CSpreadsheet::processExpression(const std::string &str, int w, int h) const {
-    std::string res = "=";
-    res.reserve(str.length() + 1);
-    try {
-        for (size_t i = 1; i < str.length(); ++i) {
-            if (str.at(i) == '\"') {
-                do {
-                    res += str.at(i);
-                    ++i;
-                } while (i < str.length() && str.at(i) != '\"');
-                --i;
-                continue;
-            } else if (str.at(i) == '\'') {
-                do {
-                    res += str.at(i);
-                    ++i;
-                } while (i < str.length() && str.at(i) != '\'');
-                --i;
-                continue;
-            } else if (isdigit(str.at(i))) {
-                do {
-                    res += str.at(i);
-                    ++i;
-                } while (i < str.length() && (isdigit(str.at(i)) || str.at(i) == 'e' || str.at(i) == 'E'));
-                --i;
-                continue;
-            } else if (str.at(i) == '$' || isalpha(str.at(i))) {
-                if (str.at(i) == '$') {
-                    do {
-                        res += str.at(i);
-                        ++i;
-                    } while (i < str.length() && isalpha(str.at(i)));
-                } else {
-                    std::string buffer;
-                    do {
-                        buffer += str.at(i);
-                        ++i;
-                    } while (i < str.length() && isalpha(str.at(i)));
-                    res += numberToString(calculateCol(buffer) + w);
+void CSpreadsheet::relocateCells(const CRelocation &relocation) {
+    ++writers;
+    if (beginInPlace()) {
+        current->relocate(relocation);
+        ++current->epoch;
+        endInPlace();
+    } else {
+        auto next = std::make_shared<CSnapshot>(*current);
+        next->relocate(relocation);
+        next->epoch = current->epoch + 1;
+        publish(std::move(next));
+    }
+    --writers;
+    if (recalcWorker) {
+        recalcWorker->discard();
+    }
+    history.clear();
+    replaced = true;
+}
+
+void CSpreadsheet::relocateLinks(const CRelocation &relocation, const std::string &name) {
+    {
+        std::lock_guard lock(writeMutex);
+        auto links = current->links.find(relocation.source);
+        if (links == current->links.end()) {
+            return;
+        }
+        std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes;
+        links->second.forEachFormula({0, 0, SIZE_MAX, SIZE_MAX},
+                                     [this, &relocation, &name, &changes](const std::pair<size_t, size_t> &key) {
+            const CCell &cell = current->sheet.at(key);
+            std::shared_ptr<Node> ast = cell.second->relocate(relocation);
+            if (!ast) {
+                return;
+            }
+            std::string text = CFormulaText::fromRelative(std::get<std::string>(cell.first), key.first, key.second);
+            text = CFormulaText::toRelative(CFormulaText::relocate(text, relocation, name), key.first, key.second);
+            changes.emplace_back(key, std::make_pair(std::move(text), std::move(ast)));
+        });
+        if (changes.empty()) {
+            return;
+        }
+        std::sort(changes.begin(), changes.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        // links the journal cannot record stay as they are, as recover would leave them
+        if (!journalCells(changes)) {
+            return;
+        }
+        if (history.enabled()) {
+            history.record(prior(changes));
+        }
+        commit(std::move(changes));
+        compactJournal(false);
+    }
+    deliver();
+    propagate();
+}
+
+bool CSpreadsheet::attachJournal(const std::string &snapshotPath, const std::string &journalPath,
+                                 size_t compactEvery) {
+    std::lock_guard lock(writeMutex);
+    journal = std::make_unique<CJournal>(snapshotPath, journalPath, compactEvery);
+    if (!compactJournal(true)) {
+        journal.reset();
+        return false;
+    }
+    return true;
+}
+
+void CSpreadsheet::detachJournal() {
+    std::lock_guard lock(writeMutex);
+    journal.reset();
+}
+
+bool CSpreadsheet::recover(const std::string &snapshotPath, const std::string &journalPath, size_t compactEvery) {
+    std::unique_lock lock(writeMutex);
+    journal = std::make_unique<CJournal>(snapshotPath, journalPath, compactEvery);
+    bool loaded = journal->recover(
+            [this](std::istream &is) {
+                auto next = std::make_shared<CSnapshot>();
+                if (is.peek() != EOF && !loadVersion(is, *next)) {
+                    return false;
                 }
-                if (str.at(i) == '$') {
-                    do {
-                        res += str.at(i);
-                        ++i;
-                    } while (i < str.length() && isdigit(str.at(i)));
+                install(std::move(next));
+                return true;
+            },
+            [this](const CJournal::CRecord &record) {
+                if (record.operation == CJournal::OP_SET) {
+                    CCell cell;
+                    if (parseCell(record.contents, record.row, record.column, cell)) {
+                        std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes;
+                        changes.emplace_back(std::make_pair(record.row, record.column), std::move(cell));
+                        commit(std::move(changes));
+                    }
+                } else if (record.operation == CJournal::OP_CLEAR) {
+                    std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes;
+                    changes.emplace_back(std::make_pair(record.row, record.column), CCell());
+                    commit(std::move(changes));
+                } else if (record.operation == CJournal::OP_RELOCATE) {
+                    relocateCells(record.relocation);
                 } else {
-                    std::string buffer;
-                    do {
-                        buffer += str.at(i);
-                        ++i;
-                    } while (i < str.length() && isdigit(str.at(i)));
-                    res += std::to_string(std::stoi(buffer) + h);
+                    commit(copyCells(record.row, record.column, record.srcRow, record.srcColumn, record.w, record.h));
                 }
-                --i;
-                continue;
-            } else {
-                res += str.at(i);
-            }
+            });
+    // a recovered sheet replaces the old one like load does, its records are not reported
+    notifications.clear();
+    exported.clear();
+    history.clear();
+    replaced = true;
+    // rewriting the snapshot also drops a torn record at the end of the journal
+    bool compacted = loaded && compactJournal(true);
+    if (!compacted) {
+        journal.reset();
+    }
+    lock.unlock();
+    propagate();
+    return compacted;
+}
+
+bool CSpreadsheet::checkpoint() {
+    std::lock_guard lock(writeMutex);
+    return journal && compactJournal(true);
+}
+
+bool CSpreadsheet::journalCells(const std::vector<std::pair<std::pair<size_t, size_t>, CCell>> &cells) {
+    if (!journal) {
+        return true;
+    }
+    for (const auto &[key, cell]: cells) {
+        bool written;
+        if (std::holds_alternative<std::string>(cell.first)) {
+            const std::string &text = std::get<std::string>(cell.first);
+            written = journal->appendSet(key.first, key.second,
+                                         cell.second ? CFormulaText::fromRelative(text, key.first, key.second) : text);
+        } else if (std::holds_alternative<double>(cell.first)) {
+            // the shortest text reading back as the same number
+            char text[32];
+            auto end = std::to_chars(text, text + sizeof(text), std::get<double>(cell.first)).ptr;
+            written = journal->appendSet(key.first, key.second, std::string(text, end));
+        } else {
+            written = journal->appendClear(key.first, key.second);
+        }
+        if (!written) {
+            return false;
         }
     }
-    catch (const std::exception &e) {
+    return true;
+}
+
+bool CSpreadsheet::compactJournal(bool force) {
+    if (!journal || !(force || journal->needsCompaction())) {
+        return true;
     }
-    return res;
-}
\ No newline at end of file
+    return journal->compact([this](std::ostream &os) { return saveVersion(*current, os); });
+}
@@ -34,8 +34,15 @@
 #include <charconv>
 #include <span>
 #include <utility>
+#include <mutex>
+#include <atomic>
 #include "CPos.h"
 #include "Node.h"
+#include "CSnapshot.h"
+#include "CJournal.h"
+#include "CRelocation.h"
+#include "CRecalcWorker.h"
+#include "CHistory.h"
 
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
@@ -47,8 +54,27 @@ constexpr unsigned SPREADSHEET_SPEED = 0x08;
 constexpr unsigned SPREADSHEET_PARSER = 0x10;
 
 class Node;
+class CWorkbook;
+class ExpressionBuilder;
+
+/** @brief A cell whose computed value changed, see CSpreadsheet::subscribe().
+ */
+struct CChange {
+    size_t row;
+    size_t column;
+    CValue value;
+};
+
+using CChangeCallback = std::function<void(const std::vector<CChange> &)>;
 
 /** @brief The CSpreadsheet class represents a spreadsheet.
+ *
+ * The contents are kept in versions (CSnapshot). Readers pin the current
+ * version by an atomic load and evaluate against it without locks, writers
+ * are serialized and publish a new version atomically. A version is modified
+ * in place only when nobody has it pinned, otherwise the writer works on a
+ * copy, so readers always see a consistent state. A reader arriving while a
+ * version is modified in place waits for that one write.
  */
 class CSpreadsheet {
 public:
@@ -60,11 +86,12 @@ public:
      */
     CSpreadsheet();
     /**  @brief creates a new spreadsheet
-     * copy-constructor
+     * copy-constructor, the copy starts with an empty history
      * @param other [in] other spreadsheet
      */
     CSpreadsheet(const CSpreadsheet &other);
     /** @brief overloads operator =
+     * The history of this sheet is dropped.
      * @param other [in] other spreadsheet
      * @return spreadsheet
      */
@@ -86,6 +113,27 @@ public:
      */
     bool save(std::ostream &os) const;
 
+    /**
+     * @brief saves a spreadsheet into stream in the compact binary format
+     *
+     * Cells are written in row-major order with delta-encoded coordinates,
+     * formulas go into a dictionary in relative form (so formulas copied by
+     * copyRect are stored once), numbers are packed in binary and the whole
+     * result is compressed by CCompressor and protected by a checksum.
+     *
+     * @param os [in] stream to save spreadsheet into.
+     * @return bool True if saving is successful, false otherwise.
+     */
+    bool saveCompact(std::ostream &os) const;
+
+    /**
+     * @brief loads a spreadsheet saved by saveCompact
+     *
+     * @param is [in] stream to load spreadsheet from.
+     * @return bool True if loading is successful, false otherwise.
+     */
+    bool loadCompact(std::istream &is);
+
     /**
      * @brief sets value of a cell in given position
      *
@@ -99,19 +147,214 @@ public:
     /**
      * @brief returns a value on given position
      *
+     * Evaluates against the current version, any number of threads may call it
+     * concurrently, also while a write is in progress.
+     *
      * @param pos [in] position in the sheet.
      * @return CValue, Value of a given position.
      */
-    CValue getValue(CPos pos);
+    CValue getValue(CPos pos) const;
+
+    /**
+     * @brief returns values of a rectangle
+     *
+     * All formulas of the rectangle and the formulas they read are evaluated
+     * once, in dependency order, against one version of the sheet.
+     *
+     * @param topLeft [in] top left corner of the rectangle
+     * @param w [in] width of the rectangle
+     * @param h [in] height of the rectangle
+     * @return std::vector<std::vector<CValue>> h rows of w values, empty if w or h is not positive.
+     */
+    std::vector<std::vector<CValue>> getValues(CPos topLeft, int w, int h) const;
 
     /**
-     * @brief returns a value on given position, needed for cyclic dependencies.
+     * @brief returns a value on given position unless the budget runs out first
+     *
+     * A request thread can bound a read of a cell with a large upstream cone
+     * by a deadline, or cancel it from another thread. The formulas computed
+     * before the budget ran out stay in the value cache, so a repeated call
+     * resumes instead of starting over, unless a write has replaced them.
      *
      * @param pos [in] position in the sheet.
-     * @param positions [in] already visited positions.
-     * @return CValue, Value of a given position.
+     * @param value [out] value of the position, untouched when not ready
+     * @param budget [in] deadline and cancellation token
+     * @return CEvalStatus READY if the value is computed, NOT_READY if the budget ran out.
      */
-    CValue getValueRec(CPos pos, std::set<std::string> &positions);
+    CEvalStatus getValue(CPos pos, CValue &value, const CBudget &budget) const;
+
+    /**
+     * @brief returns values of a rectangle unless the budget runs out first
+     *
+     * @param topLeft [in] top left corner of the rectangle
+     * @param w [in] width of the rectangle
+     * @param h [in] height of the rectangle
+     * @param values [out] h rows of w values, untouched when not ready
+     * @param budget [in] deadline and cancellation token
+     * @return CEvalStatus READY if the values are computed, NOT_READY if the budget ran out.
+     */
+    CEvalStatus getValues(CPos topLeft, int w, int h, std::vector<std::vector<CValue>> &values,
+                          const CBudget &budget) const;
+
+    /**
+     * @brief pins the current version of the sheet
+     *
+     * The returned version stays unchanged for as long as it is held, later
+     * writes are published as new versions.
+     *
+     * @return std::shared_ptr<const CSnapshot> pinned version.
+     */
+    std::shared_ptr<const CSnapshot> snapshot() const;
+
+    /**
+     * @brief enables or disables the range index
+     *
+     * The index keeps sums and counts of numbers and texts, so range functions
+     * over large rectangles do not visit every cell. It costs memory and a
+     * little time on every write, it is enabled by default.
+     *
+     * @param enable [in] true to build the index, false to drop it
+     */
+    void setRangeIndex(bool enable);
+
+    /**
+     * @brief adds, changes or drops the index of the values of a column
+     *
+     * match, xlookup and lookup over a range of an indexed column search the
+     * index instead of the cells. It holds literals and the computed values of
+     * formulas, a formula is evaluated by the first lookup after a write its
+     * value depends on. A HASH index finds equal values, a SORTED one also
+     * serves lookup. Indexed columns move with inserted and deleted columns.
+     *
+     * @param column [in] column, 1 for A
+     * @param kind [in] kind of the index, NONE to drop it
+     */
+    void setColumnIndex(size_t column, CIndexKind kind);
+
+    /**
+     * @brief enables or disables tracing of evaluations
+     *
+     * While enabled, every formula evaluated on read or by recalculation is
+     * timed by CTracer, see traceReport(). Enabling starts a new trace,
+     * disabling keeps the recorded one for the report. It is disabled by
+     * default, a disabled tracer costs one null check per evaluation.
+     *
+     * @param enable [in] true to start a trace, false to stop it
+     */
+    void setTracing(bool enable);
+
+    /**
+     * @brief summarizes the last trace
+     *
+     * @param heaviest [in] number of the heaviest cells to be reported
+     * @return CTraceReport the cells with the largest self time and the critical path, empty if nothing was traced.
+     */
+    CTraceReport traceReport(size_t heaviest = 20) const;
+
+    /**
+     * @brief writes the summary of the last trace in the Chrome trace event format
+     *
+     * The file can be opened in chrome://tracing or Perfetto.
+     *
+     * @param os [in] stream to write the JSON into
+     * @param heaviest [in] number of the heaviest cells to be written
+     * @return bool True if writing is successful, false otherwise.
+     */
+    bool saveTrace(std::ostream &os, size_t heaviest = 20) const;
+
+    /**
+     * @brief enables or disables recalculation on a background thread
+     *
+     * When enabled, setCell and copyRect return right after the write and the
+     * formulas depending on the modified cells are evaluated into the value
+     * cache by CRecalcWorker. getValue does not wait for it, a cell that is
+     * not recalculated yet is evaluated on demand together with the cells it
+     * reads. It is disabled by default, values are then computed on read only.
+     *
+     * @param enable [in] true to start the worker, false to stop it
+     */
+    void setAsyncRecalc(bool enable);
+
+    /**
+     * @brief future of the background recalculation of all writes made so far
+     *
+     * @return std::shared_future<void> completes once they are recalculated, ready when the mode is disabled,
+     * get() rethrows a failure of resources (e.g. std::bad_alloc) that ended the recalculation.
+     */
+    std::shared_future<void> recalculation();
+
+    /**
+     * @brief waits until the background recalculation has nothing to do
+     */
+    void waitIdle();
+
+    /**
+     * @brief evaluates all formulas into the value cache in worker processes
+     *
+     * The formulas are split into regions evaluated by CProcessEvaluator in
+     * forked processes, the values are merged into the current version. Writes
+     * wait until it is done and the background recalculation is stopped
+     * meanwhile, its queued cells are evaluated with the rest. Other threads
+     * should not read the sheet or the workbook meanwhile, a worker stuck on a
+     * lock they held is killed after CProcessEvaluator::STALL.
+     *
+     * @param processes [in] number of worker processes
+     */
+    void recalculateInProcesses(size_t processes);
+
+    /**
+     * @brief registers interest in the values of a rectangle
+     *
+     * After every write (setCell, or copyRect as one batch) the callback gets
+     * the cells of the rectangle whose computed values actually changed, in
+     * row-major order, and is not called when none did. Only the modified
+     * cells and the formulas depending on them are compared, they are found
+     * in the dependency graph. Callbacks run after the write has been
+     * published, on the writing thread unless another thread is calling
+     * callbacks already, which then calls them too, so batches keep the order
+     * of the writes. No lock is held meanwhile, callbacks may read and modify
+     * the sheet, the batches of their own writes follow once they return.
+     * Loading, recovery and assignment replace the whole sheet and are not
+     * reported.
+     *
+     * The watched cells are evaluated on the writing thread before and after
+     * every write that may change them, also when setAsyncRecalc() is
+     * enabled, so a subscription makes such writes recalculate synchronously.
+     * A watched cell failing with CEvalError is compared as undefined, any
+     * other exception (e.g. std::bad_alloc) propagates from the write, before
+     * it is published when the old values are read.
+     *
+     * @param topLeft [in] top left corner of the rectangle
+     * @param w [in] width of the rectangle
+     * @param h [in] height of the rectangle
+     * @param callback [in] function called with the changed cells
+     * @return size_t identifier of the subscription, 0 for an empty rectangle.
+     */
+    size_t subscribe(CPos topLeft, int w, int h, CChangeCallback callback);
+
+    /**
+     * @brief cancels a subscription
+     *
+     * @param id [in] identifier returned by subscribe
+     */
+    void unsubscribe(size_t id);
+
+    /**
+     * @brief estimates the memory used by the current version
+     *
+     * @return CMemoryUsage bytes of cell storage, strings, formula expressions and caches with indexes.
+     */
+    CMemoryUsage memoryUsage() const;
+
+    /**
+     * @brief rebuilds the current version densely
+     *
+     * Cells are copied into a new map in order and texts at their exact length,
+     * the dependency graph and the range index are rebuilt from scratch and
+     * cached values are dropped. Released expression nodes are swept from
+     * CNodePool. Readers holding the old version keep it until they release it.
+     */
+    void compact();
 
     /**
      * @brief copies a rectangle of values into a different place in sheet
@@ -120,39 +363,375 @@ public:
      * @param src [in] position to be copied
      * @param w [in] weight of a rectangle (default 1)
      * @param h [in] height of a rectangle (default 1)
+     * @return bool True if copying is successful, false if the journal could not record it.
      */
-    void copyRect(CPos dst,
+    bool copyRect(CPos dst,
                   CPos src,
                   int w = 1,
                   int h = 1);
 
+    /**
+     * @brief undoes the last setCell, copyRect or load
+     *
+     * Only the cells the edit touched are restored, through the same write
+     * path, so subscriptions, the journal and the other sheets of the workbook
+     * see it as a write. An undone load is published like load. Inserting or
+     * deleting rows or columns, recovery and assignment drop the history.
+     *
+     * @return bool True if an edit was undone, false if there is none or the journal cannot record it.
+     */
+    bool undo();
+
+    /**
+     * @brief redoes the last undone edit
+     *
+     * A new edit drops the edits to redo.
+     *
+     * @return bool True if an edit was redone, false if there is none or the journal cannot record it.
+     */
+    bool redo();
+
+    /**
+     * @brief limits the memory of the undo and redo history
+     *
+     * The history keeps the previous contents of the touched cells only, the
+     * oldest edits are forgotten once their estimated memory exceeds the limit.
+     * An edit larger than the limit cannot be undone. It is 64 MiB by default,
+     * 0 disables the history, so the sheet records nothing.
+     *
+     * @param bytes [in] limit in bytes
+     */
+    void setHistoryLimit(size_t bytes);
+
+    /**
+     * @brief inserts empty rows, the rows from the given one on move down
+     *
+     * References to the moved cells move with them, so formulas keep reading
+     * the same cells. Only formulas whose references moved are rebuilt, the
+     * stored relative form of the others stays. The current version is moved
+     * in place unless a reader holds it, it is published at once, like load,
+     * and is not reported to subscriptions. Formulas of other sheets of the
+     * workbook reading the moved cells are rewritten and committed there like
+     * setCell does it, their journals record them as set cells.
+     *
+     * @param row [in] first inserted row
+     * @param count [in] number of inserted rows
+     * @return bool True if the rows are inserted, false if the journal could not record it.
+     */
+    bool insertRows(size_t row, size_t count = 1);
+
+    /**
+     * @brief deletes rows, the rows below them move up
+     *
+     * References to deleted cells become #REF! and read an undefined value,
+     * ranges shrink and become #REF!:#REF! when all their rows are deleted.
+     *
+     * @param row [in] first deleted row
+     * @param count [in] number of deleted rows
+     * @return bool True if the rows are deleted, false if the journal could not record it.
+     */
+    bool deleteRows(size_t row, size_t count = 1);
+
+    /**
+     * @brief inserts empty columns, the columns from the given one on move right
+     *
+     * @param column [in] first inserted column
+     * @param count [in] number of inserted columns
+     * @return bool True if the columns are inserted, false if the journal could not record it.
+     */
+    bool insertColumns(size_t column, size_t count = 1);
+
+    /**
+     * @brief deletes columns, the columns right of them move left
+     *
+     * @param column [in] first deleted column
+     * @param count [in] number of deleted columns
+     * @return bool True if the columns are deleted, false if the journal could not record it.
+     */
+    bool deleteColumns(size_t column, size_t count = 1);
+
+    /**
+     * @brief starts journaling modifications
+     *
+     * The current sheet is written as the snapshot and the journal starts empty.
+     * Each later setCell/copyRect/insertRows... appends one flushed record, load and assignment
+     * write a new snapshot.
+     *
+     * @param snapshotPath [in] file for full snapshots
+     * @param journalPath [in] file for appended records
+     * @param compactEvery [in] number of records after which the journal is compacted
+     * @return bool True if the journal could be started, false otherwise.
+     */
+    bool attachJournal(const std::string &snapshotPath,
+                       const std::string &journalPath,
+                       size_t compactEvery = 10000);
+
+    /**
+     * @brief stops journaling, files are left as they are
+     */
+    void detachJournal();
+
+    /**
+     * @brief restores the sheet from the last snapshot and the journal and continues journaling
+     *
+     * @param snapshotPath [in] file with the last snapshot
+     * @param journalPath [in] file with records appended after it
+     * @param compactEvery [in] number of records after which the journal is compacted
+     * @return bool True if recovery is successful, false otherwise.
+     */
+    bool recover(const std::string &snapshotPath,
+                 const std::string &journalPath,
+                 size_t compactEvery = 10000);
+
+    /**
+     * @brief compacts the journal into a full snapshot now
+     *
+     * @return bool True if the snapshot was written, false otherwise.
+     */
+    bool checkpoint();
+
 private:
-    std::map<std::pair<size_t, size_t>, std::pair<CValue, std::shared_ptr<Node>>> sheet;
+    friend class CWorkbook;
+
+    static constexpr std::string_view COMPACT_MAGIC = "BIGC\x01";
+    static constexpr uint8_t COMPACT_DOUBLE = 0;
+    static constexpr uint8_t COMPACT_INTEGER = 1;
+    static constexpr uint8_t COMPACT_TEXT = 2;
+    static constexpr uint8_t COMPACT_FORMULA = 3;
+
+    // the current version, guarded by writeMutex
+    std::shared_ptr<CSnapshot> current;
+    // the same version for readers, who load it without locks
+    std::atomic<std::shared_ptr<CSnapshot>> published;
+    // readers about to load published
+    mutable std::atomic<size_t> pinning = 0;
+    // current is being modified in place, readers wait until it is done
+    std::atomic<bool> inPlace = false;
+    std::mutex writeMutex;
+    std::unique_ptr<CJournal> journal;
+    std::atomic<size_t> writers = 0;
+    std::map<size_t, std::pair<CRect, CChangeCallback>> subscriptions;
+    size_t nextSubscription = 1;
+    // changes committed but not delivered yet, guarded by writeMutex
+    std::vector<std::pair<CChangeCallback, std::vector<CChange>>> notifications;
+    // a thread is calling the callbacks, guarded by writeMutex
+    bool delivering = false;
+    // workbook the sheet belongs to, its formulas may read the other sheets
+    CWorkbook *workbook = nullptr;
+    // cells written since the other sheets were told, the whole sheet if replaced, guarded by writeMutex
+    std::vector<std::pair<size_t, size_t>> exported;
+    bool replaced = false;
+    // previous contents of the edited cells, guarded by writeMutex
+    CHistory history;
+    // the last trace, kept after tracing is disabled, guarded by traceMutex
+    std::shared_ptr<const CTracer> trace;
+    mutable std::mutex traceMutex;
+    // declared last, its thread reads the members above until it is stopped
+    std::unique_ptr<CRecalcWorker> recalcWorker;
 
     /**
-     * @brief converts number into a column position
+     * @brief applies changed cells and publishes the result as a new version
      *
-     * @param number [in] number to be converted
-     * @return string column value of a given number.
+     * The caller holds writeMutex.
+     *
+     * @param changes [in] cells to be stored.
+     * @param touched [in] formulas whose values changed with another sheet of the workbook
      */
-    std::string numberToString(size_t number) const;
+    void commit(std::vector<std::pair<std::pair<size_t, size_t>, CCell>> changes,
+                const std::vector<std::pair<size_t, size_t>> &touched = {});
 
     /**
-     * @brief converts string into a column number
+     * @brief drops cached values of formulas reading modified cells of another sheet
      *
-     * @param str [in] string to be converted
-     * @return size_t column value of a given string.
+     * @param cells [in] formulas of this sheet reading the modified cells
      */
-    size_t calculateCol(const std::string &str) const;
+    void refresh(const std::vector<std::pair<size_t, size_t>> &cells);
 
+    /**
+     * @brief tells the other sheets of the workbook about the cells written so far
+     *
+     * The caller must not hold writeMutex.
+     */
+    void propagate();
+
+    /**
+     * @brief creates a builder resolving the other sheets of the workbook
+     */
+    ExpressionBuilder makeBuilder() const;
+
+    /**
+     * @brief calls the callbacks of subscriptions with the committed changes
+     *
+     * Returns at once when another call is delivering, that one delivers the
+     * changes too. The caller must not hold writeMutex.
+     */
+    void deliver();
+
+    /**
+     * @brief makes given version the current one
+     *
+     * The caller holds writeMutex.
+     *
+     * @param next [in] version to be published.
+     */
+    void publish(std::shared_ptr<CSnapshot> next);
+
+    /**
+     * @brief starts modifying the current version in place if nobody holds it
+     *
+     * The caller holds writeMutex. On success, readers wait until endInPlace.
+     *
+     * @return bool True if current may be modified in place, false if it must be copied.
+     */
+    bool beginInPlace();
+
+    /**
+     * @brief lets the readers waiting for an in-place modification load the version
+     */
+    void endInPlace();
+
+    /**
+     * @brief publishes a freshly loaded version
+     *
+     * @param next [in] loaded version, its indexes are built here and it pins the other sheets it reads
+     */
+    void install(std::shared_ptr<CSnapshot> next);
+
+    /**
+     * @brief current versions of other sheets of the workbook for a version of this sheet to pin
+     *
+     * The caller holds writeMutex but does not modify current in place yet, the
+     * other sheets may be waiting for their own in-place modifications.
+     *
+     * @param reads [in] sheets read by the version
+     * @return std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> versions to pin, see CWorkbook::pin.
+     */
+    std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> pins(
+            const std::set<const CSpreadsheet *> &reads) const;
+
+    /**
+     * @brief replaces all cells by a loaded version without telling the other sheets
+     *
+     * @param next [in] loaded version
+     */
+    void replace(std::shared_ptr<CSnapshot> next);
+
+    /**
+     * @brief parses cell contents as setCell does
+     *
+     * A formula is stored in the relative form of CFormulaText::toRelative,
+     * so cells moved or copied with their references keep the same text.
+     *
+     * @param contents [in] contents of the cell
+     * @param row [in] row of the cell
+     * @param column [in] column of the cell
+     * @param cell [out] parsed cell
+     * @return bool True if the contents are valid, false otherwise.
+     */
+    bool parseCell(const std::string &contents, size_t row, size_t column, CCell &cell) const;
+
+    /**
+     * @brief parses the text of a formula
+     *
+     * @param formula [in] formula starting with =
+     * @return std::shared_ptr<Node> expression, nullptr if the formula is not valid.
+     */
+    std::shared_ptr<Node> parseFormula(const std::string &formula) const;
+
+    /**
+     * @brief builds the cells of a copied rectangle, the caller holds writeMutex
+     *
+     * @return changes to be committed.
+     */
+    std::vector<std::pair<std::pair<size_t, size_t>, CCell>> copyCells(size_t dstRow, size_t dstCol,
+                                                                       size_t srcRow, size_t srcCol,
+                                                                       int w, int h) const;
+
+    /**
+     * @brief current contents of the cells to be changed, the caller holds writeMutex
+     *
+     * @param changes [in] cells to be stored
+     * @return CHistory::CStep the cells with their current contents, empty cells included.
+     */
+    CHistory::CStep prior(const std::vector<std::pair<std::pair<size_t, size_t>, CCell>> &changes) const;
+
+    /**
+     * @brief records the cells a loaded version replaces, the caller holds writeMutex
+     *
+     * @param next [in] loaded version, cells with the same contents are skipped
+     */
+    void recordReplace(const CSnapshot &next);
+
+    /**
+     * @brief undoes or redoes a step of the history
+     *
+     * @param redo [in] true to redo, false to undo
+     * @return bool False if there is no step.
+     */
+    bool restore(bool redo);
+
+    /**
+     * @brief inserts or deletes rows or columns, journals it and publishes the result
+     *
+     * @param relocation [in] inserted or deleted rows or columns
+     * @return bool False if the journal could not record it, the sheet is then left as it was.
+     */
+    bool relocate(const CRelocation &relocation);
+
+    /**
+     * @brief moves cells and their references, the caller holds writeMutex
+     *
+     * The current version is moved in place when nobody else holds it,
+     * otherwise the moved cells go into a new version.
+     *
+     * @param relocation [in] inserted or deleted rows or columns
+     */
+    void relocateCells(const CRelocation &relocation);
+
+    /**
+     * @brief moves references of the formulas into another relocated sheet of the workbook
+     *
+     * The changed formulas are journaled and committed as setCell commits them.
+     * The caller must not hold writeMutex.
+     *
+     * @param relocation [in] inserted or deleted rows or columns of relocation.source
+     * @param name [in] name of the relocated sheet
+     */
+    void relocateLinks(const CRelocation &relocation, const std::string &name);
+
+    /**
+     * @brief writes a version in the save format
+     *
+     * @param version [in] version to be written
+     * @param os [in] stream to save it into
+     * @return bool True if saving is successful, false otherwise.
+     */
+    static bool saveVersion(const CSnapshot &version, std::ostream &os);
+
+    /**
+     * @brief reads cells in the save format into a version
+     *
+     * @param is [in] stream to load from
+     * @param version [out] version to fill
+     * @return bool True if loading is successful, false otherwise.
+     */
+    bool loadVersion(std::istream &is, CSnapshot &version) const;
+
+    /**
+     * @brief compacts the journal if there is one, the caller holds writeMutex
+     *
+     * @param force [in] compact even below the threshold
+     * @return bool False if compaction failed.
+     */
+    bool compactJournal(bool force);
 
     /**
-     * @brief converts string into a column number
+     * @brief appends a record per cell to the journal if there is one, the caller holds writeMutex
      *
-     * @param str [in] string to be converted
-     * @return size_t column value of a given string.
+     * @param cells [in] cells with the contents they get, an empty cell is cleared
+     * @return bool False if a record could not be written.
      */
-    std::string processExpression(const std::string &str, int w, int h) const;
+    bool journalCells(const std::vector<std::pair<std::pair<size_t, size_t>, CCell>> &cells);
 };
 
 #endif // CSPREADSHEET_H
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include "CTracer.h"
+#include "CSnapshot.h"
+#include "CFormulaText.h"
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <unordered_set>
+
+namespace {
+    /** @brief Evaluation being timed by a CScope of this thread.
+     */
+    struct CTiming {
+        CTracer::CClock::time_point start;
+        // time of the cells evaluated meanwhile
+        CTracer::CClock::duration children{};
+    };
+
+    thread_local std::vector<CTiming> timings;
+
+    constexpr std::pair<size_t, size_t> NO_CELL{SIZE_MAX, SIZE_MAX};
+
+    double seconds(CTracer::CClock::duration duration) {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    /**
+     * @brief formulas a formula reads in its own sheet
+     */
+    std::vector<std::pair<size_t, size_t>> readFormulas(const CCellMap &sheet, const CDependencyGraph &graph,
+                                                        const std::pair<size_t, size_t> &key) {
+        std::vector<std::pair<size_t, size_t>> result;
+        auto it = sheet.find(key);
+        if (it == sheet.end() || !it->second.second) {
+            return result;
+        }
+        CPrecedents precedents;
+        it->second.second->precedents(precedents);
+        for (const auto &cell: precedents.cells) {
+            auto read = sheet.find(cell);
+            if (read != sheet.end() && read->second.second) {
+                result.push_back(cell);
+            }
+        }
+        for (const auto &rect: precedents.ranges) {
+            graph.forEachFormula(rect, [&result](const std::pair<size_t, size_t> &cell) {
+                result.push_back(cell);
+            });
+        }
+        return result;
+    }
+}
+
+CTracer::CScope::CScope(const CTracer *tracer, const CKey &key) : tracer(tracer), key(key) {
+    if (tracer) {
+        timings.push_back({CClock::now()});
+    }
+}
+
+CTracer::CScope::~CScope() {
+    if (!tracer) {
+        return;
+    }
+    CTiming timing = timings.back();
+    timings.pop_back();
+    CClock::duration total = CClock::now() - timing.start;
+    if (!timings.empty()) {
+        timings.back().children += total;
+    }
+    tracer->record(key, total, total - timing.children);
+}
+
+void CTracer::record(const CKey &key, CClock::duration total, CClock::duration self) const {
+    std::lock_guard lock(mutex);
+    CStats &cell = stats[key];
+    ++cell.calls;
+    cell.total += total;
+    cell.self += self;
+}
+
+CTraceReport CTracer::report(const CSnapshot &version, size_t heaviest) const {
+    std::unordered_map<CKey, CStats, CKeyHash> recorded;
+    {
+        std::lock_guard lock(mutex);
+        recorded = stats;
+    }
+    CTraceReport result;
+    std::vector<std::pair<CKey, CStats>> cells(recorded.begin(), recorded.end());
+    size_t count = std::min(heaviest, cells.size());
+    std::partial_sort(cells.begin(), cells.begin() + static_cast<std::ptrdiff_t>(count), cells.end(),
+                      [](const auto &a, const auto &b) {
+                          return a.second.self != b.second.self ? a.second.self > b.second.self : a.first < b.first;
+                      });
+    for (size_t i = 0; i < count; ++i) {
+        result.heaviest.push_back(describe(version, cells[i].first, cells[i].second));
+    }
+
+    // the heaviest chain below every formula with the formula it continues with, searched depth first
+    struct CFrame {
+        CKey key;
+        std::vector<CKey> children;
+        size_t next = 0;
+        CClock::duration best{};
+        CKey bestChild = NO_CELL;
+    };
+    std::unordered_map<CKey, std::pair<CClock::duration, CKey>, CKeyHash> chains;
+    std::unordered_set<CKey, CKeyHash> open;
+    std::vector<CFrame> stack;
+    CKey top = NO_CELL;
+    CClock::duration topTime{-1};
+    for (const auto &[root, rootStats]: cells) {
+        if (chains.contains(root)) {
+            continue;
+        }
+        stack.push_back({root, readFormulas(version.sheet, version.graph, root)});
+        open.insert(root);
+        while (!stack.empty()) {
+            CFrame &frame = stack.back();
+            if (frame.next < frame.children.size()) {
+                CKey child = frame.children[frame.next++];
+                auto done = chains.find(child);
+                if (done != chains.end()) {
+                    if (done->second.first > frame.best) {
+                        frame.best = done->second.first;
+                        frame.bestChild = child;
+                    }
+                } else if (!open.contains(child) && !version.graph.cyclic(child)) {
+                    open.insert(child);
+                    stack.push_back({child, readFormulas(version.sheet, version.graph, child)});
+                }
+                continue;
+            }
+            auto traced = recorded.find(frame.key);
+            CClock::duration total = frame.best + (traced != recorded.end() ? traced->second.self : CClock::duration{});
+            CKey key = frame.key;
+            chains[key] = {total, frame.bestChild};
+            open.erase(key);
+            stack.pop_back();
+            if (!stack.empty() && total > stack.back().best) {
+                stack.back().best = total;
+                stack.back().bestChild = key;
+            }
+        }
+        if (chains[root].first > topTime) {
+            topTime = chains[root].first;
+            top = root;
+        }
+    }
+    for (CKey key = top; key != NO_CELL; key = chains[key].second) {
+        auto traced = recorded.find(key);
+        result.criticalPath.push_back(describe(version, key, traced != recorded.end() ? traced->second : CStats()));
+        result.criticalTime += result.criticalPath.back().selfTime;
+    }
+    return result;
+}
+
+CCellTrace CTracer::describe(const CSnapshot &version, const CKey &key, const CStats &stats) {
+    CCellTrace result;
+    result.row = key.first;
+    result.column = key.second;
+    result.calls = stats.calls;
+    result.totalTime = seconds(stats.total);
+    result.selfTime = seconds(stats.self);
+    auto it = version.sheet.find(key);
+    if (it != version.sheet.end() && it->second.second) {
+        CPrecedents precedents;
+        it->second.second->precedents(precedents);
+        result.fanIn = precedents.cells.size();
+        for (const auto &rect: precedents.ranges) {
+            result.fanIn += rect.area();
+        }
+        for (const auto &[source, rect]: precedents.external) {
+            result.fanIn += rect.area();
+        }
+    }
+    return result;
+}
+
+bool CTracer::saveChromeTrace(const CTraceReport &report, std::ostream &os) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    json << "{\"traceEvents\":[\n";
+    json << R"({"name":"thread_name","ph":"M","pid":1,"tid":1,"args":{"name":"heaviest cells"}},)" << '\n';
+    json << R"({"name":"thread_name","ph":"M","pid":1,"tid":2,"args":{"name":"critical path"}})";
+    auto events = [&json](const std::vector<CCellTrace> &cells, int tid) {
+        // events of a thread follow one another, in microseconds
+        double ts = 0;
+        for (const auto &cell: cells) {
+            json << ",\n{\"name\":\"" << CFormulaText::columnName(cell.column) << cell.row
+                 << R"(","cat":"cell","ph":"X","pid":1,"tid":)" << tid
+                 << ",\"ts\":" << ts * 1e6 << ",\"dur\":" << cell.selfTime * 1e6
+                 << ",\"args\":{\"calls\":" << cell.calls << ",\"fanIn\":" << cell.fanIn
+                 << ",\"totalUs\":" << cell.totalTime * 1e6 << ",\"selfUs\":" << cell.selfTime * 1e6 << "}}";
+            ts += cell.selfTime;
+        }
+    };
+    events(report.heaviest, 1);
+    events(report.criticalPath, 2);
+    json << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    os << json.str();
+    return os.good();
+}
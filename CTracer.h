@@ -0,0 +1,124 @@
+#ifndef CTRACER_H
+#define CTRACER_H
+
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <ostream>
+#include <utility>
+#include <unordered_map>
+#include "CValueCache.h"
+
+class CSnapshot;
+
+/** @brief Statistics of one traced formula cell.
+ */
+struct CCellTrace {
+    size_t row = 0;
+    size_t column = 0;
+    // evaluations that did not find a cached value
+    size_t calls = 0;
+    // cells the formula reads, a range counts all its cells
+    size_t fanIn = 0;
+    // seconds spent in the evaluations, including the cells they evaluated
+    double totalTime = 0;
+    // seconds spent in the evaluations, without the cells they evaluated
+    double selfTime = 0;
+};
+
+/** @brief Summary of a trace, see CSpreadsheet::traceReport().
+ */
+struct CTraceReport {
+    // cells with the largest self time, the largest first
+    std::vector<CCellTrace> heaviest;
+    // chain of formulas each reading the next one, with the largest sum of self times, the reading formula first
+    std::vector<CCellTrace> criticalPath;
+    // sum of the self times of the critical path
+    double criticalTime = 0;
+};
+
+/** @brief Records evaluations of formula cells while tracing is enabled.
+ *
+ * Every evaluation of a formula that misses the value cache is timed by a
+ * CScope. The scopes of one thread form a stack, so the time of a cell
+ * evaluated while another one is being evaluated is subtracted from the self
+ * time of the outer one. A run of copied formulas evaluated by CColumnKernel
+ * counts as one evaluation of the cell that was read. Evaluations in worker
+ * processes of CProcessEvaluator are not traced.
+ *
+ * The critical path is searched in the dependency graph of a version: it is
+ * the chain of formulas, each reading the next one, with the largest sum of
+ * self times. Cells of cycles and of other sheets are left out.
+ */
+class CTracer {
+public:
+    using CKey = std::pair<size_t, size_t>;
+    using CClock = std::chrono::steady_clock;
+
+    /** @brief Times one evaluation of a cell, nothing is timed without a tracer.
+     */
+    class CScope {
+    public:
+        /**  @brief starts timing
+         * @param tracer [in] tracer of the evaluated version, nullptr when tracing is disabled
+         * @param key [in] evaluated cell
+         */
+        CScope(const CTracer *tracer, const CKey &key);
+
+        /**  @brief records the evaluation
+         */
+        ~CScope();
+
+        CScope(const CScope &) = delete;
+
+        CScope &operator=(const CScope &) = delete;
+
+    private:
+        const CTracer *tracer;
+        CKey key;
+    };
+
+    /**
+     * @brief summarizes the recorded evaluations
+     *
+     * @param version [in] version whose dependency graph and formulas give the fan-in and the critical path
+     * @param heaviest [in] number of the heaviest cells to be reported
+     * @return CTraceReport the heaviest cells and the critical path.
+     */
+    CTraceReport report(const CSnapshot &version, size_t heaviest) const;
+
+    /**
+     * @brief writes a report in the Chrome trace event format
+     *
+     * The heaviest cells and the critical path are two threads of one process,
+     * every cell is a complete event as long as its self time, placed one after
+     * another. The statistics of a cell are the arguments of its event.
+     *
+     * @param report [in] report to be written
+     * @param os [in] stream to write the JSON into
+     * @return bool True if writing is successful, false otherwise.
+     */
+    static bool saveChromeTrace(const CTraceReport &report, std::ostream &os);
+
+private:
+    struct CStats {
+        size_t calls = 0;
+        CClock::duration total{};
+        CClock::duration self{};
+    };
+
+    mutable std::mutex mutex;
+    mutable std::unordered_map<CKey, CStats, CKeyHash> stats;
+
+    /**
+     * @brief adds one evaluation of a cell
+     */
+    void record(const CKey &key, CClock::duration total, CClock::duration self) const;
+
+    /**
+     * @brief statistics of a cell with its fan-in
+     */
+    static CCellTrace describe(const CSnapshot &version, const CKey &key, const CStats &stats);
+};
+
+#endif // CTRACER_H
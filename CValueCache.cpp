@@ -0,0 +1,132 @@
+#include "CValueCache.h"
+#include "CMemoryUsage.h"
+
+CValueCache &CValueCache::operator=(const CValueCache &other) {
+    if (this != &other) {
+        clear();
+    }
+    return *this;
+}
+
+bool CValueCache::find(const std::pair<size_t, size_t> &key, CTerm &value) const {
+    if (empty.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    std::pair<size_t, size_t> chunk{key.first / CHUNK, key.second};
+    const CShard &part = shard(chunk);
+    std::lock_guard lock(part.mutex);
+    auto it = part.chunks.find(chunk);
+    if (it == part.chunks.end() || !it->second->present[key.first % CHUNK]) {
+        return false;
+    }
+    value = it->second->values[key.first % CHUNK];
+    return true;
+}
+
+void CValueCache::store(const std::pair<size_t, size_t> &key, const CTerm &value) {
+    std::pair<size_t, size_t> chunk{key.first / CHUNK, key.second};
+    CShard &part = shard(chunk);
+    std::lock_guard lock(part.mutex);
+    auto &slot = part.chunks[chunk];
+    if (!slot) {
+        slot = std::make_unique<CChunk>();
+    }
+    slot->values[key.first % CHUNK] = value;
+    slot->present[key.first % CHUNK] = true;
+    empty.store(false, std::memory_order_relaxed);
+}
+
+void CValueCache::store(const std::pair<size_t, size_t> &first, const std::vector<CTerm> &values) {
+    size_t i = 0;
+    while (i < values.size()) {
+        size_t row = first.first + i;
+        std::pair<size_t, size_t> chunk{row / CHUNK, first.second};
+        CShard &part = shard(chunk);
+        std::lock_guard lock(part.mutex);
+        auto &slot = part.chunks[chunk];
+        if (!slot) {
+            slot = std::make_unique<CChunk>();
+        }
+        for (size_t offset = row % CHUNK; offset < CHUNK && i < values.size(); ++offset, ++i) {
+            slot->values[offset] = values[i];
+            slot->present[offset] = true;
+        }
+    }
+    empty.store(false, std::memory_order_relaxed);
+}
+
+void CValueCache::erase(const std::pair<size_t, size_t> &key) {
+    if (empty.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::pair<size_t, size_t> chunk{key.first / CHUNK, key.second};
+    CShard &part = shard(chunk);
+    std::lock_guard lock(part.mutex);
+    auto it = part.chunks.find(chunk);
+    if (it == part.chunks.end()) {
+        return;
+    }
+    it->second->present[key.first % CHUNK] = false;
+    if (it->second->present.none()) {
+        part.chunks.erase(it);
+    }
+}
+
+void CValueCache::clear() {
+    if (empty.exchange(true)) {
+        return;
+    }
+    for (auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        part.chunks.clear();
+    }
+}
+
+void CValueCache::inherit(const CValueCache &base) {
+    clear();
+    bool copied = false;
+    for (size_t i = 0; i < SHARDS; ++i) {
+        std::unordered_map<std::pair<size_t, size_t>, std::unique_ptr<CChunk>, CKeyHash> chunks;
+        {
+            std::lock_guard lock(base.shards[i].mutex);
+            for (const auto &[chunk, values]: base.shards[i].chunks) {
+                chunks.emplace(chunk, std::make_unique<CChunk>(*values));
+            }
+        }
+        // a chunk stays in the shard of its key
+        std::lock_guard lock(shards[i].mutex);
+        shards[i].chunks = std::move(chunks);
+        copied = copied || !shards[i].chunks.empty();
+    }
+    empty.store(!copied, std::memory_order_relaxed);
+}
+
+bool CValueCache::isEmpty() const {
+    return empty.load(std::memory_order_relaxed);
+}
+
+size_t CValueCache::memoryUsage() const {
+    size_t result = 0;
+    for (const auto &part: shards) {
+        std::lock_guard lock(part.mutex);
+        result += CMemoryUsage::hash(part.chunks.size(), part.chunks.bucket_count(),
+                                     sizeof(std::pair<const std::pair<size_t, size_t>, std::unique_ptr<CChunk>>));
+        for (const auto &[chunk, values]: part.chunks) {
+            result += sizeof(CChunk);
+            for (size_t i = 0; i < CHUNK; ++i) {
+                if (values->present[i] && std::holds_alternative<CRope>(values->values[i])) {
+                    result += std::get<CRope>(values->values[i]).memoryUsage();
+                }
+            }
+        }
+    }
+    return result;
+}
+
+CValueCache::CShard &CValueCache::shard(const std::pair<size_t, size_t> &chunk) {
+    return shards[CKeyHash{}(chunk) % SHARDS];
+}
+
+const CValueCache::CShard &CValueCache::shard(const std::pair<size_t, size_t> &chunk) const {
+    return shards[CKeyHash{}(chunk) % SHARDS];
+}
@@ -0,0 +1,125 @@
+#ifndef CVALUECACHE_H
+#define CVALUECACHE_H
+
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <variant>
+#include <utility>
+#include <unordered_map>
+#include "CRope.h"
+
+/** @brief Hash of a (row, column) key.
+ */
+struct CKeyHash {
+    size_t operator()(const std::pair<size_t, size_t> &key) const {
+        return std::hash<size_t>{}(key.first * 0x9E3779B97F4A7C15ull ^ key.second);
+    }
+};
+
+/** @brief Computed values of formula cells of one version.
+ *
+ * Values are kept in chunks of CHUNK consecutive rows of one column, so a run
+ * of values computed together is stored and found with one lookup. Readers of
+ * the same version fill it concurrently, so chunks are spread over
+ * independently locked shards. A copy starts empty, the values belong to the
+ * version they were computed from, a write copying the version takes them
+ * over explicitly (inherit).
+ */
+class CValueCache {
+public:
+    static constexpr size_t CHUNK = 64;
+
+    CValueCache() = default;
+
+    CValueCache(const CValueCache &) {}
+
+    CValueCache &operator=(const CValueCache &other);
+
+    /**
+     * @brief looks a value up
+     *
+     * @param key [in] position of the cell
+     * @param value [out] cached value
+     * @return bool True if the value is cached.
+     */
+    bool find(const std::pair<size_t, size_t> &key, CTerm &value) const;
+
+    /**
+     * @brief stores a value
+     *
+     * @param key [in] position of the cell
+     * @param value [in] computed value
+     */
+    void store(const std::pair<size_t, size_t> &key, const CTerm &value);
+
+    /**
+     * @brief stores values of consecutive rows of one column
+     *
+     * @param first [in] position of the first cell
+     * @param values [in] computed values, one per row
+     */
+    void store(const std::pair<size_t, size_t> &first, const std::vector<CTerm> &values);
+
+    /**
+     * @brief forgets the value of one cell
+     *
+     * @param key [in] position of the cell
+     */
+    void erase(const std::pair<size_t, size_t> &key);
+
+    /**
+     * @brief forgets all values
+     */
+    void clear();
+
+    /**
+     * @brief replaces the values by those of the cache of the version this one was copied from
+     *
+     * @param base [in] cache of the other version
+     */
+    void inherit(const CValueCache &base);
+
+    /**
+     * @brief tells whether nothing is cached
+     *
+     * @return bool True if the cache is empty.
+     */
+    bool isEmpty() const;
+
+    /**
+     * @brief estimates the memory of the cached values
+     *
+     * @return size_t bytes.
+     */
+    size_t memoryUsage() const;
+
+private:
+    static constexpr size_t SHARDS = 64;
+
+    struct CChunk {
+        std::array<CTerm, CHUNK> values;
+        std::bitset<CHUNK> present;
+    };
+
+    struct CShard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::pair<size_t, size_t>, std::unique_ptr<CChunk>, CKeyHash> chunks;
+    };
+
+    std::array<CShard, SHARDS> shards;
+    std::atomic<bool> empty = true;
+
+    /**
+     * @brief selects the shard of a chunk
+     */
+    CShard &shard(const std::pair<size_t, size_t> &chunk);
+
+    const CShard &shard(const std::pair<size_t, size_t> &chunk) const;
+};
+
+#endif // CVALUECACHE_H
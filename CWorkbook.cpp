@@ -0,0 +1,257 @@
+#include "CWorkbook.h"
+#include <set>
+#include <tuple>
+#include <thread>
+#include <unordered_set>
+
+CWorkbook::~CWorkbook() {
+    // a worker of one sheet may be reading another one
+    for (CSpreadsheet *sheet: list()) {
+        sheet->setAsyncRecalc(false);
+    }
+}
+
+CSpreadsheet *CWorkbook::addSheet(const std::string &name) {
+    if (name.empty()) {
+        return nullptr;
+    }
+    std::lock_guard lock(mutex);
+    auto [it, fresh] = sheets.try_emplace(name);
+    if (!fresh) {
+        return nullptr;
+    }
+    it->second = std::make_shared<CSpreadsheet>();
+    it->second->workbook = this;
+    return it->second.get();
+}
+
+CSpreadsheet *CWorkbook::sheet(const std::string &name) const {
+    return share(name).get();
+}
+
+std::shared_ptr<CSpreadsheet> CWorkbook::share(const std::string &name) const {
+    std::lock_guard lock(mutex);
+    auto it = sheets.find(name);
+    return it == sheets.end() ? nullptr : it->second;
+}
+
+std::vector<std::string> CWorkbook::sheetNames() const {
+    std::lock_guard lock(mutex);
+    std::vector<std::string> names;
+    names.reserve(sheets.size());
+    for (const auto &[name, sheet]: sheets) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+std::vector<CSpreadsheet *> CWorkbook::list() const {
+    std::lock_guard lock(mutex);
+    std::vector<CSpreadsheet *> result;
+    result.reserve(sheets.size());
+    for (const auto &[name, sheet]: sheets) {
+        result.push_back(sheet.get());
+    }
+    return result;
+}
+
+void CWorkbook::recalculate() {
+    std::vector<CSpreadsheet *> pending = list();
+    std::set<const CSpreadsheet *> waiting(pending.begin(), pending.end());
+    while (!pending.empty()) {
+        std::vector<CSpreadsheet *> wave;
+        std::vector<CSpreadsheet *> later;
+        for (CSpreadsheet *sheet: pending) {
+            bool ready = true;
+            for (const auto &[source, links]: sheet->snapshot()->getLinks()) {
+                if (source != sheet && waiting.contains(source)) {
+                    ready = false;
+                    break;
+                }
+            }
+            (ready ? wave : later).push_back(sheet);
+        }
+        if (wave.empty()) {
+            // the rest reads each other, the evaluation follows references across sheets
+            wave.swap(later);
+        }
+        std::atomic<size_t> next = 0;
+        auto work = [&wave, &next]() {
+            for (size_t i = next++; i < wave.size(); i = next++) {
+                evaluate(*wave[i]);
+            }
+        };
+        size_t threads = std::min<size_t>(wave.size(), std::max(1U, std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; ++i) {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        for (CSpreadsheet *sheet: wave) {
+            waiting.erase(sheet);
+        }
+        pending.swap(later);
+    }
+}
+
+void CWorkbook::evaluate(const CSpreadsheet &sheet) {
+    std::shared_ptr<const CSnapshot> version = sheet.snapshot();
+    std::vector<CKey> roots;
+    for (const auto &[key, cell]: version->getCells()) {
+        if (cell.second) {
+            roots.push_back(key);
+        }
+    }
+    version->recalculate(roots);
+}
+
+void CWorkbook::propagate(const CSpreadsheet &source, std::vector<CKey> cells, bool replaced) {
+    std::vector<CSpreadsheet *> all = list();
+    // formulas dropped already, a cycle across sheets is followed once
+    std::map<const CSpreadsheet *, std::unordered_set<CKey, CKeyHash>> seen;
+    std::vector<std::tuple<const CSpreadsheet *, std::vector<CKey>, bool>> work;
+    work.emplace_back(&source, std::move(cells), replaced);
+    while (!work.empty()) {
+        auto [from, changed, everything] = std::move(work.back());
+        work.pop_back();
+        std::vector<CKey> affected;
+        bool found = false;
+        for (CSpreadsheet *sheet: all) {
+            std::vector<CKey> touched;
+            {
+                std::shared_ptr<const CSnapshot> version = sheet->snapshot();
+                auto it = version->getLinks().find(from);
+                if (it == version->getLinks().end()) {
+                    continue;
+                }
+                auto touch = [&seen, &touched, sheet](const CKey &key) {
+                    if (seen[sheet].insert(key).second) {
+                        touched.push_back(key);
+                    }
+                };
+                if (everything) {
+                    it->second.forEachFormula({0, 0, SIZE_MAX, SIZE_MAX}, touch);
+                } else {
+                    if (!found) {
+                        affected = from->snapshot()->dependents(changed);
+                        found = true;
+                    }
+                    for (const auto &key: affected) {
+                        it->second.forEachDependent(key, touch);
+                    }
+                }
+                // released first, a version nobody holds is refreshed in place
+            }
+            if (!touched.empty()) {
+                sheet->refresh(touched);
+                work.emplace_back(sheet, std::move(touched), false);
+            }
+        }
+    }
+}
+
+std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> CWorkbook::pin(
+        const CSpreadsheet &reader, const std::set<const CSpreadsheet *> &reads) const {
+    std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> versions;
+    for (CSpreadsheet *sheet: list()) {
+        if (sheet == &reader || !reads.contains(sheet)) {
+            continue;
+        }
+        std::shared_ptr<const CSnapshot> version = sheet->snapshot();
+        // the pinned versions are held, so none of them is modified in place meanwhile
+        std::vector<const CSnapshot *> stack{version.get()};
+        std::set<const CSnapshot *> seen{version.get()};
+        bool cycle = false;
+        while (!stack.empty() && !cycle) {
+            const CSnapshot *next = stack.back();
+            stack.pop_back();
+            cycle = next->getLinks().contains(&reader);
+            for (const auto &[source, pinned]: next->getSources()) {
+                if (seen.insert(pinned.get()).second) {
+                    stack.push_back(pinned.get());
+                }
+            }
+        }
+        if (!cycle) {
+            versions.emplace(sheet, std::move(version));
+        }
+    }
+    return versions;
+}
+
+void CWorkbook::relocate(const CSpreadsheet &source, CRelocation relocation) {
+    std::string name;
+    std::vector<CSpreadsheet *> all;
+    {
+        std::lock_guard lock(mutex);
+        for (const auto &[sheetName, sheet]: sheets) {
+            if (sheet.get() == &source) {
+                name = sheetName;
+            }
+            all.push_back(sheet.get());
+        }
+    }
+    relocation.source = &source;
+    // the relocated sheet itself may name its own cells with its name
+    for (CSpreadsheet *sheet: all) {
+        sheet->relocateLinks(relocation, name);
+    }
+}
+
+bool CWorkbook::save(std::ostream &os) const {
+    for (const auto &name: sheetNames()) {
+        std::ostringstream contents;
+        if (!sheet(name)->save(contents)) {
+            return false;
+        }
+        std::string text = contents.str();
+        os << name.length() << ' ' << name << ' ' << text.length() << '\n' << text;
+    }
+    return os.good();
+}
+
+bool CWorkbook::load(std::istream &is) {
+    std::vector<std::pair<std::string, std::string>> parts;
+    size_t length;
+    while (is >> length) {
+        std::string name(length, '\0');
+        size_t size;
+        if (!is.ignore(1) || !is.read(name.data(), static_cast<std::streamsize>(length)) || !(is >> size)
+            || !is.ignore(1)) {
+            return false;
+        }
+        std::string text(size, '\0');
+        if (!is.read(text.data(), static_cast<std::streamsize>(size))) {
+            return false;
+        }
+        parts.emplace_back(std::move(name), std::move(text));
+    }
+    if (!is.eof()) {
+        return false;
+    }
+    for (const auto &[name, text]: parts) {
+        if (!sheet(name) && !addSheet(name)) {
+            return false;
+        }
+    }
+    std::vector<std::pair<CSpreadsheet *, std::shared_ptr<CSnapshot>>> loaded;
+    for (const auto &[name, text]: parts) {
+        CSpreadsheet *target = sheet(name);
+        auto next = std::make_shared<CSnapshot>();
+        std::istringstream contents(text);
+        if (!text.empty() && !target->loadVersion(contents, *next)) {
+            return false;
+        }
+        loaded.emplace_back(target, std::move(next));
+    }
+    for (auto &[target, next]: loaded) {
+        target->replace(std::move(next));
+    }
+    for (const auto &[target, next]: loaded) {
+        target->propagate();
+    }
+    return true;
+}
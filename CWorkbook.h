@@ -0,0 +1,166 @@
+#ifndef CWORKBOOK_H
+#define CWORKBOOK_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include "CSpreadsheet.h"
+
+/** @brief Named sheets whose formulas may read each other.
+ *
+ * A formula refers to another sheet as Data!A1, Data!A1:B7 or 'My data'!A1,
+ * quotes inside a quoted name are doubled. The sheet is resolved when the
+ * formula is built, so it must be added before. A write to a sheet drops the
+ * cached values of the formulas of other sheets reading the modified cells,
+ * found through the links of every version (CSnapshot::getLinks), before it
+ * returns, the new versions of those sheets pin the written version
+ * (CSnapshot::getSources). Inserted or deleted rows and columns of a sheet move the
+ * references of other sheets to it too. Sheets live as long as the workbook
+ * and cannot be removed.
+ * Formulas hold the sheets they read weakly, so a sheet copied out of the
+ * workbook reads undefined values from the other sheets once the workbook is
+ * gone.
+ */
+class CWorkbook {
+public:
+    using CKey = std::pair<size_t, size_t>;
+
+    /**
+     * @brief creates an empty workbook
+     */
+    CWorkbook() = default;
+
+    CWorkbook(const CWorkbook &) = delete;
+
+    CWorkbook &operator=(const CWorkbook &) = delete;
+
+    /**
+     * @brief stops the background recalculation of all sheets before they are released
+     */
+    ~CWorkbook();
+
+    /**
+     * @brief adds an empty sheet
+     *
+     * @param name [in] name of the sheet, not empty
+     * @return CSpreadsheet * the new sheet, nullptr if the name is empty or taken.
+     */
+    CSpreadsheet *addSheet(const std::string &name);
+
+    /**
+     * @brief finds a sheet
+     *
+     * @param name [in] name of the sheet
+     * @return CSpreadsheet * the sheet, nullptr if there is none.
+     */
+    CSpreadsheet *sheet(const std::string &name) const;
+
+    /**
+     * @brief names of all sheets in alphabetical order
+     */
+    std::vector<std::string> sheetNames() const;
+
+    /**
+     * @brief evaluates all formulas of all sheets into their value caches
+     *
+     * Sheets are evaluated in waves, a sheet after the sheets it reads. Sheets
+     * of one wave do not read each other and are evaluated in parallel, one
+     * thread each up to the number of hardware threads. Sheets reading each
+     * other in a cycle form the last wave.
+     */
+    void recalculate();
+
+    /**
+     * @brief saves all sheets into stream
+     *
+     * Every sheet is written as the length of its name, the name, the length of
+     * its contents and the contents in the save format of CSpreadsheet.
+     *
+     * @param os [in] stream to save the workbook into.
+     * @return bool True if saving is successful, false otherwise.
+     */
+    bool save(std::ostream &os) const;
+
+    /**
+     * @brief loads sheets saved by save
+     *
+     * Missing sheets are added first, so formulas may read any sheet of the
+     * stream. Sheets of the same name are replaced, other sheets are kept. All
+     * sheets are parsed before the first one is replaced, so a stream failing
+     * to load replaces none of them. They are replaced one right after another
+     * and the formulas reading them are refreshed after the last one, against
+     * the loaded versions.
+     *
+     * @param is [in] stream to load the workbook from.
+     * @return bool True if loading is successful, false otherwise.
+     */
+    bool load(std::istream &is);
+
+private:
+    friend class CSpreadsheet;
+
+    mutable std::mutex mutex;
+    // shared only with the formulas reading a sheet, which hold it weakly
+    std::map<std::string, std::shared_ptr<CSpreadsheet>> sheets;
+
+    /**
+     * @brief finds a sheet for a formula reading it
+     *
+     * @param name [in] name of the sheet
+     * @return std::shared_ptr<CSpreadsheet> the sheet, nullptr if there is none.
+     */
+    std::shared_ptr<CSpreadsheet> share(const std::string &name) const;
+
+    /**
+     * @brief drops cached values of formulas reading modified cells of a sheet
+     *
+     * Formulas depending on the dropped ones are followed into further sheets.
+     * The caller must not hold writeMutex of any sheet.
+     *
+     * @param source [in] modified sheet
+     * @param cells [in] modified cells
+     * @param replaced [in] the whole sheet was replaced
+     */
+    void propagate(const CSpreadsheet &source, std::vector<CKey> cells, bool replaced);
+
+    /**
+     * @brief moves references of all sheets into a sheet whose rows or columns were inserted or deleted
+     *
+     * The caller must not hold writeMutex of any sheet.
+     *
+     * @param source [in] relocated sheet, its own formulas are relocated already
+     * @param relocation [in] inserted or deleted rows or columns
+     */
+    void relocate(const CSpreadsheet &source, CRelocation relocation);
+
+    /**
+     * @brief current versions of the sheets a version of another sheet reads
+     *
+     * A sheet whose current version reads the reader, directly or through the
+     * versions it pinned, is left out, pinned versions of sheets reading each
+     * other would keep each other's whole history alive.
+     *
+     * @param reader [in] sheet of the version
+     * @param reads [in] sheets read by the version
+     * @return std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> version of every sheet to pin.
+     */
+    std::map<const CSpreadsheet *, std::shared_ptr<const CSnapshot>> pin(
+            const CSpreadsheet &reader, const std::set<const CSpreadsheet *> &reads) const;
+
+    /**
+     * @brief all sheets, so they can be used without holding mutex
+     */
+    std::vector<CSpreadsheet *> list() const;
+
+    /**
+     * @brief evaluates all formulas of a sheet into its value cache
+     */
+    static void evaluate(const CSpreadsheet &sheet);
+};
+
+#endif // CWORKBOOK_H
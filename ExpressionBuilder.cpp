@@ -1,6 +1,21 @@
 #include "ExpressionBuilder.h"
+#include "CFormulaText.h"
+#include "CNodePool.h"
+#include <cstring>
+
+namespace
+{
+    template<typename T>
+    void appendRaw(std::string &key, const T &value)
+    {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        key.append(bytes, sizeof(T));
+    }
+}
 
 ExpressionBuilder::ExpressionBuilder() {}
+ExpressionBuilder::ExpressionBuilder(CSheetResolver resolver) : resolver(std::move(resolver)) {}
 ExpressionBuilder::~ExpressionBuilder() = default;
 
 void ExpressionBuilder::opAdd()
@@ -9,9 +24,7 @@ void ExpressionBuilder::opAdd()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::ADD);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::ADD, left, right);
     stack.push(node);
     ast = node;
 }
@@ -22,9 +35,7 @@ void ExpressionBuilder::opSub()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::SUBTRACT);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::SUBTRACT, left, right);
     stack.push(node);
     ast = node;
 }
@@ -35,9 +46,7 @@ void ExpressionBuilder::opMul()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::MULTIPLY);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::MULTIPLY, left, right);
     stack.push(node);
     ast = node;
 }
@@ -48,9 +57,7 @@ void ExpressionBuilder::opDiv()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::DIVIDE);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::DIVIDE, left, right);
     stack.push(node);
     ast = node;
 }
@@ -61,9 +68,7 @@ void ExpressionBuilder::opPow()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::POWER);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::POWER, left, right);
     stack.push(node);
     ast = node;
 }
@@ -72,9 +77,7 @@ void ExpressionBuilder::opNeg()
 {
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::NEGATE);
-    node->setLeft(left);
-    node->setRight(std::make_shared<ValueNode>(CValue()));
+    auto node = makeOperator(Operator::NEGATE, left, makeValue(CValue()));
     stack.push(node);
     ast = node;
 }
@@ -85,9 +88,7 @@ void ExpressionBuilder::opEq()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::EQUAL);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::EQUAL, left, right);
     stack.push(node);
     ast = node;
 }
@@ -98,9 +99,7 @@ void ExpressionBuilder::opNe()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::NOT_EQUAL);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::NOT_EQUAL, left, right);
     stack.push(node);
     ast = node;
 }
@@ -111,9 +110,7 @@ void ExpressionBuilder::opLt()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::LESS_THAN);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::LESS_THAN, left, right);
     stack.push(node);
     ast = node;
 }
@@ -124,9 +121,7 @@ void ExpressionBuilder::opLe()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::LESS_THAN_OR_EQUAL);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::LESS_THAN_OR_EQUAL, left, right);
     stack.push(node);
     ast = node;
 }
@@ -137,9 +132,7 @@ void ExpressionBuilder::opGt()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::GREATER_THAN);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::GREATER_THAN, left, right);
     stack.push(node);
     ast = node;
 }
@@ -150,58 +143,244 @@ void ExpressionBuilder::opGe()
     stack.pop();
     auto left = stack.top();
     stack.pop();
-    auto node = std::make_shared<OperatorNode>(Operator::GREATER_THAN_OR_EQUAL);
-    node->setLeft(left);
-    node->setRight(right);
+    auto node = makeOperator(Operator::GREATER_THAN_OR_EQUAL, left, right);
     stack.push(node);
     ast = node;
 }
 
 void ExpressionBuilder::valNumber(double val)
 {
-    auto node = std::make_shared<ValueNode>(CValue(val));
+    auto node = makeValue(CValue(val));
     stack.push(node);
     ast = node;
 }
 
 void ExpressionBuilder::valString(std::string val)
 {
-    auto node = std::make_shared<ValueNode>(CValue(val));
+    valString(std::string_view(val));
+}
+
+void ExpressionBuilder::valReference(std::string val)
+{
+    valReference({}, std::string_view(val));
+}
+
+void ExpressionBuilder::valRange(std::string val)
+{
+    valRange({}, std::string_view(val));
+}
+
+void ExpressionBuilder::funcCall(std::string fnName, int paramCount)
+{
+    funcCall(std::string_view(fnName), paramCount);
+}
+
+void ExpressionBuilder::valString(std::string_view val)
+{
+    auto node = makeValue(CValue(std::string(val)));
     stack.push(node);
     ast = node;
 }
 
-void ExpressionBuilder::valReference(std::string val)
+void ExpressionBuilder::valReference(std::string_view sheet, std::string_view val)
 {
-    std::string pos;
-    for (auto c : val)
+    CFormulaText::CRef ref{};
+    if (!CFormulaText::parseRef(val, ref))
+    {
+        throw std::invalid_argument("Not a valid reference.");
+    }
+    std::shared_ptr<Node> node;
+    if (std::shared_ptr<const CSpreadsheet> source = sheetNamed(sheet))
     {
-        if (c != '$')
+        node = std::make_shared<RefNode>(ref.row, ref.column, ref.absRow, ref.absColumn, source);
+        unpooled.push_back(node.get());
+    }
+    else if (ref.absRow && ref.absColumn)
+    {
+        std::string key = "r";
+        appendRaw(key, ref.row);
+        appendRaw(key, ref.column);
+        node = CNodePool::instance().intern(key, [&ref]()
         {
-            pos += std::tolower(c);
-        }
+            return std::make_shared<RefNode>(ref.row, ref.column, true, true);
+        }, false);
+    }
+    else
+    {
+        node = std::make_shared<RefNode>(ref.row, ref.column, ref.absRow, ref.absColumn);
+        unpooled.push_back(node.get());
     }
-    auto node = std::make_shared<RefNode>(pos);
     stack.push(node);
     ast = node;
 }
 
-void ExpressionBuilder::valRange(std::string val)
+void ExpressionBuilder::valRange(std::string_view sheet, std::string_view val)
 {
-    stack.push(std::make_shared<ValueNode>(CValue(val)));
+    size_t colon = val.find(':');
+    CFormulaText::CRef from{};
+    CFormulaText::CRef to{};
+    if (colon == std::string::npos || !CFormulaText::parseRef(val.substr(0, colon), from)
+        || !CFormulaText::parseRef(val.substr(colon + 1), to))
+    {
+        throw std::invalid_argument("Not a valid range.");
+    }
+    std::shared_ptr<const CSpreadsheet> source = sheetNamed(sheet);
+    bool absRow = from.absRow || to.absRow;
+    bool absColumn = from.absColumn || to.absColumn;
+    std::shared_ptr<Node> node;
+    if (source)
+    {
+        node = std::make_shared<RangeNode>(from.row, from.column, to.row, to.column, absRow, absColumn, source);
+        unpooled.push_back(node.get());
+    }
+    else if (from.absRow && from.absColumn && to.absRow && to.absColumn)
+    {
+        std::string key = "g";
+        appendRaw(key, std::min(from.row, to.row));
+        appendRaw(key, std::min(from.column, to.column));
+        appendRaw(key, std::max(from.row, to.row));
+        appendRaw(key, std::max(from.column, to.column));
+        node = CNodePool::instance().intern(key, [&from, &to]()
+        {
+            return std::make_shared<RangeNode>(from.row, from.column, to.row, to.column, true, true);
+        }, false);
+    }
+    else
+    {
+        node = std::make_shared<RangeNode>(from.row, from.column, to.row, to.column, absRow, absColumn);
+        unpooled.push_back(node.get());
+    }
+    stack.push(node);
+    ast = node;
 }
 
-void ExpressionBuilder::funcCall(std::string fnName, int paramCount)
+void ExpressionBuilder::funcCall(std::string_view fnName, int paramCount)
 {
-    std::string name = fnName;
-    int size = stack.size();
-    if (size < paramCount)
+    if (paramCount < 0 || stack.size() < static_cast<size_t>(paramCount))
+    {
+        throw std::invalid_argument("Missing function arguments.");
+    }
+    std::vector<std::shared_ptr<Node>> args(paramCount);
+    for (int i = paramCount - 1; i >= 0; --i)
+    {
+        args[i] = stack.top();
+        stack.pop();
+    }
+    const CFunctionRegistry::CFunction *function = CFunctionRegistry::find(fnName);
+    if (!function || !function->takesCount(args.size()))
     {
-        stack.push(std::make_shared<ValueNode>(CValue()));
+        throw std::invalid_argument("Unknown function or wrong number of arguments.");
     }
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        // the functions rely on it, a range argument is a RangeNode
+        if (function->takesRange(i) != (dynamic_cast<const RangeNode *>(args[i].get()) != nullptr))
+        {
+            throw std::invalid_argument("Wrong kind of function argument.");
+        }
+    }
+    std::shared_ptr<Node> node;
+    if (std::none_of(args.begin(), args.end(), [this](const auto &arg) { return isUnpooled(arg.get()); }))
+    {
+        std::string key = "f";
+        appendRaw(key, function);
+        for (const auto &arg : args)
+        {
+            appendRaw(key, arg.get());
+        }
+        node = CNodePool::instance().intern(key, [function, &args]()
+        {
+            return std::make_shared<FunctionNode>(*function, args);
+        }, true);
+    }
+    else
+    {
+        node = std::make_shared<FunctionNode>(*function, std::move(args));
+        unpooled.push_back(node.get());
+    }
+    stack.push(node);
+    ast = node;
 }
 
 std::shared_ptr<Node> ExpressionBuilder::getAST()
 {
-    return ast;
-}
\ No newline at end of file
+    if (!ast || isUnpooled(ast.get()))
+    {
+        return NumericNode::wrap(ast);
+    }
+    std::string key = "N";
+    appendRaw(key, ast.get());
+    return CNodePool::instance().intern(key, [this]()
+    {
+        return NumericNode::wrap(ast);
+    }, false);
+}
+
+std::shared_ptr<Node> ExpressionBuilder::makeOperator(Operator op, const std::shared_ptr<Node> &left,
+                                                      const std::shared_ptr<Node> &right)
+{
+    if (isUnpooled(left.get()) || isUnpooled(right.get()))
+    {
+        auto node = std::make_shared<OperatorNode>(op);
+        node->setLeft(left);
+        node->setRight(right);
+        unpooled.push_back(node.get());
+        return node;
+    }
+    // children are pooled already, so their addresses describe them
+    std::string key = "o";
+    key += static_cast<char>(op);
+    appendRaw(key, left.get());
+    appendRaw(key, right.get());
+    return CNodePool::instance().intern(key, [op, &left, &right]()
+    {
+        auto node = std::make_shared<OperatorNode>(op);
+        node->setLeft(left);
+        node->setRight(right);
+        return node;
+    }, true);
+}
+
+std::shared_ptr<Node> ExpressionBuilder::makeValue(const CValue &value)
+{
+    std::string key(1, static_cast<char>('0' + value.index()));
+    if (std::holds_alternative<double>(value))
+    {
+        appendRaw(key, std::get<double>(value));
+    }
+    else if (std::holds_alternative<std::string>(value))
+    {
+        key += std::get<std::string>(value);
+    }
+    return CNodePool::instance().intern(key, [&value]()
+    {
+        return std::make_shared<ValueNode>(value);
+    }, false);
+}
+
+bool ExpressionBuilder::isUnpooled(const Node *node) const
+{
+    return std::find(unpooled.begin(), unpooled.end(), node) != unpooled.end();
+}
+
+std::shared_ptr<const CSpreadsheet> ExpressionBuilder::sheetNamed(std::string_view name)
+{
+    if (name.empty())
+    {
+        return nullptr;
+    }
+    for (const auto &[known, sheet] : sheets)
+    {
+        if (known == name)
+        {
+            return sheet;
+        }
+    }
+    std::shared_ptr<const CSpreadsheet> sheet = resolver ? resolver(std::string(name)) : nullptr;
+    if (!sheet)
+    {
+        throw std::invalid_argument("Unknown sheet " + std::string(name) + ".");
+    }
+    sheets.emplace_back(name, sheet);
+    return sheet;
+}
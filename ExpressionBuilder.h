@@ -5,17 +5,35 @@
 #include <iostream>
 #include <cmath>
 #include <variant>
+#include <functional>
+#include <string_view>
 #include "expression.h"
 #include "Node.h"
 
 using CValue = std::variant<std::monostate, double, std::string>;
 
 /** @brief subclass of an external class to handle expressions
+ *
+ * Formulas are parsed by CFormulaParser, which calls the string_view overloads.
+ * The CExprBuilder interface is kept for parseExpression of the external
+ * library, the benchmark compares both.
+ *
+ * References to other sheets of a workbook (Data!A1) come from CFormulaParser
+ * with the name of the sheet, which is resolved here, when the formula is built.
  */
 class ExpressionBuilder : public CExprBuilder {
 public:
+    using CSheetResolver = std::function<std::shared_ptr<const CSpreadsheet>(const std::string &)>;
+
     ExpressionBuilder();
 
+    /**
+     * @brief creates a builder resolving references to other sheets
+     *
+     * @param resolver [in] returns the sheet of given name, nullptr if there is none
+     */
+    explicit ExpressionBuilder(CSheetResolver resolver);
+
     ~ExpressionBuilder();
 
     void opAdd() override;
@@ -51,6 +69,17 @@ public:
     void valRange(std::string val) override;
 
     void funcCall(std::string fnName, int paramCount) override;
+
+    // the same without copying the text, called by CFormulaParser
+
+    void valString(std::string_view val);
+
+    void valReference(std::string_view sheet, std::string_view val);
+
+    void valRange(std::string_view sheet, std::string_view val);
+
+    void funcCall(std::string_view fnName, int paramCount);
+
     /**
      * @brief Getter for AST.
 
@@ -61,6 +90,36 @@ public:
 private:
     std::stack<std::shared_ptr<Node>> stack;
     std::shared_ptr<Node> ast;
+    CSheetResolver resolver;
+    // sheets referenced by the formula, resolved once per name
+    std::vector<std::pair<std::string, std::shared_ptr<const CSpreadsheet>>> sheets;
+    // nodes reading a relative reference, they differ between cells and are not pooled
+    std::vector<const Node *> unpooled;
+
+    /**
+     * @brief returns the operator node with given children, pooled unless a child is not
+     */
+    std::shared_ptr<Node> makeOperator(Operator op, const std::shared_ptr<Node> &left,
+                                       const std::shared_ptr<Node> &right);
+
+    /**
+     * @brief returns the pooled constant node
+     */
+    static std::shared_ptr<Node> makeValue(const CValue &value);
+
+    /**
+     * @brief tells whether a node of this formula was left out of the pool
+     */
+    bool isUnpooled(const Node *node) const;
+
+    /**
+     * @brief resolves the sheet named in front of a reference
+     *
+     * @param name [in] name of the sheet, empty for the sheet of the formula
+     * @return std::shared_ptr<const CSpreadsheet> referenced sheet, nullptr for the sheet of the formula.
+     * @throws std::invalid_argument when the sheet does not exist.
+     */
+    std::shared_ptr<const CSpreadsheet> sheetNamed(std::string_view name);
 };
 
 #endif // EXPRESSIONBUILDER_H
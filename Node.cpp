@@ -1,45 +1,111 @@
 #include "Node.h"
+#include "CSnapshot.h"
+#include "CSpreadsheet.h"
+#include "CColumnKernel.h"
+#include "CMemoryUsage.h"
+#include "CFormulaText.h"
+#include "CRelocation.h"
 
-CValue OperatorNode::evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) {
-    std::set<std::string> positionsRight = positions;
-    const CValue &leftVal = left->evaluate(sheet, positions);
-    const CValue &rightVal = right->evaluate(sheet, positionsRight);
+namespace {
+    // counters of a node created by std::make_shared
+    constexpr size_t CONTROL_BLOCK = 2 * sizeof(void *);
+
+    // references to other sheets being evaluated by this thread
+    thread_local std::vector<const Node *> crossing;
+
+    /** @brief Marks a reference to another sheet as being evaluated.
+     *
+     * The dependency graph of a sheet does not see cycles going through other
+     * sheets, they are found here: a reference met again while its own value
+     * is being computed is a part of such cycle.
+     */
+    class CCrossing {
+    public:
+        explicit CCrossing(const Node *node)
+                : entered(std::find(crossing.begin(), crossing.end(), node) == crossing.end()) {
+            if (entered) {
+                crossing.push_back(node);
+            } else {
+                CSnapshot::noteCycle();
+            }
+        }
+
+        ~CCrossing() {
+            if (entered) {
+                crossing.pop_back();
+            }
+        }
+
+        const bool entered;
+    };
+
+    /**
+     * @brief version of another sheet of the workbook a version reads
+     *
+     * @param reader [in] version being evaluated
+     * @param source [in] the sheet
+     * @return std::shared_ptr<const CSnapshot> the version pinned by the reader, the current one if it pinned
+     * none, nullptr once the sheet is gone.
+     */
+    std::shared_ptr<const CSnapshot> versionOf(const CSnapshot &reader,
+                                               const std::weak_ptr<const CSpreadsheet> &source) {
+        std::shared_ptr<const CSpreadsheet> sheet = source.lock();
+        if (!sheet) {
+            return nullptr;
+        }
+        auto pinned = reader.getSources().find(sheet.get());
+        return pinned != reader.getSources().end() ? pinned->second : sheet->snapshot();
+    }
+}
+
+CTerm Node::value(const CSnapshot &sheet) const {
+    if (!isShared()) {
+        return evaluate(sheet);
+    }
+    return sheet.getSharedValue(*this);
+}
+
+CTerm OperatorNode::evaluate(const CSnapshot &sheet) const {
+    return apply(op, left->value(sheet), right->value(sheet));
+}
+
+CTerm OperatorNode::apply(Operator op, const CTerm &leftVal, const CTerm &rightVal) {
     switch (op) {
         case Operator::ADD:
 
             if (std::holds_alternative<double>(leftVal) && std::holds_alternative<double>(rightVal)) {
                 return std::get<double>(leftVal) + std::get<double>(rightVal);
-            } else if (std::holds_alternative<std::string>(leftVal) || std::holds_alternative<std::string>(rightVal)) {
-                std::string str_b = std::holds_alternative<std::string>(leftVal) ? std::get<std::string>(leftVal)
-                                                                                 : std::to_string(
-                                std::get<double>(leftVal));
-                std::string str_a = std::holds_alternative<std::string>(rightVal) ? std::get<std::string>(rightVal)
-                                                                                  : std::to_string(
-                                std::get<double>(rightVal));
-                std::string result = str_b + str_a;
-                return result;
+            } else if ((std::holds_alternative<CRope>(leftVal) || std::holds_alternative<CRope>(rightVal))
+                       && !std::holds_alternative<std::monostate>(leftVal)
+                       && !std::holds_alternative<std::monostate>(rightVal)) {
+                // the texts are joined, not copied
+                CRope str_b = std::holds_alternative<CRope>(leftVal) ? std::get<CRope>(leftVal)
+                                                                     : CRope(std::to_string(std::get<double>(leftVal)));
+                CRope str_a = std::holds_alternative<CRope>(rightVal) ? std::get<CRope>(rightVal)
+                                                                      : CRope(std::to_string(std::get<double>(rightVal)));
+                return CRope::concat(str_b, str_a);
             } else {
-                return CValue();
+                return CTerm();
             }
             break;
         case Operator::SUBTRACT:
             if (std::holds_alternative<double>(leftVal) && std::holds_alternative<double>(rightVal)) {
                 return std::get<double>(leftVal) - std::get<double>(rightVal);
             } else {
-                return CValue();
+                return CTerm();
             }
             break;
         case Operator::MULTIPLY:
             if (std::holds_alternative<double>(leftVal) && std::holds_alternative<double>(rightVal)) {
                 return std::get<double>(leftVal) * std::get<double>(rightVal);
             } else {
-                return CValue();
+                return CTerm();
             }
             break;
         case Operator::DIVIDE:
             if (std::holds_alternative<double>(leftVal) && std::holds_alternative<double>(rightVal)) {
                 if (std::get<double>(rightVal) == 0) {
-                    return CValue();
+                    return CTerm();
                 }
                 return std::get<double>(leftVal) / std::get<double>(rightVal);
             }
@@ -48,14 +114,14 @@ CValue OperatorNode::evaluate(CSpreadsheet &sheet, std::set<std::string> &positi
             if (std::holds_alternative<double>(leftVal) && std::holds_alternative<double>(rightVal)) {
                 return std::pow(std::get<double>(leftVal), std::get<double>(rightVal));
             } else {
-                return CValue();
+                return CTerm();
             }
             break;
         case Operator::NEGATE:
             if (std::holds_alternative<double>(leftVal)) {
                 return -std::get<double>(leftVal);
             } else {
-                return CValue();
+                return CTerm();
             }
             break;
         case Operator::EQUAL:
@@ -77,22 +143,476 @@ CValue OperatorNode::evaluate(CSpreadsheet &sheet, std::set<std::string> &positi
             return (leftVal >= rightVal) ? 1.0 : 0.0;
             break;
         default:
-            return CValue();
+            return CTerm();
             break;
     }
-    return CValue();
+    return CTerm();
 }
 
-CValue ValueNode::evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) {
+bool OperatorNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    size_t start = program.size();
+    if (!left->compile(program, row, column)) {
+        return false;
+    }
+    // the right side of NEGATE is only a placeholder
+    if (op != Operator::NEGATE && !right->compile(program, row, column)) {
+        return false;
+    }
+    CKernelOp instruction{CKernelOp::Type::OPERATOR};
+    instruction.op = op;
+    program.push_back(instruction);
+    // a pooled sub-expression over absolute cells may be shared by other formulas, only the outermost is marked
+    auto first = program.begin() + static_cast<std::ptrdiff_t>(start);
+    bool reads = false;
+    for (auto it = first; it != program.end(); ++it) {
+        if (it->type == CKernelOp::Type::REFERENCE && !(it->absRow && it->absColumn)) {
+            return true;
+        }
+        reads = reads || it->type == CKernelOp::Type::REFERENCE;
+    }
+    if (reads) {
+        program.erase(std::remove_if(first, program.end(), [](const CKernelOp &inner) {
+            return inner.type == CKernelOp::Type::SHARED;
+        }), program.end());
+        CKernelOp marker{CKernelOp::Type::SHARED};
+        marker.node = this;
+        marker.length = program.size() - start;
+        program.insert(program.begin() + static_cast<std::ptrdiff_t>(start), marker);
+    }
+    return true;
+}
+
+void OperatorNode::precedents(CPrecedents &precedents) const {
+    left->precedents(precedents);
+    right->precedents(precedents);
+}
+
+size_t OperatorNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    if (!seen.insert(this).second) {
+        return 0;
+    }
+    return sizeof(*this) + CONTROL_BLOCK + left->memoryUsage(seen) + right->memoryUsage(seen);
+}
+
+std::shared_ptr<Node> OperatorNode::relocate(const CRelocation &relocation) const {
+    std::shared_ptr<Node> movedLeft = left->relocate(relocation);
+    std::shared_ptr<Node> movedRight = right->relocate(relocation);
+    if (!movedLeft && !movedRight) {
+        return nullptr;
+    }
+    auto node = std::make_shared<OperatorNode>(op);
+    node->setLeft(movedLeft ? movedLeft : left);
+    node->setRight(movedRight ? movedRight : right);
+    return node;
+}
+
+CTerm ValueNode::evaluate(const CSnapshot &sheet) const {
     (void) sheet;
     return value;
 }
 
-CValue RefNode::evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) {
-    if (positions.contains(value)) {
-        return CValue();
+bool ValueNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    (void) row;
+    (void) column;
+    if (!std::holds_alternative<double>(value)) {
+        return false;
+    }
+    CKernelOp instruction{CKernelOp::Type::CONSTANT};
+    instruction.constant = std::get<double>(value);
+    program.push_back(instruction);
+    return true;
+}
+
+void ValueNode::precedents(CPrecedents &precedents) const {
+    (void) precedents;
+}
+
+size_t ValueNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    if (!seen.insert(this).second) {
+        return 0;
+    }
+    size_t text = std::holds_alternative<CRope>(value) ? std::get<CRope>(value).memoryUsage() : 0;
+    return sizeof(*this) + CONTROL_BLOCK + text;
+}
+
+std::shared_ptr<Node> ValueNode::relocate(const CRelocation &relocation) const {
+    (void) relocation;
+    return nullptr;
+}
+
+CTerm RefNode::evaluate(const CSnapshot &sheet) const {
+    if (external) {
+        CCrossing crossing(this);
+        std::shared_ptr<const CSnapshot> version = crossing.entered ? versionOf(sheet, source) : nullptr;
+        return version ? version->getValueAt(key) : CTerm();
+    }
+    return sheet.getValueAt(key);
+}
+
+bool RefNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    if (external) {
+        return false;
+    }
+    CKernelOp instruction{CKernelOp::Type::REFERENCE};
+    instruction.absRow = absRow;
+    instruction.absColumn = absColumn;
+    instruction.row = static_cast<long long>(key.first) - (absRow ? 0 : static_cast<long long>(row));
+    instruction.column = static_cast<long long>(key.second) - (absColumn ? 0 : static_cast<long long>(column));
+    program.push_back(instruction);
+    return true;
+}
+
+void RefNode::precedents(CPrecedents &precedents) const {
+    precedents.fixedRows = precedents.fixedRows || absRow || external;
+    precedents.fixedColumns = precedents.fixedColumns || absColumn || external;
+    if (external) {
+        // a sheet that is gone cannot change any more
+        if (std::shared_ptr<const CSpreadsheet> sheet = source.lock()) {
+            precedents.external.emplace_back(sheet.get(), CRect{key.first, key.second, key.first, key.second});
+        }
+        return;
+    }
+    precedents.cells.push_back(key);
+}
+
+size_t RefNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    return seen.insert(this).second ? sizeof(*this) + CONTROL_BLOCK : 0;
+}
+
+std::shared_ptr<Node> RefNode::relocate(const CRelocation &relocation) const {
+    // only cells of the relocated sheet move
+    if (external != (relocation.source != nullptr) || key.second == CFormulaText::INVALID_COLUMN) {
+        return nullptr;
+    }
+    std::shared_ptr<const CSpreadsheet> sheet = source.lock();
+    if (sheet.get() != relocation.source) {
+        return nullptr;
+    }
+    std::pair<size_t, size_t> moved = key;
+    if (!relocation.move(moved.first, moved.second)) {
+        return std::make_shared<RefNode>(1, CFormulaText::INVALID_COLUMN, true, true);
+    }
+    if (moved == key) {
+        return nullptr;
+    }
+    return std::make_shared<RefNode>(moved.first, moved.second, absRow, absColumn, sheet);
+}
+
+CTerm RangeNode::evaluate(const CSnapshot &sheet) const {
+    (void) sheet;
+    return CTerm();
+}
+
+bool RangeNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    (void) program;
+    (void) row;
+    (void) column;
+    return false;
+}
+
+void RangeNode::precedents(CPrecedents &precedents) const {
+    precedents.fixedRows = precedents.fixedRows || absRow || external;
+    precedents.fixedColumns = precedents.fixedColumns || absColumn || external;
+    if (external) {
+        if (std::shared_ptr<const CSpreadsheet> sheet = source.lock()) {
+            precedents.external.emplace_back(sheet.get(), CRect{top, left, bottom, right});
+        }
+        return;
+    }
+    precedents.ranges.push_back({top, left, bottom, right});
+}
+
+size_t RangeNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    return seen.insert(this).second ? sizeof(*this) + CONTROL_BLOCK : 0;
+}
+
+std::shared_ptr<Node> RangeNode::relocate(const CRelocation &relocation) const {
+    if (external != (relocation.source != nullptr) || left == CFormulaText::INVALID_COLUMN) {
+        return nullptr;
+    }
+    std::shared_ptr<const CSpreadsheet> sheet = source.lock();
+    if (sheet.get() != relocation.source) {
+        return nullptr;
+    }
+    size_t movedTop = top;
+    size_t movedLeft = left;
+    size_t movedBottom = bottom;
+    size_t movedRight = right;
+    bool kept = relocation.columns ? relocation.span(movedLeft, movedRight) : relocation.span(movedTop, movedBottom);
+    if (!kept) {
+        return std::make_shared<RangeNode>(1, CFormulaText::INVALID_COLUMN, 1, CFormulaText::INVALID_COLUMN, true, true);
+    }
+    if (movedTop == top && movedLeft == left && movedBottom == bottom && movedRight == right) {
+        return nullptr;
+    }
+    return std::make_shared<RangeNode>(movedTop, movedLeft, movedBottom, movedRight, absRow, absColumn, sheet);
+}
+
+CAggregate RangeNode::aggregate(const CSnapshot &sheet) const {
+    if (external) {
+        CCrossing crossing(this);
+        std::shared_ptr<const CSnapshot> version = crossing.entered ? versionOf(sheet, source) : nullptr;
+        return version ? version->aggregate({top, left, bottom, right}) : CAggregate();
+    }
+    return sheet.aggregate({top, left, bottom, right});
+}
+
+void RangeNode::forEachValue(const CSnapshot &sheet, const std::function<void(const CTerm &)> &visit) const {
+    if (external) {
+        CCrossing crossing(this);
+        std::shared_ptr<const CSnapshot> version = crossing.entered ? versionOf(sheet, source) : nullptr;
+        if (version) {
+            version->forEachValue({top, left, bottom, right}, visit);
+        }
+        return;
+    }
+    sheet.forEachValue({top, left, bottom, right}, visit);
+}
+
+size_t RangeNode::match(const CSnapshot &sheet, const CTerm &value, bool floor) const {
+    if (external) {
+        CCrossing crossing(this);
+        std::shared_ptr<const CSnapshot> version = crossing.entered ? versionOf(sheet, source) : nullptr;
+        return version ? version->match({top, left, bottom, right}, value, floor) : CColumnIndex::NOT_FOUND;
+    }
+    return sheet.match({top, left, bottom, right}, value, floor);
+}
+
+CTerm RangeNode::valueAt(const CSnapshot &sheet, size_t offset) const {
+    std::pair<size_t, size_t> key;
+    if (left == right && offset <= bottom - top) {
+        key = {top + offset, left};
+    } else if (top == bottom && offset <= right - left) {
+        key = {top, left + offset};
     } else {
-        positions.insert(value);
-        return sheet.getValueRec(CPos(value), positions);
+        return CTerm();
+    }
+    if (external) {
+        CCrossing crossing(this);
+        std::shared_ptr<const CSnapshot> version = crossing.entered ? versionOf(sheet, source) : nullptr;
+        return version ? version->getValueAt(key) : CTerm();
+    }
+    return sheet.getValueAt(key);
+}
+
+CTerm FunctionNode::evaluate(const CSnapshot &sheet) const {
+    return function->evaluate(sheet, args);
+}
+
+bool FunctionNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    (void) program;
+    (void) row;
+    (void) column;
+    return false;
+}
+
+void FunctionNode::precedents(CPrecedents &precedents) const {
+    for (const auto &arg: args) {
+        arg->precedents(precedents);
+    }
+}
+
+size_t FunctionNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    if (!seen.insert(this).second) {
+        return 0;
+    }
+    size_t result = sizeof(*this) + CONTROL_BLOCK + args.capacity() * sizeof(std::shared_ptr<Node>);
+    for (const auto &arg: args) {
+        result += arg->memoryUsage(seen);
+    }
+    return result;
+}
+
+std::shared_ptr<Node> FunctionNode::relocate(const CRelocation &relocation) const {
+    std::vector<std::shared_ptr<Node>> moved;
+    for (size_t i = 0; i < args.size(); ++i) {
+        std::shared_ptr<Node> arg = args[i]->relocate(relocation);
+        if (arg && moved.empty()) {
+            moved.assign(args.begin(), args.begin() + static_cast<std::ptrdiff_t>(i));
+        }
+        if (!moved.empty() || arg) {
+            moved.push_back(arg ? arg : args[i]);
+        }
+    }
+    if (moved.empty()) {
+        return nullptr;
     }
-}
\ No newline at end of file
+    return std::make_shared<FunctionNode>(*function, std::move(moved));
+}
+
+NumericNode::NumericNode(std::shared_ptr<Node> node, std::vector<CKernelOp> program)
+        : node(std::move(node)), program(std::move(program)) {}
+
+NumericNode::~NumericNode() = default;
+
+CTerm NumericNode::evaluate(const CSnapshot &sheet) const {
+    double stack[MAX_DEPTH];
+    size_t top = 0;
+    // an operand that is not a number, one slot keeps the frame small for long chains of formulas
+    CTerm value;
+    for (size_t i = 0; i < program.size(); ++i) {
+        const CKernelOp &instruction = program[i];
+        switch (instruction.type) {
+            case CKernelOp::Type::CONSTANT:
+                stack[top++] = instruction.constant;
+                continue;
+            case CKernelOp::Type::REFERENCE: {
+                // compiled at row 0 and column 0, so every reference is absolute
+                if (!sheet.getNumberAt({static_cast<size_t>(instruction.row), static_cast<size_t>(instruction.column)},
+                                       stack[top], value)) {
+                    return resume(sheet, stack, top, i + 1, std::move(value));
+                }
+                ++top;
+                continue;
+            }
+            case CKernelOp::Type::SHARED: {
+                if (!instruction.node->isShared()) {
+                    // no other formula uses it, its instructions follow
+                    continue;
+                }
+                i += instruction.length;
+                if (!sharedNumber(sheet, *instruction.node, stack[top], value)) {
+                    return resume(sheet, stack, top, i + 1, std::move(value));
+                }
+                ++top;
+                continue;
+            }
+            case CKernelOp::Type::OPERATOR:
+                break;
+        }
+        if (instruction.op == Operator::NEGATE) {
+            stack[top - 1] = -stack[top - 1];
+            continue;
+        }
+        double b = stack[--top];
+        double &a = stack[top - 1];
+        switch (instruction.op) {
+            case Operator::ADD:
+                a += b;
+                break;
+            case Operator::SUBTRACT:
+                a -= b;
+                break;
+            case Operator::MULTIPLY:
+                a *= b;
+                break;
+            case Operator::DIVIDE:
+                if (b == 0) {
+                    // only the quotient is undefined, what is built on it goes on as in the tree
+                    value = CTerm();
+                    return resume(sheet, stack, top - 1, i + 1, std::move(value));
+                }
+                a /= b;
+                break;
+            case Operator::POWER:
+                a = std::pow(a, b);
+                break;
+            case Operator::EQUAL:
+                a = a == b ? 1.0 : 0.0;
+                break;
+            case Operator::NOT_EQUAL:
+                a = a != b ? 1.0 : 0.0;
+                break;
+            case Operator::LESS_THAN:
+                a = a < b ? 1.0 : 0.0;
+                break;
+            case Operator::LESS_THAN_OR_EQUAL:
+                a = a <= b ? 1.0 : 0.0;
+                break;
+            case Operator::GREATER_THAN:
+                a = a > b ? 1.0 : 0.0;
+                break;
+            case Operator::GREATER_THAN_OR_EQUAL:
+                a = a >= b ? 1.0 : 0.0;
+                break;
+            default:
+                return node->value(sheet);
+        }
+    }
+    return stack[0];
+}
+
+bool NumericNode::sharedNumber(const CSnapshot &sheet, const Node &node, double &number, CTerm &value) {
+    value = sheet.getSharedValue(node);
+    if (!std::holds_alternative<double>(value)) {
+        return false;
+    }
+    number = std::get<double>(value);
+    return true;
+}
+
+CTerm NumericNode::resume(const CSnapshot &sheet, const double *numbers, size_t count, size_t next,
+                          CTerm &&value) const {
+    std::vector<CTerm> stack(numbers, numbers + count);
+    stack.push_back(std::move(value));
+    for (size_t i = next; i < program.size(); ++i) {
+        const CKernelOp &instruction = program[i];
+        switch (instruction.type) {
+            case CKernelOp::Type::CONSTANT:
+                stack.emplace_back(instruction.constant);
+                continue;
+            case CKernelOp::Type::REFERENCE:
+                stack.push_back(sheet.getValueAt({static_cast<size_t>(instruction.row),
+                                                  static_cast<size_t>(instruction.column)}));
+                continue;
+            case CKernelOp::Type::SHARED:
+                stack.push_back(instruction.node->value(sheet));
+                i += instruction.length;
+                continue;
+            case CKernelOp::Type::OPERATOR:
+                break;
+        }
+        if (instruction.op == Operator::NEGATE) {
+            stack.back() = OperatorNode::apply(Operator::NEGATE, stack.back(), CTerm());
+            continue;
+        }
+        CTerm b = std::move(stack.back());
+        stack.pop_back();
+        stack.back() = OperatorNode::apply(instruction.op, stack.back(), b);
+    }
+    return std::move(stack.back());
+}
+
+bool NumericNode::compile(std::vector<CKernelOp> &program, size_t row, size_t column) const {
+    return node->compile(program, row, column);
+}
+
+void NumericNode::precedents(CPrecedents &precedents) const {
+    node->precedents(precedents);
+}
+
+size_t NumericNode::memoryUsage(std::unordered_set<const Node *> &seen) const {
+    if (!seen.insert(this).second) {
+        return 0;
+    }
+    return sizeof(*this) + CONTROL_BLOCK + program.capacity() * sizeof(CKernelOp) + node->memoryUsage(seen);
+}
+
+std::shared_ptr<Node> NumericNode::relocate(const CRelocation &relocation) const {
+    std::shared_ptr<Node> moved = node->relocate(relocation);
+    // the program reads the cells of the old tree, it is compiled again
+    return moved ? wrap(std::move(moved)) : nullptr;
+}
+
+std::shared_ptr<Node> NumericNode::wrap(std::shared_ptr<Node> node) {
+    std::vector<CKernelOp> program;
+    if (!node || !node->compile(program, 0, 0)) {
+        return node;
+    }
+    size_t depth = 0;
+    size_t maxDepth = 0;
+    for (const auto &instruction: program) {
+        if (instruction.type == CKernelOp::Type::SHARED) {
+            continue;
+        }
+        if (instruction.type != CKernelOp::Type::OPERATOR) {
+            maxDepth = std::max(maxDepth, ++depth);
+        } else if (instruction.op != Operator::NEGATE) {
+            --depth;
+        }
+    }
+    if (maxDepth > MAX_DEPTH) {
+        return node;
+    }
+    return std::make_shared<NumericNode>(std::move(node), std::move(program));
+}
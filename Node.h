@@ -5,25 +5,77 @@
 #include <iostream>
 #include <cmath>
 #include <variant>
-#include "CSpreadsheet.h"
+#include <set>
+#include <string>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
+#include "CRangeIndex.h"
+#include "CDependencyGraph.h"
+#include "CRope.h"
+#include "CFunctionRegistry.h"
 
 using CValue = std::variant<std::monostate, double, std::string>;
 
+class CSnapshot;
 class CSpreadsheet;
+struct CKernelOp;
+struct CRelocation;
 
 /** @brief Node for AST
+ *
+ * Nodes are pooled by CNodePool, a node used by more than one formula is
+ * shared and its value is cached per version.
  */
-class Node {
+class Node : public std::enable_shared_from_this<Node> {
 public:
     /**  @brief default destructor
       */
     virtual ~Node() = default;
     /**  @brief evalueates an expression
      * @param sheet [in] an sheet needed to evaluate node
-     * @param positions [in] visited positions
      * @return Value depending on type of node
      */
-    virtual CValue evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) = 0;
+    virtual CTerm evaluate(const CSnapshot &sheet) const = 0;
+    /**  @brief compiles the expression into a numeric column program
+     * @param program [out] program the node is appended to
+     * @param row [in] row of the formula cell
+     * @param column [in] column of the formula cell
+     * @return bool True if the expression is numeric only, false otherwise.
+     */
+    virtual bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const = 0;
+    /**  @brief collects cells and ranges the expression reads
+     * @param precedents [out] precedents the node adds to
+     */
+    virtual void precedents(CPrecedents &precedents) const = 0;
+    /**  @brief estimates the memory of the expression
+     * @param seen [in, out] nodes counted already, each node of a DAG is counted once
+     * @return size_t bytes of the nodes not seen before.
+     */
+    virtual size_t memoryUsage(std::unordered_set<const Node *> &seen) const = 0;
+    /**  @brief moves references as inserted or deleted rows or columns move the cells
+     * @param relocation [in] inserted or deleted rows or columns
+     * @return std::shared_ptr<Node> new expression, nullptr if no reference of this one moves.
+     */
+    virtual std::shared_ptr<Node> relocate(const CRelocation &relocation) const = 0;
+    /**  @brief evaluates the node, a shared node only once per version
+     * @param sheet [in] an sheet needed to evaluate node
+     * @return Value of the node.
+     */
+    CTerm value(const CSnapshot &sheet) const;
+    /**  @brief marks the node as used by more than one formula
+     */
+    void share() const { shared.store(true, std::memory_order_relaxed); }
+    /**
+     * @brief tells whether the node is used by more than one formula
+     */
+    bool isShared() const { return shared.load(std::memory_order_relaxed); }
+private:
+    mutable std::atomic<bool> shared = false;
 };
 
 /** @brief Enum class representing all possible operations
@@ -56,10 +108,25 @@ public:
     ~OperatorNode() override = default;
     /**  @brief evalueates an expression
      * @param sheet [in] an sheet needed to evaluate node
-     * @param positions [in] visited positions
      * @return Value depending on type of operation.
      */
-    CValue evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) override;
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
+    /**  @brief applies an operator to computed operands
+     *
+     * ADD joins two texts or a text and a number. An undefined operand makes
+     * the arithmetic operators undefined, ADD of a text included, comparisons
+     * order it like CTerm does.
+     *
+     * @param op [in] an operator
+     * @param leftVal [in] left operand, the only one of NEGATE
+     * @param rightVal [in] right operand
+     * @return Value depending on type of operation.
+     */
+    static CTerm apply(Operator op, const CTerm &leftVal, const CTerm &rightVal);
     /**
      * @brief Setter for left node.
      */
@@ -78,36 +145,225 @@ private:
  */
 class ValueNode : public Node {
 public:
-    ValueNode(CValue value) : value(value) {}
+    ValueNode(const CValue &value) : value(CRope::term(value)) {}
     /**  @brief default destructor
      */
     ~ValueNode() override = default;
     /**  @brief evalueates an expression
      * @param sheet [in] an sheet needed to evaluate node
-     * @param positions [in] visited positions
      * @return Value.
      */
-    CValue evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) override;
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
 private:
-    CValue value;
+    CTerm value;
 };
 
 /** @brief Node representing Reference
+ *
+ * A reference to another sheet of the workbook reads the current version of
+ * that sheet. The sheet is held weakly, a copy of the sheet of the formula may
+ * outlive the workbook and then reads an undefined value.
  */
 class RefNode : public Node {
 public:
-    RefNode(std::string value) : value(value) {}
+    /**  @brief creates a new reference node
+     * @param row [in] referenced row
+     * @param column [in] referenced column
+     * @param absRow [in] the row is written with $
+     * @param absColumn [in] the column is written with $
+     * @param source [in] referenced sheet of the workbook, nullptr for the sheet of the formula
+     */
+    RefNode(size_t row, size_t column, bool absRow, bool absColumn,
+            const std::shared_ptr<const CSpreadsheet> &source = nullptr)
+            : key(row, column), absRow(absRow), absColumn(absColumn), external(source != nullptr), source(source) {}
     /**  @brief default destructor
      */
     ~RefNode() override = default;
     /**  @brief evalueates an expressi
      * @param sheet [in] an sheet needed to evaluate node
-     * @param positions [in] visited positions
      * @return Value depending on referenced position
      */
-    CValue evaluate(CSpreadsheet &sheet, std::set<std::string> &positions) override;
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
+private:
+    std::pair<size_t, size_t> key;
+    bool absRow;
+    bool absColumn;
+    // the cell is in another sheet, source may have expired since
+    bool external;
+    std::weak_ptr<const CSpreadsheet> source;
+};
+
+/** @brief Node representing a range of cells, e.g. A1:B7
+ *
+ * A range is not a value on its own, it is only an argument of a function. A
+ * range of another sheet holds the sheet weakly like RefNode, it is empty once
+ * the workbook is gone.
+ */
+class RangeNode : public Node {
+public:
+    /**  @brief creates a new range node, corners may be given in any order
+     * @param top [in] first row
+     * @param left [in] first column
+     * @param bottom [in] last row
+     * @param right [in] last column
+     * @param absRow [in] a row of a corner is written with $
+     * @param absColumn [in] a column of a corner is written with $
+     * @param source [in] sheet of the workbook the range is in, nullptr for the sheet of the formula
+     */
+    RangeNode(size_t top, size_t left, size_t bottom, size_t right, bool absRow, bool absColumn,
+              const std::shared_ptr<const CSpreadsheet> &source = nullptr)
+            : top(std::min(top, bottom)), left(std::min(left, right)),
+              bottom(std::max(top, bottom)), right(std::max(left, right)), absRow(absRow), absColumn(absColumn),
+              external(source != nullptr), source(source) {}
+    /**  @brief default destructor
+     */
+    ~RangeNode() override = default;
+    /**  @brief evalueates an expression
+     * @param sheet [in] an sheet needed to evaluate node
+     * @return Undefined value, a range has no value outside of a function.
+     */
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
+    /**  @brief aggregates the cells of the range
+     * @param sheet [in] an sheet needed to evaluate node
+     * @return CAggregate sum, minimum, maximum and count of numbers and count of defined values.
+     */
+    CAggregate aggregate(const CSnapshot &sheet) const;
+    /**  @brief visits the values of the cells of the range
+     * @param sheet [in] an sheet needed to evaluate node
+     * @param visit [in] called for every defined value
+     */
+    void forEachValue(const CSnapshot &sheet, const std::function<void(const CTerm &)> &visit) const;
+    /**  @brief finds a value in the range, see CSnapshot::match
+     * @param sheet [in] an sheet needed to evaluate node
+     * @param value [in] value to be found
+     * @param floor [in] find the largest value not above value instead of an equal one
+     * @return size_t offset of the cell in the range, CColumnIndex::NOT_FOUND if there is none.
+     */
+    size_t match(const CSnapshot &sheet, const CTerm &value, bool floor) const;
+    /**  @brief returns the value of a cell of a range of one row or column
+     * @param sheet [in] an sheet needed to evaluate node
+     * @param offset [in] offset of the cell in the range
+     * @return Value of the cell, undefined when the offset is outside of the range or the range is not one row or column.
+     */
+    CTerm valueAt(const CSnapshot &sheet, size_t offset) const;
 private:
-    std::string value;
+    size_t top;
+    size_t left;
+    size_t bottom;
+    size_t right;
+    bool absRow;
+    bool absColumn;
+    // the range is in another sheet, source may have expired since
+    bool external;
+    std::weak_ptr<const CSpreadsheet> source;
+};
+
+/** @brief Node representing a function call
+ *
+ * The function is resolved when the formula is built, it evaluates the
+ * arguments it needs itself.
+ */
+class FunctionNode : public Node {
+public:
+    /**  @brief creates a new function node
+     * @param function [in] function of CFunctionRegistry
+     * @param args [in] arguments in the order they were written
+     */
+    FunctionNode(const CFunctionRegistry::CFunction &function, std::vector<std::shared_ptr<Node>> args)
+            : function(&function), args(std::move(args)) {}
+    /**  @brief default destructor
+     */
+    ~FunctionNode() override = default;
+    /**  @brief evalueates an expression
+     * @param sheet [in] an sheet needed to evaluate node
+     * @return Value of the function, undefined when an argument depends on a cycle.
+     */
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
+private:
+    const CFunctionRegistry::CFunction *function;
+    std::vector<std::shared_ptr<Node>> args;
+};
+
+/** @brief Root of a formula that computes with numbers only
+ *
+ * Such formula is compiled into a postfix program once, when it is built, and
+ * evaluated on a small stack of doubles without creating any CValue. When a
+ * referenced cell does not hold a number, the rest of the program runs on
+ * values like the tree would, starting from the numbers and the value read so
+ * far, so no referenced cell is evaluated twice.
+ */
+class NumericNode : public Node {
+public:
+    static constexpr size_t MAX_DEPTH = 16;
+
+    /**  @brief creates a new numeric node
+     * @param node [in] the expression tree
+     * @param program [in] the expression compiled for a cell at row 0 and column 0
+     */
+    NumericNode(std::shared_ptr<Node> node, std::vector<CKernelOp> program);
+    /**  @brief default destructor
+     */
+    ~NumericNode() override;
+    /**  @brief evalueates an expression
+     * @param sheet [in] an sheet needed to evaluate node
+     * @return Value of the expression.
+     */
+    CTerm evaluate(const CSnapshot &sheet) const override;
+    bool compile(std::vector<CKernelOp> &program, size_t row, size_t column) const override;
+    void precedents(CPrecedents &precedents) const override;
+    size_t memoryUsage(std::unordered_set<const Node *> &seen) const override;
+    std::shared_ptr<Node> relocate(const CRelocation &relocation) const override;
+    /**  @brief wraps an expression into a numeric node if it computes with numbers only
+     * @param node [in] the expression tree
+     * @return std::shared_ptr<Node> numeric node, or the tree itself.
+     */
+    static std::shared_ptr<Node> wrap(std::shared_ptr<Node> node);
+    /**
+     * @brief Getter for the program compiled at row 0 and column 0.
+     */
+    const std::vector<CKernelOp> &getProgram() const { return program; }
+private:
+    std::shared_ptr<Node> node;
+    std::vector<CKernelOp> program;
+
+    /**
+     * @brief takes the cached value of a shared sub-expression, kept out of evaluate to keep its frame small
+     *
+     * @param sheet [in] an sheet needed to evaluate node
+     * @param node [in] the shared sub-expression
+     * @param number [out] the value when it is a number
+     * @param value [out] the value when it is not a number
+     * @return bool True if the value is a number.
+     */
+    static bool sharedNumber(const CSnapshot &sheet, const Node &node, double &number, CTerm &value);
+
+    /**
+     * @brief runs the rest of the program on values once a reference is not a number
+     *
+     * @param sheet [in] an sheet needed to evaluate node
+     * @param numbers [in] stack of doubles computed so far
+     * @param count [in] size of the stack
+     * @param next [in] instruction following the reference
+     * @param value [in] value of the reference
+     * @return Value of the expression.
+     */
+    CTerm resume(const CSnapshot &sheet, const double *numbers, size_t count, size_t next, CTerm &&value) const;
 };
 
 #endif // NODE_H
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <variant>
+#include "CPos.h"
+#include "CSpreadsheet.h"
+
+/* Allocation counts of the copy-on-write paths and failing allocations. The
+ * allocator of the whole binary is replaced for them, so they live apart from
+ * test.cpp.
+ */
+
+// bytes allocated by this thread
+static thread_local size_t allocatedBytes = 0;
+// large blocks asked for by other threads than the main one fail while set
+static std::atomic<bool> failLarge = false;
+static std::thread::id mainThread;
+
+void *operator new(size_t size) {
+    allocatedBytes += size;
+    if (failLarge.load() && size >= 64 * 1024 && std::this_thread::get_id() != mainThread) {
+        throw std::bad_alloc();
+    }
+    if (void *block = std::malloc(size ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void *block, size_t) noexcept {
+    std::free(block);
+}
+
+int main() {
+    CSpreadsheet x0;
+    for (int i = 1; i <= 20000; ++i) {
+        assert (x0.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+        assert (x0.setCell(CPos("B" + std::to_string(i)), "b" + std::to_string(i % 100)));
+    }
+    x0.setColumnIndex(2, CIndexKind::HASH);
+    // a write while a reader pins the version copies a few chunks, not the cells or the indexes
+    std::shared_ptr<const CSnapshot> pinned = x0.snapshot();
+    allocatedBytes = 0;
+    assert (x0.setCell(CPos("A10000"), "-1"));
+    assert (allocatedBytes < 64 * 1024);
+    CValue sum = x0.getValue(CPos("A10000"));
+    assert (std::holds_alternative<double>(sum) && std::get<double>(sum) == -1.0);
+    assert (x0.setCell(CPos("C1"), "=sum(A1:A20000)"));
+    sum = x0.getValue(CPos("C1"));
+    assert (std::holds_alternative<double>(sum) && std::get<double>(sum) == 199999999.0);
+
+    // a failure of resources in the background recalculation reaches its future, the worker goes on afterwards
+    CSpreadsheet x1;
+    assert (x1.setCell(CPos("A1"), "1"));
+    for (int i = 2; i <= 20000; ++i) {
+        assert (x1.setCell(CPos("A" + std::to_string(i)), "=A" + std::to_string(i - 1) + "+1"));
+    }
+    x1.setAsyncRecalc(true);
+    mainThread = std::this_thread::get_id();
+    failLarge = true;
+    assert (x1.setCell(CPos("A1"), "2"));
+    bool failed = false;
+    try {
+        x1.recalculation().get();
+    } catch (const std::bad_alloc &) {
+        failed = true;
+    }
+    failLarge = false;
+    assert (failed);
+    assert (x1.setCell(CPos("A1"), "3"));
+    x1.recalculation().get();
+    CValue last = x1.getValue(CPos("A20000"));
+    assert (std::holds_alternative<double>(last) && std::get<double>(last) == 20002.0);
+
+    // a failure of resources while a subscription reads the old values propagates before the write is published
+    CSpreadsheet x2;
+    for (int i = 1; i <= 20000; ++i) {
+        assert (x2.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+        assert (x2.setCell(CPos("B" + std::to_string(i)), "=A" + std::to_string(i) + "*2"));
+    }
+    assert (x2.setCell(CPos("C1"), "=sum(B1:B20000)"));
+    size_t calls = 0;
+    x2.subscribe(CPos("C1"), 1, 1, [&calls](const std::vector<CChange> &) { ++calls; });
+    bool thrown = false;
+    failLarge = true;
+    std::thread writer([&x2, &thrown]() {
+        try {
+            x2.setCell(CPos("A1"), "100");
+        } catch (const std::bad_alloc &) {
+            thrown = true;
+        }
+    });
+    writer.join();
+    failLarge = false;
+    assert (thrown && !calls);
+    CValue first = x2.getValue(CPos("A1"));
+    assert (std::holds_alternative<double>(first) && std::get<double>(first) == 1.0);
+    assert (x2.setCell(CPos("A1"), "100") && calls == 1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <functional>
+#include <vector>
+#include "CPos.h"
+#include "CSpreadsheet.h"
+#include "CFormulaText.h"
+#include "CFormulaParser.h"
+#include "ExpressionBuilder.h"
+
+/**
+ * @brief measures how long a function runs
+ *
+ * @param fn [in] function to be measured
+ * @return double duration in seconds.
+ */
+static double measure(const std::function<void()> &fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief fills a sheet with numbers, text and formula columns filled by copyRect
+ *
+ * @param sheet [in,out] sheet to be filled
+ * @param rows [in] number of rows
+ */
+static void fillSheet(CSpreadsheet &sheet, size_t rows) {
+    for (size_t r = 1; r <= rows; ++r) {
+        std::string row = std::to_string(r);
+        sheet.setCell(CPos("A" + row), std::to_string(r * 1.5));
+        sheet.setCell(CPos("B" + row), std::to_string(r));
+        sheet.setCell(CPos("C" + row), "item " + row);
+    }
+    sheet.setCell(CPos("D1"), "=A1*2+B1");
+    sheet.setCell(CPos("E1"), "=$A$1+D1");
+    for (size_t filled = 1; filled < rows;) {
+        size_t h = std::min(filled, rows - filled);
+        sheet.copyRect(CPos("D" + std::to_string(filled + 1)), CPos("D1"), 2, static_cast<int>(h));
+        filled += h;
+    }
+}
+
+/**
+ * @brief prints one line of the format report
+ */
+static void report(const std::string &name, size_t bytes, double saveTime, double loadTime) {
+    double mb = static_cast<double>(bytes) / (1024.0 * 1024.0);
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::setw(14) << bytes << " B"
+              << std::setw(12) << std::fixed << std::setprecision(1) << mb / saveTime << " MB/s save"
+              << std::setw(12) << mb / loadTime << " MB/s load"
+              << std::setw(10) << std::setprecision(3) << saveTime << " s"
+              << std::setw(10) << loadTime << " s" << std::endl;
+}
+
+/**
+ * @brief formulas of the shapes the generator writes, relative and absolute references, ranges and strings
+ *
+ * @param rows [in] number of rows the formulas read
+ * @return std::vector<std::string> the formulas.
+ */
+static std::vector<std::string> formulaCorpus(size_t rows) {
+    std::vector<std::string> corpus;
+    for (size_t r = 1; r <= rows; ++r) {
+        std::string row = std::to_string(r);
+        std::string top = std::to_string(r > 1000 ? r - 999 : 1);
+        corpus.push_back("=A" + row + "*2+B" + row);
+        corpus.push_back("=$A$1+D" + row);
+        corpus.push_back("=sum(A" + top + ":A" + row + ")-max($B$1:$B$" + row + ")/2");
+        corpus.push_back("=if(C" + row + "=\"item " + row + "\", -A" + row + "^2, countval(1.5e3, B1:C" + row + "))");
+    }
+    return corpus;
+}
+
+/**
+ * @brief builds the expressions of all formulas by a parser
+ *
+ * @param corpus [in] formulas
+ * @param parse [in] parser feeding the builder
+ * @return double duration in seconds.
+ */
+static double measureParser(const std::vector<std::string> &corpus,
+                            const std::function<void(const std::string &, ExpressionBuilder &)> &parse) {
+    return measure([&]() {
+        for (const auto &formula: corpus) {
+            ExpressionBuilder builder;
+            parse(formula, builder);
+            builder.getAST();
+        }
+    });
+}
+
+/** @brief CExprBuilder ignoring the expression, measures parseExpression alone.
+ */
+class CNullExprBuilder : public CExprBuilder {
+public:
+    void opAdd() override {}
+
+    void opSub() override {}
+
+    void opMul() override {}
+
+    void opDiv() override {}
+
+    void opPow() override {}
+
+    void opNeg() override {}
+
+    void opEq() override {}
+
+    void opNe() override {}
+
+    void opLt() override {}
+
+    void opLe() override {}
+
+    void opGt() override {}
+
+    void opGe() override {}
+
+    void valNumber(double) override {}
+
+    void valString(std::string) override {}
+
+    void valReference(std::string) override {}
+
+    void valRange(std::string) override {}
+
+    void funcCall(std::string, int) override {}
+};
+
+/**
+ * @brief writes lookup formulas into column G and evaluates each of them
+ *
+ * @param sheet [in,out] sheet filled by fillSheet
+ * @param rows [in] number of rows of the sheet
+ * @param lookups [in] number of formulas
+ * @param formula [in] builds the formula looking up given row of the sheet
+ * @return double duration in seconds.
+ */
+static double measureLookups(CSpreadsheet &sheet, size_t rows, size_t lookups,
+                             const std::function<std::string(size_t)> &formula) {
+    return measure([&]() {
+        for (size_t i = 1; i <= lookups; ++i) {
+            CPos pos("G" + std::to_string(i));
+            sheet.setCell(pos, formula((i * 7919) % rows + 1));
+            sheet.getValue(pos);
+        }
+    });
+}
+
+int main(int argc, char *argv[]) {
+    size_t rows = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    CSpreadsheet sheet;
+    double fillTime = measure([&]() { fillSheet(sheet, rows); });
+    std::cout << rows << " rows, " << rows * 5 << " cells, filled in " << fillTime << " s" << std::endl;
+
+    double evalTime = measure([&]() {
+        for (size_t r = 1; r <= rows; ++r) {
+            sheet.getValue(CPos("E" + std::to_string(r)));
+        }
+    });
+    std::cout << "formula columns evaluated in " << evalTime << " s" << std::endl;
+
+    std::ostringstream text;
+    double textSave = measure([&]() { sheet.save(text); });
+    std::istringstream textIn(text.str());
+    CSpreadsheet textLoaded;
+    bool textOk = false;
+    double textLoad = measure([&]() { textOk = textLoaded.load(textIn); });
+
+    std::ostringstream compact;
+    double compactSave = measure([&]() { sheet.saveCompact(compact); });
+    std::istringstream compactIn(compact.str());
+    CSpreadsheet compactLoaded;
+    bool compactOk = false;
+    double compactLoad = measure([&]() { compactOk = compactLoaded.loadCompact(compactIn); });
+
+    std::vector<std::string> corpus = formulaCorpus(rows);
+    double external = measureParser(corpus, [](const std::string &formula, ExpressionBuilder &builder) {
+        parseExpression(formula, builder);
+    });
+    double inTree = measureParser(corpus, [](const std::string &formula, ExpressionBuilder &builder) {
+        CFormulaParser::parse(formula, builder);
+    });
+    std::cout << corpus.size() << " formulas built in " << external << " s by parseExpression, " << inTree
+              << " s by CFormulaParser" << std::endl;
+    double externalAlone = measure([&]() {
+        CNullExprBuilder builder;
+        for (const auto &formula: corpus) {
+            parseExpression(formula, builder);
+        }
+    });
+    double inTreeAlone = measure([&]() {
+        CNullBuilder builder;
+        for (const auto &formula: corpus) {
+            CBasicFormulaParser<CNullBuilder>::parse(formula, builder);
+        }
+    });
+    std::cout << corpus.size() << " formulas parsed with a no-op builder in " << externalAlone
+              << " s by parseExpression, " << inTreeAlone << " s by CFormulaParser" << std::endl;
+
+    size_t lookups = 20;
+    std::string last = std::to_string(rows);
+    auto match = [&last](size_t row) {
+        return "=match(\"item " + std::to_string(row) + "\", C1:C" + last + ")";
+    };
+    // E = 2 * A + B + A1 grows with the row, so lookup finds the row itself
+    auto lookup = [&last](size_t row) {
+        return "=lookup(" + std::to_string(4.0 * row + 1.5) + ", E1:E" + last + ", B1:B" + last + ")";
+    };
+    double matchScan = measureLookups(sheet, rows, lookups, match);
+    double lookupScan = measureLookups(sheet, rows, lookups, lookup);
+    sheet.setColumnIndex(3, CIndexKind::HASH);
+    sheet.setColumnIndex(5, CIndexKind::SORTED);
+    double matchIndex = measureLookups(sheet, rows, lookups, match);
+    double lookupIndex = measureLookups(sheet, rows, lookups, lookup);
+    std::cout << lookups << " match over text in " << matchScan << " s by scan, " << matchIndex
+              << " s with HASH index" << std::endl;
+    std::cout << lookups << " lookup over formulas in " << lookupScan << " s by scan, " << lookupIndex
+              << " s with SORTED index" << std::endl;
+
+    report("text", text.str().size(), textSave, textLoad);
+    report("compact", compact.str().size(), compactSave, compactLoad);
+    CPos lastFormula("E" + last);
+    if (!textOk || !compactOk || compactLoaded.getValue(lastFormula) != sheet.getValue(lastFormula)) {
+        std::cout << "round trip FAILED" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
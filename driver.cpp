@@ -0,0 +1,114 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <functional>
+#include "CPos.h"
+#include "CSpreadsheet.h"
+#include "CFormulaText.h"
+
+/**
+ * @brief measures how long a function runs
+ *
+ * @param fn [in] function to be measured
+ * @return double duration in seconds.
+ */
+static double measure(const std::function<void()> &fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief position of a cell given by its row and column
+ */
+static CPos position(size_t row, size_t column) {
+    return CPos(CFormulaText::columnName(column) + std::to_string(row));
+}
+
+/**
+ * @brief reads every cell of the bounding rectangle, STRIP rows at a time
+ *
+ * @return size_t number of defined values.
+ */
+static size_t evaluateAll(const CSpreadsheet &sheet, size_t rows, size_t columns) {
+    constexpr size_t STRIP = 4096;
+    size_t defined = 0;
+    for (size_t top = 1; top <= rows; top += STRIP) {
+        size_t h = std::min(STRIP, rows - top + 1);
+        for (const auto &row: sheet.getValues(position(top, 1), static_cast<int>(columns), static_cast<int>(h))) {
+            for (const auto &value: row) {
+                defined += value.index() != 0;
+            }
+        }
+    }
+    return defined;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <file> [--compact] [edits] [seed] [processes]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    bool compact = argc > 2 && std::strcmp(argv[2], "--compact") == 0;
+    int next = compact ? 3 : 2;
+    size_t edits = argc > next ? std::strtoull(argv[next], nullptr, 10) : 1000;
+    std::mt19937_64 random(argc > next + 1 ? std::strtoull(argv[next + 1], nullptr, 10) : 1);
+    size_t processes = argc > next + 2 ? std::strtoull(argv[next + 2], nullptr, 10) : 1;
+
+    CSpreadsheet sheet;
+    std::ifstream file(argv[1], std::ios::binary);
+    bool loaded = false;
+    double loadTime = measure([&]() { loaded = compact ? sheet.loadCompact(file) : sheet.load(file); });
+    if (!loaded) {
+        std::cerr << "cannot load " << argv[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t rows = 0;
+    size_t columns = 0;
+    std::vector<std::pair<size_t, size_t>> numbers;
+    {
+        auto version = sheet.snapshot();
+        for (const auto &[key, cell]: version->getCells()) {
+            rows = std::max(rows, key.first);
+            columns = std::max(columns, key.second);
+            if (std::holds_alternative<double>(cell.first)) {
+                numbers.push_back(key);
+            }
+        }
+        std::cout << version->getCells().size() << " cells in " << rows << " rows and " << columns
+                  << " columns, loaded in " << loadTime << " s" << std::endl;
+    }
+
+    size_t defined = 0;
+    double evalTime = measure([&]() {
+        if (processes > 1) {
+            sheet.recalculateInProcesses(processes);
+        }
+        defined = evaluateAll(sheet, rows, columns);
+    });
+    std::cout << "full evaluation in " << evalTime << " s (" << processes << " processes), " << defined
+              << " defined values" << std::endl;
+
+    if (!numbers.empty()) {
+        double editTime = measure([&]() {
+            for (size_t i = 0; i < edits; ++i) {
+                auto [row, column] = numbers[random() % numbers.size()];
+                sheet.setCell(position(row, column), std::to_string(random() % 1000));
+            }
+        });
+        std::cout << edits << " edits in " << editTime << " s" << std::endl;
+        double recalcTime = measure([&]() { evaluateAll(sheet, rows, columns); });
+        std::cout << "evaluation after edits in " << recalcTime << " s" << std::endl;
+    }
+
+    CMemoryUsage usage = sheet.memoryUsage();
+    std::cout << "memory " << usage.total() << " B: cells " << usage.cells << ", strings " << usage.strings
+              << ", formulas " << usage.formulas << ", caches " << usage.caches << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <functional>
+#include <map>
+#include "CSpreadsheet.h"
+#include "CFormulaText.h"
+
+/**
+ * @brief writes sheets in the save format without building them in memory
+ */
+class CSheetWriter {
+public:
+    /**
+     * @param os [in] stream the cells are written into
+     */
+    explicit CSheetWriter(std::ostream &os) : os(os) {}
+
+    /**
+     * @brief writes a number cell
+     */
+    void number(size_t row, size_t column, long long value) {
+        os << row << ' ' << column << " 1 1 " << value << '\n';
+        ++count;
+    }
+
+    /**
+     * @brief writes a text or formula cell
+     */
+    void text(size_t row, size_t column, const std::string &value) {
+        os << row << ' ' << column << " 2 " << value.length() << ' ' << value << '\n';
+        ++count;
+    }
+
+    /**
+     * @brief number of cells written so far
+     */
+    size_t cells() const {
+        return count;
+    }
+
+private:
+    std::ostream &os;
+    size_t count = 0;
+};
+
+using CShape = std::function<void(CSheetWriter &, size_t, std::mt19937_64 &)>;
+
+/**
+ * @brief name of a cell, e.g. B7
+ */
+static std::string cell(size_t row, size_t column, bool absolute = false) {
+    std::string dollar = absolute ? "$" : "";
+    return dollar + CFormulaText::columnName(column) + dollar + std::to_string(row);
+}
+
+/**
+ * @brief formulas reading one to three random cells of earlier rows, the cells form a random DAG
+ */
+static void randomDag(CSheetWriter &out, size_t cells, std::mt19937_64 &random) {
+    constexpr size_t WIDTH = 16;
+    size_t rows = (cells + WIDTH - 1) / WIDTH;
+    for (size_t row = 1; row <= rows; ++row) {
+        for (size_t column = 1; column <= WIDTH && out.cells() < cells; ++column) {
+            if (row == 1) {
+                out.number(row, column, static_cast<long long>(random() % 1000));
+                continue;
+            }
+            static const char *OPERATORS[] = {"+", "-", "*", "+"};
+            std::string formula = "=";
+            size_t refs = 1 + random() % 3;
+            for (size_t i = 0; i < refs; ++i) {
+                if (i) {
+                    formula += OPERATORS[random() % 4];
+                }
+                // drawn one by one, the order of arguments is unspecified
+                size_t source = 1 + random() % (row - 1);
+                formula += cell(source, 1 + random() % WIDTH);
+            }
+            out.text(row, column, formula);
+        }
+    }
+}
+
+/**
+ * @brief columns of formulas each reading the cell above, CHAIN rows long
+ */
+static void longChains(CSheetWriter &out, size_t cells, std::mt19937_64 &random) {
+    constexpr size_t CHAIN = 100000;
+    for (size_t column = 1; out.cells() < cells; ++column) {
+        out.number(1, column, static_cast<long long>(random() % 100));
+        for (size_t row = 2; row <= CHAIN && out.cells() < cells; ++row) {
+            out.text(row, column, "=" + cell(row - 1, column) + "+1");
+        }
+    }
+}
+
+/**
+ * @brief a column of numbers aggregated by sliding windows of WINDOW rows
+ */
+static void fanIn(CSheetWriter &out, size_t cells, std::mt19937_64 &random) {
+    constexpr size_t WINDOW = 1000;
+    static const char *FUNCTIONS[] = {"sum", "count", "min", "max"};
+    size_t rows = (cells + 1) / 2;
+    for (size_t row = 1; row <= rows && out.cells() < cells; ++row) {
+        out.number(row, 1, static_cast<long long>(random() % 100000));
+    }
+    for (size_t row = 1; row <= rows && out.cells() < cells; ++row) {
+        size_t top = row > WINDOW ? row - WINDOW + 1 : 1;
+        out.text(row, 2, std::string("=") + FUNCTIONS[random() % 4] + "(" + cell(top, 1) + ":" + cell(row, 1) + ")");
+    }
+}
+
+/**
+ * @brief numbers with formula columns as copyRect fills them, relative and absolute references
+ */
+static void filledColumns(CSheetWriter &out, size_t cells, std::mt19937_64 &random) {
+    size_t rows = (cells + 3) / 4;
+    for (size_t row = 1; row <= rows && out.cells() < cells; ++row) {
+        out.number(row, 1, static_cast<long long>(random() % 10000));
+        if (out.cells() < cells) {
+            out.number(row, 2, static_cast<long long>(random() % 10000));
+        }
+        if (out.cells() < cells) {
+            out.text(row, 3, "=" + cell(row, 1) + "*2+" + cell(row, 2));
+        }
+        if (out.cells() < cells) {
+            out.text(row, 4, "=" + cell(1, 1, true) + "+" + cell(row, 3));
+        }
+    }
+}
+
+/**
+ * @brief random words of various lengths and formulas joining them
+ */
+static void textHeavy(CSheetWriter &out, size_t cells, std::mt19937_64 &random) {
+    size_t rows = (cells + 2) / 3;
+    for (size_t row = 1; row <= rows && out.cells() < cells; ++row) {
+        for (size_t column = 1; column <= 2 && out.cells() < cells; ++column) {
+            std::string word(3 + random() % 60, ' ');
+            for (auto &c: word) {
+                c = static_cast<char>('a' + random() % 26);
+            }
+            out.text(row, column, word);
+        }
+        if (out.cells() < cells) {
+            out.text(row, 3, "=" + cell(row, 1) + "+" + cell(row, 2));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const std::map<std::string, CShape> shapes = {
+            {"dag",    randomDag},
+            {"chain",  longChains},
+            {"fanin",  fanIn},
+            {"filled", filledColumns},
+            {"text",   textHeavy},
+    };
+    if (argc < 5 || !shapes.contains(argv[1])) {
+        std::cerr << "usage: " << argv[0] << " dag|chain|fanin|filled|text <cells> <seed> <file> [--compact]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t cells = std::strtoull(argv[2], nullptr, 10);
+    std::mt19937_64 random(std::strtoull(argv[3], nullptr, 10));
+    bool compact = argc > 5 && std::strcmp(argv[5], "--compact") == 0;
+
+    std::stringstream text;
+    std::ofstream file;
+    std::ostream *os = &text;
+    if (!compact) {
+        file.open(argv[4], std::ios::binary);
+        os = &file;
+    }
+    CSheetWriter writer(*os);
+    shapes.at(argv[1])(writer, cells, random);
+    if (!os->good()) {
+        std::cerr << "cannot write " << argv[4] << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (compact) {
+        // the compact format is only written by CSpreadsheet itself
+        CSpreadsheet sheet;
+        std::ofstream out(argv[4], std::ios::binary);
+        if (!sheet.load(text) || !sheet.saveCompact(out)) {
+            std::cerr << "cannot write " << argv[4] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::cout << writer.cells() << " cells written to " << argv[4] << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -33,10 +33,17 @@
 #include <charconv>
 #include <span>
 #include <utility>
+#include <thread>
+#include <filesystem>
+#include <atomic>
 #include "expression.h"
 #include "ExpressionBuilder.h"
 #include "CPos.h"
 #include "CSpreadsheet.h"
+#include "CWorkbook.h"
+#include "CProcessEvaluator.h"
+#include "CFormulaText.h"
+#include "CSharedMap.h"
 
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
@@ -149,6 +156,16 @@ int main() {
     iss.clear();
     iss.str(data);
     assert (!x1.load(iss));
+    CSpreadsheet texts;
+    assert (texts.setCell(CPos("A1"), "") && texts.setCell(CPos("A2"), std::string("nul\0inside", 10)));
+    oss.clear();
+    oss.str("");
+    assert (texts.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x1.load(iss));
+    assert (valueMatch(x1.getValue(CPos("A1")), CValue()));
+    assert (valueMatch(x1.getValue(CPos("A2")), CValue(std::string("nul\0inside", 10))));
     assert (x0.setCell(CPos("D0"), "10"));
     assert (x0.setCell(CPos("D1"), "20"));
     assert (x0.setCell(CPos("D2"), "30"));
@@ -196,6 +213,894 @@ int main() {
     assert (valueMatch(x0.getValue(CPos("H12")), CValue(25.0)));
     assert (valueMatch(x0.getValue(CPos("H13")), CValue(-22.0)));
     assert (valueMatch(x0.getValue(CPos("H14")), CValue(-22.0)));
+    // + joins a text with a text or a number, with an undefined operand it is undefined like for two numbers
+    CSpreadsheet x0Text;
+    assert (x0Text.setCell(CPos("A1"), "ab") && x0Text.setCell(CPos("A2"), "2") && x0Text.setCell(CPos("A3"), "=Z9"));
+    assert (x0Text.setCell(CPos("B1"), "=A1+A2") && x0Text.setCell(CPos("B2"), "=A2+A1"));
+    assert (x0Text.setCell(CPos("B3"), "=A1+C1") && x0Text.setCell(CPos("B4"), "=C1+A1") && x0Text.setCell(CPos("B5"), "=A1+A3"));
+    assert (x0Text.setCell(CPos("B6"), "=A2+C1"));
+    assert (valueMatch(x0Text.getValue(CPos("B1")), CValue("ab2.000000")));
+    assert (valueMatch(x0Text.getValue(CPos("B2")), CValue("2.000000ab")));
+    assert (valueMatch(x0Text.getValue(CPos("B3")), CValue()) && valueMatch(x0Text.getValue(CPos("B4")), CValue()));
+    assert (valueMatch(x0Text.getValue(CPos("B5")), CValue()) && valueMatch(x0Text.getValue(CPos("B6")), CValue()));
+
+    CSpreadsheet x2;
+    assert (x2.setCell(CPos("A1"), "1"));
+    assert (x2.setCell(CPos("A2"), "=A1*2"));
+    assert (x2.setCell(CPos("A3"), "=A2+A1"));
+    std::atomic<bool> readersOk = true;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 8; ++t) {
+        readers.emplace_back([&x2, &readersOk]() {
+            for (int i = 0; i < 2000; ++i) {
+                CValue v = x2.getValue(CPos("A3"));
+                if (!valueMatch(v, CValue(3.0)) && !valueMatch(v, CValue(6.0))) {
+                    readersOk = false;
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 200; ++i) {
+        assert (x2.setCell(CPos("A1"), i % 2 ? "1" : "2"));
+    }
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    assert (readersOk);
+
+    std::shared_ptr<const CSnapshot> pinned = x2.snapshot();
+    CValue pinnedA3 = pinned->getValue(CPos("A3"));
+    assert (x2.setCell(CPos("A1"), "10"));
+    assert (x2.setCell(CPos("A2"), "=A1*3"));
+    assert (valueMatch(pinned->getValue(CPos("A3")), pinnedA3));
+    assert (valueMatch(x2.getValue(CPos("A3")), CValue(40.0)));
+    assert (x2.snapshot()->getEpoch() > pinned->getEpoch());
+    pinned.reset();
+    assert (x2.setCell(CPos("A1"), "20"));
+    assert (valueMatch(x2.getValue(CPos("A3")), CValue(80.0)));
+
+    CSharedMap<int, int> original;
+    for (int i = 0; i < 1000; ++i) {
+        original[(i * 7919) % 1000] = i;
+    }
+    CSharedMap<int, int> copy = original;
+    copy[500] = -1;
+    assert (copy.erase(0) == 1 && copy.erase(0) == 0);
+    copy[1000] = 1000;
+    assert (original.size() == 1000 && copy.size() == 1000);
+    assert (original.at(0) == 0 && !copy.contains(0) && copy.at(1000) == 1000);
+    assert (original.at(500) != -1 && copy.at(500) == -1);
+    assert (std::is_sorted(copy.begin(), copy.end()) && copy.lower_bound(1)->first == 1);
+    int expected = 0;
+    for (const auto &[key, value]: original) {
+        assert (key == expected++ && (value * 7919) % 1000 == key);
+    }
+
+    std::string snapshotPath = (std::filesystem::temp_directory_path() / "big_test.snapshot").string();
+    std::string journalPath = (std::filesystem::temp_directory_path() / "big_test.journal").string();
+    {
+        CSpreadsheet x3;
+        assert (x3.setCell(CPos("A1"), "5"));
+        assert (x3.attachJournal(snapshotPath, journalPath, 4));
+        assert (x3.setCell(CPos("A2"), "=A1*2"));
+        assert (x3.setCell(CPos("B1"), "text"));
+        x3.copyRect(CPos("A3"), CPos("A2"));
+        assert (x3.setCell(CPos("A1"), "7"));
+        assert (x3.setCell(CPos("C1"), "=A1+A2+A3"));
+        assert (x3.setCell(CPos("C2"), "=\"multi\nline\""));
+    }
+    {
+        std::ofstream torn(journalPath, std::ios::app);
+        torn << "99 S 1 1 40 =A";
+    }
+    CSpreadsheet x4;
+    assert (x4.setCell(CPos("Z9"), "1"));
+    assert (x4.recover(snapshotPath, journalPath));
+    assert (valueMatch(x4.getValue(CPos("Z9")), CValue()));
+    assert (valueMatch(x4.getValue(CPos("A2")), CValue(14.0)));
+    assert (valueMatch(x4.getValue(CPos("A3")), CValue(28.0)));
+    assert (valueMatch(x4.getValue(CPos("B1")), CValue("text")));
+    assert (valueMatch(x4.getValue(CPos("C1")), CValue(49.0)));
+    assert (valueMatch(x4.getValue(CPos("C2")), CValue("multi\nline")));
+    assert (x4.setCell(CPos("A1"), "1"));
+    x4.detachJournal();
+    CSpreadsheet x5;
+    assert (x5.recover(snapshotPath, journalPath));
+    assert (valueMatch(x5.getValue(CPos("C1")), CValue(7.0)));
+    std::filesystem::remove(snapshotPath);
+    std::filesystem::remove(journalPath);
+
+    {
+        CSpreadsheet moving;
+        assert (moving.setCell(CPos("A1"), "3") && moving.setCell(CPos("B2"), "=A1*2"));
+        assert (moving.attachJournal(snapshotPath, journalPath, 100));
+        moving.insertRows(1, 2);
+        assert (moving.setCell(CPos("C4"), "=B4+A3"));
+        moving.deleteRows(1);
+    }
+    CSpreadsheet moved;
+    assert (moved.recover(snapshotPath, journalPath));
+    assert (valueMatch(moved.getValue(CPos("A1")), CValue()) && valueMatch(moved.getValue(CPos("A2")), CValue(3.0)));
+    assert (valueMatch(moved.getValue(CPos("B3")), CValue(6.0)) && valueMatch(moved.getValue(CPos("C3")), CValue(9.0)));
+    std::filesystem::remove(snapshotPath);
+    std::filesystem::remove(journalPath);
+
+    if (std::filesystem::exists("/dev/full")) {
+        // a write the journal cannot record is refused
+        CSpreadsheet full;
+        full.setHistoryLimit(size_t(1) << 20);
+        assert (full.setCell(CPos("A1"), "3"));
+        assert (full.attachJournal(snapshotPath, "/dev/full"));
+        assert (!full.setCell(CPos("A2"), "4") && !full.copyRect(CPos("B1"), CPos("A1")));
+        assert (valueMatch(full.getValue(CPos("A2")), CValue()) && valueMatch(full.getValue(CPos("B1")), CValue()));
+        // so is an undo, the edit stays to be undone
+        assert (!full.undo() && valueMatch(full.getValue(CPos("A1")), CValue(3.0)));
+        // and so is a relocation, the cells stay where they were
+        assert (!full.insertRows(0) && !full.deleteColumns(1));
+        assert (valueMatch(full.getValue(CPos("A1")), CValue(3.0)) && valueMatch(full.getValue(CPos("A2")), CValue()));
+        full.detachJournal();
+        assert (full.undo() && valueMatch(full.getValue(CPos("A1")), CValue()));
+        std::filesystem::remove(snapshotPath);
+    }
+
+    CSpreadsheet x6;
+    assert (x6.setCell(CPos("A1"), "1.25"));
+    assert (x6.setCell(CPos("A2"), "-7"));
+    assert (x6.setCell(CPos("A3"), "plain \"text\""));
+    assert (x6.setCell(CPos("B1"), "=\"A1\"\"\"+A1"));
+    assert (x6.setCell(CPos("C1"), "=A1*$A$2"));
+    x6.copyRect(CPos("C2"), CPos("C1"), 1, 2);
+    oss.clear();
+    oss.str("");
+    assert (x6.saveCompact(oss));
+    iss.clear();
+    iss.str(oss.str());
+    CSpreadsheet x7;
+    assert (x7.loadCompact(iss));
+    assert (valueMatch(x7.getValue(CPos("A1")), CValue(1.25)));
+    assert (valueMatch(x7.getValue(CPos("A3")), CValue("plain \"text\"")));
+    assert (valueMatch(x7.getValue(CPos("B1")), CValue("A1\"1.250000")));
+    assert (valueMatch(x7.getValue(CPos("C2")), CValue(49.0)));
+    assert (valueMatch(x7.getValue(CPos("C3")), CValue()));
+    data = oss.str();
+    data[data.length() / 2] ^= 0x5a;
+    iss.clear();
+    iss.str(data);
+    assert (!x7.loadCompact(iss));
+
+    CSpreadsheet x8;
+    for (int r = 1; r <= 3000; ++r) {
+        assert (x8.setCell(CPos("A" + std::to_string(r)), std::to_string(r)));
+    }
+    assert (x8.setCell(CPos("A1500"), "text"));
+    assert (x8.setCell(CPos("A1600"), "0"));
+    assert (x8.setCell(CPos("B1"), "=(A1*2+$A$2)/A1 - (A1 > 1000)"));
+    for (int r = 2; r <= 3000; ++r) {
+        x8.copyRect(CPos("B" + std::to_string(r)), CPos("B1"));
+    }
+    assert (valueMatch(x8.getValue(CPos("B1000")), CValue(2.002)));
+    assert (valueMatch(x8.getValue(CPos("B1001")), CValue(2.0 + 2.0 / 1001 - 1.0)));
+    assert (valueMatch(x8.getValue(CPos("B1500")), CValue()));
+    assert (valueMatch(x8.getValue(CPos("B1600")), CValue()));
+    assert (valueMatch(x8.getValue(CPos("B3000")), CValue(2.0 + 2.0 / 3000 - 1.0)));
+    assert (x8.setCell(CPos("A2"), "4"));
+    assert (valueMatch(x8.getValue(CPos("B1000")), CValue(2.004)));
+    assert (x8.setCell(CPos("C1"), "=(2>=1/A1)+(1/A1>=2)*10"));
+    for (int r = 2; r <= 3000; ++r) {
+        x8.copyRect(CPos("C" + std::to_string(r)), CPos("C1"));
+    }
+    assert (valueMatch(x8.getValue(CPos("C1600")), CValue(1.0)));
+    assert (valueMatch(x8.getValue(CPos("C1599")), CValue(1.0)) && valueMatch(x8.getValue(CPos("C1601")), CValue(1.0)));
+    assert (x8.setCell(CPos("D1"), "1") && x8.setCell(CPos("D2"), "=$D1+1"));
+    for (int r = 3; r <= 3000; ++r) {
+        x8.copyRect(CPos("D" + std::to_string(r)), CPos("D2"));
+    }
+    assert (valueMatch(x8.getValue(CPos("D3000")), CValue(3000.0)));
+    CSpreadsheet zero;
+    assert (zero.setCell(CPos("B3"), "0") && zero.setCell(CPos("C2"), "20") && zero.setCell(CPos("E2"), "1"));
+    assert (zero.setCell(CPos("A1"), "=2>=1/0") && zero.setCell(CPos("A2"), "=1/0>=2"));
+    assert (zero.setCell(CPos("A3"), "=(1/B3)=(1/B3)") && zero.setCell(CPos("A4"), "=3^(C2>=10+E2/B3)"));
+    assert (valueMatch(zero.getValue(CPos("A1")), CValue(1.0)) && valueMatch(zero.getValue(CPos("A2")), CValue(0.0)));
+    assert (valueMatch(zero.getValue(CPos("A3")), CValue(1.0)) && valueMatch(zero.getValue(CPos("A4")), CValue(3.0)));
+
+    CSpreadsheet huge;
+    for (int r = 1; r <= 300; ++r) {
+        assert (huge.setCell(CPos("A" + std::to_string(r)), "0.5"));
+    }
+    assert (huge.setCell(CPos("B1"), "=sum($A$1:$A$300)"));
+    assert (huge.setCell(CPos("A200"), "1e20") && valueMatch(huge.getValue(CPos("B1")), CValue(1e20 + 149.5)));
+    // a huge value written and restored leaves no rounding error in the index
+    assert (huge.setCell(CPos("A200"), "0.5") && valueMatch(huge.getValue(CPos("B1")), CValue(150.0)));
+
+    CSpreadsheet x9;
+    for (int r = 1; r <= 1000; ++r) {
+        assert (x9.setCell(CPos("A" + std::to_string(r)), std::to_string(r)));
+    }
+    assert (x9.setCell(CPos("C1"), "=sum(A1:A1000)"));
+    assert (x9.setCell(CPos("C2"), "=count($A1000:A1) + sum(A1:A10)"));
+    assert (valueMatch(x9.getValue(CPos("C1")), CValue(500500.0)));
+    assert (valueMatch(x9.getValue(CPos("C2")), CValue(1055.0)));
+    assert (x9.setCell(CPos("A500"), "text"));
+    assert (x9.setCell(CPos("A1000"), "=A1+1"));
+    assert (x9.setCell(CPos("A2000"), "5"));
+    assert (valueMatch(x9.getValue(CPos("C1")), CValue(500500.0 - 500 - 1000 + 2)));
+    assert (valueMatch(x9.getValue(CPos("C2")), CValue(1055.0)));
+    assert (x9.setCell(CPos("C3"), "=sum(C1:C4)"));
+    assert (valueMatch(x9.getValue(CPos("C3")), CValue()));
+    assert (x9.setCell(CPos("C3"), "=sum(C1:C2)"));
+    assert (x9.setCell(CPos("C4"), "=sum(C3:C3)"));
+    assert (valueMatch(x9.getValue(CPos("C4")), CValue(500500.0 - 500 - 1000 + 2 + 1055)));
+    assert (x9.setCell(CPos("D1"), "=sum(A$1:A1)"));
+    x9.copyRect(CPos("D2"), CPos("D1"));
+    assert (valueMatch(x9.getValue(CPos("D2")), CValue(3.0)));
+    assert (x9.setCell(CPos("E1"), "=sum(E2:E300)"));
+    assert (valueMatch(x9.getValue(CPos("E1")), CValue()));
+    x9.setRangeIndex(false);
+    assert (valueMatch(x9.getValue(CPos("C1")), CValue(500500.0 - 500 - 1000 + 2)));
+    assert (x9.setCell(CPos("A1"), "11"));
+    x9.setRangeIndex(true);
+    assert (valueMatch(x9.getValue(CPos("C1")), CValue(500500.0 - 500 - 1000 + 22)));
+    assert (x9.setCell(CPos("F1"), "=min(A1:A999)"));
+    assert (x9.setCell(CPos("F2"), "=max(A2:A999) - min(A5:A7)"));
+    assert (valueMatch(x9.getValue(CPos("F1")), CValue(2.0)));
+    assert (valueMatch(x9.getValue(CPos("F2")), CValue(994.0)));
+    assert (x9.setCell(CPos("A2"), "100"));
+    assert (x9.setCell(CPos("A999"), "-3"));
+    assert (valueMatch(x9.getValue(CPos("F1")), CValue(-3.0)));
+    assert (valueMatch(x9.getValue(CPos("F2")), CValue(998.0 - 5)));
+    assert (x9.setCell(CPos("A999"), "x"));
+    assert (x9.setCell(CPos("A998"), "=A1000*1000"));
+    assert (valueMatch(x9.getValue(CPos("F1")), CValue(3.0)));
+    assert (valueMatch(x9.getValue(CPos("F2")), CValue(12000.0 - 5)));
+    assert (x9.setCell(CPos("F3"), "=max(G1:H500)"));
+    assert (valueMatch(x9.getValue(CPos("F3")), CValue()));
+    // the range index takes memory for the cells it holds, not for the rectangle around them
+    CSpreadsheet x9Sparse;
+    assert (x9Sparse.setCell(CPos("A1"), "1") && x9Sparse.setCell(CPos("ALL4000000"), "2"));
+    assert (x9Sparse.setCell(CPos("ALL3999999"), "x") && x9Sparse.setCell(CPos("A4000001"), "=count(A1:ALL4000000)"));
+    assert (x9Sparse.setCell(CPos("B4000001"), "=sum(A1:ALL4000000)+max(A2:ALL4000000)"));
+    assert (valueMatch(x9Sparse.getValue(CPos("A4000001")), CValue(3.0)));
+    assert (valueMatch(x9Sparse.getValue(CPos("B4000001")), CValue(5.0)));
+    assert (x9Sparse.memoryUsage().total() < (size_t(1) << 20));
+    // rectangles over hundreds of columns are answered by bands of columns, formulas by their filled in values
+    auto x9Name = [](size_t column, size_t row) {
+        std::string name;
+        for (size_t n = column; n; n = (n - 1) / 26) {
+            name.insert(name.begin(), static_cast<char>('A' + (n - 1) % 26));
+        }
+        return name + std::to_string(row);
+    };
+    assert (CPos(x9Name(700, 4)).getColumn() == 700 && CPos(x9Name(700, 4)).getRow() == 4);
+    CSpreadsheet x9Wide;
+    for (size_t c = 1; c <= 700; c += 3) {
+        for (size_t r = 1; r <= 90; r += 1 + c % 4) {
+            std::string contents = std::to_string(static_cast<int>((r * 31 + c * 17) % 41) - 20);
+            if ((r + c) % 7 == 0) {
+                contents = "text";
+            } else if ((r + c) % 5 == 0 && r > 1) {
+                contents = "=" + x9Name(c, r - 1) + "*2";
+            }
+            assert (x9Wide.setCell(CPos(x9Name(c, r)), contents));
+        }
+    }
+    auto x9Check = [&x9Wide, &x9Name](size_t left, size_t top, size_t right, size_t bottom) {
+        double sum = 0;
+        double min = INFINITY;
+        double max = -INFINITY;
+        size_t numbers = 0;
+        size_t values = 0;
+        for (size_t c = left; c <= right; ++c) {
+            for (size_t r = top; r <= bottom; ++r) {
+                CValue value = x9Wide.getValue(CPos(x9Name(c, r)));
+                if (std::holds_alternative<double>(value)) {
+                    sum += std::get<double>(value);
+                    min = std::min(min, std::get<double>(value));
+                    max = std::max(max, std::get<double>(value));
+                    ++numbers;
+                }
+                values += value.index() != 0;
+            }
+        }
+        std::string range = x9Name(left, top) + ":" + x9Name(right, bottom);
+        assert (x9Wide.setCell(CPos("A1000"), "=sum(" + range + ")") && x9Wide.setCell(CPos("B1000"), "=count(" + range + ")"));
+        assert (x9Wide.setCell(CPos("C1000"), "=min(" + range + ")") && x9Wide.setCell(CPos("D1000"), "=max(" + range + ")"));
+        assert (valueMatch(x9Wide.getValue(CPos("A1000")), numbers ? CValue(sum) : CValue()));
+        assert (valueMatch(x9Wide.getValue(CPos("B1000")), CValue(static_cast<double>(values))));
+        assert (valueMatch(x9Wide.getValue(CPos("C1000")), numbers ? CValue(min) : CValue()));
+        assert (valueMatch(x9Wide.getValue(CPos("D1000")), numbers ? CValue(max) : CValue()));
+    };
+    for (int round = 0; round < 2; ++round) {
+        x9Check(1, 1, 700, 90);
+        x9Check(2, 3, 698, 70);
+        x9Check(64, 10, 575, 11);
+        x9Check(5, 1, 12, 90);
+        x9Check(300, 20, 301, 90);
+        x9Check(511, 1, 520, 40);
+        // a literal read by formulas, a formula replaced by a literal and a literal by a formula
+        assert (x9Wide.setCell(CPos(x9Name(4, 5)), "1000") && x9Wide.setCell(CPos(x9Name(4, 11)), "-500"));
+        assert (x9Wide.setCell(CPos(x9Name(10, 2)), "=" + x9Name(10, 1) + "*1000") && x9Wide.setCell(CPos(x9Name(301, 20)), "7"));
+    }
+    // a cell of a cycle makes the whole rectangle undefined, also once the other formulas have their values
+    assert (x9Wide.setCell(CPos(x9Name(600, 50)), "=" + x9Name(601, 50)) && x9Wide.setCell(CPos(x9Name(601, 50)), "=" + x9Name(600, 50)));
+    assert (x9Wide.setCell(CPos("A1001"), "=sum(A1:ZZ90)") && valueMatch(x9Wide.getValue(CPos("A1001")), CValue()));
+    assert (x9Wide.setCell(CPos(x9Name(601, 50)), "5") && !std::holds_alternative<std::monostate>(x9Wide.getValue(CPos("A1001"))));
+
+    CSpreadsheet x10;
+    assert (x10.setCell(CPos("A1"), "=B1+1"));
+    assert (x10.setCell(CPos("B1"), "=C1*2"));
+    assert (x10.setCell(CPos("D1"), "=A1"));
+    assert (x10.setCell(CPos("E1"), "=sum(A1:A2)"));
+    assert (x10.setCell(CPos("C1"), "0"));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue(1.0)));
+    assert (x10.setCell(CPos("C1"), "=A1"));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue()));
+    assert (valueMatch(x10.getValue(CPos("C1")), CValue()));
+    assert (valueMatch(x10.getValue(CPos("D1")), CValue()));
+    assert (valueMatch(x10.getValue(CPos("E1")), CValue()));
+    assert (x10.setCell(CPos("B1"), "=C2*2"));
+    assert (x10.setCell(CPos("C2"), "1"));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue(3.0)));
+    assert (valueMatch(x10.getValue(CPos("E1")), CValue(3.0)));
+    assert (x10.setCell(CPos("C2"), "=sum(D1:D5)"));
+    assert (valueMatch(x10.getValue(CPos("C1")), CValue()));
+    assert (x10.setCell(CPos("D1"), "4"));
+    assert (valueMatch(x10.getValue(CPos("C1")), CValue(9.0)));
+    x10.copyRect(CPos("D2"), CPos("C1"));
+    assert (valueMatch(x10.getValue(CPos("D2")), CValue()));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue(9.0)));
+    assert (x10.setCell(CPos("D2"), "=A1-1"));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue()));
+    assert (valueMatch(x10.getValue(CPos("C2")), CValue()));
+    assert (x10.setCell(CPos("D2"), "5"));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue(19.0)));
+    // ranges of 64 columns and more are found by bands of columns, on several levels
+    CSpreadsheet x10Wide;
+    assert (x10Wide.setCell(CPos("A1"), "=sum(A5:CZ6)") && x10Wide.setCell(CPos("B1"), "=sum(B7:ZZZ7)"));
+    assert (x10Wide.setCell(CPos("C1"), "=sum(A2:ZZZZ3)+1") && x10Wide.setCell(CPos("D1"), "=count(CY5:DA5)"));
+    assert (valueMatch(x10Wide.getValue(CPos("A1")), CValue()) && valueMatch(x10Wide.getValue(CPos("B1")), CValue()));
+    assert (x10Wide.setCell(CPos("CZ6"), "3") && x10Wide.setCell(CPos("ZZ7"), "4") && x10Wide.setCell(CPos("DA5"), "1"));
+    assert (valueMatch(x10Wide.getValue(CPos("A1")), CValue(3.0)) && valueMatch(x10Wide.getValue(CPos("B1")), CValue(4.0)));
+    assert (valueMatch(x10Wide.getValue(CPos("D1")), CValue(1.0)) && valueMatch(x10Wide.getValue(CPos("C1")), CValue()));
+    assert (x10Wide.setCell(CPos("ZZZZ3"), "2") && valueMatch(x10Wide.getValue(CPos("C1")), CValue(3.0)));
+    assert (x10Wide.setCell(CPos("ZZZ7"), "=C1") && valueMatch(x10Wide.getValue(CPos("B1")), CValue(7.0)));
+    assert (x10Wide.setCell(CPos("ZZ3"), "=B1") && valueMatch(x10Wide.getValue(CPos("C1")), CValue()));
+    assert (valueMatch(x10Wide.getValue(CPos("B1")), CValue()) && valueMatch(x10Wide.getValue(CPos("A1")), CValue(3.0)));
+    assert (x10Wide.setCell(CPos("ZZ3"), "") && valueMatch(x10Wide.getValue(CPos("B1")), CValue(7.0)));
+
+    auto view = x9.getValues(CPos("A998"), 6, 4);
+    assert (view.size() == 4 && view[0].size() == 6);
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 6; ++c) {
+            std::string name = std::string(1, static_cast<char>('A' + c)) + std::to_string(998 + r);
+            assert (valueMatch(view[r][c], x9.getValue(CPos(name))));
+        }
+    }
+    assert (valueMatch(view[2][0], CValue(12.0)));
+    assert (x9.getValues(CPos("A1"), 0, 5).empty());
+    CSpreadsheet x11;
+    assert (x11.setCell(CPos("A1"), "1"));
+    for (int r = 2; r <= 50000; ++r) {
+        assert (x11.setCell(CPos("A" + std::to_string(r)), "=A" + std::to_string(r - 1) + "+1"));
+    }
+    auto chain = x11.getValues(CPos("A49999"), 1, 2);
+    assert (valueMatch(chain[1][0], CValue(50000.0)));
+    assert (valueMatch(x11.getValue(CPos("A50000")), CValue(50000.0)));
+    assert (x11.setCell(CPos("B1"), "=(A2 - A1) * 4 / (A3 - 2) ^ 2 - (A1 < A2)"));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue(3.0)));
+    assert (x11.setCell(CPos("A3"), "2"));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue()));
+    assert (x11.setCell(CPos("A3"), "=A2+1"));
+    assert (x11.setCell(CPos("A1"), "abc"));
+    assert (valueMatch(x11.getValue(CPos("A2")), CValue("abc1.000000")));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue()));
+    CSpreadsheet x11Text;
+    assert (x11Text.setCell(CPos("A1"), "abc"));
+    for (int row = 2; row <= 1000; ++row) {
+        assert (x11Text.setCell(CPos("A" + std::to_string(row)), "=A" + std::to_string(row - 1) + "+1"));
+    }
+    CValue x11Joined = x11Text.getValue(CPos("A1000"));
+    assert (std::holds_alternative<std::string>(x11Joined) && std::get<std::string>(x11Joined).size() == 3 + 999 * 8);
+
+    CSpreadsheet x12;
+    assert (x12.setCell(CPos("A1"), "2"));
+    assert (x12.setCell(CPos("B1"), "3"));
+    for (int r = 1; r <= 100; ++r) {
+        assert (x12.setCell(CPos("C" + std::to_string(r)), "=($A$1*$B$1)+sum($A$1:$B$1)+" + std::to_string(r)));
+    }
+    assert (x12.setCell(CPos("D1"), "=($A$1*$B$1)+sum($A$1:$B$1)+7"));
+    auto shared = x12.snapshot();
+    assert (shared->getCells().at({7, 3}).second == shared->getCells().at({1, 4}).second);
+    assert (valueMatch(x12.getValue(CPos("C7")), CValue(18.0)));
+    assert (valueMatch(x12.getValue(CPos("C100")), CValue(111.0)));
+    shared.reset();
+    assert (x12.setCell(CPos("E1"), "5"));
+    assert (valueMatch(x12.getValue(CPos("C100")), CValue(111.0)));
+    assert (x12.setCell(CPos("A1"), "4"));
+    assert (valueMatch(x12.getValue(CPos("C7")), CValue(26.0)));
+    assert (valueMatch(x12.getValue(CPos("D1")), CValue(26.0)));
+    assert (x12.setCell(CPos("B1"), "x"));
+    assert (valueMatch(x12.getValue(CPos("C1")), CValue()));
+    assert (x12.setCell(CPos("B1"), "3"));
+    for (int r = 1; r <= 100; ++r) {
+        assert (x12.setCell(CPos("F" + std::to_string(r)), "=($A$1*$B$1)+E" + std::to_string(r)));
+        assert (x12.setCell(CPos("E" + std::to_string(r)), std::to_string(r)));
+    }
+    assert (x12.setCell(CPos("H5"), "=($A$1*$B$1)-E5") && x12.setCell(CPos("J9"), "=2*($A$1*$B$1)"));
+    size_t evaluated = CSnapshot::sharedEvaluations();
+    assert (valueMatch(x12.getValue(CPos("F1")), CValue(13.0)) && valueMatch(x12.getValue(CPos("F100")), CValue(112.0)));
+    assert (valueMatch(x12.getValue(CPos("H5")), CValue(7.0)) && valueMatch(x12.getValue(CPos("J9")), CValue(24.0)));
+    assert (CSnapshot::sharedEvaluations() == evaluated + 1);
+    assert (x12.setCell(CPos("A1"), "5") && valueMatch(x12.getValue(CPos("F50")), CValue(65.0)));
+    assert (valueMatch(x12.getValue(CPos("H5")), CValue(10.0)) && CSnapshot::sharedEvaluations() == evaluated + 2);
+    // a write copying a pinned version keeps the values it does not make stale
+    assert (x12.setCell(CPos("L1"), "=sum(E1:G100)") && valueMatch(x12.getValue(CPos("L1")), CValue(11600.0)));
+    std::shared_ptr<const CSnapshot> x12Pinned = x12.snapshot();
+    assert (x12.setCell(CPos("K1"), "1") && x12.snapshot() != x12Pinned);
+    assert (valueMatch(x12.getValue(CPos("H5")), CValue(10.0)) && CSnapshot::sharedEvaluations() == evaluated + 2);
+    x12Pinned = x12.snapshot();
+    assert (x12.setCell(CPos("A1"), "6") && valueMatch(x12.getValue(CPos("H5")), CValue(13.0)));
+    assert (CSnapshot::sharedEvaluations() == evaluated + 3 && valueMatch(x12.getValue(CPos("L1")), CValue(11900.0)));
+    assert (valueMatch(x12Pinned->getValue(CPos("L1")), CValue(11600.0)));
+    x12Pinned = x12.snapshot();
+    assert (x12.setCell(CPos("E100"), "0") && valueMatch(x12.getValue(CPos("L1")), CValue(11700.0)));
+    x12Pinned.reset();
+
+    CSpreadsheet x13;
+    for (int r = 1; r <= 2000; ++r) {
+        assert (x13.setCell(CPos("A" + std::to_string(r)), "=B" + std::to_string(r) + "+$C$1*2"));
+        assert (x13.setCell(CPos("B" + std::to_string(r)), "a rather long text that is not kept inline"));
+    }
+    CMemoryUsage used = x13.memoryUsage();
+    assert (used.cells > 0 && used.strings > 0 && used.formulas > 0 && used.caches > 0);
+    assert (used.total() == used.cells + used.strings + used.formulas + used.caches);
+    for (int r = 1; r <= 2000; ++r) {
+        assert (x13.setCell(CPos("A" + std::to_string(r)), std::to_string(r)));
+    }
+    x13.copyRect(CPos("D1"), CPos("A1"), 1, 2000);
+    CMemoryUsage churned = x13.memoryUsage();
+    assert (churned.formulas == 0);
+    x13.compact();
+    CMemoryUsage compacted = x13.memoryUsage();
+    assert (compacted.cells <= churned.cells && compacted.caches < churned.caches);
+    assert (valueMatch(x13.getValue(CPos("D2000")), CValue(2000.0)));
+
+    CSpreadsheet x14;
+    x14.setAsyncRecalc(true);
+    assert (x14.setCell(CPos("A1"), "1"));
+    for (int r = 2; r <= 3000; ++r) {
+        assert (x14.setCell(CPos("A" + std::to_string(r)), "=A" + std::to_string(r - 1) + "*1+1"));
+    }
+    assert (valueMatch(x14.getValue(CPos("A10")), CValue(10.0)));
+    assert (x14.setCell(CPos("A1"), "5"));
+    std::shared_future<void> recalculated = x14.recalculation();
+    assert (valueMatch(x14.getValue(CPos("A3000")), CValue(3004.0)));
+    recalculated.wait();
+    x14.waitIdle();
+    assert (valueMatch(x14.getValue(CPos("A2999")), CValue(3003.0)));
+    // moving cells drops what the worker has queued and wakes it
+    assert (x14.setCell(CPos("A1"), "6"));
+    x14.insertRows(1, 2);
+    x14.deleteRows(1);
+    x14.waitIdle();
+    assert (valueMatch(x14.getValue(CPos("A3001")), CValue(3005.0)));
+    x14.setAsyncRecalc(false);
+    x14.deleteRows(1);
+    assert (x14.setCell(CPos("A1"), "0"));
+    assert (x14.recalculation().wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    assert (valueMatch(x14.getValue(CPos("A3000")), CValue(2999.0)));
+    // a text added to an undefined cell is undefined, also on the worker
+    CSpreadsheet x14Text;
+    x14Text.setAsyncRecalc(true);
+    assert (x14Text.setCell(CPos("B1"), "1") && x14Text.setCell(CPos("A1"), "=\"a\"+B1"));
+    x14Text.waitIdle();
+    assert (valueMatch(x14Text.getValue(CPos("A1")), CValue("a1.000000")));
+    assert (x14Text.setCell(CPos("B1"), ""));
+    x14Text.waitIdle();
+    assert (valueMatch(x14Text.getValue(CPos("A1")), CValue()));
+
+    CSpreadsheet x15;
+    std::vector<std::vector<CChange>> received;
+    size_t watch = x15.subscribe(CPos("B1"), 2, 3, [&received](const std::vector<CChange> &changes) {
+        received.push_back(changes);
+    });
+    assert (watch != 0);
+    assert (x15.setCell(CPos("A1"), "1"));
+    assert (received.empty());
+    assert (x15.setCell(CPos("B1"), "=A1*2"));
+    assert (x15.setCell(CPos("C2"), "=B1>0"));
+    assert (received.size() == 2 && received[1].size() == 1 && valueMatch(received[1][0].value, CValue(1.0)));
+    assert (x15.setCell(CPos("A1"), "3"));
+    assert (received.size() == 3 && received[2].size() == 1);
+    assert (received[2][0].row == 1 && received[2][0].column == 2 && valueMatch(received[2][0].value, CValue(6.0)));
+    assert (x15.setCell(CPos("A2"), "5") && x15.setCell(CPos("A3"), "7"));
+    assert (x15.setCell(CPos("C1"), "=A1+1"));
+    assert (received.size() == 4);
+    x15.copyRect(CPos("B2"), CPos("B1"), 2, 1);
+    assert (received.size() == 5 && received[4].size() == 2 && valueMatch(received[4][1].value, CValue(6.0)));
+    assert (x15.setCell(CPos("D9"), "=B1"));
+    assert (received.size() == 5);
+    x15.unsubscribe(watch);
+    assert (x15.setCell(CPos("A1"), "4"));
+    assert (received.size() == 5);
+    // a callback writing the sheet gets its own batch delivered after it returns
+    x15.subscribe(CPos("A1"), 1, 1, [&x15](const std::vector<CChange> &changes) {
+        x15.setCell(CPos("E1"), std::to_string(std::get<double>(changes[0].value) * 10));
+    });
+    std::vector<CValue> copied;
+    x15.subscribe(CPos("E1"), 1, 1, [&copied](const std::vector<CChange> &changes) {
+        copied.push_back(changes[0].value);
+    });
+    assert (x15.setCell(CPos("A1"), "2") && copied.size() == 1 && valueMatch(copied[0], CValue(20.0)));
+    // a watched cell turning undefined is delivered as a change of the write
+    std::vector<CChange> x15Text;
+    x15.subscribe(CPos("F1"), 1, 1, [&x15Text](const std::vector<CChange> &changes) {
+        x15Text.insert(x15Text.end(), changes.begin(), changes.end());
+    });
+    assert (x15.setCell(CPos("G1"), "1") && x15.setCell(CPos("F1"), "=\"a\"+G1"));
+    assert (x15.setCell(CPos("G1"), ""));
+    assert (x15Text.size() == 2 && valueMatch(x15Text[1].value, CValue()));
+
+    CWorkbook book;
+    CSpreadsheet *source = book.addSheet("Data");
+    CSpreadsheet *report = book.addSheet("My report");
+    assert (source && report && !book.addSheet("Data") && !book.addSheet(""));
+    assert (!x15.setCell(CPos("A1"), "=Data!A1") && !report->setCell(CPos("A1"), "=Nope!A1"));
+    assert (source->setCell(CPos("A1"), "10") && source->setCell(CPos("A2"), "20"));
+    assert (report->setCell(CPos("A1"), "=Data!A1*2") && report->setCell(CPos("B1"), "=sum(Data!$A$1:A2)+A1"));
+    assert (source->setCell(CPos("B1"), "='My report'!A1+1"));
+    book.recalculate();
+    assert (valueMatch(report->getValue(CPos("B1")), CValue(50.0)));
+    assert (source->setCell(CPos("A1"), "5"));
+    assert (valueMatch(report->getValue(CPos("A1")), CValue(10.0)));
+    assert (valueMatch(report->getValue(CPos("B1")), CValue(35.0)));
+    assert (valueMatch(source->getValue(CPos("B1")), CValue(11.0)));
+    report->copyRect(CPos("A2"), CPos("A1"));
+    assert (valueMatch(report->getValue(CPos("A2")), CValue(40.0)));
+    assert (source->setCell(CPos("C1"), "='My report'!C1") && report->setCell(CPos("C1"), "=Data!C1+1"));
+    assert (valueMatch(report->getValue(CPos("C1")), CValue()));
+    // a wide column of the own sheet is not taken for a reference to another sheet
+    assert (report->setCell(CPos("AAAAAAAA1"), "7") && report->setCell(CPos("D1"), "=Data!A1+AAAAAAAA1"));
+    assert (valueMatch(report->getValue(CPos("D1")), CValue(12.0)));
+    assert (report->setCell(CPos("D1"), ""));
+    std::ostringstream bookOut;
+    assert (book.save(bookOut));
+    CWorkbook loaded;
+    std::istringstream bookIn(bookOut.str());
+    assert (loaded.load(bookIn) && loaded.sheetNames() == book.sheetNames());
+    assert (valueMatch(loaded.sheet("My report")->getValue(CPos("B1")), CValue(35.0)));
+    assert (loaded.sheet("Data")->setCell(CPos("A2"), "0"));
+    assert (valueMatch(loaded.sheet("My report")->getValue(CPos("B1")), CValue(15.0)));
+    // a stream failing to load replaces none of its sheets
+    std::istringstream broken(bookOut.str() + "3 Bad 8\n1 1 9 1\n");
+    assert (!loaded.load(broken) && valueMatch(loaded.sheet("Data")->getValue(CPos("A2")), CValue(0.0)));
+    // references from other sheets move with the inserted or deleted rows
+    loaded.sheet("Data")->insertRows(1);
+    auto reportText = [&loaded](size_t row, size_t column) {
+        auto version = loaded.sheet("My report")->snapshot();
+        return CFormulaText::fromRelative(std::get<std::string>(version->getCells().at({row, column}).first),
+                                          row, column);
+    };
+    assert (reportText(1, 1) == "=Data!A2*2" && reportText(1, 2) == "=sum(Data!$A$2:A3)+A1");
+    assert (valueMatch(loaded.sheet("My report")->getValue(CPos("B1")), CValue(15.0)));
+    assert (valueMatch(loaded.sheet("Data")->getValue(CPos("B2")), CValue(11.0)));
+    assert (loaded.sheet("Data")->setCell(CPos("A2"), "6"));
+    assert (valueMatch(loaded.sheet("My report")->getValue(CPos("A1")), CValue(12.0)));
+    loaded.sheet("Data")->deleteRows(2);
+    assert (reportText(1, 1) == "=Data!#REF!*2" && valueMatch(loaded.sheet("My report")->getValue(CPos("A1")), CValue()));
+    // a sheet copied out of a workbook reads nothing from the other sheets once the workbook is gone
+    CSpreadsheet detached;
+    {
+        CWorkbook gone;
+        CSpreadsheet *data = gone.addSheet("Data");
+        CSpreadsheet *sums = gone.addSheet("Sums");
+        assert (data->setCell(CPos("A1"), "4") && sums->setCell(CPos("A1"), "=Data!A1*2"));
+        assert (sums->setCell(CPos("B1"), "=sum(Data!A1:A2)"));
+        detached = *sums;
+    }
+    detached.copyRect(CPos("A2"), CPos("A1"));
+    assert (valueMatch(detached.getValue(CPos("A1")), CValue()) && valueMatch(detached.getValue(CPos("A2")), CValue()));
+    assert (valueMatch(detached.getValue(CPos("B1")), CValue()));
+    // a version reads the other sheets as they were when it was published
+    CWorkbook pinning;
+    CSpreadsheet *facts = pinning.addSheet("Facts");
+    CSpreadsheet *summary = pinning.addSheet("View");
+    assert (facts->setCell(CPos("A1"), "1") && summary->setCell(CPos("A1"), "=Facts!A1+1"));
+    assert (summary->setCell(CPos("A2"), "=sum(Facts!A1:A3)"));
+    std::shared_ptr<const CSnapshot> summaryVersion = summary->snapshot();
+    assert (facts->setCell(CPos("A1"), "10"));
+    assert (valueMatch(summaryVersion->getValue(CPos("A1")), CValue(2.0)));
+    assert (valueMatch(summaryVersion->getValue(CPos("A2")), CValue(1.0)));
+    assert (valueMatch(summary->getValue(CPos("A1")), CValue(11.0)) && valueMatch(summary->getValue(CPos("A2")), CValue(10.0)));
+
+    CSpreadsheet x16;
+    auto textAt = [&x16](size_t row, size_t column) {
+        auto version = x16.snapshot();
+        auto it = version->getCells().find({row, column});
+        return it == version->getCells().end()
+               ? std::string() : CFormulaText::fromRelative(std::get<std::string>(it->second.first), row, column);
+    };
+    assert (x16.setCell(CPos("A1"), "1") && x16.setCell(CPos("A2"), "2") && x16.setCell(CPos("A3"), "3"));
+    assert (x16.setCell(CPos("B1"), "=sum(A1:A3)") && x16.setCell(CPos("B2"), "=$A$2*10+A3"));
+    assert (x16.setCell(CPos("C1"), "=B2") && x16.setCell(CPos("C2"), "=sum(A2:A2)"));
+    x16.insertRows(2, 2);
+    assert (textAt(4, 2) == "=$A$4*10+A5" && textAt(1, 2) == "=sum(A1:A5)" && textAt(1, 3) == "=B4");
+    assert (valueMatch(x16.getValue(CPos("B1")), CValue(6.0)));
+    assert (valueMatch(x16.getValue(CPos("C1")), CValue(23.0)));
+    assert (x16.setCell(CPos("A5"), "4") && valueMatch(x16.getValue(CPos("C1")), CValue(24.0)));
+    assert (x16.setCell(CPos("A5"), "3"));
+    assert (x16.setCell(CPos("A2"), "100"));
+    assert (valueMatch(x16.getValue(CPos("B1")), CValue(106.0)));
+    x16.deleteRows(2, 3);
+    assert (textAt(1, 2) == "=sum(A1:A2)" && textAt(1, 3) == "=#REF!" && textAt(2, 3) == "");
+    assert (valueMatch(x16.getValue(CPos("B1")), CValue(4.0)));
+    assert (valueMatch(x16.getValue(CPos("C1")), CValue()));
+    assert (x16.setCell(CPos("D1"), "=sum(A1:A2)") && x16.setCell(CPos("E1"), "=A2+D1"));
+    x16.deleteColumns(1);
+    assert (textAt(1, 1) == "=sum(#REF!:#REF!)" && textAt(1, 4) == "=#REF!+C1");
+    assert (valueMatch(x16.getValue(CPos("C1")), CValue()) && valueMatch(x16.getValue(CPos("D1")), CValue()));
+    x16.insertColumns(1);
+    assert (x16.setCell(CPos("A1"), "7") && textAt(1, 2) == "=sum(#REF!:#REF!)");
+    assert (x16.setCell(CPos("F1"), "=A1*2"));
+    std::ostringstream relocatedOut;
+    assert (x16.save(relocatedOut));
+    CSpreadsheet x17;
+    std::istringstream relocatedIn(relocatedOut.str());
+    assert (x17.load(relocatedIn));
+    assert (valueMatch(x17.getValue(CPos("F1")), CValue(14.0)) && valueMatch(x17.getValue(CPos("E1")), CValue()));
+    assert (x16.setCell(CPos("G1"), "=G2") && x16.setCell(CPos("G2"), "=G1+1"));
+    x16.insertRows(1);
+    assert (valueMatch(x16.getValue(CPos("G3")), CValue()));
+    assert (x16.setCell(CPos("G2"), "5") && valueMatch(x16.getValue(CPos("G3")), CValue(6.0)));
+
+    CSpreadsheet edge;
+    auto edgeText = [&edge](size_t row, size_t column) {
+        auto version = edge.snapshot();
+        auto it = version->getCells().find({row, column});
+        return it == version->getCells().end()
+               ? std::string() : CFormulaText::fromRelative(std::get<std::string>(it->second.first), row, column);
+    };
+    assert (edge.setCell(CPos("A1"), "1") && edge.setCell(CPos("A2"), "2"));
+    assert (edge.setCell(CPos("C5"), "=sum(A1:A2)") && edge.setCell(CPos("D10"), "=B2+$A$1"));
+    edge.copyRect(CPos("A5"), CPos("C5"));
+    edge.copyRect(CPos("A4"), CPos("D10"));
+    edge.copyRect(CPos("E1"), CPos("D10"));
+    assert (edgeText(5, 1) == "=sum(#REF!:#REF!)" && edgeText(4, 1) == "=#REF!+$A$1" && edgeText(1, 5) == "=#REF!+$A$1");
+    assert (valueMatch(edge.getValue(CPos("A5")), CValue()) && valueMatch(edge.getValue(CPos("A4")), CValue()));
+    edge.insertColumns(2);
+    edge.deleteColumns(2);
+    assert (edgeText(4, 1) == "=#REF!+$A$1" && valueMatch(edge.getValue(CPos("A4")), CValue()));
+    assert (edge.setCell(CPos("A2"), "5") && valueMatch(edge.getValue(CPos("C5")), CValue(6.0)));
+    std::ostringstream edgeOut;
+    assert (edge.save(edgeOut));
+    CSpreadsheet edgeLoaded;
+    std::istringstream edgeIn(edgeOut.str());
+    assert (edgeLoaded.load(edgeIn));
+    assert (valueMatch(edgeLoaded.getValue(CPos("C5")), CValue(6.0)) && valueMatch(edgeLoaded.getValue(CPos("A5")), CValue()));
+    assert (CFormulaText::shift("=A1+$A2+sum(B1:C3)", -1, 0) == "=#REF!+$A2+sum(A1:B3)");
+    assert (CFormulaText::shift("=sum(A2:B3)+A$1", 0, -2) == "=sum(A0:B1)+A$1");
+    assert (CFormulaText::shift("=sum(A2:B3)+A$1", 0, -3) == "=sum(#REF!:#REF!)+A$1");
+
+    // only the formulas whose references cross the band are rewritten, all of them as the text would be
+    for (const CRelocation &relocation: {CRelocation{false, true, 4, 2}, CRelocation{false, false, 4, 2},
+                                         CRelocation{true, true, 3, 1}, CRelocation{true, false, 3, 2}}) {
+        CSpreadsheet band;
+        assert (band.setCell(CPos("B2"), "=A1+$A$6*A$3") && band.setCell(CPos("C2"), "=sum(A1:B3)+sum($A1:$A8)"));
+        assert (band.setCell(CPos("D2"), "=$C5-sum(B$2:E$2)") && band.setCell(CPos("E2"), "=D1+#REF!+sum(#REF!:#REF!)"));
+        assert (band.copyRect(CPos("B3"), CPos("B2"), 4, 1) && band.copyRect(CPos("B4"), CPos("B2"), 4, 2));
+        assert (band.copyRect(CPos("B6"), CPos("B2"), 4, 4) && band.copyRect(CPos("F2"), CPos("B2"), 4, 8));
+        std::map<std::pair<size_t, size_t>, std::string> before;
+        for (const auto &[key, cell]: band.snapshot()->getCells()) {
+            before[key] = CFormulaText::fromRelative(std::get<std::string>(cell.first), key.first, key.second);
+        }
+        assert (relocation.columns ? (relocation.insert ? band.insertColumns(relocation.first, relocation.count)
+                                                        : band.deleteColumns(relocation.first, relocation.count))
+                                   : (relocation.insert ? band.insertRows(relocation.first, relocation.count)
+                                                        : band.deleteRows(relocation.first, relocation.count)));
+        auto version = band.snapshot();
+        for (const auto &[key, text]: before) {
+            std::pair<size_t, size_t> moved = key;
+            if (relocation.move(moved.first, moved.second)) {
+                const std::string &stored = std::get<std::string>(version->getCells().at(moved).first);
+                assert (CFormulaText::fromRelative(stored, moved.first, moved.second)
+                        == CFormulaText::relocate(text, relocation));
+            }
+        }
+    }
+
+    // rows start at 0, a relative reference may land there
+    CSpreadsheet rowZero;
+    assert (rowZero.setCell(CPos("A0"), "5") && rowZero.setCell(CPos("A1"), "3"));
+    assert (rowZero.setCell(CPos("B2"), "=A1+1") && rowZero.setCell(CPos("C1"), "=A0*2"));
+    assert (rowZero.copyRect(CPos("B1"), CPos("B2")));
+    assert (valueMatch(rowZero.getValue(CPos("B1")), CValue(6.0)) && valueMatch(rowZero.getValue(CPos("C1")), CValue(10.0)));
+    std::ostringstream rowZeroOut;
+    assert (rowZero.save(rowZeroOut));
+    CSpreadsheet rowZeroLoaded;
+    std::istringstream rowZeroIn(rowZeroOut.str());
+    assert (rowZeroLoaded.load(rowZeroIn));
+    assert (valueMatch(rowZeroLoaded.getValue(CPos("B1")), CValue(6.0)));
+    assert (valueMatch(rowZeroLoaded.getValue(CPos("C1")), CValue(10.0)));
+    std::ostringstream rowZeroCompactOut;
+    assert (rowZero.saveCompact(rowZeroCompactOut));
+    CSpreadsheet rowZeroCompact;
+    std::istringstream rowZeroCompactIn(rowZeroCompactOut.str());
+    assert (rowZeroCompact.loadCompact(rowZeroCompactIn));
+    assert (valueMatch(rowZeroCompact.getValue(CPos("B1")), CValue(6.0)));
+    assert (valueMatch(rowZeroCompact.getValue(CPos("C1")), CValue(10.0)));
+
+    CSpreadsheet x18;
+    CSpreadsheet x19;
+    for (CSpreadsheet *sheet: {&x18, &x19}) {
+        for (int row = 1; row <= 60; ++row) {
+            std::string r = std::to_string(row);
+            assert (sheet->setCell(CPos("A" + r), r));
+            assert (sheet->setCell(CPos("B" + r), row == 1 ? "=A1" : "=B" + std::to_string(row - 1) + "+A" + r));
+            assert (sheet->setCell(CPos("C" + r), "=sum(A$1:B" + r + ")"));
+            assert (sheet->setCell(CPos("D" + r), "=\"row \"+C" + r));
+        }
+        assert (sheet->setCell(CPos("E1"), "=E2") && sheet->setCell(CPos("E2"), "=E1+B60"));
+    }
+    CProcessEvaluator::evaluate(*x18.snapshot(), 3, 8);
+    assert (x18.getValues(CPos("A1"), 5, 60) == x19.getValues(CPos("A1"), 5, 60));
+    assert (valueMatch(x18.getValue(CPos("B60")), CValue(1830.0)));
+    assert (x18.setCell(CPos("A1"), "101") && x19.setCell(CPos("A1"), "101"));
+    x18.recalculateInProcesses(4);
+    assert (x18.getValues(CPos("A1"), 5, 60) == x19.getValues(CPos("A1"), 5, 60));
+    assert (valueMatch(x18.getValue(CPos("D2")), CValue("row 307.000000")));
+    // workers that do not answer at once are killed and the parent evaluates their regions
+    assert (x18.setCell(CPos("A2"), "102") && x19.setCell(CPos("A2"), "102"));
+    x18.setAsyncRecalc(true);
+    CProcessEvaluator::evaluate(*x18.snapshot(), 3, 8, std::chrono::milliseconds(0));
+    x18.recalculateInProcesses(4);
+    x18.setAsyncRecalc(false);
+    assert (x18.getValues(CPos("A1"), 5, 60) == x19.getValues(CPos("A1"), 5, 60));
+
+    CSpreadsheet x20;
+    assert (x20.setCell(CPos("A1"), "ab") && x20.setCell(CPos("B1"), "=A1"));
+    for (int row = 2; row <= 5000; ++row) {
+        assert (x20.setCell(CPos("B" + std::to_string(row)), "=B" + std::to_string(row - 1) + "+A1"));
+    }
+    CValue x20Last = x20.getValue(CPos("B5000"));
+    assert (std::holds_alternative<std::string>(x20Last) && std::get<std::string>(x20Last).length() == 10000);
+    std::vector<std::vector<CValue>> joined = x20.getValues(CPos("B1"), 1, 5000);
+    assert (std::get<std::string>(joined[4999][0]).length() == 10000);
+    assert (valueMatch(x20.getValue(CPos("B3")), CValue("ababab")));
+    assert (x20.setCell(CPos("C1"), "=B4000=B4000") && valueMatch(x20.getValue(CPos("C1")), CValue(1.0)));
+    assert (x20.setCell(CPos("C2"), "=B4000<B4001") && valueMatch(x20.getValue(CPos("C2")), CValue(1.0)));
+
+    CSpreadsheet x21;
+    assert (x21.setCell(CPos("A1"), "=-2^2") && valueMatch(x21.getValue(CPos("A1")), CValue(-4.0)));
+    assert (x21.setCell(CPos("A2"), "=2^3^2") && valueMatch(x21.getValue(CPos("A2")), CValue(64.0)));
+    assert (x21.setCell(CPos("A3"), "=1=2<3") && valueMatch(x21.getValue(CPos("A3")), CValue(1.0)));
+    assert (x21.setCell(CPos("A4"), "= \"say \"\"hi\"\"\" + 1.5e1") && valueMatch(x21.getValue(CPos("A4")), CValue("say \"hi\"15.000000")));
+    assert (x21.setCell(CPos("A5"), "=sum($A$1:A2) - max(A1:A3) / 2") && valueMatch(x21.getValue(CPos("A5")), CValue(28.0)));
+    assert (!x21.setCell(CPos("B1"), "=1<") && !x21.setCell(CPos("B1"), "=sum(A1)") && !x21.setCell(CPos("B1"), "=A1:A2"));
+    assert (!x21.setCell(CPos("B1"), "=A1:A2+1") && !x21.setCell(CPos("B1"), "=abs(1)") && !x21.setCell(CPos("B1"), "=\"a"));
+    assert (!x21.setCell(CPos("B1"), "=2^-1") && !x21.setCell(CPos("B1"), "=if(1,2)") && !x21.setCell(CPos("B1"), "=A1B"));
+
+    CSpreadsheet x22;
+    assert (x22.setCell(CPos("A1"), "3") && x22.setCell(CPos("A2"), "text") && x22.setCell(CPos("A3"), "3"));
+    assert (x22.setCell(CPos("A4"), "=A1") && x22.setCell(CPos("A5"), "=A2"));
+    assert (x22.setCell(CPos("B1"), "=if(A1>2, sum(A1:A4), A2)") && valueMatch(x22.getValue(CPos("B1")), CValue(9.0)));
+    assert (x22.setCell(CPos("B2"), "=if(A1>5, sum(A1:A4), A2)") && valueMatch(x22.getValue(CPos("B2")), CValue("text")));
+    assert (x22.setCell(CPos("B3"), "=if(A2, 1, 2)") && valueMatch(x22.getValue(CPos("B3")), CValue()));
+    assert (x22.setCell(CPos("B4"), "=and(A1, A1>2, 1)") && valueMatch(x22.getValue(CPos("B4")), CValue(1.0)));
+    // the second argument decides, the text after it is not evaluated
+    assert (x22.setCell(CPos("B5"), "=and(1, 0, A2)") && valueMatch(x22.getValue(CPos("B5")), CValue(0.0)));
+    assert (x22.setCell(CPos("B6"), "=or(0, A1, A2)") && valueMatch(x22.getValue(CPos("B6")), CValue(1.0)));
+    assert (x22.setCell(CPos("B7"), "=or(0, A2)") && valueMatch(x22.getValue(CPos("B7")), CValue()));
+    assert (x22.setCell(CPos("C1"), "=countval(3, A1:A5)") && valueMatch(x22.getValue(CPos("C1")), CValue(3.0)));
+    assert (x22.setCell(CPos("C2"), "=countval(\"text\", A1:A5)") && valueMatch(x22.getValue(CPos("C2")), CValue(2.0)));
+    assert (x22.setCell(CPos("A1"), "1") && valueMatch(x22.getValue(CPos("B1")), CValue("text")));
+    assert (valueMatch(x22.getValue(CPos("C1")), CValue(1.0)));
+    assert (!x22.setCell(CPos("D1"), "=and()") && !x22.setCell(CPos("D1"), "=or(A1:A2)") && !x22.setCell(CPos("D1"), "=if(1, A1:A2, 0)"));
+
+    CSpreadsheet x23;
+    // the history is on by default, a limit of 0 turns it off and forgets the steps
+    assert (x23.setCell(CPos("A1"), "5") && x23.undo() && valueMatch(x23.getValue(CPos("A1")), CValue()));
+    assert (x23.redo() && valueMatch(x23.getValue(CPos("A1")), CValue(5.0)) && x23.undo() && x23.redo());
+    x23.setHistoryLimit(0);
+    assert (!x23.undo() && x23.setCell(CPos("A1"), "6") && !x23.undo() && !x23.redo());
+    x23.setHistoryLimit(size_t(1) << 20);
+    assert (x23.setCell(CPos("A1"), "0.1") && x23.setCell(CPos("A2"), "=A1*10") && x23.setCell(CPos("A1"), "2"));
+    x23.copyRect(CPos("B1"), CPos("A1"), 1, 3);
+    assert (valueMatch(x23.getValue(CPos("B2")), CValue(20.0)));
+    assert (x23.attachJournal(snapshotPath, journalPath));
+    assert (x23.undo() && valueMatch(x23.getValue(CPos("B1")), CValue()) && valueMatch(x23.getValue(CPos("B2")), CValue()));
+    assert (x23.undo() && valueMatch(x23.getValue(CPos("A2")), CValue(1.0)));
+    assert (x23.redo() && valueMatch(x23.getValue(CPos("A2")), CValue(20.0)));
+    assert (x23.undo() && x23.undo() && valueMatch(x23.getValue(CPos("A2")), CValue()));
+    assert (x23.setCell(CPos("C1"), "new") && !x23.redo());
+    x23.detachJournal();
+    CSpreadsheet x24;
+    assert (x24.recover(snapshotPath, journalPath));
+    assert (valueMatch(x24.getValue(CPos("A1")), CValue(0.1)) && valueMatch(x24.getValue(CPos("A2")), CValue()));
+    assert (valueMatch(x24.getValue(CPos("C1")), CValue("new")) && valueMatch(x24.getValue(CPos("B1")), CValue()));
+    std::filesystem::remove(snapshotPath);
+    std::filesystem::remove(journalPath);
+    std::istringstream replacement("1 1 1 1 5\n5 5 2 3 =A1\n");
+    assert (x23.load(replacement) && valueMatch(x23.getValue(CPos("E5")), CValue(5.0)));
+    assert (x23.undo() && valueMatch(x23.getValue(CPos("A1")), CValue(0.1)) && valueMatch(x23.getValue(CPos("E5")), CValue()));
+    assert (valueMatch(x23.getValue(CPos("C1")), CValue("new")));
+    assert (x23.redo() && valueMatch(x23.getValue(CPos("E5")), CValue(5.0)) && valueMatch(x23.getValue(CPos("C1")), CValue()));
+    x23.setHistoryLimit(0);
+    assert (!x23.undo() && x23.setCell(CPos("A1"), "1") && !x23.undo());
+    std::string x23Long = "=A1";
+    for (int i = 0; i < 100; ++i) {
+        x23Long += "+A1";
+    }
+    // the overwritten tree counts against the limit, its text alone would fit
+    x23.setHistoryLimit(4096);
+    assert (x23.setCell(CPos("D1"), x23Long) && x23.setCell(CPos("D1"), "1") && !x23.undo());
+
+    CSpreadsheet x25;
+    assert (x25.setCell(CPos("A1"), "10") && x25.setCell(CPos("A2"), "b") && x25.setCell(CPos("A3"), "=A1*3"));
+    assert (x25.setCell(CPos("A4"), "20") && x25.setCell(CPos("A5"), "d"));
+    for (int i = 1; i <= 5; ++i) {
+        assert (x25.setCell(CPos("B" + std::to_string(i)), "r" + std::to_string(i)));
+    }
+    x25.setHistoryLimit(size_t(1) << 20);
+    x25.setColumnIndex(1, CIndexKind::HASH);
+    assert (x25.setCell(CPos("C1"), "=match(30, A1:A5)") && valueMatch(x25.getValue(CPos("C1")), CValue(3.0)));
+    assert (x25.setCell(CPos("C2"), "=xlookup(\"d\", A1:A5, B1:B5)") && valueMatch(x25.getValue(CPos("C2")), CValue("r5")));
+    assert (x25.setCell(CPos("C3"), "=lookup(25, A1:A5, B1:B5)") && valueMatch(x25.getValue(CPos("C3")), CValue("r4")));
+    assert (x25.setCell(CPos("C4"), "=match(45, A1:A5)") && valueMatch(x25.getValue(CPos("C4")), CValue()));
+    assert (x25.setCell(CPos("A1"), "15") && valueMatch(x25.getValue(CPos("C1")), CValue()));
+    assert (valueMatch(x25.getValue(CPos("C4")), CValue(3.0)));
+    x25.setColumnIndex(1, CIndexKind::SORTED);
+    assert (valueMatch(x25.getValue(CPos("C3")), CValue("r4")) && valueMatch(x25.getValue(CPos("C4")), CValue(3.0)));
+    assert (x25.setCell(CPos("A2"), "25") && valueMatch(x25.getValue(CPos("C3")), CValue("r2")));
+    assert (x25.setCell(CPos("C5"), "=match(20, A4:A5) + match(\"r3\", A3:B3)") && valueMatch(x25.getValue(CPos("C5")), CValue(3.0)));
+    assert (x25.setCell(CPos("C6"), "=match(20, A4:B5)") && valueMatch(x25.getValue(CPos("C6")), CValue()));
+    x25.insertColumns(1);
+    assert (x25.setCell(CPos("D7"), "=lookup(\"e\", B1:B5, C1:C5)") && valueMatch(x25.getValue(CPos("D7")), CValue("r5")));
+    assert (valueMatch(x25.getValue(CPos("D4")), CValue(3.0)));
+    for (int i = 1; i <= 3000; ++i) {
+        assert (x25.setCell(CPos("F" + std::to_string(i)), std::to_string(3000 - i)));
+        assert (x25.setCell(CPos("G" + std::to_string(i)), "=F" + std::to_string(i) + "*2"));
+    }
+    x25.setColumnIndex(7, CIndexKind::SORTED);
+    assert (x25.setCell(CPos("H1"), "=lookup(1001, G1:G3000, F1:F3000)") && valueMatch(x25.getValue(CPos("H1")), CValue(500.0)));
+    assert (x25.setCell(CPos("F2500"), "700") && valueMatch(x25.getValue(CPos("H1")), CValue(499.0)));
+    assert (x25.setCell(CPos("F2501"), "500.25") && valueMatch(x25.getValue(CPos("H1")), CValue(500.25)));
+    assert (x25.undo() && valueMatch(x25.getValue(CPos("H1")), CValue(499.0)));
+
+    CSpreadsheet x26;
+    assert (x26.traceReport().criticalPath.empty());
+    assert (x26.setCell(CPos("A1"), "1") && x26.setCell(CPos("B1"), "=A1*2"));
+    for (int i = 2; i <= 50; ++i) {
+        assert (x26.setCell(CPos("A" + std::to_string(i)), "=A" + std::to_string(i - 1) + "+1"));
+    }
+    x26.setTracing(true);
+    assert (valueMatch(x26.getValue(CPos("A50")), CValue(50.0)) && valueMatch(x26.getValue(CPos("B1")), CValue(2.0)));
+    x26.setTracing(false);
+    CTraceReport x26Report = x26.traceReport(5);
+    assert (!x26Report.heaviest.empty() && x26Report.heaviest.size() <= 5 && x26Report.heaviest[0].calls >= 1);
+    assert (x26Report.criticalPath.size() == 49 && x26Report.criticalPath.front().row == 50 && x26Report.criticalPath.back().row == 2);
+    assert (x26Report.criticalPath.front().column == 1 && x26Report.criticalPath.front().fanIn == 1 && x26Report.criticalTime > 0);
+    std::ostringstream x26Trace;
+    assert (x26.saveTrace(x26Trace) && x26Trace.str().find("\"traceEvents\"") != std::string::npos);
+    assert (x26Trace.str().find("\"name\":\"A50\"") != std::string::npos);
+
+    CSpreadsheet x27;
+    assert (x27.setCell(CPos("A1"), "1"));
+    for (int i = 2; i <= 1000; ++i) {
+        assert (x27.setCell(CPos("A" + std::to_string(i)), "=A" + std::to_string(i - 1) + "+1"));
+    }
+    CValue x27Value = CValue("none");
+    CBudget x27Cancelled;
+    x27Cancelled.cancel();
+    assert (x27.getValue(CPos("A1000"), x27Value, x27Cancelled) == CEvalStatus::NOT_READY && valueMatch(x27Value, CValue("none")));
+    assert (x27.getValue(CPos("A1"), x27Value, x27Cancelled) == CEvalStatus::READY && valueMatch(x27Value, CValue(1.0)));
+    int x27Attempts = 0;
+    while (x27.getValue(CPos("A1000"), x27Value, CBudget::until(CBudget::CClock::now())) == CEvalStatus::NOT_READY) {
+        assert (++x27Attempts < 1000);
+    }
+    assert (x27Attempts > 0 && valueMatch(x27Value, CValue(1000.0)));
+    assert (x27.setCell(CPos("A500"), "0"));
+    std::vector<std::vector<CValue>> x27Values;
+    assert (x27.getValues(CPos("A999"), 1, 2, x27Values, CBudget::within(std::chrono::seconds(60))) == CEvalStatus::READY);
+    assert (x27Values.size() == 2 && valueMatch(x27Values[1][0], CValue(500.0)));
     return EXIT_SUCCESS;
 }
 